@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "server/parser.h"
+
+#define DEFAULT_LINES 50000
+#define PAIRS_PER_LINE 8
+
+/// How a benchmark run reads the job file.
+typedef enum {
+  MODE_SYSCALL,   // Unattached fd, parse_write with one read() per byte.
+  MODE_COPY,      // Attached fd, parse_write copying into arrays.
+  MODE_SLICES     // Attached fd, parse_write_slices.
+} BenchMode;
+
+static const char *mode_names[] = {"read() per byte", "attached, copying",
+"attached, slices"};
+
+/// Writes a bulk-load job file of WRITE lines.
+/// @param fd File to write to.
+/// @param lines Number of WRITE lines.
+/// @return Size of the file in bytes.
+static size_t generate_job(int fd, size_t lines) {
+  char line[PAIRS_PER_LINE * 2 * MAX_STRING_SIZE + 16];
+  size_t total = 0;
+  for (size_t i = 0; i < lines; i++) {
+    size_t offset = (size_t) snprintf(line, sizeof(line), "WRITE [");
+    for (size_t j = 0; j < PAIRS_PER_LINE; j++)
+      offset += (size_t) snprintf(line + offset, sizeof(line) - offset,
+      "(key%zu_%zu,value_for_key%zu)", i, j, i * PAIRS_PER_LINE + j);
+    offset += (size_t) snprintf(line + offset, sizeof(line) - offset, "]\n");
+    if (write(fd, line, offset) != (ssize_t) offset) {
+      perror("write");
+      exit(1);
+    }
+    total += offset;
+  }
+  return total;
+}
+
+/// Parses the whole job file once.
+/// @param fd The job file.
+/// @param mode How to read it.
+/// @param checksum Sum of the parsed key and value lengths, to compare modes.
+/// @return Elapsed seconds.
+static double run(int fd, BenchMode mode, size_t *checksum) {
+  static char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+  static char values[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+  StringSlice key_slices[MAX_WRITE_SIZE];
+  StringSlice value_slices[MAX_WRITE_SIZE];
+  struct timespec start, end;
+
+  lseek(fd, 0, SEEK_SET);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (mode != MODE_SYSCALL && parser_attach(fd) != 0) {
+    fprintf(stderr, "Failed to attach the job file.\n");
+    exit(1);
+  }
+
+  *checksum = 0;
+  while (get_next(fd) == CMD_WRITE) {
+    if (mode == MODE_SLICES) {
+      size_t num_pairs = parse_write_slices(fd, key_slices, value_slices,
+      MAX_WRITE_SIZE);
+      for (size_t i = 0; i < num_pairs; i++)
+        *checksum += key_slices[i].size + value_slices[i].size;
+    } else {
+      size_t num_pairs = parse_write(fd, keys, values, MAX_WRITE_SIZE,
+      MAX_STRING_SIZE);
+      for (size_t i = 0; i < num_pairs; i++)
+        *checksum += strlen(keys[i]) + strlen(values[i]);
+    }
+  }
+
+  parser_detach(fd);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (double) (end.tv_sec - start.tv_sec) +
+  (double) (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+  size_t lines = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_LINES;
+  char path[] = "/tmp/kvs_parse_bench_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd == -1) {
+    perror("mkstemp");
+    return 1;
+  }
+  unlink(path);
+
+  size_t size = generate_job(fd, lines);
+  printf("%zu WRITE lines, %.1f MB\n", lines, (double) size / 1e6);
+
+  size_t expected = 0;
+  for (BenchMode mode = MODE_SYSCALL; mode <= MODE_SLICES; mode++) {
+    size_t checksum;
+    double seconds = run(fd, mode, &checksum);
+    printf("%-20s %8.3f s %10.1f MB/s\n", mode_names[mode], seconds,
+    (double) size / 1e6 / seconds);
+    if (mode == MODE_SYSCALL)
+      expected = checksum;
+    else if (checksum != expected)
+      printf("  checksum mismatch: %zu != %zu\n", checksum, expected);
+  }
+
+  close(fd);
+  return 0;
+}
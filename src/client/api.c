@@ -1,7 +1,14 @@
+#define _GNU_SOURCE // For F_GETPIPE_SZ.
+
+#include <poll.h>
+#include <stdint.h>
 #include <string.h>
 
 #include "api.h"
 
+// Largest message of send_message, a CONNECT with its three paths.
+#define MESSAGE_SIZE (FRAME_HEADER_SIZE + 3 * (2 + MAX_PIPE_PATH_LENGTH))
+
 /// Sends a message to the KVS server or the request pipe.
 /// @param opcode The operation code specifying the action to be performed.
 /// @param client_data Pointer to a struct holding client-specific information.
@@ -9,49 +16,222 @@
 /// (used for subscribe/unsubscribe); use NULL if not applicable.
 /// @param registration_fifo_fd Pointer to the file descriptor for the
 /// registration's FIFO; pass -1 if not applicable.
+/// @param request_id Id of the request.
 /// @return 0 if the message was sent successfully, 1 otherwise.
-static int send_message(enum OperationCode opcode, const ClientData*
-client_data, const char* key, const int* registration_fifo_fd) {
-  char message[MAX_PIPE_PATH_LENGTH * 3 + 3 + sizeof(int)];
+static int send_message(enum OperationCode opcode,
+const ClientData* client_data, const char* key,
+const int* registration_fifo_fd, uint32_t request_id) {
+  uint8_t message[MESSAGE_SIZE];
+  FrameEncoder enc;
+  frame_begin(&enc, message, sizeof(message), opcode, 0, request_id);
+  int fifo_fd = client_data->req_fifo_fd;
   switch (opcode) {
     case OP_CODE_CONNECT:
       // Send message to the registration pipe.
-      snprintf(message, sizeof(message), "%d|%s|%s|%s", opcode,
-      client_data->req_pipe_path, client_data->resp_pipe_path,
-      client_data->notif_pipe_path);
-      if (write(*registration_fifo_fd, message, strlen(message)) == -1) {
-        fprintf(stderr, "Failed to write to the registration FIFO.\n");
-        return 1;
-      }
-      return 0;
+      frame_put_string(&enc, client_data->req_pipe_path,
+      strlen(client_data->req_pipe_path));
+      frame_put_string(&enc, client_data->resp_pipe_path,
+      strlen(client_data->resp_pipe_path));
+      frame_put_string(&enc, client_data->notif_pipe_path,
+      strlen(client_data->notif_pipe_path));
+      fifo_fd = *registration_fifo_fd;
+      break;
     case OP_CODE_DISCONNECT:
-      snprintf(message, sizeof(message), "%d", opcode);
       break;
     case OP_CODE_SUBSCRIBE:
     case OP_CODE_UNSUBSCRIBE:
-      snprintf(message, sizeof(message), "%d|%s", opcode, key);
+      frame_put_string(&enc, key, strlen(key));
       break;
+    case OP_CODE_GET:
+    case OP_CODE_PUT:
+    case OP_CODE_DEL:
+    case OP_CODE_MGET:
+    case OP_CODE_NOTIFY:
+      return 1; // Sent by data_request, or not by clients.
   }
-  // Send message to the request pipe.
-  if (write(client_data->req_fifo_fd, message, strlen(message)) == -1) {
-    fprintf(stderr, "Failed to write to the request FIFO.\n");
+  // A single write under PIPE_BUF, so that clients sharing the
+  // registration pipe never mix their frames.
+  size_t size = frame_end(&enc);
+  if (size == 0 || write(fifo_fd, message, size) != (ssize_t) size) {
+    fprintf(stderr, "Failed to write to the %s FIFO.\n",
+    opcode == OP_CODE_CONNECT ? "registration" : "request");
+    return 1;
+  }
+  return 0;
+}
+
+/// Reads a response and checks that it answers the last request.
+/// @param client_data Pointer to a struct holding client-specific information.
+/// @param opcode The operation of the last request.
+/// @param header Where to store the response's header.
+/// @param payload Where to store its payload.
+/// @param capacity Size of the payload buffer.
+/// @return 0 on success, 1 otherwise.
+static int read_response(const ClientData* client_data,
+enum OperationCode opcode, FrameHeader* header, void* payload,
+size_t capacity) {
+  if (frame_read(client_data->resp_fifo_fd, header, payload, capacity) != 1 ||
+  header->opcode != opcode || header->request_id != client_data->request_id) {
+    fprintf(stderr, "Failed to read the server response.\n");
     return 1;
   }
   return 0;
 }
 
 /// Reads and validates the server's response.
-/// @param resp_fifo_fd Pointer to the file descriptor for the response FIFO.
+/// @param client_data Pointer to a struct holding client-specific information.
+/// @param opcode The operation of the last request.
 /// @return The server response code. 0 on success, or an error code otherwise.
-static int check_server_response(const int* resp_fifo_fd) {
-  char server_response[SERVER_RESPONSE_SIZE];
-  if (read(*resp_fifo_fd, server_response, SERVER_RESPONSE_SIZE)
-  != SERVER_RESPONSE_SIZE) {
-    fprintf(stderr, "Failed to read the server response.\n");
-  } else if (server_response[1] != 0) {
+static int check_server_response(const ClientData* client_data,
+enum OperationCode opcode) {
+  FrameHeader header;
+  if (read_response(client_data, opcode, &header, NULL, 0) != 0)
+    return 1;
+  if (header.status != 0)
     fprintf(stderr, "Server responded with an error.\n");
+  return header.status;
+}
+
+/// Picks the id of a new request, never 0.
+/// @param client_data Pointer to a struct holding client-specific information.
+/// @return The id.
+static uint32_t next_request_id(ClientData* client_data) {
+  if (++client_data->request_id == 0)
+    client_data->request_id = 1;
+  return client_data->request_id;
+}
+
+/// Finds a submitted request.
+/// @param client_data Pointer to a struct holding client-specific information.
+/// @param request_id Its id.
+/// @return Its slot, NULL if no request has that id.
+static PendingRequest* find_pending(ClientData* client_data,
+uint32_t request_id) {
+  for (size_t i = 0; i < MAX_PENDING_REQUESTS; i++)
+    if (request_id != 0 && client_data->pending[i].id == request_id)
+      return &client_data->pending[i];
+  return NULL;
+}
+
+/// Frees the slot of a request that was reported.
+/// @param client_data Pointer to a struct holding client-specific information.
+/// @param request The request, done.
+static void release_pending(ClientData* client_data,
+PendingRequest* request) {
+  request->id = 0;
+  client_data->num_pending--;
+}
+
+/// Stores the results of a response where its request asked for them.
+/// @param request The request.
+/// @param header The response's header.
+/// @param payload The response's payload.
+/// @return The request's status, 1 if the payload is malformed.
+static int decode_response(PendingRequest* request, const FrameHeader* header,
+const uint8_t* payload) {
+  if (header->status != 0)
+    return header->status;
+
+  FrameDecoder dec;
+  frame_decode(&dec, payload, header->length);
+  switch (request->opcode) {
+    case OP_CODE_GET:
+    case OP_CODE_MGET:
+      if (frame_get_u16(&dec) != request->num_keys)
+        return 1;
+      for (size_t i = 0; i < request->num_keys; i++) {
+        request->found[i] = frame_get_u8(&dec);
+        frame_get_cstring(&dec, request->values[i], MAX_STRING_SIZE);
+      }
+      break;
+    case OP_CODE_DEL:
+      if (frame_get_u16(&dec) != request->num_keys)
+        return 1;
+      for (size_t i = 0; i < request->num_keys; i++) {
+        int existed = frame_get_u8(&dec);
+        if (request->found != NULL)
+          request->found[i] = existed;
+      }
+      break;
+    case OP_CODE_CONNECT:
+    case OP_CODE_DISCONNECT:
+    case OP_CODE_SUBSCRIBE:
+    case OP_CODE_UNSUBSCRIBE:
+    case OP_CODE_PUT:
+    case OP_CODE_NOTIFY:
+      break;
   }
-  return server_response[1];
+  return frame_done(&dec);
+}
+
+/// Reads the next response, whichever request it answers, and marks that
+/// request done.
+/// @param client_data Pointer to a struct holding client-specific information.
+/// @return 0 on success, 1 if no response could be read.
+static int read_next_response(ClientData* client_data) {
+  uint8_t payload[FRAME_MAX_PAYLOAD];
+  FrameHeader header;
+  if (frame_read(client_data->resp_fifo_fd, &header, payload,
+  sizeof(payload)) != 1) {
+    fprintf(stderr, "Failed to read the server response.\n");
+    return 1;
+  }
+  PendingRequest* request = find_pending(client_data, header.request_id);
+  if (request == NULL || request->done || request->opcode != header.opcode) {
+    fprintf(stderr, "Unexpected response from the server.\n");
+    return 1;
+  }
+
+  request->status = decode_response(request, &header, payload);
+  if (request->opcode == OP_CODE_SUBSCRIBE && request->status != 0)
+    __sync_fetch_and_sub(&client_data->client_subs, 1);
+  else if (request->opcode == OP_CODE_UNSUBSCRIBE && request->status == 0)
+    __sync_fetch_and_sub(&client_data->client_subs, 1);
+  request->done = 1;
+  client_data->num_in_flight--;
+  client_data->response_bytes -= request->response_size;
+  return 0;
+}
+
+/// Takes a slot for a new request, first reading responses until the
+/// window has room for its response.
+/// @param client_data Pointer to a struct holding client-specific information.
+/// @param opcode The operation.
+/// @param response_size Size of its largest response.
+/// @return The slot, with a new id, NULL if none is free.
+static PendingRequest* claim_pending(ClientData* client_data,
+enum OperationCode opcode, size_t response_size) {
+  while (client_data->num_in_flight > 0 && client_data->response_bytes +
+  response_size > client_data->response_window)
+    if (read_next_response(client_data) != 0)
+      return NULL;
+
+  PendingRequest* request = NULL;
+  for (size_t i = 0; request == NULL && i < MAX_PENDING_REQUESTS; i++)
+    if (client_data->pending[i].id == 0)
+      request = &client_data->pending[i];
+  if (request == NULL) {
+    fprintf(stderr, "Too many requests not completed.\n");
+    return NULL;
+  }
+  *request = (PendingRequest){.id = next_request_id(client_data),
+  .opcode = opcode, .response_size = response_size};
+  client_data->num_pending++;
+  client_data->num_in_flight++;
+  client_data->response_bytes += response_size;
+  return request;
+}
+
+/// Takes back a request that could not be sent.
+/// @param client_data Pointer to a struct holding client-specific information.
+/// @param request The request.
+/// @return 0, the id of no request.
+static uint32_t abandon_pending(ClientData* client_data,
+PendingRequest* request) {
+  client_data->num_in_flight--;
+  client_data->response_bytes -= request->response_size;
+  release_pending(client_data, request);
+  return 0;
 }
 
 int kvs_connect(ClientData* client_data, const char* registration_pipe_path) {
@@ -68,25 +248,37 @@ int kvs_connect(ClientData* client_data, const char* registration_pipe_path) {
     return 1;
   }
 
-  if (send_message(OP_CODE_CONNECT, client_data, NULL, &registration_fifo_fd)) {
+  // The server opens its ends without waiting for ours, open them first so
+  // that it finds them right away.
+  client_data->resp_fifo_fd = open(client_data->resp_pipe_path,
+  O_RDONLY | O_NONBLOCK);
+  client_data->notif_fifo_fd = open(client_data->notif_pipe_path,
+  O_RDONLY | O_NONBLOCK);
+  if (client_data->resp_fifo_fd == -1 || client_data->notif_fifo_fd == -1 ||
+  send_message(OP_CODE_CONNECT, client_data, NULL, &registration_fifo_fd,
+  next_request_id(client_data))) {
     close(registration_fifo_fd);
+    fprintf(stderr, "Failed to connect.\n");
     return 1;
   }
 
   close(registration_fifo_fd);
   
   client_data->req_fifo_fd = open(client_data->req_pipe_path, O_WRONLY);
-  client_data->resp_fifo_fd = open(client_data->resp_pipe_path, O_RDONLY);
-  client_data->notif_fifo_fd = open(client_data->notif_pipe_path,
-  O_RDONLY | O_NONBLOCK);
-
-  if (client_data->req_fifo_fd == -1 || client_data->resp_fifo_fd == -1 ||
-  client_data->notif_fifo_fd == -1) {
+  // Without a writer yet, a read would see the end of the FIFO: wait for
+  // the answer to the CONNECT before reading it.
+  struct pollfd response = {.fd = client_data->resp_fifo_fd, .events = POLLIN};
+  while (poll(&response, 1, -1) == -1 && errno == EINTR)
+    continue;
+  if (client_data->req_fifo_fd == -1 || fcntl(client_data->resp_fifo_fd,
+  F_SETFL, fcntl(client_data->resp_fifo_fd, F_GETFL) & ~O_NONBLOCK) != 0) {
     fprintf(stderr, "Failed to open FIFOs.\n");
     return 1;
   }
+  int pipe_size = fcntl(client_data->resp_fifo_fd, F_GETPIPE_SZ);
+  client_data->response_window = pipe_size > 0 ? (size_t) pipe_size : PIPE_BUF;
 
-  int server_response = check_server_response(&client_data->resp_fifo_fd);
+  int server_response = check_server_response(client_data, OP_CODE_CONNECT);
   printf("Server returned %d for operation: connect.\n", server_response);
 
   if (server_response != 0) {
@@ -99,10 +291,15 @@ int kvs_connect(ClientData* client_data, const char* registration_pipe_path) {
 }
 
 int kvs_disconnect(ClientData* client_data) {
-  if (send_message(OP_CODE_DISCONNECT, client_data, NULL, NULL))
+  // Requests sent before are answered first.
+  while (client_data->num_in_flight > 0)
+    if (read_next_response(client_data) != 0)
+      return 1;
+  if (send_message(OP_CODE_DISCONNECT, client_data, NULL, NULL,
+  next_request_id(client_data)))
     return 1;
 
-  int server_response = check_server_response(&client_data->resp_fifo_fd);
+  int server_response = check_server_response(client_data, OP_CODE_DISCONNECT);
   printf("Server returned %d for operation: disconnect.\n", server_response);
 
   if (server_response != 0)
@@ -110,43 +307,202 @@ int kvs_disconnect(ClientData* client_data) {
   return 0;
 }
 
-int kvs_subscribe(ClientData* client_data, const char* key) {
-  // Check if max number of subscriptions has been reached.
+uint32_t kvs_submit_subscribe(ClientData* client_data, const char* key) {
+  // Counted when submitted, so that requests in flight respect the limit.
   if (client_data->client_subs >= MAX_NUMBER_SUB) {
     fprintf(stderr, "Max number of subscriptions reached. Please unsubscribe from a key before subscribing to another.\n");
     return 0;
   }
+  PendingRequest* request = claim_pending(client_data, OP_CODE_SUBSCRIBE,
+  FRAME_HEADER_SIZE);
+  if (request == NULL)
+    return 0;
+  if (send_message(OP_CODE_SUBSCRIBE, client_data, key, NULL, request->id))
+    return abandon_pending(client_data, request);
+  __sync_fetch_and_add(&client_data->client_subs, 1);
+  return request->id;
+}
 
-  if (send_message(OP_CODE_SUBSCRIBE, client_data, key, NULL)) {
+uint32_t kvs_submit_unsubscribe(ClientData* client_data, const char* key) {
+  PendingRequest* request = claim_pending(client_data, OP_CODE_UNSUBSCRIBE,
+  FRAME_HEADER_SIZE);
+  if (request == NULL)
+    return 0;
+  if (send_message(OP_CODE_UNSUBSCRIBE, client_data, key, NULL, request->id))
+    return abandon_pending(client_data, request);
+  return request->id;
+}
+
+/// Checks that a key or value can be sent in a data request.
+/// @param string The key or value.
+/// @return 1 if it can be sent, 0 otherwise.
+static int valid_argument(const char* string) {
+  size_t length = strlen(string);
+  return length > 0 && length < MAX_STRING_SIZE;
+}
+
+/// Submits a GET, PUT, DEL or MGET request.
+/// @param opcode The operation.
+/// @param client_data Pointer to a struct holding client-specific information.
+/// @param num_keys Number of keys, at most MAX_REQUEST_KEYS.
+/// @param keys The keys.
+/// @param values Values of a PUT, NULL otherwise.
+/// @param results Where a GET or MGET stores the values read, or NULL.
+/// @param found Where a GET, MGET or DEL stores whether each key existed,
+/// or NULL.
+/// @return The request's id, 0 if it could not be sent.
+static uint32_t submit_data(enum OperationCode opcode,
+ClientData* client_data, size_t num_keys, const char keys[][MAX_STRING_SIZE],
+const char values[][MAX_STRING_SIZE], char results[][MAX_STRING_SIZE],
+int* found) {
+  if (num_keys == 0 || num_keys > MAX_REQUEST_KEYS) {
+    fprintf(stderr, "A request takes 1 to %d keys.\n", MAX_REQUEST_KEYS);
+    return 0;
+  }
+  for (size_t i = 0; i < num_keys; i++) {
+    if (!valid_argument(keys[i]) ||
+    (values != NULL && !valid_argument(values[i]))) {
+      fprintf(stderr, "Invalid key or value.\n");
+      return 0;
+    }
+  }
+
+  size_t response_size = FRAME_HEADER_SIZE;
+  if (opcode == OP_CODE_GET || opcode == OP_CODE_MGET)
+    response_size += 2 + num_keys * (1 + 2 + MAX_STRING_SIZE);
+  else if (opcode == OP_CODE_DEL)
+    response_size += 2 + num_keys;
+  PendingRequest* request = claim_pending(client_data, opcode, response_size);
+  if (request == NULL)
+    return 0;
+  request->num_keys = num_keys;
+  request->values = results;
+  request->found = found;
+
+  uint8_t message[FRAME_MAX_SIZE];
+  FrameEncoder enc;
+  frame_begin(&enc, message, sizeof(message), opcode, 0, request->id);
+  frame_put_u16(&enc, (uint16_t) num_keys);
+  for (size_t i = 0; i < num_keys; i++) {
+    frame_put_string(&enc, keys[i], strlen(keys[i]));
+    if (values != NULL)
+      frame_put_string(&enc, values[i], strlen(values[i]));
+  }
+  size_t size = frame_end(&enc);
+  if (size == 0 || write_all(client_data->req_fifo_fd, message, size) != 1) {
+    fprintf(stderr, "Failed to write to the request FIFO.\n");
+    return abandon_pending(client_data, request);
+  }
+  return request->id;
+}
+
+uint32_t kvs_submit_get(ClientData* client_data, size_t num_keys,
+const char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE],
+int* found) {
+  return submit_data(num_keys == 1 ? OP_CODE_GET : OP_CODE_MGET, client_data,
+  num_keys, keys, NULL, values, found);
+}
+
+uint32_t kvs_submit_put(ClientData* client_data, size_t num_pairs,
+const char keys[][MAX_STRING_SIZE], const char values[][MAX_STRING_SIZE]) {
+  return submit_data(OP_CODE_PUT, client_data, num_pairs, keys, values, NULL,
+  NULL);
+}
+
+uint32_t kvs_submit_del(ClientData* client_data, size_t num_keys,
+const char keys[][MAX_STRING_SIZE], int* deleted) {
+  return submit_data(OP_CODE_DEL, client_data, num_keys, keys, NULL, NULL,
+  deleted);
+}
+
+int kvs_complete(ClientData* client_data, uint32_t* request_id, int* status) {
+  while (1) {
+    for (size_t i = 0; i < MAX_PENDING_REQUESTS; i++) {
+      PendingRequest* request = &client_data->pending[i];
+      if (request->id != 0 && request->done) {
+        *request_id = request->id;
+        *status = request->status;
+        release_pending(client_data, request);
+        return 0;
+      }
+    }
+    if (client_data->num_in_flight == 0 ||
+    read_next_response(client_data) != 0)
+      return 1;
+  }
+}
+
+/// Waits for one request to complete, reading the responses of others
+/// meanwhile for kvs_complete to report.
+/// @param client_data Pointer to a struct holding client-specific information.
+/// @param request_id The request, 0 if it could not be submitted.
+/// @return Its status, 1 if it was not submitted or not answered.
+static int wait_for(ClientData* client_data, uint32_t request_id) {
+  PendingRequest* request = find_pending(client_data, request_id);
+  if (request == NULL)
     return 1;
+  while (!request->done)
+    if (read_next_response(client_data) != 0)
+      return 1;
+  int status = request->status;
+  release_pending(client_data, request);
+  return status;
+}
+
+int kvs_subscribe(ClientData* client_data, const char* key) {
+  // Check if max number of subscriptions has been reached.
+  if (client_data->client_subs >= MAX_NUMBER_SUB) {
+    fprintf(stderr, "Max number of subscriptions reached. Please unsubscribe from a key before subscribing to another.\n");
+    return 0;
   }
 
-  int server_response = check_server_response(&client_data->resp_fifo_fd);
+  int server_response = wait_for(client_data,
+  kvs_submit_subscribe(client_data, key));
   printf("Server returned %d for operation: subscribe.\n", server_response);
 
   if (server_response != 0)
     return 1;
-  
-  if (server_response == 3)
-    printf("Key was already subscribed to previously.\n");
-
-
-  // Increment client subscriptions.
-  __sync_fetch_and_add(&client_data->client_subs, 1);
   return 0;
 }
 
 int kvs_unsubscribe(ClientData* client_data, const char* key) {
-  if (send_message(OP_CODE_UNSUBSCRIBE, client_data, key, NULL))
-    return 1;
-  
-  int server_response = check_server_response(&client_data->resp_fifo_fd);
+  int server_response = wait_for(client_data,
+  kvs_submit_unsubscribe(client_data, key));
   printf("Server returned %d for operation: unsubscribe.\n", server_response);
 
   if (server_response != 0)
     return 1;
-
-  // Decrement client subscriptions.
-  __sync_fetch_and_sub(&client_data->client_subs, 1);
   return 0;
 }
+
+int kvs_get(ClientData* client_data, const char* key,
+char value[MAX_STRING_SIZE], int* found) {
+  // A longer key would be cut short, and another key read.
+  if (!valid_argument(key)) {
+    fprintf(stderr, "Invalid key or value.\n");
+    return 1;
+  }
+  char keys[1][MAX_STRING_SIZE];
+  strcpy(keys[0], key);
+  return wait_for(client_data, kvs_submit_get(client_data, 1, keys,
+  (char (*)[MAX_STRING_SIZE]) value, found)) != 0;
+}
+
+int kvs_mget(ClientData* client_data, size_t num_keys,
+const char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE],
+int* found) {
+  return wait_for(client_data, kvs_submit_get(client_data, num_keys, keys,
+  values, found)) != 0;
+}
+
+int kvs_put(ClientData* client_data, size_t num_pairs,
+const char keys[][MAX_STRING_SIZE], const char values[][MAX_STRING_SIZE]) {
+  return wait_for(client_data, kvs_submit_put(client_data, num_pairs, keys,
+  values)) != 0;
+}
+
+int kvs_del(ClientData* client_data, size_t num_keys,
+const char keys[][MAX_STRING_SIZE], int* deleted) {
+  return wait_for(client_data, kvs_submit_del(client_data, num_keys, keys,
+  deleted)) != 0;
+}
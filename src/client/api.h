@@ -2,6 +2,7 @@
 #define CLIENT_API_H
 
 #include <fcntl.h> 
+#include <stdint.h>
 #include <stdio.h>
 
 #include "client/utils.h"
@@ -31,4 +32,105 @@ int kvs_subscribe(ClientData* client_data, const char* key);
 /// @return 0 if the key was unsubscribed successfully, 1 otherwise.
 int kvs_unsubscribe(ClientData* client_data, const char* key);
 
+/// Reads the value of a key.
+/// @param client_data Pointer to a struct holding client-specific information.
+/// @param key Key to read, shorter than MAX_STRING_SIZE.
+/// @param value Where to store the value, "" if the key does not exist.
+/// @param found Where to store whether the key exists.
+/// @return 0 if the server answered, 1 if the key is too long or the
+/// request failed.
+int kvs_get(ClientData* client_data, const char* key,
+char value[MAX_STRING_SIZE], int* found);
+
+/// Reads the values of several keys in one round trip.
+/// @param client_data Pointer to a struct holding client-specific information.
+/// @param num_keys Number of keys, at most MAX_REQUEST_KEYS.
+/// @param keys Keys to read.
+/// @param values Where to store each value, "" for a key that does not exist.
+/// @param found Where to store whether each key exists.
+/// @return 0 if the server answered, 1 otherwise.
+int kvs_mget(ClientData* client_data, size_t num_keys,
+const char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE],
+int* found);
+
+/// Writes key-value pairs in one round trip. Subscribers of the keys are
+/// notified, as for a job's WRITE.
+/// @param client_data Pointer to a struct holding client-specific information.
+/// @param num_pairs Number of pairs, at most MAX_REQUEST_KEYS.
+/// @param keys Keys to write.
+/// @param values Their values.
+/// @return 0 if the pairs were written, 1 otherwise.
+int kvs_put(ClientData* client_data, size_t num_pairs,
+const char keys[][MAX_STRING_SIZE], const char values[][MAX_STRING_SIZE]);
+
+/// Deletes keys in one round trip.
+/// @param client_data Pointer to a struct holding client-specific information.
+/// @param num_keys Number of keys, at most MAX_REQUEST_KEYS.
+/// @param keys Keys to delete.
+/// @param deleted Where to store whether each key existed, or NULL.
+/// @return 0 if the server answered, 1 otherwise.
+int kvs_del(ClientData* client_data, size_t num_keys,
+const char keys[][MAX_STRING_SIZE], int* deleted);
+
+// Asynchronous requests. A submit function sends a request and returns at
+// once with its id, so that many requests travel back-to-back on a session
+// instead of waiting for each round trip. Responses are matched to requests
+// by id, not by order, and reported by kvs_complete. The buffers given to
+// a submit function must stay valid until the request completes. Up to
+// MAX_PENDING_REQUESTS requests may be submitted and not completed; a
+// submit may read responses first when the response FIFO could otherwise
+// fill up. The blocking functions above are a submit and a wait, and may
+// read responses of other requests, which kvs_complete reports later.
+
+/// Submits a subscription to a key, see kvs_subscribe.
+/// @param client_data Pointer to a struct holding client-specific information.
+/// @param key Key to be subscribed.
+/// @return The request's id, 0 if it could not be sent.
+uint32_t kvs_submit_subscribe(ClientData* client_data, const char* key);
+
+/// Submits the removal of a subscription, see kvs_unsubscribe.
+/// @param client_data Pointer to a struct holding client-specific information.
+/// @param key Key to be unsubscribed.
+/// @return The request's id, 0 if it could not be sent.
+uint32_t kvs_submit_unsubscribe(ClientData* client_data, const char* key);
+
+/// Submits a read of keys, see kvs_mget.
+/// @param client_data Pointer to a struct holding client-specific information.
+/// @param num_keys Number of keys, at most MAX_REQUEST_KEYS.
+/// @param keys Keys to read.
+/// @param values Where to store each value once it completes.
+/// @param found Where to store whether each key exists once it completes.
+/// @return The request's id, 0 if it could not be sent.
+uint32_t kvs_submit_get(ClientData* client_data, size_t num_keys,
+const char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE],
+int* found);
+
+/// Submits a write of key-value pairs, see kvs_put.
+/// @param client_data Pointer to a struct holding client-specific information.
+/// @param num_pairs Number of pairs, at most MAX_REQUEST_KEYS.
+/// @param keys Keys to write.
+/// @param values Their values.
+/// @return The request's id, 0 if it could not be sent.
+uint32_t kvs_submit_put(ClientData* client_data, size_t num_pairs,
+const char keys[][MAX_STRING_SIZE], const char values[][MAX_STRING_SIZE]);
+
+/// Submits a deletion of keys, see kvs_del.
+/// @param client_data Pointer to a struct holding client-specific information.
+/// @param num_keys Number of keys, at most MAX_REQUEST_KEYS.
+/// @param keys Keys to delete.
+/// @param deleted Where to store whether each key existed once it
+/// completes, or NULL.
+/// @return The request's id, 0 if it could not be sent.
+uint32_t kvs_submit_del(ClientData* client_data, size_t num_keys,
+const char keys[][MAX_STRING_SIZE], int* deleted);
+
+/// Waits for any submitted request to complete.
+/// @param client_data Pointer to a struct holding client-specific information.
+/// @param request_id Where to store the id of the request.
+/// @param status Where to store its result, 0 on success or the server's
+/// error code.
+/// @return 0 if a request completed, 1 if none was submitted or the
+/// response could not be read.
+int kvs_complete(ClientData* client_data, uint32_t* request_id, int* status);
+
 #endif  // CLIENT_API_H
@@ -10,6 +10,32 @@
 
 ClientData* client_data;
 
+/// Subscribes to or unsubscribes from keys, sending every request before
+/// waiting for the responses.
+/// @param op_code OP_CODE_SUBSCRIBE or OP_CODE_UNSUBSCRIBE.
+/// @param num_keys Number of keys.
+/// @param keys The keys.
+/// @return 0 if every request succeeded, 1 otherwise.
+static int change_subscriptions(enum OperationCode op_code, size_t num_keys,
+const char keys[][MAX_STRING_SIZE]) {
+  int result = 0;
+  for (size_t i = 0; i < num_keys; i++) {
+    uint32_t request_id = op_code == OP_CODE_SUBSCRIBE ?
+    kvs_submit_subscribe(client_data, keys[i]) :
+    kvs_submit_unsubscribe(client_data, keys[i]);
+    result |= request_id == 0;
+  }
+
+  uint32_t request_id;
+  int status;
+  while (kvs_complete(client_data, &request_id, &status) == 0) {
+    printf("Server returned %d for operation: %s.\n", status,
+    op_code == OP_CODE_SUBSCRIBE ? "subscribe" : "unsubscribe");
+    result |= status != 0;
+  }
+  return result;
+}
+
 int main(int argc, char* argv[]) {
   if (argc < 3) {
     fprintf(stderr, "Usage: %s <client_unique_id> <register_pipe_path>\n",
@@ -44,7 +70,9 @@ int main(int argc, char* argv[]) {
   }
 
   while (!atomic_load(&client_data->terminate)) {
-    char keys[MAX_NUMBER_SUB][MAX_STRING_SIZE] = {0};
+    char keys[MAX_REQUEST_KEYS][MAX_STRING_SIZE] = {0};
+    char values[MAX_REQUEST_KEYS][MAX_STRING_SIZE] = {0};
+    int found[MAX_REQUEST_KEYS];
     unsigned int delay_ms;
     size_t num;
 
@@ -61,25 +89,71 @@ int main(int argc, char* argv[]) {
         break;
 
       case CMD_SUBSCRIBE:
-        num = parse_list(STDIN_FILENO, keys, 1, MAX_STRING_SIZE);
+        num = parse_list(STDIN_FILENO, keys, MAX_NUMBER_SUB, MAX_STRING_SIZE);
         if (num == 0) {
           fprintf(stderr, "Invalid command. See HELP for usage.\n");
           continue;
         }
-        if (kvs_subscribe(client_data, keys[0]))
+        if (change_subscriptions(OP_CODE_SUBSCRIBE, num, keys))
           fprintf(stderr, "Command subscribe failed.\n");
         break;
 
       case CMD_UNSUBSCRIBE:
-        num = parse_list(STDIN_FILENO, keys, 1, MAX_STRING_SIZE);
+        num = parse_list(STDIN_FILENO, keys, MAX_NUMBER_SUB, MAX_STRING_SIZE);
         if (num == 0) {
           fprintf(stderr, "Invalid command. See HELP for usage.\n");
           continue;
         }
-        if (kvs_unsubscribe(client_data, keys[0]))
+        if (change_subscriptions(OP_CODE_UNSUBSCRIBE, num, keys))
           fprintf(stderr, "Command unsubscribe failed.\n");
         break;
 
+      case CMD_READ:
+        num = parse_list(STDIN_FILENO, keys, MAX_REQUEST_KEYS,
+        MAX_STRING_SIZE - 1);
+        if (num == 0) {
+          fprintf(stderr, "Invalid command. See HELP for usage.\n");
+          continue;
+        }
+        if (num == 1 ? kvs_get(client_data, keys[0], values[0], found) :
+        kvs_mget(client_data, num, keys, values, found)) {
+          fprintf(stderr, "Command read failed.\n");
+          break;
+        }
+        // Printed as in a job's output.
+        printf("[");
+        for (size_t i = 0; i < num; i++)
+          printf("(%s,%s)", keys[i], found[i] ? values[i] : "KVSERROR");
+        printf("]\n");
+        break;
+
+      case CMD_WRITE:
+        num = parse_pairs(STDIN_FILENO, keys, values, MAX_REQUEST_KEYS,
+        MAX_STRING_SIZE - 1);
+        if (num == 0) {
+          fprintf(stderr, "Invalid command. See HELP for usage.\n");
+          continue;
+        }
+        if (kvs_put(client_data, num, keys, values))
+          fprintf(stderr, "Command write failed.\n");
+        break;
+
+      case CMD_DELETE:
+        num = parse_list(STDIN_FILENO, keys, MAX_REQUEST_KEYS,
+        MAX_STRING_SIZE - 1);
+        if (num == 0) {
+          fprintf(stderr, "Invalid command. See HELP for usage.\n");
+          continue;
+        }
+        if (kvs_del(client_data, num, keys, found)) {
+          fprintf(stderr, "Command delete failed.\n");
+          break;
+        }
+        for (size_t i = 0; i < num; i++)
+          if (!found[i])
+            printf("(%s,KVSMISSING)\n", keys[i]);
+        break;
+
       case CMD_DELAY:
         if (parse_delay(STDIN_FILENO, &delay_ms) == -1) {
           fprintf(stderr, "Invalid command. See HELP for usage.\n");
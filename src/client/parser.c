@@ -113,8 +113,35 @@ enum Command get_next(int fd) {
 
       return CMD_UNSUBSCRIBE;
 
+    case 'R':
+      if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "READ ", 5) != 0) {
+        cleanup(fd);
+        return CMD_INVALID;
+      }
+
+      return CMD_READ;
+
+    case 'W':
+      if (read(fd, buf + 1, 5) != 5 || strncmp(buf, "WRITE ", 6) != 0) {
+        cleanup(fd);
+        return CMD_INVALID;
+      }
+
+      return CMD_WRITE;
+
     case 'D':
-      if (read(fd, buf + 1, 5) != 5 || strncmp(buf, "DELAY ", 6) != 0) {
+      if (read(fd, buf + 1, 5) != 5) {
+        cleanup(fd);
+        return CMD_INVALID;
+      }
+      if (strncmp(buf, "DELETE", 6) == 0) {
+        if (read(fd, buf + 6, 1) != 1 || buf[6] != ' ') {
+          cleanup(fd);
+          return CMD_INVALID;
+        }
+        return CMD_DELETE;
+      }
+      if (strncmp(buf, "DELAY ", 6) != 0) {
         if (read(fd, buf + 6, 4) != 4 ||
         strncmp(buf, "DISCONNECT", 10) != 0) {
           cleanup(fd);
@@ -181,6 +208,42 @@ size_t max_keys, size_t max_string_size) {
   return num_keys;
 }
 
+size_t parse_pairs(int fd, char keys[][MAX_STRING_SIZE],
+char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size) {
+  char ch;
+
+  if (read(fd, &ch, 1) != 1 || ch != '[') {
+    cleanup(fd);
+    return 0;
+  }
+
+  size_t num_pairs = 0;
+  while (1) {
+    if (read(fd, &ch, 1) != 1) {
+      return 0;
+    }
+    if (ch == ']') {
+      break;
+    }
+
+    // A key ends at ',', its value at ')'.
+    if (ch != '(' || num_pairs == max_pairs ||
+    read_string(fd, keys[num_pairs], max_string_size) != 0 ||
+    read_string(fd, values[num_pairs], max_string_size) != 1) {
+      cleanup(fd);
+      return 0;
+    }
+    num_pairs++;
+  }
+
+  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
+    cleanup(fd);
+    return 0;
+  }
+
+  return num_pairs;
+}
+
 int parse_delay(int fd, unsigned int *delay) {
   char ch;
 
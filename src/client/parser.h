@@ -11,6 +11,9 @@ enum Command {
   CMD_SUBSCRIBE,
   CMD_UNSUBSCRIBE,
   CMD_DELAY,
+  CMD_READ,
+  CMD_WRITE,
+  CMD_DELETE,
   CMD_EMPTY,
   CMD_INVALID,
   EOC  // End of commands
@@ -32,6 +35,17 @@ enum Command get_next(int fd);
 size_t parse_list(int fd, char keys[][MAX_STRING_SIZE],
 size_t max_keys, size_t max_string_size);
 
+/// Parses a list of pairs, "[(key,value)(key,value)]".
+/// @param fd File descriptor to read from.
+/// @param keys Array to store the keys.
+/// @param values Array to store the values.
+/// @param max_pairs Maximum number of pairs it will write.
+/// @param max_string_size Maximum string size allowed.
+/// @return 0 if the command was not parsed successfully, otherwise the
+/// number of pairs parsed.
+size_t parse_pairs(int fd, char keys[][MAX_STRING_SIZE],
+char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size);
+
 /// Parses a DELAY command.
 /// @param fd File descriptor to read from.
 /// @param delay Pointer to the variable to store the wait delay in.
@@ -12,6 +12,7 @@ void initialize_client_data(char* client_id) {
   client_data->req_fifo_fd = -1;
   client_data->resp_fifo_fd = -1;
   client_data->notif_fifo_fd = -1;
+  client_data->request_id = 0;
 }
 
 /* Cancel notification thread, unlink FIFOs,
@@ -76,19 +77,52 @@ int create_fifos() {
   return 0;
 }
 
+/// Prints a notification as "(key,value)".
+/// @param header The notification's header.
+/// @param payload Its payload.
+static void print_notification(const FrameHeader* header,
+const uint8_t* payload) {
+  char key[MAX_STRING_SIZE + 1];
+  char value[MAX_STRING_SIZE + 1];
+  FrameDecoder dec;
+  frame_decode(&dec, payload, header->length);
+  frame_get_cstring(&dec, key, sizeof(key));
+  frame_get_cstring(&dec, value, sizeof(value));
+  if (header->opcode != OP_CODE_NOTIFY || frame_done(&dec) != 0)
+    fprintf(stderr, "Invalid notification from the server.\n");
+  else
+    printf("(%s,%s)\n", key, value);
+}
+
 // Thread function.
 void* notification_listener() {
-  char buffer[MAX_STRING_SIZE];
+  // Notifications read so far, the last one maybe cut short.
+  uint8_t buffer[FRAME_MAX_SIZE];
+  size_t size = 0;
   while (!atomic_load(&client_data->terminate)) {
     int notif_fifo_fd = client_data->notif_fifo_fd;
 
     if (notif_fifo_fd == -1) break;
 
-    int bytes_read = read_string(notif_fifo_fd, buffer);
+    ssize_t bytes_read = read(notif_fifo_fd, buffer + size,
+    sizeof(buffer) - size);
     
     if (bytes_read > 0) {
-      buffer[bytes_read] = '\0';
-      printf("%s\n", buffer);
+      size += (size_t) bytes_read;
+      size_t offset = 0;
+      FrameHeader header;
+      FrameStatus status;
+      while ((status = frame_peek(buffer + offset, size - offset, &header))
+      == FRAME_COMPLETE) {
+        print_notification(&header, buffer + offset + FRAME_HEADER_SIZE);
+        offset += FRAME_HEADER_SIZE + header.length;
+      }
+      if (status == FRAME_INVALID) {
+        fprintf(stderr, "Invalid notification from the server.\n");
+        break;
+      }
+      memmove(buffer, buffer + offset, size - offset);
+      size -= offset;
     } else if (bytes_read == 0) {
       fprintf(stderr, "Notification pipe closed by server.\n");
       kill(getpid(), SIGINT);
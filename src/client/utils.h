@@ -5,6 +5,7 @@
 #include <pthread.h>
 #include <signal.h>
 #include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -12,6 +13,21 @@
 
 #include "common/constants.h"
 #include "common/io.h"
+#include "common/protocol.h"
+
+#define MAX_PENDING_REQUESTS 64 // Requests submitted and not completed.
+
+/// A request submitted to the server, and where its results go.
+typedef struct PendingRequest {
+  uint32_t id;                  // 0 for a free slot.
+  enum OperationCode opcode;
+  int done;                     // Answered, not reported by kvs_complete yet.
+  int status;                   // Server's error code, once done.
+  size_t response_size;         // Largest response, see response_window.
+  size_t num_keys;
+  char (*values)[MAX_STRING_SIZE]; // Values of a GET or MGET.
+  int* found;                   // Whether each key existed, or NULL.
+} PendingRequest;
 
 typedef struct ClientData {
   char req_pipe_path[MAX_PIPE_PATH_LENGTH];
@@ -21,6 +37,15 @@ typedef struct ClientData {
   int resp_fifo_fd;
   int notif_fifo_fd;
   int client_subs;
+  uint32_t request_id;  // Of the last request, echoed by its response.
+  PendingRequest pending[MAX_PENDING_REQUESTS];
+  size_t num_pending;   // Slots in use, done or not.
+  size_t num_in_flight; // Not answered yet.
+  // Requests in flight may be answered by at most response_window bytes,
+  // the size of the response FIFO, so that the server never blocks writing
+  // responses while the client blocks writing requests.
+  size_t response_window;
+  size_t response_bytes;
   pthread_t notif_thread;
   _Atomic volatile sig_atomic_t terminate;
 } ClientData;
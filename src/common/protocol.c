@@ -0,0 +1,167 @@
+#include <string.h>
+
+#include "common/io.h"
+#include "protocol.h"
+
+/// Stores a 16 bit value, little endian.
+static void store_u16(uint8_t *to, uint16_t value) {
+  to[0] = (uint8_t) value;
+  to[1] = (uint8_t) (value >> 8);
+}
+
+/// Stores a 32 bit value, little endian.
+static void store_u32(uint8_t *to, uint32_t value) {
+  store_u16(to, (uint16_t) value);
+  store_u16(to + 2, (uint16_t) (value >> 16));
+}
+
+/// Loads a 16 bit value, little endian.
+static uint16_t load_u16(const uint8_t *from) {
+  return (uint16_t) (from[0] | from[1] << 8);
+}
+
+/// Loads a 32 bit value, little endian.
+static uint32_t load_u32(const uint8_t *from) {
+  return (uint32_t) load_u16(from) | (uint32_t) load_u16(from + 2) << 16;
+}
+
+/// Claims room for a field.
+/// @param enc The encoder.
+/// @param size Size of the field.
+/// @return Where to write it, NULL if it does not fit.
+static uint8_t *frame_claim(FrameEncoder *enc, size_t size) {
+  if (enc->overflow || enc->capacity - enc->size < size) {
+    enc->overflow = 1;
+    return NULL;
+  }
+  uint8_t *field = enc->data + enc->size;
+  enc->size += size;
+  return field;
+}
+
+void frame_begin(FrameEncoder *enc, void *buffer, size_t capacity,
+enum OperationCode opcode, uint16_t status, uint32_t request_id) {
+  enc->data = buffer;
+  enc->capacity = capacity;
+  enc->size = FRAME_HEADER_SIZE;
+  enc->overflow = capacity < FRAME_HEADER_SIZE;
+  if (!enc->overflow) {
+    enc->data[0] = PROTOCOL_VERSION;
+    enc->data[1] = (uint8_t) opcode;
+    store_u16(enc->data + 2, status);
+    store_u32(enc->data + 4, request_id);
+  }
+}
+
+void frame_put_u8(FrameEncoder *enc, uint8_t value) {
+  uint8_t *field = frame_claim(enc, 1);
+  if (field != NULL)
+    *field = value;
+}
+
+void frame_put_u16(FrameEncoder *enc, uint16_t value) {
+  uint8_t *field = frame_claim(enc, 2);
+  if (field != NULL)
+    store_u16(field, value);
+}
+
+void frame_put_string(FrameEncoder *enc, const char *data, size_t size) {
+  uint8_t *field = size > UINT16_MAX ? NULL : frame_claim(enc, 2 + size);
+  if (field == NULL) {
+    enc->overflow = 1;
+    return;
+  }
+  store_u16(field, (uint16_t) size);
+  memcpy(field + 2, data, size);
+}
+
+size_t frame_end(FrameEncoder *enc) {
+  if (enc->overflow)
+    return 0;
+  store_u32(enc->data + 8, (uint32_t) (enc->size - FRAME_HEADER_SIZE));
+  return enc->size;
+}
+
+FrameStatus frame_peek(const void *data, size_t size, FrameHeader *header) {
+  const uint8_t *bytes = data;
+  if (size < FRAME_HEADER_SIZE)
+    return FRAME_PARTIAL;
+  header->version = bytes[0];
+  header->opcode = bytes[1];
+  header->status = load_u16(bytes + 2);
+  header->request_id = load_u32(bytes + 4);
+  header->length = load_u32(bytes + 8);
+  if (header->version != PROTOCOL_VERSION ||
+  header->length > FRAME_MAX_PAYLOAD)
+    return FRAME_INVALID;
+  return size - FRAME_HEADER_SIZE < header->length ? FRAME_PARTIAL :
+  FRAME_COMPLETE;
+}
+
+void frame_decode(FrameDecoder *dec, const void *payload, size_t length) {
+  dec->data = payload;
+  dec->size = length;
+  dec->offset = 0;
+  dec->overflow = 0;
+}
+
+/// Consumes a field.
+/// @param dec The decoder.
+/// @param size Size of the field.
+/// @return Its bytes, NULL if the payload ends before it.
+static const uint8_t *frame_take(FrameDecoder *dec, size_t size) {
+  if (dec->overflow || dec->size - dec->offset < size) {
+    dec->overflow = 1;
+    return NULL;
+  }
+  const uint8_t *field = dec->data + dec->offset;
+  dec->offset += size;
+  return field;
+}
+
+uint8_t frame_get_u8(FrameDecoder *dec) {
+  const uint8_t *field = frame_take(dec, 1);
+  return field != NULL ? *field : 0;
+}
+
+uint16_t frame_get_u16(FrameDecoder *dec) {
+  const uint8_t *field = frame_take(dec, 2);
+  return field != NULL ? load_u16(field) : 0;
+}
+
+const char *frame_get_string(FrameDecoder *dec, size_t *size) {
+  *size = frame_get_u16(dec);
+  const uint8_t *field = frame_take(dec, *size);
+  if (field == NULL)
+    *size = 0;
+  return field != NULL ? (const char *) field : "";
+}
+
+void frame_get_cstring(FrameDecoder *dec, char *buffer, size_t capacity) {
+  size_t size;
+  const char *data = frame_get_string(dec, &size);
+  if (size >= capacity) {
+    dec->overflow = 1;
+    size = 0;
+  }
+  memcpy(buffer, data, size);
+  buffer[size] = '\0';
+}
+
+int frame_done(const FrameDecoder *dec) {
+  return dec->overflow || dec->offset != dec->size;
+}
+
+int frame_read(int fd, FrameHeader *header, void *payload, size_t capacity) {
+  uint8_t bytes[FRAME_HEADER_SIZE];
+  int result = read_all(fd, bytes, FRAME_HEADER_SIZE, NULL);
+  if (result != 1)
+    return result;
+  if (frame_peek(bytes, FRAME_HEADER_SIZE, header) == FRAME_INVALID ||
+  header->length > capacity)
+    return -1;
+  if (header->length == 0)
+    return 1;
+  result = read_all(fd, payload, header->length, NULL);
+  return result == 0 ? -1 : result;
+}
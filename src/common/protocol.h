@@ -1,6 +1,11 @@
 #ifndef COMMON_PROTOCOL_H
 #define COMMON_PROTOCOL_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common/constants.h"
+
 /// Opcodes for client-server communication.
 /// These opcodes are used in a switch case to determine what to do with the
 /// received message on the server.
@@ -10,6 +15,155 @@ enum OperationCode {
   OP_CODE_DISCONNECT = 2,
   OP_CODE_SUBSCRIBE = 3,
   OP_CODE_UNSUBSCRIBE = 4,
+  OP_CODE_GET = 5,          // One key.
+  OP_CODE_PUT = 6,          // Up to MAX_REQUEST_KEYS pairs.
+  OP_CODE_DEL = 7,          // Up to MAX_REQUEST_KEYS keys.
+  OP_CODE_MGET = 8,         // Up to MAX_REQUEST_KEYS keys.
+  OP_CODE_NOTIFY = 9,       // Server to client, on the notification FIFO.
 };
 
+// Every message, on any FIFO, is a frame: a FRAME_HEADER_SIZE byte header
+// and a payload of packed fields. Integers are little endian, strings are a
+// 16 bit size and their bytes, without a NUL. The header holds:
+//   version     8 bits, PROTOCOL_VERSION
+//   opcode      8 bits
+//   status     16 bits, 0 in requests, the error code in responses
+//   request id 32 bits, chosen by the client, echoed in the response
+//   length     32 bits, size of the payload
+// A reader can thus split any number of frames out of a read, and tell a
+// frame it cannot parse from one it has not fully received.
+//
+// Payloads, "*n" repeating a field as many times as the count before it:
+//   CONNECT      req path, resp path, notif path  -> empty
+//   DISCONNECT   empty                            -> empty
+//   SUBSCRIBE    key                              -> empty
+//   UNSUBSCRIBE  key                              -> empty
+//   GET, MGET    u16 n, key*n     -> u16 n, (u8 found, value)*n
+//   PUT          u16 n, (key, value)*n            -> empty
+//   DEL          u16 n, key*n     -> u16 n, u8 deleted*n
+//   NOTIFY       key, value ("DELETED" once deleted)
+// Responses repeat the request's opcode and id. A client may send requests
+// without waiting for their responses, which it matches to them by id:
+// they are not bound to come back in order. A GET holds exactly one key.
+
+#define PROTOCOL_VERSION 1
+#define FRAME_HEADER_SIZE 12
+// Largest payload, a PUT of MAX_REQUEST_KEYS pairs.
+#define FRAME_MAX_PAYLOAD (2 + MAX_REQUEST_KEYS * 2 * (2 + MAX_STRING_SIZE))
+#define FRAME_MAX_SIZE (FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD)
+
+typedef struct FrameHeader {
+  uint8_t version;
+  uint8_t opcode;
+  uint16_t status;
+  uint32_t request_id;
+  uint32_t length;
+} FrameHeader;
+
+/// What frame_peek found at the start of a buffer.
+typedef enum {
+  FRAME_COMPLETE,  // A whole frame.
+  FRAME_PARTIAL,   // The start of a frame, more bytes are needed.
+  FRAME_INVALID,   // Another version, or a payload over FRAME_MAX_PAYLOAD.
+} FrameStatus;
+
+/// Builds a frame in a caller's buffer. Writes past the capacity are
+/// dropped and remembered, so that fields are put without checks and the
+/// frame is checked once by frame_end.
+typedef struct FrameEncoder {
+  uint8_t *data;
+  size_t capacity;
+  size_t size;
+  int overflow;
+} FrameEncoder;
+
+/// Reads the fields of a payload in place. Reads past its end return zeros
+/// and are remembered, checked once by frame_done.
+typedef struct FrameDecoder {
+  const uint8_t *data;
+  size_t size;
+  size_t offset;
+  int overflow;
+} FrameDecoder;
+
+/// Starts a frame, leaving room for its header.
+/// @param enc The encoder.
+/// @param buffer Where to build the frame.
+/// @param capacity Size of the buffer, at least FRAME_HEADER_SIZE.
+/// @param opcode The operation.
+/// @param status 0 for a request, the error code for a response.
+/// @param request_id The request id.
+void frame_begin(FrameEncoder *enc, void *buffer, size_t capacity,
+enum OperationCode opcode, uint16_t status, uint32_t request_id);
+
+/// Appends an 8 bit field.
+/// @param enc The encoder.
+/// @param value The value.
+void frame_put_u8(FrameEncoder *enc, uint8_t value);
+
+/// Appends a 16 bit field.
+/// @param enc The encoder.
+/// @param value The value.
+void frame_put_u16(FrameEncoder *enc, uint16_t value);
+
+/// Appends a string field.
+/// @param enc The encoder.
+/// @param data The string, NUL terminated or not.
+/// @param size Its size, at most UINT16_MAX.
+void frame_put_string(FrameEncoder *enc, const char *data, size_t size);
+
+/// Finishes a frame by filling in its payload length.
+/// @param enc The encoder.
+/// @return Size of the frame, 0 if it did not fit in the buffer.
+size_t frame_end(FrameEncoder *enc);
+
+/// Looks at the frame starting a buffer, without consuming it.
+/// @param data The buffer.
+/// @param size Bytes in the buffer.
+/// @param header Where to store the header, once it was received.
+/// @return Whether the buffer holds a whole frame.
+FrameStatus frame_peek(const void *data, size_t size, FrameHeader *header);
+
+/// Starts reading a payload.
+/// @param dec The decoder.
+/// @param payload The payload, right after the header.
+/// @param length Its length, from the header.
+void frame_decode(FrameDecoder *dec, const void *payload, size_t length);
+
+/// Reads an 8 bit field.
+/// @param dec The decoder.
+/// @return The value.
+uint8_t frame_get_u8(FrameDecoder *dec);
+
+/// Reads a 16 bit field.
+/// @param dec The decoder.
+/// @return The value.
+uint16_t frame_get_u16(FrameDecoder *dec);
+
+/// Reads a string field, borrowed from the payload.
+/// @param dec The decoder.
+/// @param size Where to store its size.
+/// @return Its bytes, not NUL terminated.
+const char *frame_get_string(FrameDecoder *dec, size_t *size);
+
+/// Reads a string field into a NUL terminated buffer.
+/// @param dec The decoder.
+/// @param buffer Where to copy it.
+/// @param capacity Size of the buffer; a longer string is a decoding error.
+void frame_get_cstring(FrameDecoder *dec, char *buffer, size_t capacity);
+
+/// Checks that a payload was read whole and without errors.
+/// @param dec The decoder.
+/// @return 0 if every field was there and nothing is left, 1 otherwise.
+int frame_done(const FrameDecoder *dec);
+
+/// Reads one frame from a blocking file descriptor.
+/// @param fd The file descriptor.
+/// @param header Where to store the header.
+/// @param payload Where to store the payload.
+/// @param capacity Size of the payload buffer.
+/// @return 1 on success, 0 on end of file, -1 on an error or an invalid
+/// frame.
+int frame_read(int fd, FrameHeader *header, void *payload, size_t capacity);
+
 #endif  // COMMON_PROTOCOL_H
@@ -0,0 +1,98 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "arena.h"
+
+/// Header at the start of every slab, blocks find their arena through it.
+typedef struct ArenaSlab {
+  Arena *arena;
+  struct ArenaSlab *next;
+} ArenaSlab;
+
+// Space reserved for the slab header, keeps blocks ARENA_ALIGN aligned.
+#define SLAB_HEADER_SIZE \
+  ((sizeof(ArenaSlab) + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN)
+
+/// Size class of a block size.
+/// @param size Block size, at most ARENA_MAX_BLOCK.
+/// @return Index in [0, ARENA_CLASSES).
+static size_t size_class(size_t size) {
+  if (size < sizeof(ArenaBlock))
+    size = sizeof(ArenaBlock);
+  return (size + ARENA_ALIGN - 1) / ARENA_ALIGN - 1;
+}
+
+void arena_init(Arena *arena) {
+  arena->slabs = NULL;
+  arena->bump = NULL;
+  arena->bump_end = NULL;
+  for (size_t i = 0; i < ARENA_CLASSES; i++)
+    arena->free_blocks[i] = NULL;
+  atomic_init(&arena->pending, NULL);
+}
+
+/// Moves the blocks freed by other threads to the owner's free lists.
+/// @param arena The arena.
+static void collect_pending(Arena *arena) {
+  ArenaBlock *block = atomic_exchange(&arena->pending, NULL);
+  while (block != NULL) {
+    ArenaBlock *next = block->next;
+    block->next = arena->free_blocks[block->size_class];
+    arena->free_blocks[block->size_class] = block;
+    block = next;
+  }
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+  if (size > ARENA_MAX_BLOCK)
+    return NULL;
+  size_t index = size_class(size);
+  size_t block_size = (index + 1) * ARENA_ALIGN;
+
+  if (arena->free_blocks[index] == NULL &&
+  atomic_load_explicit(&arena->pending, memory_order_relaxed) != NULL)
+    collect_pending(arena);
+
+  ArenaBlock *block = arena->free_blocks[index];
+  if (block != NULL) {
+    arena->free_blocks[index] = block->next;
+    return block;
+  }
+
+  if (arena->bump == NULL || (size_t) (arena->bump_end - arena->bump) <
+  block_size) {
+    ArenaSlab *slab = aligned_alloc(ARENA_SLAB_SIZE, ARENA_SLAB_SIZE);
+    if (slab == NULL)
+      return NULL;
+    slab->arena = arena;
+    slab->next = arena->slabs;
+    arena->slabs = slab;
+    arena->bump = (char *) slab + SLAB_HEADER_SIZE;
+    arena->bump_end = (char *) slab + ARENA_SLAB_SIZE;
+  }
+
+  void *ptr = arena->bump;
+  arena->bump += block_size;
+  return ptr;
+}
+
+void arena_free(void *ptr, size_t size) {
+  ArenaSlab *slab = (ArenaSlab *)
+  ((uintptr_t) ptr & ~(uintptr_t) (ARENA_SLAB_SIZE - 1));
+  Arena *arena = slab->arena;
+  ArenaBlock *block = ptr;
+  block->size_class = size_class(size);
+  block->next = atomic_load_explicit(&arena->pending, memory_order_relaxed);
+  while (!atomic_compare_exchange_weak_explicit(&arena->pending, &block->next,
+  block, memory_order_release, memory_order_relaxed))
+    ;
+}
+
+void arena_destroy(Arena *arena) {
+  while (arena->slabs != NULL) {
+    ArenaSlab *next = arena->slabs->next;
+    free(arena->slabs);
+    arena->slabs = next;
+  }
+  arena_init(arena);
+}
@@ -0,0 +1,49 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+#define ARENA_SLAB_SIZE 8192  // Bytes per slab, slabs are aligned to it.
+#define ARENA_ALIGN 32        // Block sizes are rounded up to this.
+#define ARENA_MAX_BLOCK 256   // Largest block the arena hands out.
+#define ARENA_CLASSES (ARENA_MAX_BLOCK / ARENA_ALIGN)
+
+/// Freed block, linked through its own storage.
+typedef struct ArenaBlock {
+  struct ArenaBlock *next;
+  size_t size_class;
+} ArenaBlock;
+
+/// Slab allocator for small fixed-size blocks with per-size free lists.
+/// Allocation is single owner: callers serialize arena_alloc themselves.
+/// Blocks may be freed from any thread, they are queued on a lock-free list
+/// the owner collects on its next allocation.
+typedef struct Arena {
+  struct ArenaSlab *slabs;                  // Every slab, freed on destroy.
+  char *bump;                               // Unused space of the newest slab.
+  char *bump_end;
+  ArenaBlock *free_blocks[ARENA_CLASSES];   // Owner's free lists, by size.
+  _Atomic(ArenaBlock *) pending;            // Blocks freed by other threads.
+} Arena;
+
+/// Initializes an empty arena. No memory is allocated until first use.
+/// @param arena The arena.
+void arena_init(Arena *arena);
+
+/// Allocates a block, reusing a freed one of the same size class if any.
+/// @param arena The arena.
+/// @param size Block size, at most ARENA_MAX_BLOCK.
+/// @return The block, NULL on failure.
+void *arena_alloc(Arena *arena, size_t size);
+
+/// Returns a block to the arena it was allocated from. Thread safe.
+/// @param ptr The block.
+/// @param size The size it was allocated with.
+void arena_free(void *ptr, size_t size);
+
+/// Frees every slab of the arena, including blocks still in use.
+/// @param arena The arena.
+void arena_destroy(Arena *arena);
+
+#endif // ARENA_H
@@ -0,0 +1,41 @@
+#ifndef BYTES_H
+#define BYTES_H
+
+#include <stdint.h>
+
+// Little endian integers in on-disk formats (snapshots, the WAL).
+
+static inline void put_le16(uint8_t *p, uint16_t value) {
+  p[0] = (uint8_t) value;
+  p[1] = (uint8_t) (value >> 8);
+}
+
+static inline void put_le32(uint8_t *p, uint32_t value) {
+  for (int i = 0; i < 4; i++)
+    p[i] = (uint8_t) (value >> (8 * i));
+}
+
+static inline void put_le64(uint8_t *p, uint64_t value) {
+  for (int i = 0; i < 8; i++)
+    p[i] = (uint8_t) (value >> (8 * i));
+}
+
+static inline uint16_t get_le16(const uint8_t *p) {
+  return (uint16_t) (p[0] | p[1] << 8);
+}
+
+static inline uint32_t get_le32(const uint8_t *p) {
+  uint32_t value = 0;
+  for (int i = 3; i >= 0; i--)
+    value = (value << 8) | p[i];
+  return value;
+}
+
+static inline uint64_t get_le64(const uint8_t *p) {
+  uint64_t value = 0;
+  for (int i = 7; i >= 0; i--)
+    value = (value << 8) | p[i];
+  return value;
+}
+
+#endif // BYTES_H
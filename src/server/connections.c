@@ -3,33 +3,62 @@
 #include <signal.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include "common/constants.h"
+#include "common/io.h"
 #include "common/protocol.h"
 #include "connections.h"
 #include "server/io.h"
 #include "server/utils.h"
+#include "server/wal.h"
+
+// Largest CONNECT payload, three paths. Clients write a CONNECT with a
+// single write under PIPE_BUF, so frames of several clients never mix.
+#define REGISTRATION_PAYLOAD_SIZE (3 * (2 + MAX_PIPE_PATH_LENGTH))
+// Bytes read from the registration FIFO at once.
+#define REGISTRATION_READ_SIZE 4096
 
 extern ServerData* server_data;
-RequestBuffer session_buffer;
 
-void initialize_session_buffer() {
-  session_buffer.in = 0;
-  session_buffer.out = 0;
-  session_buffer.session_data = malloc(MAX_SESSION_COUNT * sizeof(ClientData));
-  if (session_buffer.session_data == NULL) {
-    write_str(STDERR_FILENO, "Failed to allocate memory for session_data.\n");
-    exit(1);
-  }
-  for (int i = 0; i < MAX_SESSION_COUNT; ++i) {
-    session_buffer.session_data[i] = NULL;
-  }
-  sem_init(&session_buffer.full, 0, 0);
-  sem_init(&session_buffer.empty, 0, MAX_SESSION_COUNT);
-  pthread_mutex_init(&session_buffer.buffer_mutex, NULL);
-}
+/// An event loop thread and the sessions it serves.
+typedef struct SessionLoop {
+  pthread_t thread;
+  int started;                  // Whether the thread was created.
+  int epoll_fd;
+  int wake_fds[2];              // Wakeup pipe, read and write ends.
+  pthread_mutex_t mutex;        // Guards incoming.
+  ClientData* incoming;         // Sessions handed over, their FIFOs not open yet.
+  ClientData* opening;          // Taken over, waiting for the client's FIFOs.
+  ClientData* sessions;         // Open sessions, only touched by the loop.
+  atomic_size_t num_sessions;   // Sessions handed over and not closed yet.
+  unsigned disconnects;         // Value of disconnect_requests last handled.
+  uint8_t buffer[SESSION_READ_SIZE];  // Requests being handled.
+  uint8_t response[SESSION_RESPONSE_SIZE]; // Their responses, not sent yet.
+  size_t response_size;
+  uint64_t response_lsn;        // Log record the responses wait for.
+  ClientData* held;             // Sessions whose output waits for the log.
+  _Atomic uint64_t waiting_lsn; // Oldest record they wait for, 0 for none.
+} SessionLoop;
+
+/// Every connected session by response FIFO path, to detect a reused id.
+/// The buckets double once they hold a session each on average.
+typedef struct SessionRegistry {
+  ClientData** buckets;         // Chained through registry_next.
+  size_t num_buckets;           // A power of two.
+  size_t count;
+  pthread_mutex_t mutex;
+} SessionRegistry;
+
+static SessionRegistry registry = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+static SessionLoop manager = {.epoll_fd = -1, .wake_fds = {-1, -1}};
+static SessionLoop* loops;
+static size_t num_loops;
+static atomic_bool stopping;            // Set by stop_session_loops.
+static atomic_uint disconnect_requests; // Bumped for each SIGUSR1.
 
 /// Cleans up the memory allocated for a ClientData structure.
 /// @param client_data Pointer to the ClientData structure to be cleaned up.
@@ -38,248 +67,945 @@ void cleanup_client_data(ClientData* client_data) {
     free(client_data->req_pipe_path);
     free(client_data->resp_pipe_path);
     free(client_data->notif_pipe_path);
+    free(client_data->pending);
+    free(client_data->output);
     free(client_data);
   }
 }
 
-void cleanup_session_buffer() {
-  free(session_buffer.session_data);
-  sem_destroy(&session_buffer.full);
-  sem_destroy(&session_buffer.empty);
-  pthread_mutex_destroy(&session_buffer.buffer_mutex);
-}
-
-/// Verifies if a client with the same id is already
-/// connected to the server.
-/// @param client_data the data of the new client
-/// trying to connect
-/// @return 1 if the client is already
-/// connected 0 otherwise
-int client_already_exists(ClientData* client_data) {
-  pthread_mutex_lock(&session_buffer.buffer_mutex);
-  for (int i = 0; i < MAX_SESSION_COUNT; ++i) {
-    if (session_buffer.session_data != NULL &&
-    session_buffer.session_data[i] != NULL &&
-    strcmp(session_buffer.session_data[i]->resp_pipe_path,
-    client_data->resp_pipe_path) == 0) {
-      pthread_mutex_unlock(&session_buffer.buffer_mutex);
-      return 1;
-    }
+/// Creates the epoll instance and the wakeup pipe of a loop.
+/// @param loop The loop.
+/// @return 0 on success, 1 otherwise.
+static int loop_init(SessionLoop* loop) {
+  loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (loop->epoll_fd == -1 || pipe(loop->wake_fds) != 0)
+    return 1;
+  // A full pipe already wakes the loop up, a signal handler must not block.
+  for (int i = 0; i < 2; i++)
+    fcntl(loop->wake_fds[i], F_SETFL,
+    fcntl(loop->wake_fds[i], F_GETFL) | O_NONBLOCK);
+
+  struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+  if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fds[0], &event) != 0)
+    return 1;
+  pthread_mutex_init(&loop->mutex, NULL);
+  loop->incoming = NULL;
+  loop->opening = NULL;
+  loop->sessions = NULL;
+  loop->held = NULL;
+  atomic_store(&loop->waiting_lsn, 0);
+  atomic_store(&loop->num_sessions, 0);
+  loop->disconnects = 0;
+  return 0;
+}
+
+/// Closes the file descriptors of a loop.
+/// @param loop The loop.
+static void loop_destroy(SessionLoop* loop) {
+  if (loop->epoll_fd != -1)
+    close(loop->epoll_fd);
+  for (int i = 0; i < 2; i++)
+    if (loop->wake_fds[i] != -1)
+      close(loop->wake_fds[i]);
+  loop->epoll_fd = -1;
+  loop->wake_fds[0] = loop->wake_fds[1] = -1;
+}
+
+/// Wakes a loop up. Async-signal-safe.
+/// @param loop The loop.
+static void loop_wake(SessionLoop* loop) {
+  int fd = loop->wake_fds[1];
+  if (fd != -1) {
+    int saved_errno = errno;
+    char byte = 0;
+    ssize_t written = write(fd, &byte, 1);
+    (void) written; // A full pipe is awake already.
+    errno = saved_errno;
+  }
+}
+
+/// Empties the wakeup pipe of a loop.
+/// @param loop The loop.
+static void loop_drain(SessionLoop* loop) {
+  char bytes[64];
+  while (read(loop->wake_fds[0], bytes, sizeof(bytes)) > 0)
+    continue;
+}
+
+int initialize_session_loops() {
+  // Each session holds three FIFOs open.
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+
+  registry.num_buckets = SESSION_REGISTRY_MIN_BUCKETS;
+  registry.buckets = calloc(registry.num_buckets, sizeof(ClientData*));
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t count = cores > 0 ? (size_t) cores : 1;
+  loops = calloc(count, sizeof(SessionLoop));
+  if (registry.buckets == NULL || loops == NULL)
+    return 1;
+  num_loops = count;
+
+  for (size_t i = 0; i < num_loops; i++) {
+    loops[i].epoll_fd = -1;
+    loops[i].wake_fds[0] = loops[i].wake_fds[1] = -1;
+  }
+  if (loop_init(&manager) != 0) {
+    loop_destroy(&manager);
+    return 1;
   }
-  pthread_mutex_unlock(&session_buffer.buffer_mutex);
+  for (size_t i = 0; i < num_loops; i++)
+    if (loop_init(&loops[i]) != 0)
+      return 1;
   return 0;
 }
 
-/// Adds a client's request to the session buffer.
-/// @param client_data Pointer to the client's request data to be added to the session buffer.
-void create_request(ClientData* client_data) {
-  sem_wait(&session_buffer.empty);
-  pthread_mutex_lock(&session_buffer.buffer_mutex);
+void wake_connection_manager() {
+  loop_wake(&manager);
+}
+
+/// Bucket of a response FIFO path in the registry.
+/// @param resp_pipe_path The path.
+/// @return The bucket.
+static ClientData** registry_bucket(const char* resp_pipe_path) {
+  StringSlice path = {resp_pipe_path, strlen(resp_pipe_path)};
+  return &registry.buckets[slice_hash(path) & (registry.num_buckets - 1)];
+}
+
+/// Doubles the buckets of the registry, keeping the old ones if memory is
+/// short. Called with the registry locked.
+static void grow_registry() {
+  size_t old_count = registry.num_buckets;
+  ClientData** old_buckets = registry.buckets;
+  ClientData** buckets = calloc(old_count * 2, sizeof(ClientData*));
+  if (buckets == NULL)
+    return;
+  registry.buckets = buckets;
+  registry.num_buckets = old_count * 2;
+  for (size_t i = 0; i < old_count; i++) {
+    ClientData* session = old_buckets[i];
+    while (session != NULL) {
+      ClientData* next = session->registry_next;
+      ClientData** bucket = registry_bucket(session->resp_pipe_path);
+      session->registry_next = *bucket;
+      *bucket = session;
+      session = next;
+    }
+  }
+  free(old_buckets);
+}
 
-  session_buffer.session_data[session_buffer.in] = client_data;
-  session_buffer.in = (session_buffer.in + 1) % MAX_SESSION_COUNT;
-  
-  pthread_mutex_unlock(&session_buffer.buffer_mutex);
-  sem_post(&session_buffer.full);
+/// Adds a session to the registry, unless one with the same id is there.
+/// @param client_data The session.
+/// @return 0 on success, 1 if the id is taken.
+static int register_session(ClientData* client_data) {
+  pthread_mutex_lock(&registry.mutex);
+  ClientData** bucket = registry_bucket(client_data->resp_pipe_path);
+  for (ClientData* session = *bucket; session != NULL;
+  session = session->registry_next) {
+    if (strcmp(session->resp_pipe_path, client_data->resp_pipe_path) == 0) {
+      pthread_mutex_unlock(&registry.mutex);
+      return 1;
+    }
+  }
+  client_data->registry_next = *bucket;
+  *bucket = client_data;
+  if (++registry.count > registry.num_buckets)
+    grow_registry();
+  pthread_mutex_unlock(&registry.mutex);
+  return 0;
 }
 
+/// Removes a session from the registry.
+/// @param client_data The session.
+static void unregister_session(ClientData* client_data) {
+  pthread_mutex_lock(&registry.mutex);
+  ClientData** link = registry_bucket(client_data->resp_pipe_path);
+  while (*link != NULL && *link != client_data)
+    link = &(*link)->registry_next;
+  if (*link != NULL) {
+    *link = client_data->registry_next;
+    registry.count--;
+  }
+  pthread_mutex_unlock(&registry.mutex);
+}
 
-/// Sends a message to the client through the specified response FIFO file descriptor.
+/// Sends a response without payload to the client.
 /// @param resp_fifo_fd The file descriptor of the response FIFO to write to.
 /// @param op_code The operation code to include in the response.
 /// @param error_code The error code to include in the response.
-void send_message (int resp_fifo_fd,
-enum OperationCode op_code, int error_code) {
-  char response[SERVER_RESPONSE_SIZE] = {op_code, (char) error_code};
-  if (write(resp_fifo_fd, response, SERVER_RESPONSE_SIZE) == -1) {
+/// @param request_id The id of the request being answered.
+void send_message(int resp_fifo_fd, enum OperationCode op_code,
+int error_code, uint32_t request_id) {
+  uint8_t response[FRAME_HEADER_SIZE];
+  FrameEncoder enc;
+  frame_begin(&enc, response, sizeof(response), op_code,
+  (uint16_t) error_code, request_id);
+  if (frame_end(&enc) == 0 ||
+  write_all(resp_fifo_fd, response, sizeof(response)) != 1) {
     write_str(STDERR_FILENO,
     "Failed to write to the client's response FIFO.\n");
   }
 }
 
-void disconnect_all_clients() {
-  pthread_mutex_lock(&session_buffer.buffer_mutex);
+/// Closes a session's FIFOs, and frees it.
+/// @param loop The loop serving it.
+/// @param client_data The session, opened or not.
+static void close_session(SessionLoop* loop, ClientData* client_data) {
+  if (client_data->held) {
+    ClientData** link = &loop->held;
+    while (*link != client_data)
+      link = &(*link)->held_next;
+    *link = client_data->held_next;
+  }
+  if (client_data->notif_fifo_fd != -1)
+    remove_client(client_data->notif_fifo_fd);
+  if (client_data->req_fifo_fd != -1)
+    close(client_data->req_fifo_fd); // Also removes it from the epoll set.
+  if (client_data->resp_fifo_fd != -1)
+    close(client_data->resp_fifo_fd);
+  if (client_data->notif_fifo_fd != -1)
+    close(client_data->notif_fifo_fd);
+  unregister_session(client_data);
+  atomic_fetch_sub(&loop->num_sessions, 1);
+  cleanup_client_data(client_data);
+}
+
+/// Unlinks an open session from its loop and closes it.
+/// @param loop The loop serving it.
+/// @param client_data The session.
+static void end_session(SessionLoop* loop, ClientData* client_data) {
+  if (client_data->prev != NULL)
+    client_data->prev->next = client_data->next;
+  else
+    loop->sessions = client_data->next;
+  if (client_data->next != NULL)
+    client_data->next->prev = client_data->prev;
+  close_session(loop, client_data);
+}
+
+/// Sets which FIFO of a session its loop waits on: the request FIFO to
+/// read requests, or the response FIFO to send queued output.
+/// @param loop The loop serving it.
+/// @param client_data The session.
+/// @param fd The FIFO, -1 for neither.
+/// @param events EPOLLIN or EPOLLOUT.
+/// @return 0 on success, 1 otherwise.
+static int watch_session(SessionLoop* loop, ClientData* client_data, int fd,
+uint32_t events) {
+  if (client_data->watched_fd == fd)
+    return 0;
+  if (client_data->watched_fd != -1)
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, client_data->watched_fd, NULL);
+  client_data->watched_fd = -1;
+  struct epoll_event event = {.events = events, .data.ptr = client_data};
+  if (fd != -1 && epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0)
+    return 1;
+  client_data->watched_fd = fd;
+  return 0;
+}
+
+/// Writes as much of a session's output as its response FIFO takes.
+/// @param client_data The session.
+/// @param data The bytes.
+/// @param size Number of bytes.
+/// @return Bytes written, -1 if the client is gone.
+static ssize_t write_output(const ClientData* client_data, const uint8_t* data,
+size_t size) {
+  size_t sent = 0;
+  while (sent < size) {
+    ssize_t written = write(client_data->resp_fifo_fd, data + sent,
+    size - sent);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written < 0 && errno == EAGAIN)
+      break;
+    if (written < 0)
+      return -1;
+    sent += (size_t) written;
+  }
+  return (ssize_t) sent;
+}
+
+/// Holds the output of a session until its log record is durable, and has
+/// the WAL committer wake the loop up by then.
+/// @param loop The loop serving it.
+/// @param client_data The session.
+static void hold_session(SessionLoop* loop, ClientData* client_data) {
+  if (!client_data->held) {
+    client_data->held = 1;
+    client_data->held_next = loop->held;
+    loop->held = client_data;
+  }
+  uint64_t waiting = atomic_load(&loop->waiting_lsn);
+  if (waiting == 0 || client_data->output_lsn < waiting)
+    atomic_store(&loop->waiting_lsn, client_data->output_lsn);
+  // Committed before waiting_lsn was set, the committer did not see it.
+  if (wal_durable_lsn() >= client_data->output_lsn)
+    loop_wake(loop);
+}
+
+/// Sends the output of the held sessions whose log records are durable.
+/// A session is closed instead if the log failed, its updates must not be
+/// acknowledged.
+/// @param loop The loop.
+static void release_sessions(SessionLoop* loop) {
+  uint64_t durable_lsn = wal_durable_lsn();
+  uint64_t waiting = 0;
+  ClientData** link = &loop->held;
+  while (*link != NULL) {
+    ClientData* client_data = *link;
+    if (client_data->output_lsn > durable_lsn) {
+      if (waiting == 0 || client_data->output_lsn < waiting)
+        waiting = client_data->output_lsn;
+      link = &client_data->held_next;
+      continue;
+    }
+    *link = client_data->held_next;
+    client_data->held = 0;
+    if (wal_commit(client_data->output_lsn) != 0 || watch_session(loop,
+    client_data, client_data->resp_fifo_fd, EPOLLOUT) != 0)
+      end_session(loop, client_data);
+  }
+  atomic_store(&loop->waiting_lsn, waiting);
+  if (waiting != 0 && wal_durable_lsn() >= waiting)
+    loop_wake(loop);
+}
+
+/// Sends bytes on a session's response FIFO without blocking. What the FIFO
+/// has no room for is queued, and the loop waits for room for it instead of
+/// reading the session's requests. Output answering updates that are not
+/// durable yet is queued and held.
+/// @param loop The loop serving it.
+/// @param client_data The session.
+/// @param data The bytes.
+/// @param size Number of bytes.
+/// @param lsn Log record of the last update they answer, 0 for none.
+static void send_output(SessionLoop* loop, ClientData* client_data,
+const uint8_t* data, size_t size, uint64_t lsn) {
+  if (lsn > client_data->output_lsn)
+    client_data->output_lsn = lsn;
+  int durable = client_data->output_lsn <= wal_durable_lsn();
+  if (client_data->output_size == 0 && durable) {
+    ssize_t sent = write_output(client_data, data, size);
+    if (sent < 0) {
+      // The request FIFO hangs up as well, which ends the session.
+      write_str(STDERR_FILENO,
+      "Failed to write to the client's response FIFO.\n");
+      return;
+    }
+    data += sent;
+    size -= (size_t) sent;
+    if (size == 0)
+      return;
+  }
+
+  if (client_data->output_capacity - client_data->output_size < size) {
+    size_t capacity = client_data->output_capacity > 0 ?
+    client_data->output_capacity : SESSION_RESPONSE_SIZE;
+    while (capacity - client_data->output_size < size)
+      capacity *= 2;
+    uint8_t* output = realloc(client_data->output, capacity);
+    if (output == NULL) {
+      write_str(STDERR_FILENO, "Failed to allocate memory for a response.\n");
+      return;
+    }
+    client_data->output = output;
+    client_data->output_capacity = capacity;
+  }
+  memcpy(client_data->output + client_data->output_size, data, size);
+  client_data->output_size += size;
+  if (watch_session(loop, client_data, durable ?
+  client_data->resp_fifo_fd : -1, EPOLLOUT) != 0)
+    write_str(STDERR_FILENO, "Failed to wait for the client's FIFO.\n");
+  if (!durable)
+    hold_session(loop, client_data);
+}
+
+/// Sends the queued output of a session once its response FIFO has room,
+/// going back to its requests when all of it went out, or closing it if it
+/// was disconnecting.
+/// @param loop The loop serving it.
+/// @param client_data The session.
+static void handle_client_output(SessionLoop* loop, ClientData* client_data) {
+  ssize_t sent = write_output(client_data, client_data->output,
+  client_data->output_size);
+  if (sent < 0) {
+    end_session(loop, client_data);
+    return;
+  }
+  client_data->output_size -= (size_t) sent;
+  memmove(client_data->output, client_data->output + sent,
+  client_data->output_size);
+  if (client_data->output_size > 0)
+    return;
+  if (client_data->disconnecting || watch_session(loop, client_data,
+  client_data->req_fifo_fd, EPOLLIN) != 0)
+    end_session(loop, client_data);
+}
 
-  // Iterate through the buffer and set the terminate flag for all clients.
-  for (int i = 0; i < MAX_SESSION_COUNT; ++i)
-    if (session_buffer.session_data != NULL &&
-    session_buffer.session_data[i] != NULL)
-      atomic_store(&session_buffer.session_data[i]->terminate, 1);
+/// Sends the responses gathered by a loop.
+/// @param loop The loop.
+/// @param client_data The session they answer.
+static void flush_responses(SessionLoop* loop, ClientData* client_data) {
+  if (loop->response_size > 0)
+    send_output(loop, client_data, loop->response, loop->response_size,
+    loop->response_lsn);
+  loop->response_size = 0;
+  loop->response_lsn = 0;
+}
 
-  // Clean up the buffer.
-  session_buffer.in = 0;
-  session_buffer.out = 0;
+/// Starts a response after those a loop gathered, sending them first if
+/// the largest response might not fit.
+/// @param loop The loop.
+/// @param client_data The session being answered.
+/// @param enc Where to start the response.
+/// @param header The header of the request it answers.
+/// @param error_code The error code to include in the response.
+static void begin_response(SessionLoop* loop, ClientData* client_data,
+FrameEncoder* enc, const FrameHeader* header, int error_code) {
+  if (SESSION_RESPONSE_SIZE - loop->response_size < FRAME_MAX_SIZE)
+    flush_responses(loop, client_data);
+  frame_begin(enc, loop->response + loop->response_size, FRAME_MAX_SIZE,
+  (enum OperationCode) header->opcode, (uint16_t) error_code,
+  header->request_id);
+}
 
-  // Release all semaphores.
-  while (sem_trywait(&session_buffer.full) == 0)
-    sem_post(&session_buffer.empty);
+/// Adds a finished response to those a loop gathered.
+/// @param loop The loop.
+/// @param enc The response.
+static void end_response(SessionLoop* loop, FrameEncoder* enc) {
+  size_t size = frame_end(enc);
+  if (size == 0)
+    write_str(STDERR_FILENO, "A response did not fit in its frame.\n");
+  loop->response_size += size;
+}
 
-  pthread_mutex_unlock(&session_buffer.buffer_mutex);
+/// Gathers a response without payload.
+/// @param loop The loop.
+/// @param client_data The session being answered.
+/// @param header The header of the request it answers.
+/// @param error_code The error code to include in the response.
+static void queue_message(SessionLoop* loop, ClientData* client_data,
+const FrameHeader* header, int error_code) {
+  FrameEncoder enc;
+  begin_response(loop, client_data, &enc, header, error_code);
+  end_response(loop, &enc);
 }
 
+/// Opens the FIFOs of a session handed over to a loop, without waiting for
+/// the client to open its ends. Once they are all open, the session starts
+/// waiting for requests and its CONNECT is answered.
+/// @param loop The loop.
+/// @param client_data The session.
+/// @return 0 once it is open, 1 while the client has not opened a FIFO yet,
+/// -1 if the session was closed.
+static int open_session(SessionLoop* loop, ClientData* client_data) {
+  if (client_data->req_fifo_fd == -1)
+    client_data->req_fifo_fd = open(client_data->req_pipe_path,
+    O_RDONLY | O_NONBLOCK);
+  // Fails with ENXIO until the client opens the FIFO for reading.
+  if (client_data->req_fifo_fd != -1 && client_data->resp_fifo_fd == -1)
+    client_data->resp_fifo_fd = open(client_data->resp_pipe_path,
+    O_WRONLY | O_NONBLOCK);
+  // Notifications are dropped rather than stall writers, see
+  // notify_subscribers.
+  if (client_data->resp_fifo_fd != -1 && client_data->notif_fifo_fd == -1)
+    client_data->notif_fifo_fd = open(client_data->notif_pipe_path,
+    O_WRONLY | O_NONBLOCK);
+
+  if (client_data->notif_fifo_fd == -1 && errno == ENXIO) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (elapsed_ns(&client_data->connected, &now) <
+    (uint64_t) SESSION_OPEN_TIMEOUT_MS * 1000000)
+      return 1;
+  }
+  if (client_data->notif_fifo_fd == -1 || watch_session(loop, client_data,
+  client_data->req_fifo_fd, EPOLLIN) != 0) {
+    write_str(STDERR_FILENO, "Failed to open the client FIFOs.\n");
+    close_session(loop, client_data);
+    return -1;
+  }
+
+  client_data->prev = NULL;
+  client_data->next = loop->sessions;
+  if (loop->sessions != NULL)
+    loop->sessions->prev = client_data;
+  loop->sessions = client_data;
+
+  FrameHeader header = {.opcode = OP_CODE_CONNECT,
+  .request_id = client_data->connect_id};
+  queue_message(loop, client_data, &header, 0);
+  flush_responses(loop, client_data);
+  char* client_id = strrchr(client_data->req_pipe_path, 'q');
+  printf("Client %s connected.\n", client_id + 1);
+  return 0;
+}
+
+/// Tries to open the sessions waiting for their client's FIFOs, in the
+/// order they connected.
+/// @param loop The loop.
+static void open_sessions(SessionLoop* loop) {
+  ClientData** link = &loop->opening;
+  while (*link != NULL) {
+    ClientData* client_data = *link;
+    ClientData* next = client_data->next;
+    if (open_session(loop, client_data) == 1)
+      link = &client_data->next;
+    else
+      *link = next;
+  }
+}
 
 /// Handles client subscriptions by adding or removing subscriptions based on the operation code.
-/// @param resp_fifo_fd File descriptor for the response FIFO.
-/// @param notif_fifo_fd File descriptor for the notification FIFO.
-/// @param key The key associated with the subscription.
-/// @param op_code The operation code indicating whether to subscribe or unsubscribe.
-/// @details If the key is NULL, an error occurs and the result is set to 1. Otherwise, the function
-void handle_client_subscriptions(int resp_fifo_fd, int notif_fifo_fd,
-char* key, enum OperationCode op_code) {
-  int result = 0;
-  if (key != NULL) {
+/// @param loop The loop serving the session.
+/// @param client_data The session.
+/// @param header The request's header.
+/// @param dec The request's payload, the key.
+static void handle_client_subscriptions(SessionLoop* loop,
+ClientData* client_data, const FrameHeader* header, FrameDecoder* dec) {
+  enum OperationCode op_code = (enum OperationCode) header->opcode;
+  char key[MAX_STRING_SIZE];
+  frame_get_cstring(dec, key, sizeof(key));
+  int result = 1; // A missing or overlong key is an error.
+  if (frame_done(dec) == 0 && key[0] != '\0') {
     if (op_code == OP_CODE_SUBSCRIBE)
-      result = add_subscription(key, notif_fifo_fd);
-    else if (op_code == OP_CODE_UNSUBSCRIBE)
-      result = remove_subscription(key);
-  } else {
-    result = 1; // If the key is NULL an error ocurred.
+      result = add_subscription(key, client_data->notif_fifo_fd);
+    else
+      result = remove_subscription(key, client_data->notif_fifo_fd);
   }
-  send_message(resp_fifo_fd, op_code, result);
+  queue_message(loop, client_data, header, result);
 }
 
+/// Appends a value read by a GET or MGET to its response.
+/// @param key The key.
+/// @param value Its value, NULL if it does not exist.
+/// @param arg The response's FrameEncoder.
+static void encode_value(StringSlice key, const char* value, void* arg) {
+  FrameEncoder* enc = arg;
+  (void) key;
+  frame_put_u8(enc, value != NULL);
+  frame_put_string(enc, value != NULL ? value : "",
+  value != NULL ? strlen(value) : 0);
+}
 
-/// Handles the disconnection of a client by performing necessary cleanup operations.
-/// @param resp_fifo_fd The file descriptor for the response FIFO.
-/// @param req_fifo_fd The file descriptor for the request FIFO.
-/// @param notif_fifo_fd The file descriptor for the notification FIFO.
-void handle_client_disconnect(int resp_fifo_fd, int req_fifo_fd,
-int notif_fifo_fd) {
-  remove_client(notif_fifo_fd);
+/// Answers a GET, PUT, DEL or MGET. Keys and values are borrowed from the
+/// request, and values read are packed into the response straight from the
+/// table.
+/// @param loop The loop serving the session.
+/// @param client_data The session.
+/// @param header The request's header.
+/// @param dec The request's payload.
+static void handle_data_request(SessionLoop* loop, ClientData* client_data,
+const FrameHeader* header, FrameDecoder* dec) {
+  enum OperationCode op_code = (enum OperationCode) header->opcode;
+  StringSlice keys[MAX_REQUEST_KEYS];
+  StringSlice values[MAX_REQUEST_KEYS];
+  size_t num_keys = frame_get_u16(dec);
+  int result = num_keys == 0 || num_keys > MAX_REQUEST_KEYS ||
+  (op_code == OP_CODE_GET && num_keys != 1);
+  for (size_t i = 0; result == 0 && i < num_keys; i++) {
+    keys[i].data = frame_get_string(dec, &keys[i].size);
+    if (op_code == OP_CODE_PUT)
+      values[i].data = frame_get_string(dec, &values[i].size);
+    // As long as a job's, so that jobs can print them.
+    result = keys[i].size == 0 || keys[i].size >= MAX_STRING_SIZE ||
+    (op_code == OP_CODE_PUT && values[i].size >= MAX_STRING_SIZE);
+  }
+  if (result == 0)
+    result = frame_done(dec);
+
+  FrameEncoder enc;
+  begin_response(loop, client_data, &enc, header, 0);
+  uint64_t lsn = 0;
+  if (result == 0 && op_code == OP_CODE_PUT) {
+    result = kvs_write(num_keys, keys, values, NULL, &lsn);
+  } else if (result == 0 && op_code == OP_CODE_DEL) {
+    unsigned char deleted[MAX_REQUEST_KEYS];
+    result = kvs_remove(num_keys, keys, deleted, &lsn);
+    frame_put_u16(&enc, (uint16_t) num_keys);
+    for (size_t i = 0; i < num_keys; i++)
+      frame_put_u8(&enc, deleted[i]);
+  } else if (result == 0) {
+    frame_put_u16(&enc, (uint16_t) num_keys);
+    result = kvs_read_values(num_keys, keys, encode_value, &enc);
+  }
 
-  send_message(resp_fifo_fd, OP_CODE_DISCONNECT, 0);
-  
-  close(req_fifo_fd);
-  close(resp_fifo_fd);
-  close(notif_fifo_fd);
+  // A failed request is answered with its status alone.
+  if (result != 0)
+    begin_response(loop, client_data, &enc, header, result);
+  end_response(loop, &enc);
+  // Sent once the update is durable, see send_output.
+  if (lsn > loop->response_lsn)
+    loop->response_lsn = lsn;
 }
 
-/// Handles client requests by reading from the request FIFO, processing the request, and sending responses.
-/// @param client_data Pointer to the ClientData structure containing client-specific information.
-/// @note The function assumes that the FIFOs are already created and available at the paths specified in the client_data structure.
-/// @note The function uses non-blocking mode for reading from the request FIFO.
-void handle_client_request(ClientData* client_data) {
-  int req_fifo_fd = open(client_data->req_pipe_path, O_RDONLY | O_NONBLOCK);
-  int resp_fifo_fd = open(client_data->resp_pipe_path, O_WRONLY);
-  int notif_fifo_fd = open(client_data->notif_pipe_path, O_WRONLY);
+/// Handles one request of a session and gathers its response.
+/// @param loop The loop serving the session.
+/// @param client_data The session.
+/// @param header The request's header.
+/// @param payload The request's payload.
+/// @return 0 while the session goes on, 1 once it ended.
+static int handle_request_frame(SessionLoop* loop, ClientData* client_data,
+const FrameHeader* header, const uint8_t* payload) {
+  FrameDecoder dec;
+  frame_decode(&dec, payload, header->length);
+  char* client_id;
+  enum OperationCode op_code = (enum OperationCode) header->opcode;
+  switch (op_code) {
+    case OP_CODE_SUBSCRIBE:
+    case OP_CODE_UNSUBSCRIBE:
+      handle_client_subscriptions(loop, client_data, header, &dec);
+      return 0;
+    case OP_CODE_DISCONNECT:
+      client_id = strrchr(client_data->req_pipe_path, 'q');
+      printf("Client %s disconnected.\n", client_id + 1);
+      queue_message(loop, client_data, header, 0);
+      flush_responses(loop, client_data);
+      if (client_data->output_size > 0)
+        client_data->disconnecting = 1; // Once the response went out.
+      else
+        end_session(loop, client_data);
+      return 1;
+    case OP_CODE_GET:
+    case OP_CODE_PUT:
+    case OP_CODE_DEL:
+    case OP_CODE_MGET:
+      handle_data_request(loop, client_data, header, &dec);
+      return 0;
+    case OP_CODE_CONNECT: // Sent to the registration FIFO.
+    case OP_CODE_NOTIFY:  // Only sent to clients.
+    default:
+      fprintf(stderr, "Unknown operation code: %d\n", header->opcode);
+      queue_message(loop, client_data, header, 1);
+      return 0;
+  }
+}
 
-  if (req_fifo_fd == -1 || resp_fifo_fd == -1 || notif_fifo_fd == -1) {
-    write_str(STDERR_FILENO, "Failed to open the client FIFOs.\n");
+/// Handles a readable request FIFO: reads what it holds, then handles every
+/// whole request, sends their responses at once and keeps the start of a
+/// last one cut short. A client that
+/// closed its FIFO without disconnecting, or sent a frame that cannot be
+/// parsed, is disconnected.
+/// @param loop The loop serving the session.
+/// @param client_data The session.
+static void handle_client_request(SessionLoop* loop, ClientData* client_data) {
+  uint8_t* buffer = loop->buffer;
+  size_t size = client_data->pending_size;
+  ssize_t bytes_read = read(client_data->req_fifo_fd, buffer + size,
+  SESSION_READ_SIZE - size);
+  if (bytes_read == -1 && (errno == EAGAIN || errno == EINTR))
+    return;
+  if (bytes_read <= 0) {
+    end_session(loop, client_data);
     return;
   }
+  if (size > 0) {
+    memcpy(buffer, client_data->pending, size);
+    free(client_data->pending);
+    client_data->pending = NULL;
+    client_data->pending_size = 0;
+  }
+  size += (size_t) bytes_read;
 
-  send_message(resp_fifo_fd, OP_CODE_CONNECT, 0);
-  char* client_id = strrchr(client_data->req_pipe_path, 'q');
-    printf("Client %s connected.\n", client_id + 1);
-  
-  char buffer[MAX_STRING_SIZE];
-  while (!atomic_load(&client_data->terminate)) {
-    ssize_t bytes_read = read(req_fifo_fd, buffer, MAX_STRING_SIZE);
-    if (bytes_read > 0) {
-      buffer[bytes_read] = '\0';
-      char* token = strtok(buffer, "|");
-      char* key;
-      int op_code_int = atoi(token);
-      enum OperationCode op_code = (enum OperationCode)op_code_int;
-      switch (op_code) {
-        case OP_CODE_SUBSCRIBE:
-          key = strtok(NULL, "|");
-          handle_client_subscriptions(resp_fifo_fd,
-          notif_fifo_fd, key, OP_CODE_SUBSCRIBE);
-          break;
-        case OP_CODE_UNSUBSCRIBE:
-          key = strtok(NULL, "|");
-          handle_client_subscriptions(resp_fifo_fd, -1,
-          key, OP_CODE_UNSUBSCRIBE);
-          break;
-        case OP_CODE_DISCONNECT:
-          client_id = strrchr(client_data->req_pipe_path, 'q');
-          printf("Client %s disconnected.\n", client_id + 1);
-          handle_client_disconnect(resp_fifo_fd, req_fifo_fd, notif_fifo_fd);
-          return;
-        case OP_CODE_CONNECT:
-          // This case is not read here since it is sent to the server pipe.
-          break;
-        default:
-          fprintf(stderr, "Unknown operation code: %d\n", op_code);
-          send_message(resp_fifo_fd, op_code, 1);
-          break;
-      }
+  size_t offset = 0;
+  FrameHeader header;
+  FrameStatus status;
+  while ((status = frame_peek(buffer + offset, size - offset, &header)) ==
+  FRAME_COMPLETE) {
+    if (handle_request_frame(loop, client_data, &header,
+    buffer + offset + FRAME_HEADER_SIZE) != 0)
+      return;
+    offset += FRAME_HEADER_SIZE + header.length;
+  }
+  flush_responses(loop, client_data);
+
+  if (status == FRAME_INVALID) {
+    write_str(STDERR_FILENO, "Invalid request from a client.\n");
+    end_session(loop, client_data);
+  } else if (offset < size) {
+    client_data->pending = malloc(size - offset);
+    if (client_data->pending == NULL) {
+      write_str(STDERR_FILENO, "Failed to allocate memory for a request.\n");
+      end_session(loop, client_data);
+      return;
     }
+    memcpy(client_data->pending, buffer + offset, size - offset);
+    client_data->pending_size = size - offset;
   }
-  close(req_fifo_fd);
-  close(resp_fifo_fd);
-  close(notif_fifo_fd);
 }
 
-// Worker Threads Function
-void* client_request_handler() {
-  // Blocks SIGUSR1 signal in the threads assigned to this function.
+/// Takes the sessions handed over to a loop, opening them, or closing
+/// every session of the loop after a SIGUSR1 or when it stops.
+/// @param loop The loop.
+/// @param disconnect Whether to close every session.
+static void handle_wakeup(SessionLoop* loop, int disconnect) {
+  loop_drain(loop);
+  pthread_mutex_lock(&loop->mutex);
+  ClientData* incoming = loop->incoming;
+  loop->incoming = NULL;
+  pthread_mutex_unlock(&loop->mutex);
+
+  unsigned disconnects = atomic_load(&disconnect_requests);
+  if (disconnects != loop->disconnects)
+    disconnect = 1;
+  loop->disconnects = disconnects;
+  if (disconnect) {
+    while (loop->sessions != NULL)
+      end_session(loop, loop->sessions);
+    while (loop->opening != NULL) {
+      ClientData* next = loop->opening->next;
+      close_session(loop, loop->opening);
+      loop->opening = next;
+    }
+  }
+
+  // Pushed newest first, opened in the order the clients connected.
+  ClientData** tail = &loop->opening;
+  while (*tail != NULL)
+    tail = &(*tail)->next;
+  ClientData* oldest = NULL;
+  while (incoming != NULL) {
+    ClientData* next = incoming->next;
+    incoming->next = oldest;
+    oldest = incoming;
+    incoming = next;
+  }
+  while (oldest != NULL) {
+    ClientData* next = oldest->next;
+    if (disconnect) {
+      close_session(loop, oldest);
+    } else {
+      oldest->next = NULL;
+      *tail = oldest;
+      tail = &oldest->next;
+    }
+    oldest = next;
+  }
+  open_sessions(loop);
+  release_sessions(loop);
+}
+
+/// Event loop serving sessions, until stop_session_loops.
+/// @param args The SessionLoop.
+/// @return NULL.
+static void* session_loop(void* args) {
+  SessionLoop* loop = args;
+
+  // SIGUSR1 goes through the connection manager.
   sigset_t blocked_signals;
   sigemptyset(&blocked_signals);
   sigaddset(&blocked_signals, SIGUSR1);
   pthread_sigmask(SIG_BLOCK, &blocked_signals, NULL);
-  
-  pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-  pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL);
 
-  while (1) {
-    sem_wait(&session_buffer.full);
-    pthread_mutex_lock(&session_buffer.buffer_mutex);
+  struct epoll_event events[SESSION_LOOP_EVENTS];
+  while (!atomic_load(&stopping)) {
+    // Sessions whose client has not opened its FIFOs yet are tried again.
+    int num_events = epoll_wait(loop->epoll_fd, events, SESSION_LOOP_EVENTS,
+    loop->opening != NULL ? SESSION_OPEN_RETRY_MS : -1);
+    if (num_events == -1 && errno != EINTR) {
+      write_str(STDERR_FILENO, "Failed to wait for client requests.\n");
+      break;
+    }
 
-    ClientData* client_data = session_buffer.session_data[session_buffer.out];
-    int buffer_position = session_buffer.out;
-    session_buffer.out = (session_buffer.out + 1) % MAX_SESSION_COUNT;
+    // Sessions are only closed by their own events until the wakeup.
+    int woken = 0;
+    for (int i = 0; i < num_events; i++) {
+      ClientData* client_data = events[i].data.ptr;
+      if (client_data == NULL)
+        woken = 1;
+      else if (client_data->watched_fd == client_data->resp_fifo_fd)
+        handle_client_output(loop, client_data);
+      else
+        handle_client_request(loop, client_data);
+    }
+    if (woken)
+      handle_wakeup(loop, 0);
+    else if (loop->opening != NULL)
+      open_sessions(loop);
+  }
 
-    pthread_mutex_unlock(&session_buffer.buffer_mutex);
-    sem_post(&session_buffer.empty);
+  handle_wakeup(loop, 1);
+  return NULL;
+}
 
-    handle_client_request(client_data);
-    pthread_mutex_lock(&session_buffer.buffer_mutex);
-    session_buffer.session_data[buffer_position] = NULL;
-    pthread_mutex_unlock(&session_buffer.buffer_mutex);
-    cleanup_client_data(client_data);
+/// Wakes up the loops whose held sessions can be answered. Called by the
+/// WAL committer after each commit.
+/// @param durable_lsn Every record up to this LSN is durable.
+static void wake_held_sessions(uint64_t durable_lsn) {
+  for (size_t i = 0; i < num_loops; i++) {
+    uint64_t waiting = atomic_load(&loops[i].waiting_lsn);
+    if (waiting != 0 && waiting <= durable_lsn)
+      loop_wake(&loops[i]);
   }
-  return NULL;
+}
+
+int start_session_loops() {
+  wal_on_commit(wake_held_sessions);
+  for (size_t i = 0; i < num_loops; i++) {
+    if (pthread_create(&loops[i].thread, NULL, session_loop, &loops[i]) != 0)
+      return 1;
+    loops[i].started = 1;
+  }
+  return 0;
+}
+
+void stop_session_loops() {
+  wal_on_commit(NULL);
+  atomic_store(&stopping, 1);
+  for (size_t i = 0; i < num_loops; i++) {
+    if (loops[i].started) {
+      loop_wake(&loops[i]);
+      pthread_join(loops[i].thread, NULL);
+      loops[i].started = 0;
+    }
+    handle_wakeup(&loops[i], 1); // Sessions handed over after the loop exited.
+    loop_destroy(&loops[i]);
+  }
+  loop_destroy(&manager);
+  free(loops);
+  loops = NULL;
+  num_loops = 0;
+  free(registry.buckets);
+  registry.buckets = NULL;
+}
+
+/// Hands a new session to the loop serving the fewest.
+/// @param client_data The session, registered.
+static void assign_session(ClientData* client_data) {
+  SessionLoop* loop = &loops[0];
+  for (size_t i = 1; i < num_loops; i++)
+    if (atomic_load(&loops[i].num_sessions) <
+    atomic_load(&loop->num_sessions))
+      loop = &loops[i];
+
+  atomic_fetch_add(&loop->num_sessions, 1);
+  pthread_mutex_lock(&loop->mutex);
+  client_data->next = loop->incoming;
+  loop->incoming = client_data;
+  pthread_mutex_unlock(&loop->mutex);
+  loop_wake(loop);
 }
 
 /// Handle the client's connection request.
-/// @param buffer registartion fifo buffer.
-void handle_client_connection_request(char* buffer) {
-  char* token = strtok(buffer, "|");
-  int op_code_int = atoi(token);
-  enum OperationCode op_code = (enum OperationCode)op_code_int;
-
-  if (op_code == OP_CODE_CONNECT) {
-    char* req_pipe_path = strtok(NULL, "|");
-    char* resp_pipe_path = strtok(NULL, "|");
-    char* notif_pipe_path = strtok(NULL, "|");
-
-    ClientData* client_data = malloc(sizeof(ClientData));
-    client_data->req_pipe_path = strdup(req_pipe_path);
-    client_data->resp_pipe_path = strdup(resp_pipe_path);
-    client_data->notif_pipe_path = strdup(notif_pipe_path);
-    atomic_store(&client_data->terminate, 0);
-
-    if (client_already_exists(client_data)) {
-      int resp_fifo_fd = open(resp_pipe_path, O_WRONLY);
-      if (resp_fifo_fd == -1) {
-        write_str(STDERR_FILENO, "Failed to open FIFO.\n");
-      } else {
-        send_message(resp_fifo_fd, OP_CODE_CONNECT, 3);
-        close(resp_fifo_fd);
-      }
-      cleanup_client_data(client_data);
+/// @param header The request's header.
+/// @param payload The request's payload.
+void handle_client_connection_request(const FrameHeader* header,
+const uint8_t* payload) {
+  if (header->opcode != OP_CODE_CONNECT) {
+    write_str(STDERR_FILENO, "Invalid connection request.\n");
+    return;
+  }
+  char req_pipe_path[MAX_PIPE_PATH_LENGTH];
+  char resp_pipe_path[MAX_PIPE_PATH_LENGTH];
+  char notif_pipe_path[MAX_PIPE_PATH_LENGTH];
+  FrameDecoder dec;
+  frame_decode(&dec, payload, header->length);
+  frame_get_cstring(&dec, req_pipe_path, sizeof(req_pipe_path));
+  frame_get_cstring(&dec, resp_pipe_path, sizeof(resp_pipe_path));
+  frame_get_cstring(&dec, notif_pipe_path, sizeof(notif_pipe_path));
+  if (frame_done(&dec) != 0 || strrchr(req_pipe_path, 'q') == NULL) {
+    write_str(STDERR_FILENO, "Invalid connection request.\n");
+    return;
+  }
+
+  ClientData* client_data = malloc(sizeof(ClientData));
+  if (client_data == NULL) {
+    write_str(STDERR_FILENO, "Failed to allocate memory for a session.\n");
+    return;
+  }
+  client_data->req_pipe_path = strdup(req_pipe_path);
+  client_data->resp_pipe_path = strdup(resp_pipe_path);
+  client_data->notif_pipe_path = strdup(notif_pipe_path);
+  client_data->req_fifo_fd = -1;
+  client_data->resp_fifo_fd = -1;
+  client_data->notif_fifo_fd = -1;
+  client_data->connect_id = header->request_id;
+  client_data->pending = NULL;
+  client_data->pending_size = 0;
+  client_data->watched_fd = -1;
+  client_data->output = NULL;
+  client_data->output_size = 0;
+  client_data->output_capacity = 0;
+  client_data->disconnecting = 0;
+  client_data->output_lsn = 0;
+  client_data->held = 0;
+  client_data->held_next = NULL;
+  clock_gettime(CLOCK_MONOTONIC, &client_data->connected);
+
+  if (register_session(client_data)) {
+    // Never waits for a reader, that would stall every registration. The
+    // response fits in the FIFO whole, or is dropped.
+    int resp_fifo_fd = open(resp_pipe_path, O_WRONLY | O_NONBLOCK);
+    if (resp_fifo_fd == -1) {
+      write_str(STDERR_FILENO, "Failed to open FIFO.\n");
     } else {
-      create_request(client_data);
+      send_message(resp_fifo_fd, OP_CODE_CONNECT, 3, header->request_id);
+      close(resp_fifo_fd);
     }
+    cleanup_client_data(client_data);
+  } else {
+    assign_session(client_data);
+  }
+}
+
+/// Reads the registration FIFO and handles every whole CONNECT in it.
+/// @param server_fifo_fd The registration FIFO, non-blocking.
+static void handle_registrations(int server_fifo_fd) {
+  static uint8_t buffer[REGISTRATION_READ_SIZE];
+  static size_t size; // Start of a frame cut short by the last read.
+  ssize_t bytes_read = read(server_fifo_fd, buffer + size,
+  sizeof(buffer) - size);
+  if (bytes_read <= 0)
+    return;
+  size += (size_t) bytes_read;
+
+  size_t offset = 0;
+  FrameHeader header;
+  FrameStatus status;
+  while ((status = frame_peek(buffer + offset, size - offset, &header)) !=
+  FRAME_INVALID) {
+    if (size - offset >= FRAME_HEADER_SIZE &&
+    header.length > REGISTRATION_PAYLOAD_SIZE) {
+      status = FRAME_INVALID;
+      break;
+    }
+    if (status == FRAME_PARTIAL)
+      break;
+    handle_client_connection_request(&header,
+    buffer + offset + FRAME_HEADER_SIZE);
+    offset += FRAME_HEADER_SIZE + header.length;
+  }
+
+  if (status == FRAME_INVALID) {
+    // Clients share the FIFO, there is no telling where the next frame
+    // starts in what was read.
+    write_str(STDERR_FILENO, "Invalid connection request.\n");
+    size = 0;
+    return;
   }
+  memmove(buffer, buffer + offset, size - offset);
+  size -= offset;
+}
+
+/// Handles a SIGUSR1: drops every subscription and has every loop close its
+/// sessions.
+static void handle_sigusr1_request() {
+  server_data->sigusr1_received = 0;
+  clear_all_subscriptions();
+  atomic_fetch_add(&disconnect_requests, 1);
+  for (size_t i = 0; i < num_loops; i++)
+    loop_wake(&loops[i]);
 }
 
 // Thread Manager Function
 void* connection_manager(void* args) {
   char* server_pipe_path = (char*)args;
-  
+
   // Creates a FIFO.
   if(mkfifo(server_pipe_path, 0666) == -1 && errno != EEXIST) {
     write_str(STDERR_FILENO, "Failed to create the named pipe or one \
@@ -287,31 +1013,39 @@ void* connection_manager(void* args) {
     pthread_exit(NULL);
   }
 
-  // Opens FIFO for reading.
-  int server_fifo_fd;
-  if ((server_fifo_fd = open(server_pipe_path, O_RDONLY | O_NONBLOCK)) == -1) {
+  // Opens FIFO for reading, and for writing so that it never reports a
+  // hangup when the last client closes it.
+  int server_fifo_fd = open(server_pipe_path, O_RDONLY | O_NONBLOCK);
+  int keep_open_fd = server_fifo_fd == -1 ? -1 :
+  open(server_pipe_path, O_WRONLY);
+  struct epoll_event event = {.events = EPOLLIN, .data.ptr = &registry};
+  if (keep_open_fd == -1 || epoll_ctl(manager.epoll_fd, EPOLL_CTL_ADD,
+  server_fifo_fd, &event) != 0) {
     write_str(STDERR_FILENO, "Failed to open FIFO.\n");
+    if (server_fifo_fd != -1)
+      close(server_fifo_fd);
     pthread_exit(NULL);
   }
 
   while (!atomic_load(&server_data->terminate)) {
-    // Check SIGUSR1.
-    if (server_data->sigusr1_received) {
-      clear_all_subscriptions();
-      disconnect_all_clients();
-      server_data->sigusr1_received = 0;
-    }
-    char buffer[MAX_STRING_SIZE];
-    ssize_t bytes_read = read(server_fifo_fd, buffer, MAX_STRING_SIZE);
-    if (bytes_read > 0) {
-      buffer[bytes_read] = '\0';
-      handle_client_connection_request(buffer);
+    struct epoll_event events[2];
+    int num_events = epoll_wait(manager.epoll_fd, events, 2, -1);
+    for (int i = 0; i < num_events; i++) {
+      if (events[i].data.ptr == NULL) {
+        loop_drain(&manager);
+        continue;
+      }
+      handle_registrations(server_fifo_fd);
     }
+
+    // Check SIGUSR1.
+    if (server_data->sigusr1_received)
+      handle_sigusr1_request();
   }
 
   close(server_fifo_fd);
+  close(keep_open_fd);
   unlink(server_pipe_path);
   clear_all_subscriptions();
-  disconnect_all_clients();
   pthread_exit(NULL);
 }
@@ -2,44 +2,94 @@
 #define CONNECTIONS_H
 
 #include <pthread.h>
-#include <semaphore.h>
-#include <stdatomic.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include "common/constants.h"
+#include "common/protocol.h"
 #include "notifications.h"
 
+// Client sessions are not tied to threads: each is a ClientData in a
+// registry, served by one of a fixed pool of event loop threads, one per
+// core. A loop sleeps in epoll_wait on the request FIFOs of its sessions and
+// only reads one once it is readable, so CPU use follows the request rate
+// and idle sessions cost a few file descriptors. The connection manager
+// thread waits the same way on the registration FIFO and hands each new
+// session to the loop serving the fewest. Signal handlers and other threads
+// wake a loop up by writing to its wakeup pipe.
+//
+// Requests are frames (see common/protocol.h), read as many at a time as
+// the FIFO holds. The bytes of a frame cut short by a read are kept by the
+// session until the rest arrives. Clients may send many requests without
+// waiting for their responses; the responses to the requests of one read
+// are sent with a single write.
+//
+// A loop never blocks on a client. The response and notification FIFOs are
+// opened without waiting for the client to open its ends, trying again
+// every SESSION_OPEN_RETRY_MS until it does. Responses the response FIFO
+// has no room for are queued by the session, whose loop then waits for the
+// FIFO to drain instead of reading more of its requests.
+//
+// Nor does a loop wait for the write-ahead log. Responses to PUTs and DELs
+// are held by their session until their log records are durable, while the
+// loop serves its other sessions. The WAL committer wakes the loop up once
+// they are, so one sync answers every update the loop gathered meanwhile.
+
+#define SESSION_LOOP_EVENTS 64 // Events taken per epoll_wait.
+#define SESSION_REGISTRY_MIN_BUCKETS 64
+// Bytes read from a request FIFO at once, room for a whole frame after the
+// leftover of the previous read.
+#define SESSION_READ_SIZE (2 * FRAME_MAX_SIZE)
+// Responses gathered before a write.
+#define SESSION_RESPONSE_SIZE (2 * FRAME_MAX_SIZE)
+// How often the FIFOs of a new session are tried, and for how long.
+#define SESSION_OPEN_RETRY_MS 1
+#define SESSION_OPEN_TIMEOUT_MS 5000
+
 typedef struct ClientData {
-  volatile atomic_bool terminate;
-  char* req_pipe_path; 
-  char* resp_pipe_path; 
+  char* req_pipe_path;
+  char* resp_pipe_path;
   char* notif_pipe_path;
+  int req_fifo_fd;
+  int resp_fifo_fd;
+  int notif_fifo_fd;
+  uint32_t connect_id;        // Request id of the CONNECT, to answer it.
+  uint8_t* pending;           // Start of a frame cut short by a read.
+  size_t pending_size;
+  int watched_fd;             // FIFO in the loop's epoll set, -1 for none.
+  uint8_t* output;            // Responses the response FIFO had no room for.
+  size_t output_size;
+  size_t output_capacity;
+  int disconnecting;          // Closed once its output is sent.
+  uint64_t output_lsn;        // Log record its output waits for.
+  int held;                   // Whether its output waits for the log.
+  struct ClientData* held_next; // Same loop, held as well.
+  struct timespec connected;  // When its CONNECT was handled.
+  struct ClientData* prev;    // Sessions of the same loop.
+  struct ClientData* next;
+  struct ClientData* registry_next; // Same registry bucket.
 } ClientData;
 
-typedef struct {
-  ClientData** session_data;
-  int in;
-  int out;
-  sem_t full;
-  sem_t empty;
-  pthread_mutex_t buffer_mutex;
-} RequestBuffer;
-
 /// Listens for incoming connections.
-/// @param args Arguments passed to the listener (if any).
+/// @param args The path to the registration FIFO.
 /// @return A pointer to the result (if any).
 void* connection_manager(void* args);
 
-/// Initializes the session buffer.
-void initialize_session_buffer();
+/// Initializes the session registry and the event loops, before any signal
+/// handler can wake them up.
+/// @return 0 on success, 1 otherwise.
+int initialize_session_loops();
 
-/// Cleanup the session buffer.
-void cleanup_session_buffer();
+/// Starts the threads of the event loops.
+/// @return 0 on success, 1 otherwise.
+int start_session_loops();
 
-/// Handles client requests.
-void* client_request_handler();
+/// Disconnects every session, stops the event loops and frees them.
+void stop_session_loops();
 
-/// Disconnects all clients.
-void disconnect_all_clients();
+/// Wakes the connection manager up to look at the signal flags of
+/// server_data. Async-signal-safe.
+void wake_connection_manager();
 
 #endif
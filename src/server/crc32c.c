@@ -0,0 +1,71 @@
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#endif
+
+#include "crc32c.h"
+
+#define CRC32C_POLY 0x82f63b78u // Castagnoli polynomial, reflected.
+
+#if defined(__SSE4_2__)
+
+uint32_t crc32c_update(uint32_t crc, const void *data, size_t size) {
+  const unsigned char *bytes = data;
+  uint64_t value = ~crc;
+  while (size >= 8) {
+    uint64_t word;
+    memcpy(&word, bytes, 8);
+    value = _mm_crc32_u64(value, word);
+    bytes += 8;
+    size -= 8;
+  }
+  uint32_t value32 = (uint32_t) value;
+  while (size-- > 0)
+    value32 = _mm_crc32_u8(value32, *bytes++);
+  return ~value32;
+}
+
+#else
+
+static uint32_t table[8][256];
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+
+static void init_table() {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; bit++)
+      crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+    table[0][i] = crc;
+  }
+  for (uint32_t i = 0; i < 256; i++)
+    for (int slice = 1; slice < 8; slice++)
+      table[slice][i] = (table[slice - 1][i] >> 8) ^
+      table[0][table[slice - 1][i] & 0xff];
+}
+
+uint32_t crc32c_update(uint32_t crc, const void *data, size_t size) {
+  pthread_once(&table_once, init_table);
+  const unsigned char *bytes = data;
+  crc = ~crc;
+  while (size >= 8) {
+    uint32_t low = crc ^ ((uint32_t) bytes[0] | (uint32_t) bytes[1] << 8 |
+    (uint32_t) bytes[2] << 16 | (uint32_t) bytes[3] << 24);
+    crc = table[7][low & 0xff] ^ table[6][(low >> 8) & 0xff] ^
+    table[5][(low >> 16) & 0xff] ^ table[4][low >> 24] ^
+    table[3][bytes[4]] ^ table[2][bytes[5]] ^
+    table[1][bytes[6]] ^ table[0][bytes[7]];
+    bytes += 8;
+    size -= 8;
+  }
+  while (size-- > 0)
+    crc = (crc >> 8) ^ table[0][(crc ^ *bytes++) & 0xff];
+  return ~crc;
+}
+
+#endif
+
+uint32_t crc32c(const void *data, size_t size) {
+  return crc32c_update(0, data, size);
+}
@@ -0,0 +1,21 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// Extends a CRC32C (Castagnoli) with more bytes. Uses the SSE4.2 crc32
+/// instruction when built for it (make NATIVE=1), slicing-by-8 otherwise.
+/// @param crc CRC of the bytes so far, 0 to start.
+/// @param data Bytes to add.
+/// @param size Number of bytes.
+/// @return CRC of all the bytes.
+uint32_t crc32c_update(uint32_t crc, const void *data, size_t size);
+
+/// CRC32C of a buffer.
+/// @param data The bytes.
+/// @param size Number of bytes.
+/// @return The CRC.
+uint32_t crc32c(const void *data, size_t size);
+
+#endif // CRC32C_H
@@ -0,0 +1,180 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "epoch.h"
+#include "macros.h"
+
+/// Per-thread reclamation state, kept in a global registry.
+typedef struct EpochRecord {
+  _Atomic uint64_t epoch;         // Epoch observed on entry, 0 when outside.
+  atomic_bool in_use;             // Owned by a live thread.
+  unsigned int depth;             // Nesting level of critical sections.
+  unsigned int retire_count;      // Retires since the last reclaim attempt.
+  EpochEntry *limbo_head;         // Retired objects, oldest first.
+  EpochEntry *limbo_tail;
+  struct EpochRecord *next;
+} EpochRecord;
+
+static _Atomic uint64_t global_epoch = 1;
+static _Atomic(EpochRecord *) registry = NULL;
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static EpochEntry *orphans = NULL; // Limbo of exited threads, under the mutex.
+static pthread_key_t record_key;
+static pthread_once_t record_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local EpochRecord *local_record = NULL;
+
+/// Appends a list of retired objects to another one.
+/// @param head Head of the destination list.
+/// @param tail Tail of the destination list.
+/// @param entry First object to append, the list must be NULL terminated.
+static void limbo_append(EpochEntry **head, EpochEntry **tail,
+EpochEntry *entry) {
+  if (entry == NULL)
+    return;
+  if (*tail == NULL)
+    *head = entry;
+  else
+    (*tail)->next = entry;
+  while (entry->next != NULL)
+    entry = entry->next;
+  *tail = entry;
+}
+
+/// Frees the objects of a list retired at least two epochs ago.
+/// @param head Head of the list, ordered from oldest to newest.
+/// @param safe_epoch Objects retired before this epoch are freed.
+/// @return The new head of the list.
+static EpochEntry *limbo_free(EpochEntry *head, uint64_t safe_epoch) {
+  while (head != NULL && head->epoch < safe_epoch) {
+    EpochEntry *next = head->next;
+    head->free_fn(head);
+    head = next;
+  }
+  return head;
+}
+
+/// Thread exit destructor, hands the thread's limbo over to the orphans.
+/// @param arg The thread's record.
+static void record_release(void *arg) {
+  EpochRecord *record = arg;
+  pthread_mutex_lock(&registry_mutex);
+  EpochEntry *tail = NULL;
+  EpochEntry *head = orphans;
+  for (tail = orphans; tail != NULL && tail->next != NULL; tail = tail->next)
+    ;
+  limbo_append(&head, &tail, record->limbo_head);
+  orphans = head;
+  pthread_mutex_unlock(&registry_mutex);
+
+  record->limbo_head = NULL;
+  record->limbo_tail = NULL;
+  record->depth = 0;
+  record->retire_count = 0;
+  atomic_store(&record->epoch, 0);
+  atomic_store(&record->in_use, false);
+}
+
+static void create_record_key() {
+  pthread_key_create(&record_key, record_release);
+}
+
+/// Returns the calling thread's record, registering the thread if needed.
+/// @return The record.
+static EpochRecord *get_record() {
+  if (local_record != NULL)
+    return local_record;
+
+  pthread_once(&record_key_once, create_record_key);
+  pthread_mutex_lock(&registry_mutex);
+  EpochRecord *record = atomic_load(&registry);
+  while (record != NULL && atomic_load(&record->in_use))
+    record = record->next;
+
+  if (record == NULL) {
+    record = calloc(1, sizeof(EpochRecord));
+    CHECK_NULL(record, "Failed to allocate memory for epoch record.");
+    record->next = atomic_load(&registry);
+    atomic_store(&record->in_use, true);
+    atomic_store(&registry, record);
+  } else {
+    atomic_store(&record->in_use, true);
+  }
+  pthread_mutex_unlock(&registry_mutex);
+
+  pthread_setspecific(record_key, record);
+  local_record = record;
+  return record;
+}
+
+/// Advances the global epoch if every thread inside a critical section has
+/// already observed the current one.
+/// @return The global epoch after the attempt.
+static uint64_t try_advance() {
+  uint64_t epoch = atomic_load(&global_epoch);
+  for (EpochRecord *record = atomic_load(&registry); record != NULL;
+  record = record->next) {
+    uint64_t observed = atomic_load(&record->epoch);
+    if (observed != 0 && observed != epoch)
+      return epoch;
+  }
+  atomic_compare_exchange_strong(&global_epoch, &epoch, epoch + 1);
+  return atomic_load(&global_epoch);
+}
+
+void epoch_enter() {
+  EpochRecord *record = get_record();
+  if (record->depth++ == 0) {
+    atomic_store(&record->epoch, atomic_load(&global_epoch));
+    // The announcement must be visible before any shared pointer is loaded.
+    atomic_thread_fence(memory_order_seq_cst);
+  }
+}
+
+void epoch_exit() {
+  EpochRecord *record = local_record;
+  if (record != NULL && --record->depth == 0)
+    atomic_store(&record->epoch, 0);
+}
+
+void epoch_retire(EpochEntry *entry) {
+  EpochRecord *record = get_record();
+  entry->next = NULL;
+  // The unlink must be ordered before reading the epoch it is tagged with.
+  atomic_thread_fence(memory_order_seq_cst);
+  entry->epoch = atomic_load(&global_epoch);
+  limbo_append(&record->limbo_head, &record->limbo_tail, entry);
+
+  if (++record->retire_count < EPOCH_RECLAIM_INTERVAL)
+    return;
+  record->retire_count = 0;
+
+  uint64_t epoch = try_advance();
+  if (epoch < 2)
+    return;
+  record->limbo_head = limbo_free(record->limbo_head, epoch - 1);
+  if (record->limbo_head == NULL)
+    record->limbo_tail = NULL;
+
+  if (pthread_mutex_trylock(&registry_mutex) == 0) {
+    orphans = limbo_free(orphans, epoch - 1);
+    pthread_mutex_unlock(&registry_mutex);
+  }
+}
+
+void epoch_drain() {
+  EpochRecord *record = local_record;
+  if (record != NULL) {
+    limbo_free(record->limbo_head, UINT64_MAX);
+    record->limbo_head = NULL;
+    record->limbo_tail = NULL;
+  }
+  // Trylock: after a fork another thread may have left the mutex locked.
+  if (pthread_mutex_trylock(&registry_mutex) == 0) {
+    orphans = limbo_free(orphans, UINT64_MAX);
+    pthread_mutex_unlock(&registry_mutex);
+  }
+}
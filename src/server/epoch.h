@@ -0,0 +1,32 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <stdint.h>
+
+#define EPOCH_RECLAIM_INTERVAL 64 // Retires between two reclaim attempts.
+
+/// Header embedded at the start of every object reclaimed through epochs.
+typedef struct EpochEntry {
+  struct EpochEntry *next;
+  uint64_t epoch;                               // Global epoch when retired.
+  void (*free_fn)(struct EpochEntry *entry);    // Frees the whole object.
+} EpochEntry;
+
+/// Enters a read-side critical section. Objects reachable inside it are not
+/// freed until the matching epoch_exit. Sections may be nested.
+void epoch_enter();
+
+/// Leaves a read-side critical section.
+void epoch_exit();
+
+/// Hands an unlinked object over for reclamation. It is freed once every
+/// thread that could still hold a reference to it has left its critical
+/// section.
+/// @param entry The object's epoch header, with free_fn set.
+void epoch_retire(EpochEntry *entry);
+
+/// Frees every retired object. Only safe once no other thread can be inside
+/// a critical section, e.g. when the KVS is being terminated.
+void epoch_drain();
+
+#endif // EPOCH_H
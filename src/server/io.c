@@ -1,3 +1,7 @@
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+
 #include "server/io.h"
 
 void write_str(int fd, const char *str) {
@@ -40,3 +44,15 @@ size_t strn_memcpy(char *dest, const char *src, size_t n) {
   memcpy(dest, src, bytes_to_copy);
   return bytes_to_copy;
 }
+
+int sync_parent_dir(const char *path) {
+  char dir[PATH_MAX];
+  strncpy(dir, path, sizeof(dir) - 1);
+  dir[sizeof(dir) - 1] = '\0';
+  int fd = open(dirname(dir), O_RDONLY | O_DIRECTORY);
+  if (fd < 0)
+    return 1;
+  int failed = fsync(fd) != 0;
+  close(fd);
+  return failed;
+}
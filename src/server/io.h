@@ -22,4 +22,10 @@ void write_uint(int fd, int value);
 /// @return Number of bytes copied.
 size_t strn_memcpy(char* dest, const char* src, size_t n);
 
+/// Syncs the directory holding a file, so that its creation or renaming
+/// survives a crash.
+/// @param path Path of the file.
+/// @return 0 on success, 1 otherwise.
+int sync_parent_dir(const char *path);
+
 #endif  // SERVER_IO_H
@@ -1,12 +1,15 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
+#include <time.h>
 
 #include "constants.h"
 #include "jobs_manager.h"
 #include "operations.h"
 #include "parser.h"
+#include "wal.h"
 #include "server/io.h"
 #include "server/utils.h"
 
@@ -20,57 +23,221 @@ void initialize_job(Job *job, const char *file_path) {
   job->job_fd = -1;
   job->job_output_fd = -1;
   job->backup_counter = 1; // Since naming scheme for backups starts at 1.
+  job->wal_lsn = 0;
+  job->durable_lsn = 0;
+  job->cost = 0;
   job->next = NULL;
 }
 
- /// Initializes the job queue.
- /// @param queue The job queue to initialize.
-void initialize_jobs_queue(JobQueue *queue) {
-  queue->current_job = NULL;
-  queue->last_job = NULL;
-  queue->num_files = 0;
-  pthread_mutex_init(&queue->queue_mutex, NULL);
+/// Estimates how long a job will take from its file size and a pre-scan of
+/// its commands. Unreadable files cost nothing, read_file reports them.
+/// @param job The job.
+static void estimate_job_cost(Job *job) {
+  int fd = open(job->job_file_path, O_RDONLY);
+  if (fd == -1)
+    return;
+  struct stat st;
+  if (fstat(fd, &st) == 0)
+    job->cost = (uint64_t) st.st_size * JOB_COST_PER_BYTE;
+
+  CommandCounts counts;
+  count_commands(fd, &counts);
+  close(fd);
+  job->cost += counts.commands * JOB_COST_PER_COMMAND +
+  counts.shows * JOB_COST_PER_SHOW + counts.backups * JOB_COST_PER_BACKUP +
+  (uint64_t) counts.wait_ms * JOB_COST_PER_WAIT_MS;
 }
 
-/// Adds a job to the queue.
-/// @param queue The job queue.
-/// @param job The job data to add.
-void enqueue_job(JobQueue *queue, Job *job) {
-  pthread_mutex_lock(&queue->queue_mutex);
+/// Jobs found while scanning the jobs directory, in scan order.
+typedef struct JobList {
+  Job *head;
+  Job *tail;
+  int count;
+} JobList;
+
+/// Appends a job to a list.
+/// @param list The list.
+/// @param job The job to add.
+static void append_job(JobList *list, Job *job) {
   job->next = NULL;
-  if (queue->current_job == NULL) {
-    queue->current_job = job;
+  if (list->tail == NULL)
+    list->head = job;
+  else
+    list->tail->next = job;
+  list->tail = job;
+  list->count++;
+}
+
+/// Pushes a job to the bottom of a deque. Only used before the workers start.
+/// @param deque The deque, with room for the job.
+/// @param job The job.
+static void deque_push(JobDeque *deque, Job *job) {
+  int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+  deque->jobs[bottom] = job;
+  atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_release);
+}
+
+/// Pops the newest job of the calling worker's own deque.
+/// @param deque The worker's deque.
+/// @return The job, NULL if the deque is empty.
+static Job *deque_pop(JobDeque *deque) {
+  int64_t bottom =
+  atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+  atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+  // Thieves must see the reservation before the owner reads top.
+  atomic_thread_fence(memory_order_seq_cst);
+  int64_t top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+  Job *job = NULL;
+  if (top <= bottom) {
+    job = deque->jobs[bottom];
+    if (top == bottom) {
+      // Last job, race the thieves for it.
+      if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+      memory_order_seq_cst, memory_order_relaxed))
+        job = NULL;
+      atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
   } else {
-    Job *temp = queue->current_job;
-    while (temp->next != NULL)
-      temp = temp->next;
-    temp->next = job;
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
   }
-  queue->num_files++;
-  pthread_mutex_unlock(&queue->queue_mutex);
+  return job;
 }
 
-/// Removes a job from the queue.
+typedef enum {
+  STEAL_EMPTY,
+  STEAL_SUCCESS,
+  STEAL_LOST      // Another worker took the job first, the deque may have more.
+} StealResult;
+
+/// Steals the oldest job of another worker's deque.
+/// @param deque The victim's deque.
+/// @param job Where to store the stolen job.
+/// @return The outcome of the attempt.
+static StealResult deque_steal(JobDeque *deque, Job **job) {
+  int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+  if (top >= bottom)
+    return STEAL_EMPTY;
+
+  // The array is never written once the workers run, so this read is safe.
+  *job = deque->jobs[top];
+  if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+  memory_order_seq_cst, memory_order_relaxed))
+    return STEAL_LOST;
+  return STEAL_SUCCESS;
+}
+
+/// Takes the next job for a worker: one from its own deque, or else one
+/// stolen from the other workers.
 /// @param queue The job queue.
-/// @return Job* The job data removed from the queue, or NULL if the queue is empty.
-Job* dequeue_job(JobQueue *queue) {
-  if (queue->current_job == NULL) {
-    return NULL;
+/// @param self Index of the worker's deque.
+/// @return The job, NULL once every deque is empty.
+static Job *next_job(JobQueue *queue, size_t self) {
+  Job *job = deque_pop(&queue->deques[self]);
+  if (job != NULL)
+    return job;
+
+  // No job is ever added back, so a pass that finds every deque empty
+  // without losing a race means all the work has been handed out.
+  int lost;
+  do {
+    lost = 0;
+    for (size_t i = 1; i < queue->num_workers; i++) {
+      JobDeque *victim = &queue->deques[(self + i) % queue->num_workers];
+      StealResult result = deque_steal(victim, &job);
+      if (result == STEAL_SUCCESS)
+        return job;
+      if (result == STEAL_LOST)
+        lost = 1;
+    }
+  } while (lost);
+  return NULL;
+}
+
+/// qsort comparator ordering jobs by decreasing cost.
+static int compare_job_cost(const void *a, const void *b) {
+  const Job *job_a = *(Job *const *) a;
+  const Job *job_b = *(Job *const *) b;
+  return (job_a->cost < job_b->cost) - (job_a->cost > job_b->cost);
+}
+
+/// Initializes the job queue with a longest processing time first schedule:
+/// jobs are taken by decreasing cost and each goes to the worker with the
+/// least work so far. Every deque is filled so its owner pops its largest
+/// job first, while thieves steal the smallest ones.
+/// @param queue The job queue to initialize.
+/// @param list Jobs to distribute.
+/// @param max_workers Maximum number of worker threads.
+static void initialize_jobs_queue(JobQueue *queue, JobList *list,
+size_t max_workers) {
+  size_t num_files = (size_t) list->count;
+  queue->num_files = list->count;
+  queue->num_workers = max_workers < num_files ? max_workers : num_files;
+  queue->deques = NULL;
+  atomic_init(&queue->next_worker, 0);
+  atomic_init(&queue->busy_ns, 0);
+  if (queue->num_workers == 0)
+    return;
+
+  Job **jobs = malloc(num_files * sizeof(Job *));
+  size_t *owners = malloc(num_files * sizeof(size_t));
+  uint64_t *loads = calloc(queue->num_workers, sizeof(uint64_t));
+  size_t *counts = calloc(queue->num_workers, sizeof(size_t));
+  CHECK_NULL(jobs, "Failed to alloc memory for job schedule.");
+  CHECK_NULL(owners, "Failed to alloc memory for job schedule.");
+  CHECK_NULL(loads, "Failed to alloc memory for job schedule.");
+  CHECK_NULL(counts, "Failed to alloc memory for job schedule.");
+
+  size_t i = 0;
+  for (Job *job = list->head; job != NULL; job = job->next)
+    jobs[i++] = job;
+  qsort(jobs, num_files, sizeof(Job *), compare_job_cost);
+
+  for (i = 0; i < num_files; i++) {
+    size_t least = 0;
+    for (size_t w = 1; w < queue->num_workers; w++)
+      if (loads[w] < loads[least] ||
+      (loads[w] == loads[least] && counts[w] < counts[least]))
+        least = w;
+    owners[i] = least;
+    loads[least] += jobs[i]->cost;
+    counts[least]++;
   }
-  Job *job = queue->current_job;
-  queue->current_job = queue->current_job->next;
-  queue->num_files--;
-  return job;
+
+  queue->deques = aligned_alloc(CACHE_LINE_SIZE,
+  queue->num_workers * sizeof(JobDeque));
+  CHECK_NULL(queue->deques, "Failed to alloc memory for job deques.");
+  for (size_t w = 0; w < queue->num_workers; w++) {
+    JobDeque *deque = &queue->deques[w];
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+    deque->jobs = malloc(counts[w] * sizeof(Job *));
+    CHECK_NULL(deque->jobs, "Failed to alloc memory for job deques.");
+  }
+
+  // Cheapest first, so the owner's pops from the bottom start with the
+  // most expensive job.
+  for (i = num_files; i-- > 0;) {
+    jobs[i]->next = NULL;
+    deque_push(&queue->deques[owners[i]], jobs[i]);
+  }
+
+  free(jobs);
+  free(owners);
+  free(loads);
+  free(counts);
 }
 
 /// Recursively creates jobs from files in a directory and adds them to the job queue.
 /// This function checks if the current file is a job file or a directory. If it's a job file,
 /// it initializes a Job structure and enqueues it. If it's a directory, it recursively processes
 /// the directory to find more job files. 
-/// @param queue Pointer to the job queue.
+/// @param list List the jobs are appended to.
 /// @param current_file Pointer to the current directory entry.
 /// @param dir_path Path to the directory containing job entries.
-void create_jobs(JobQueue **queue, struct dirent *current_file,
+void create_jobs(JobList *list, struct dirent *current_file,
 char *dir_path) {
   if (current_file->d_type == 8 && strstr(current_file->d_name, ".job") != NULL) {
     Job *current_job = malloc(sizeof(Job));
@@ -81,9 +248,10 @@ char *dir_path) {
     dir_path, current_file->d_name);
     job_file_path = realloc(job_file_path, path_len + 1); // +1 for null terminator
     initialize_job(current_job, job_file_path);
+    estimate_job_cost(current_job);
     free(job_file_path);
     job_file_path = NULL;
-    enqueue_job(*queue, current_job);
+    append_job(list, current_job);
   } else if (current_file->d_type == 4 && strcmp(current_file->d_name, ".") != 0\
   && strcmp(current_file->d_name, "..") != 0) {
     char *nested_path = malloc(PATH_MAX);
@@ -95,56 +263,60 @@ char *dir_path) {
     CHECK_NULL(nested_dir, "Failed to open sub-directory.");
     if (nested_dir != NULL)
       while ((current_file = readdir(nested_dir)) != NULL)
-        create_jobs(queue, current_file, nested_path); // Recursive call
+        create_jobs(list, current_file, nested_path); // Recursive call
     closedir(nested_dir);
     free(nested_path);
     nested_path = NULL;
   }
 }
 
-JobQueue *create_job_queue(char *dir_path) {
+JobQueue *create_job_queue(char *dir_path, size_t max_workers) {
   DIR *dir = opendir(dir_path);
   CHECK_NULL(dir, "Failed to open directory.");
   struct dirent *current_file;
-  JobQueue *queue = malloc(sizeof(JobQueue));
-  initialize_jobs_queue(queue);
+  JobList list = {NULL, NULL, 0};
   while ((current_file = readdir(dir)) != NULL)
-    create_jobs(&queue, current_file, dir_path);
+    create_jobs(&list, current_file, dir_path);
   closedir(dir);
+  JobQueue *queue = malloc(sizeof(JobQueue));
+  CHECK_NULL(queue, "Failed to alloc memory for job queue.");
+  initialize_jobs_queue(queue, &list, max_workers);
   return queue;
 }
 
 /// Handles the write command for a job.
 /// This function parses the write command from the job's file descriptor,
 /// extracts the key-value pairs, and writes them to the key-value store.
+/// The pairs are borrowed from the job file, they are only copied into the
+/// store itself.
 /// @param job Pointer to the Job structure containing job details.
-/// @param keys Pointer to a 2D array to store the keys.
-/// @param values Pointer to a 2D array to store the values.
-void cmd_write(Job* job, char (*keys)[MAX_WRITE_SIZE][MAX_STRING_SIZE],
-char (*values)[MAX_WRITE_SIZE][MAX_STRING_SIZE]) {
+void cmd_write(Job* job) {
+  StringSlice keys[MAX_WRITE_SIZE];
+  StringSlice values[MAX_WRITE_SIZE];
   size_t num_pairs;
-  num_pairs = parse_write(job->job_fd, *keys, *values,
-  MAX_WRITE_SIZE, MAX_STRING_SIZE);
+  num_pairs = parse_write_slices(job->job_fd, keys, values, MAX_WRITE_SIZE);
 
   CHECK_NUM_PAIRS(num_pairs, "Invalid command. See HELP for usage.");
 
-  CHECK_RETURN_ONE(kvs_write(num_pairs, *keys, *values, job->job_output_fd),
-  "Failed to write pair.");
+  uint64_t lsn;
+  int result = kvs_write(num_pairs, keys, values, &job->output, &lsn);
+  if (lsn > job->wal_lsn)
+    job->wal_lsn = lsn;
+  CHECK_RETURN_ONE(result, "Failed to write pair.");
 }
 
 /// Reads key-value pairs from a job file descriptor and processes them.
 /// This function reads key-value pairs from the job's file descriptor, parses them,
 /// and attempts to read the corresponding values from the key-value store.
 /// @param job A pointer to the Job structure containing job-related information.
-/// @param keys A pointer to an array where the parsed keys will be stored.
-void cmd_read(Job* job, char (*keys)[MAX_WRITE_SIZE][MAX_STRING_SIZE]) {
+void cmd_read(Job* job) {
+  StringSlice keys[MAX_WRITE_SIZE];
   size_t num_pairs;
-  num_pairs = parse_read_delete(job->job_fd, *keys,
-  MAX_WRITE_SIZE, MAX_STRING_SIZE);
+  num_pairs = parse_read_delete_slices(job->job_fd, keys, MAX_WRITE_SIZE);
 
   CHECK_NUM_PAIRS(num_pairs, "Invalid command. See HELP for usage.");
 
-  CHECK_RETURN_ONE(kvs_read(num_pairs, *keys, job->job_output_fd),
+  CHECK_RETURN_ONE(kvs_read(num_pairs, keys, &job->output),
   "Failed to read pair.");
 }
 
@@ -153,16 +325,18 @@ void cmd_read(Job* job, char (*keys)[MAX_WRITE_SIZE][MAX_STRING_SIZE]) {
 /// the corresponding key-value pairs from the key-value store. If the command is invalid
 /// or if the deletion fails, appropriate error messages are printed to stderr.
 /// @param job Pointer to the Job structure containing job details.
-/// @param keys Pointer to a 2D array where parsed keys will be stored.
-void cmd_delete(Job* job, char (*keys)[MAX_WRITE_SIZE][MAX_STRING_SIZE]) {
+void cmd_delete(Job* job) {
+  StringSlice keys[MAX_WRITE_SIZE];
   size_t num_pairs;
-  num_pairs = parse_read_delete(job->job_fd, *keys,
-  MAX_WRITE_SIZE, MAX_STRING_SIZE);
+  num_pairs = parse_read_delete_slices(job->job_fd, keys, MAX_WRITE_SIZE);
 
   CHECK_NUM_PAIRS(num_pairs, "Invalid command. See HELP for usage.");
 
-  CHECK_RETURN_ONE(kvs_delete(num_pairs, *keys, job->job_output_fd),
-  "Failed to delete pair.");
+  uint64_t lsn;
+  int result = kvs_delete(num_pairs, keys, &job->output, &lsn);
+  if (lsn > job->wal_lsn)
+    job->wal_lsn = lsn;
+  CHECK_RETURN_ONE(result, "Failed to delete pair.");
 }
 
 
@@ -177,15 +351,14 @@ void cmd_wait(Job* job) {
   "Invalid command. See HELP for usage.");
 
   if (delay > 0)
-    kvs_wait(delay, job->job_output_fd);
+    kvs_wait(delay, &job->output);
 }
 
 /// Performs a backup of the job file and increments the backup counter.
 /// This function creates a backup of the job file specified in the Job structure.
 /// And increments the backup counter to keep track of the number of backups.
 /// @param job A pointer to the Job structure.
-/// @param queue A pointer to the JobQueue structure.
-void cmd_backup(Job* job, JobQueue* queue) {
+void cmd_backup(Job* job) {
   char *backup_out_file_path = malloc(PATH_MAX);
   CHECK_NULL(backup_out_file_path, "Failed to allocate memory for backup file.");
   strcpy(backup_out_file_path, job->job_file_path);
@@ -196,7 +369,7 @@ void cmd_backup(Job* job, JobQueue* queue) {
   "%s-%d.bck", temp_path, job->backup_counter);
   backup_out_file_path = realloc(backup_out_file_path, path_len + 1); // +1 null terminator
 
-  CHECK_RETURN_ONE(kvs_backup(backup_out_file_path, queue),
+  CHECK_RETURN_ONE(kvs_backup(backup_out_file_path),
   "Failed to perform backup.");
 
   job->backup_counter++;
@@ -205,13 +378,25 @@ void cmd_backup(Job* job, JobQueue* queue) {
 }
 
 
+/// Commits the job's updates to the log before its output is written, so
+/// that the output never reports an update a crash can still lose. One
+/// commit covers every update since the last write of the output.
+/// @param arg The Job.
+static void commit_job_updates(void *arg) {
+  Job* job = arg;
+  if (job->wal_lsn > job->durable_lsn) {
+    if (wal_commit(job->wal_lsn) != 0)
+      fprintf(stderr, "Failed to log the updates of a job.\n");
+    job->durable_lsn = job->wal_lsn;
+  }
+}
+
 /// Reads a job file and processes commands, writing output to a specified file.
 /// This function reads commands from a job file and processes them accordingly.
 /// It supports various commands such as write, read, delete, show, wait, and backup.
 /// The output of the commands is written to a specified output file.
 /// @param job A pointer to the Job structure containing job details.
-/// @param queue A pointer to the JobQueue structure for managing job backups.
-void read_file(Job* job, JobQueue* queue) {
+void read_file(Job* job) {
   char *job_out_file_path = malloc(PATH_MAX);
   CHECK_NULL(job_out_file_path, "Failed to allocate memory for job output file.");
   strcpy(job_out_file_path, job->job_file_path);
@@ -223,33 +408,35 @@ void read_file(Job* job, JobQueue* queue) {
   job_out_file_path = realloc(job_out_file_path, path_len + 1); // +1 null terminator
   job->job_fd = open(job->job_file_path, O_RDONLY);
   CHECK_RETURN_MINUS_ONE(job->job_fd, "Failed to open job file.");
+  // On failure the file is still parsed, just with a read() per byte.
+  parser_attach(job->job_fd);
   job->job_output_fd = open(job_out_file_path,
   O_WRONLY | O_CREAT | O_TRUNC, 0644);
   CHECK_RETURN_MINUS_ONE(job->job_output_fd, "Failed to open job output file.");
-
-  char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
-  char values[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
+  CHECK_RETURN_ONE(output_init(&job->output, job->job_output_fd,
+  OUTPUT_FSYNC_DEFAULT), "Failed to allocate job output buffer.");
+  output_barrier(&job->output, commit_job_updates, job);
 
   enum Command cmd;
   while ((cmd = get_next(job->job_fd)) != EOC) {
     switch (cmd) {
       case CMD_WRITE:
-        cmd_write(job, &keys, &values);
+        cmd_write(job);
         break;
       case CMD_READ:
-        cmd_read(job, &keys);
+        cmd_read(job);
         break;
       case CMD_DELETE:
-        cmd_delete(job, &keys);
+        cmd_delete(job);
         break;
       case CMD_SHOW:
-        kvs_show(job->job_output_fd);
+        kvs_show(&job->output);
         break;
       case CMD_WAIT:
         cmd_wait(job);
         break;
       case CMD_BACKUP:
-        cmd_backup(job, queue);
+        cmd_backup(job);
         break;
       case CMD_INVALID:
         fprintf(stderr, "Invalid command. See HELP for usage\n");
@@ -260,6 +447,8 @@ void read_file(Job* job, JobQueue* queue) {
         break;
     }
   }
+  parser_detach(job->job_fd);
+  CHECK_RETURN_MINUS_ONE(output_finish(&job->output), "Error during writing.");
   close(job->job_fd);
   close(job->job_output_fd);
   free(job_out_file_path);
@@ -278,22 +467,16 @@ void destroy_job(Job *job) {
 }
 
 void destroy_jobs_queue(JobQueue *queue) {
-  pthread_mutex_lock(&queue->queue_mutex);
-  queue->current_job = NULL;
+  for (size_t i = 0; i < queue->num_workers; i++)
+    free(queue->deques[i].jobs);
+  free(queue->deques);
+  queue->deques = NULL;
   queue->num_files = 0;
-  pthread_mutex_unlock(&queue->queue_mutex);
-  pthread_mutex_destroy(&queue->queue_mutex);
   free(queue);
   queue = NULL;
 }
 
 void *process_file(void *arg) {
-  // Block SIGCHLD signal for this thread.
-  sigset_t set;
-  sigemptyset(&set);
-  sigaddset(&set, SIGCHLD);
-  pthread_sigmask(SIG_BLOCK, &set, NULL);
-
   // Blocks SIGUSR1 signal in the threads assigned to this function.
   sigset_t blocked_signals;
   sigemptyset(&blocked_signals);
@@ -301,19 +484,19 @@ void *process_file(void *arg) {
   pthread_sigmask(SIG_BLOCK, &blocked_signals, NULL);
   
   JobQueue *queue = (JobQueue *)arg;
-  while (1) {
-    pthread_mutex_lock(&queue->queue_mutex);
-    if (queue->num_files == 0) {
-      pthread_mutex_unlock(&queue->queue_mutex);
-      break;
-    }
-    Job *job = dequeue_job(queue);
-    pthread_mutex_unlock(&queue->queue_mutex);
-    if (job != NULL) {
-      printf("Processing job: %s\n", job->job_file_path);
-      read_file(job, queue);
-      destroy_job(job);
-    }
+  size_t self = atomic_fetch_add(&queue->next_worker, 1) % queue->num_workers;
+  Job *job;
+  while ((job = next_job(queue, self)) != NULL) {
+    printf("Processing job: %s\n", job->job_file_path);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    read_file(job);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    uint64_t job_ns = elapsed_ns(&start, &end);
+    atomic_fetch_add(&queue->busy_ns, job_ns);
+    printf("Finished job: %s in %.3f ms\n", job->job_file_path,
+    (double) job_ns / 1e6);
+    destroy_job(job);
   }
   return NULL;
 }
@@ -2,38 +2,68 @@
 #define JOBS_MANAGER_H
 
 #include <dirent.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <limits.h>
 
+#include "constants.h"
 #include "macros.h"
+#include "output.h"
+
+// Weights of the job cost estimate, roughly nanoseconds of work each.
+#define JOB_COST_PER_BYTE 1
+#define JOB_COST_PER_COMMAND 2000
+#define JOB_COST_PER_SHOW 100000
+#define JOB_COST_PER_BACKUP 200000
+#define JOB_COST_PER_WAIT_MS 1000000
 
 typedef struct Job {
   char *job_file_path;
   int job_fd; //fd means file descriptor
   int job_output_fd;
+  OutputWriter output;  // Buffers everything written to job_output_fd.
+  uint64_t wal_lsn;     // Log record of the job's last update.
+  uint64_t durable_lsn; // Up to which its updates were committed.
   int backup_counter;
+  uint64_t cost;  // Estimated work, from the file size and its commands.
   struct Job *next;
 } Job;
 
+/// Jobs of one worker (Chase-Lev deque). The owner pops from the bottom,
+/// idle workers steal from the top. Jobs are only pushed before the workers
+/// start, so the array never grows. top and bottom sit on their own cache
+/// lines, thieves only write the former and the owner mostly the latter.
+typedef struct JobDeque {
+  alignas(CACHE_LINE_SIZE) _Atomic int64_t top;
+  alignas(CACHE_LINE_SIZE) _Atomic int64_t bottom;
+  Job **jobs;
+} JobDeque;
+
 typedef struct JobQueue{
   int num_files;
-  Job* current_job;
-  Job* last_job;
-  pthread_mutex_t queue_mutex;
+  size_t num_workers;           // Threads that will run process_file.
+  JobDeque *deques;             // One per worker.
+  atomic_size_t next_worker;    // Hands each worker its deque.
+  _Atomic uint64_t busy_ns;     // Time spent running jobs, over all workers.
 } JobQueue;
 
 /// Creates the job queue by reading entries from the specified directory.
+/// Every job file is pre-scanned to estimate its cost, and the jobs are
+/// assigned longest first, each to the least loaded of up to max_workers
+/// workers.
 /// @param dir_path The path to the directory containing job entries.
+/// @param max_workers Maximum number of worker threads.
 /// @return A pointer to the created JobQueue.
-JobQueue *create_job_queue(char *dir_path);
+JobQueue *create_job_queue(char *dir_path, size_t max_workers);
 
 /// Processes files from the job queue.
-/// This function is executed by a thread to process files from the job queue.
-/// It locks the queue mutex, retrieves the current job, and processes files
-/// until the queue is empty. The function reads files and processes jobs
-/// accordingly.
+/// This function is executed by queue->num_workers threads. Each one takes
+/// a deque and processes its jobs, then steals jobs from the other deques
+/// until they are all empty.
 /// @param arg A pointer to the job queue (JobQueue *).
 void *process_file(void *arg);
 
@@ -1,114 +1,757 @@
+#include <fcntl.h>
+#include <sched.h>
+#include <stddef.h>
+#include <time.h>
+#include <unistd.h>
+
 #include "kvs.h"
 
-int hash(const char *key) {
-  int first_letter = tolower(key[0]);
-  if (first_letter >= 'a' && first_letter <= 'z') {
-    return first_letter - 'a';
-  } else if (first_letter >= '0' && first_letter <= '9') {
-    return first_letter - '0';
+#define ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND \
+  do { \
+    v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); \
+    v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); \
+  } while (0)
+
+/// Reads 8 bytes as a little endian 64 bit integer.
+/// @param p Pointer to the bytes.
+/// @return The integer.
+static uint64_t load_le64(const unsigned char *p) {
+  uint64_t value = 0;
+  for (int i = 7; i >= 0; --i)
+    value = (value << 8) | p[i];
+  return value;
+}
+
+/// SipHash-2-4 of a byte string.
+/// @param k 128 bit key.
+/// @param in Bytes to hash.
+/// @param len Number of bytes.
+/// @return 64 bit hash.
+static uint64_t siphash24(const uint64_t k[2], const unsigned char *in,
+size_t len) {
+  uint64_t v0 = 0x736f6d6570736575ULL ^ k[0];
+  uint64_t v1 = 0x646f72616e646f6dULL ^ k[1];
+  uint64_t v2 = 0x6c7967656e657261ULL ^ k[0];
+  uint64_t v3 = 0x7465646279746573ULL ^ k[1];
+  const unsigned char *end = in + (len & ~(size_t) 7);
+  uint64_t m;
+
+  for (; in != end; in += 8) {
+    m = load_le64(in);
+    v3 ^= m;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= m;
+  }
+
+  uint64_t b = ((uint64_t) len) << 56;
+  switch (len & 7) {
+    case 7: b |= ((uint64_t) in[6]) << 48; /* fall through */
+    case 6: b |= ((uint64_t) in[5]) << 40; /* fall through */
+    case 5: b |= ((uint64_t) in[4]) << 32; /* fall through */
+    case 4: b |= ((uint64_t) in[3]) << 24; /* fall through */
+    case 3: b |= ((uint64_t) in[2]) << 16; /* fall through */
+    case 2: b |= ((uint64_t) in[1]) << 8; /* fall through */
+    case 1: b |= ((uint64_t) in[0]); break;
+    default: break;
+  }
+
+  v3 ^= b;
+  SIPROUND;
+  SIPROUND;
+  v0 ^= b;
+  v2 ^= 0xff;
+  SIPROUND;
+  SIPROUND;
+  SIPROUND;
+  SIPROUND;
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/// Picks a random SipHash key for the table, so bucket placement
+/// cannot be predicted from the keys alone.
+/// @param ht The hash table.
+static void seed_hash(HashTable *ht) {
+  int fd = open("/dev/urandom", O_RDONLY);
+  if (fd != -1) {
+    ssize_t bytes_read = read(fd, ht->seed, sizeof(ht->seed));
+    close(fd);
+    if (bytes_read == (ssize_t) sizeof(ht->seed))
+      return;
+  }
+  // Fallback when /dev/urandom is unavailable.
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  ht->seed[0] = (uint64_t) now.tv_nsec ^ ((uint64_t) now.tv_sec << 32);
+  ht->seed[1] = (uint64_t) getpid() ^ (uint64_t) (uintptr_t) ht;
+}
+
+/// Clips a key or value to the bytes the table stores.
+/// @param slice The string.
+/// @return The string, at most MAX_STRING_SIZE bytes long.
+static StringSlice significant(StringSlice slice) {
+  if (slice.size > MAX_STRING_SIZE)
+    slice.size = MAX_STRING_SIZE;
+  return slice;
+}
+
+uint64_t hash(const HashTable *ht, StringSlice key) {
+  key = significant(key);
+  return siphash24(ht->seed, (const unsigned char *) key.data, key.size);
+}
+
+size_t stripe_index(uint64_t key_hash) {
+  return (size_t) key_hash & (LOCK_STRIPES - 1);
+}
+
+/// Bucket of a key inside a bucket array. Uses the high half of the hash,
+/// the low half already picked the stripe.
+/// @param key_hash Hash of the key.
+/// @param num_buckets Size of the bucket array, a power of two.
+/// @return Bucket index.
+static size_t bucket_index(uint64_t key_hash, size_t num_buckets) {
+  return (size_t) (key_hash >> 32) & (num_buckets - 1);
+}
+
+/// Offset of a node's tail in its block.
+/// @param key_size Key length.
+/// @param value_size Value length.
+/// @return The offset, right after the value, aligned for the tail.
+static size_t tail_offset(size_t key_size, size_t value_size) {
+  size_t end = offsetof(KeyNode, data) + key_size + 1 + value_size + 1;
+  return (end + alignof(KeyNodeTail) - 1) / alignof(KeyNodeTail) *
+  alignof(KeyNodeTail);
+}
+
+_Static_assert(offsetof(KeyNode, data) + 2 * (MAX_STRING_SIZE + 1) +
+alignof(KeyNodeTail) - 1 + sizeof(KeyNodeTail) <= ARENA_MAX_BLOCK,
+"the largest pair must fit an arena block");
+
+/// Fields of a node lookups do not read.
+/// @param key_node The node.
+/// @return Its tail.
+static KeyNodeTail *node_tail(const KeyNode *key_node) {
+  return (KeyNodeTail *) ((char *) key_node +
+  tail_offset(key_node->key_size, key_node->value_size));
+}
+
+/// Bytes used by a node.
+/// @param key_node The node.
+/// @return Size of its arena block.
+static size_t node_size(const KeyNode *key_node) {
+  return tail_offset(key_node->key_size, key_node->value_size) +
+  sizeof(KeyNodeTail);
+}
+
+/// Returns a node to its arena once no reader can reach it anymore.
+/// @param entry The node's epoch header.
+static void free_node(EpochEntry *entry) {
+  KeyNodeTail *tail =
+  (KeyNodeTail *) ((char *) entry - offsetof(KeyNodeTail, retire));
+  arena_free(tail->node, node_size(tail->node));
+}
+
+/// Frees a bucket array once no reader can reach it anymore.
+/// @param entry The array's epoch header.
+static void free_bucket_array(EpochEntry *entry) {
+  free(entry);
+}
+
+/// Allocates an empty bucket array.
+/// @param num_buckets Number of buckets, a power of two.
+/// @return The array, NULL on failure.
+static BucketArray *create_bucket_array(size_t num_buckets) {
+  BucketArray *array = malloc(sizeof(BucketArray) +
+  num_buckets * sizeof(_Atomic(KeyNode *)));
+  if (array == NULL)
+    return NULL;
+  array->retire.free_fn = free_bucket_array;
+  array->num_buckets = num_buckets;
+  for (size_t i = 0; i < num_buckets; i++)
+    atomic_init(&array->buckets[i], NULL);
+  return array;
+}
+
+/// Allocates a node in the segment's arena, with the key and value inline.
+/// Strings longer than MAX_STRING_SIZE are truncated.
+/// @param seg The segment, write locked by the caller.
+/// @param key_hash Hash of the key.
+/// @param key The key.
+/// @param value The value.
+/// @param version Version of the write.
+/// @return The node, NULL on failure.
+static KeyNode *create_node(HashSegment *seg, uint64_t key_hash,
+StringSlice key, StringSlice value, uint64_t version) {
+  KeyNode *key_node = arena_alloc(&seg->arena,
+  tail_offset(key.size, value.size) + sizeof(KeyNodeTail));
+  if (key_node == NULL) return NULL;
+  key_node->hash = key_hash;
+  key_node->deleted = 0;
+  key_node->key_size = (uint8_t) key.size;
+  key_node->value_size = (uint8_t) value.size;
+  memcpy(key_node->data, key.data, key.size);
+  key_node->data[key.size] = '\0';
+  memcpy(key_node->data + key.size + 1, value.data, value.size);
+  key_node->data[key.size + 1 + value.size] = '\0';
+  atomic_init(&key_node->next, NULL);
+  KeyNodeTail *tail = node_tail(key_node);
+  tail->version = version;
+  atomic_init(&tail->older, NULL);
+  tail->retire.free_fn = free_node;
+  tail->node = key_node;
+  return key_node;
+}
+
+const char *node_key(const KeyNode *key_node) {
+  return key_node->data;
+}
+
+const char *node_value(const KeyNode *key_node) {
+  return key_node->data + key_node->key_size + 1;
+}
+
+/// Compares a node's key with a key.
+/// @param key_node The node.
+/// @param key The key, already clipped to its significant bytes.
+/// @return 1 if they are equal, 0 otherwise.
+static int node_matches(const KeyNode *key_node, StringSlice key) {
+  return key_node->key_size == key.size &&
+  memcmp(key_node->data, key.data, key.size) == 0;
+}
+
+/// Searches one bucket array for the link holding a key, for a writer.
+/// @param array The bucket array, may be NULL.
+/// @param key_hash Hash of the key.
+/// @param key The key.
+/// @return Pointer to the link holding the node, or NULL if not found.
+static _Atomic(KeyNode *) *find_in_array(BucketArray *array,
+uint64_t key_hash, StringSlice key) {
+  if (array == NULL)
+    return NULL;
+  _Atomic(KeyNode *) *link =
+  &array->buckets[bucket_index(key_hash, array->num_buckets)];
+  KeyNode *key_node;
+  while ((key_node = atomic_load_explicit(link, memory_order_relaxed)) != NULL) {
+    if (key_node->hash == key_hash && node_matches(key_node, key))
+      return link;
+    link = &key_node->next;
+  }
+  return NULL;
+}
+
+/// Finds the link that points to a key's node, for a writer.
+/// Looks in the bucket array being drained first, then in the current one.
+/// @param seg Segment owning the key, write locked by the caller.
+/// @param key_hash Hash of the key.
+/// @param key The key.
+/// @return Pointer to the link holding the node, or NULL if not found.
+static _Atomic(KeyNode *) *find_link(HashSegment *seg, uint64_t key_hash,
+StringSlice key) {
+  _Atomic(KeyNode *) *link = find_in_array(
+  atomic_load_explicit(&seg->old_buckets, memory_order_relaxed), key_hash, key);
+  if (link != NULL)
+    return link;
+  return find_in_array(
+  atomic_load_explicit(&seg->buckets, memory_order_relaxed), key_hash, key);
+}
+
+/// Searches one bucket array for a key, without holding the stripe lock.
+/// @param array The bucket array, may be NULL.
+/// @param key_hash Hash of the key.
+/// @param key The key.
+/// @return The node, or NULL if not found.
+static KeyNode *search_array(BucketArray *array, uint64_t key_hash,
+StringSlice key) {
+  if (array == NULL)
+    return NULL;
+  KeyNode *key_node = atomic_load_explicit(
+  &array->buckets[bucket_index(key_hash, array->num_buckets)],
+  memory_order_acquire);
+  while (key_node != NULL) {
+    if (key_node->hash == key_hash && node_matches(key_node, key))
+      return key_node;
+    key_node = atomic_load_explicit(&key_node->next, memory_order_acquire);
+  }
+  return NULL;
+}
+
+/// Finds a key's node without holding the stripe lock.
+/// A miss is only trusted if no writer moved nodes while it was searching.
+/// @param seg Segment owning the key.
+/// @param key_hash Hash of the key.
+/// @param key The key.
+/// @return The node, or NULL if not found.
+static KeyNode *lookup(HashSegment *seg, uint64_t key_hash, StringSlice key) {
+  while (1) {
+    unsigned int seq = atomic_load_explicit(&seg->seq, memory_order_acquire);
+    KeyNode *key_node = search_array(
+    atomic_load_explicit(&seg->old_buckets, memory_order_acquire),
+    key_hash, key);
+    if (key_node == NULL)
+      key_node = search_array(
+      atomic_load_explicit(&seg->buckets, memory_order_acquire),
+      key_hash, key);
+    if (key_node != NULL)
+      return key_node;
+    atomic_thread_fence(memory_order_acquire);
+    if ((seq & 1) == 0 && atomic_load_explicit(&seg->seq,
+    memory_order_relaxed) == seq)
+      return NULL;
   }
-  return -1; // Invalid index for non-alphabetic or number strings
+}
+
+/// Migrates up to REHASH_STEP buckets of an in-progress resize.
+/// @param seg The segment, write locked by the caller.
+static void rehash_step(HashSegment *seg) {
+  BucketArray *old_array =
+  atomic_load_explicit(&seg->old_buckets, memory_order_relaxed);
+  if (old_array == NULL)
+    return;
+  BucketArray *array =
+  atomic_load_explicit(&seg->buckets, memory_order_relaxed);
+
+  atomic_fetch_add(&seg->seq, 1);
+  for (int step = 0; step < REHASH_STEP &&
+  seg->rehash_index < old_array->num_buckets; ++step) {
+    _Atomic(KeyNode *) *old_head = &old_array->buckets[seg->rehash_index++];
+    KeyNode *key_node = atomic_load_explicit(old_head, memory_order_relaxed);
+    atomic_store_explicit(old_head, NULL, memory_order_release);
+    while (key_node != NULL) {
+      KeyNode *next = atomic_load_explicit(&key_node->next,
+      memory_order_relaxed);
+      _Atomic(KeyNode *) *head =
+      &array->buckets[bucket_index(key_node->hash, array->num_buckets)];
+      atomic_store_explicit(&key_node->next,
+      atomic_load_explicit(head, memory_order_relaxed), memory_order_relaxed);
+      atomic_store_explicit(head, key_node, memory_order_release);
+      key_node = next;
+    }
+  }
+  atomic_fetch_add(&seg->seq, 1);
+
+  if (seg->rehash_index == old_array->num_buckets) {
+    atomic_store_explicit(&seg->old_buckets, NULL, memory_order_release);
+    seg->rehash_index = 0;
+    epoch_retire(&old_array->retire);
+  }
+}
+
+/// Starts doubling the segment once it goes over the load factor.
+/// If the new array cannot be allocated the segment just keeps its size.
+/// @param seg The segment, write locked by the caller.
+static void maybe_start_resize(HashSegment *seg) {
+  BucketArray *array =
+  atomic_load_explicit(&seg->buckets, memory_order_relaxed);
+  if (atomic_load_explicit(&seg->old_buckets, memory_order_relaxed) != NULL ||
+  seg->num_keys <= array->num_buckets * MAX_LOAD_FACTOR)
+    return;
+
+  BucketArray *new_array = create_bucket_array(array->num_buckets * 2);
+  if (new_array == NULL)
+    return;
+  atomic_fetch_add(&seg->seq, 1);
+  atomic_store_explicit(&seg->old_buckets, array, memory_order_release);
+  atomic_store_explicit(&seg->buckets, new_array, memory_order_release);
+  atomic_fetch_add(&seg->seq, 1);
+  seg->rehash_index = 0;
 }
 
 struct HashTable* create_hash_table() {
   HashTable *ht = malloc(sizeof(HashTable));
   if (!ht) return NULL;
-  for (int i = 0; i < TABLE_SIZE; i++) {
-    ht->table[i] = NULL;
-    pthread_rwlock_init(&ht->hash_lock[i], NULL);
+  ht->stripes = aligned_alloc(CACHE_LINE_SIZE,
+  LOCK_STRIPES * sizeof(HashStripe));
+  if (!ht->stripes) {
+    free(ht);
+    return NULL;
+  }
+  seed_hash(ht);
+  atomic_init(&ht->version, 0);
+  atomic_init(&ht->oldest_view, UINT64_MAX);
+  atomic_init(&ht->delta_base, UINT64_MAX);
+  pthread_mutex_init(&ht->views_mutex, NULL);
+  ht->views = NULL;
+  ht->num_views = 0;
+  ht->views_capacity = 0;
+  for (size_t i = 0; i < LOCK_STRIPES; i++) {
+    HashSegment *seg = &ht->stripes[i].segment;
+    BucketArray *array = create_bucket_array(INITIAL_BUCKETS);
+    if (array == NULL) {
+      for (size_t j = 0; j < i; j++) {
+        free(atomic_load(&ht->stripes[j].segment.buckets));
+        arena_destroy(&ht->stripes[j].segment.arena);
+        pthread_rwlock_destroy(&ht->stripes[j].lock);
+      }
+      free(ht->stripes);
+      free(ht);
+      return NULL;
+    }
+    atomic_init(&seg->buckets, array);
+    atomic_init(&seg->old_buckets, NULL);
+    atomic_init(&seg->seq, 0);
+    seg->rehash_index = 0;
+    seg->num_keys = 0;
+    atomic_init(&seg->changed, 0);
+    arena_init(&seg->arena);
+    pthread_rwlock_init(&ht->stripes[i].lock, NULL);
   }
   return ht;
 }
 
-int write_pair(HashTable *ht, const char *key, const char *value) {
-  int index = hash(key);
-  KeyNode *key_node = ht->table[index];
+uint64_t next_version(HashTable *ht) {
+  return atomic_fetch_add(&ht->version, 1) + 1;
+}
+
+/// Oldest version an open view may still need. Writers must load it after
+/// taking their version, view_begin relies on that order.
+/// @param ht The hash table.
+/// @return The version, UINT64_MAX if no view is open.
+static uint64_t oldest_view(HashTable *ht) {
+  return atomic_load(&ht->oldest_view);
+}
+
+/// Records a change to a segment, for delta walks.
+/// @param seg The segment, write locked by the caller.
+/// @param version Version of the change.
+static void mark_changed(HashSegment *seg, uint64_t version) {
+  if (version > atomic_load_explicit(&seg->changed, memory_order_relaxed))
+    atomic_store_explicit(&seg->changed, version, memory_order_relaxed);
+}
+
+/// Retires the versions of a key no open view can reach: everything older
+/// than the newest version at or before the oldest view.
+/// @param key_node Newest version of the key, its stripe write locked.
+/// @param oldest Result of oldest_view.
+static void prune_versions(KeyNode *key_node, uint64_t oldest) {
+  KeyNodeTail *keep = node_tail(key_node);
+  KeyNode *older;
+  while (keep->version > oldest && (older = atomic_load_explicit(&keep->older,
+  memory_order_relaxed)) != NULL)
+    keep = node_tail(older);
+  older = atomic_load_explicit(&keep->older, memory_order_relaxed);
+  atomic_store_explicit(&keep->older, NULL, memory_order_release);
+  while (older != NULL) {
+    KeyNodeTail *tail = node_tail(older);
+    older = atomic_load_explicit(&tail->older, memory_order_relaxed);
+    epoch_retire(&tail->retire);
+  }
+}
+
+int write_pair(HashTable *ht, StringSlice key, StringSlice value,
+uint64_t version) {
+  key = significant(key);
+  value = significant(value);
+  uint64_t key_hash = hash(ht, key);
+  HashSegment *seg = &ht->stripes[stripe_index(key_hash)].segment;
+  rehash_step(seg);
+
+  KeyNode *key_node = create_node(seg, key_hash, key, value, version);
+  if (key_node == NULL) return 1;
+  mark_changed(seg, version);
+
   // Search for the key node
-  while (key_node != NULL) {
-    if (strcmp(key_node->key, key) == 0) {
-      char *temp = key_node->value;
-      key_node->value = strdup(value);
-      free(temp);
-      temp = NULL;
-      return 0;
+  _Atomic(KeyNode *) *link = find_link(seg, key_hash, key);
+  if (link != NULL) {
+    // Replace the node, readers still holding the old one keep a valid copy
+    // and open views still reach it through the new one.
+    KeyNode *old_node = atomic_load_explicit(link, memory_order_relaxed);
+    atomic_init(&key_node->next,
+    atomic_load_explicit(&old_node->next, memory_order_relaxed));
+    atomic_init(&node_tail(key_node)->older, old_node);
+    prune_versions(key_node, oldest_view(ht));
+    atomic_store_explicit(link, key_node, memory_order_release);
+    return 0;
+  }
+
+  // Key not found. New keys always go to the current array, never to one
+  // being drained.
+  BucketArray *array = atomic_load_explicit(&seg->buckets, memory_order_relaxed);
+  _Atomic(KeyNode *) *head =
+  &array->buckets[bucket_index(key_hash, array->num_buckets)];
+  atomic_init(&key_node->next, atomic_load_explicit(head, memory_order_relaxed));
+  atomic_store_explicit(head, key_node, memory_order_release);
+  seg->num_keys++;
+  maybe_start_resize(seg);
+  return 0;
+}
+
+const char* read_pair(HashTable *ht, StringSlice key) {
+  key = significant(key);
+  uint64_t key_hash = hash(ht, key);
+  HashSegment *seg = &ht->stripes[stripe_index(key_hash)].segment;
+  KeyNode *key_node = lookup(seg, key_hash, key);
+  return key_node == NULL || key_node->deleted ? NULL : node_value(key_node);
+}
+
+int contains_pair(HashTable *ht, StringSlice key) {
+  return read_pair(ht, key) != NULL;
+}
+
+/// Unlinks a node and retires it with its older versions.
+/// @param seg The segment, write locked by the caller.
+/// @param link Link pointing to the node.
+static void unlink_node(HashSegment *seg, _Atomic(KeyNode *) *link) {
+  // Bypass the node, readers on it can still follow its next.
+  KeyNode *key_node = atomic_load_explicit(link, memory_order_relaxed);
+  atomic_store_explicit(link,
+  atomic_load_explicit(&key_node->next, memory_order_relaxed),
+  memory_order_release);
+  prune_versions(key_node, UINT64_MAX);
+  epoch_retire(&node_tail(key_node)->retire);
+  seg->num_keys--;
+}
+
+int delete_pair(HashTable *ht, StringSlice key, uint64_t version) {
+  key = significant(key);
+  uint64_t key_hash = hash(ht, key);
+  HashSegment *seg = &ht->stripes[stripe_index(key_hash)].segment;
+  rehash_step(seg);
+
+  _Atomic(KeyNode *) *link = find_link(seg, key_hash, key);
+  if (link == NULL)
+    return 1;
+  KeyNode *key_node = atomic_load_explicit(link, memory_order_relaxed);
+  int missing = key_node->deleted;
+
+  if (!missing)
+    mark_changed(seg, version);
+  uint64_t oldest = oldest_view(ht);
+  if (oldest != UINT64_MAX ||
+  version > atomic_load_explicit(&ht->delta_base, memory_order_relaxed)) {
+    if (missing)
+      return 1;
+    // A view may still need the pair, or the next delta backup the delete,
+    // leave a tombstone in front of it.
+    // Without one, keep the pair rather than lose the delete.
+    KeyNode *tombstone = create_node(seg, key_hash, key, STRING_SLICE(""),
+    version);
+    if (tombstone == NULL)
+      return -1;
+    tombstone->deleted = 1;
+    atomic_init(&tombstone->next,
+    atomic_load_explicit(&key_node->next, memory_order_relaxed));
+    atomic_init(&node_tail(tombstone)->older, key_node);
+    prune_versions(tombstone, oldest);
+    atomic_store_explicit(link, tombstone, memory_order_release);
+    return 0;
+  }
+
+  unlink_node(seg, link);
+  return missing;
+}
+
+int view_begin(HashTable *ht, TableView *view) {
+  pthread_mutex_lock(&ht->views_mutex);
+  if (ht->num_views == ht->views_capacity) {
+    size_t capacity = ht->views_capacity ? ht->views_capacity * 2 : 8;
+    uint64_t *views = realloc(ht->views, capacity * sizeof(uint64_t));
+    if (views == NULL) {
+      pthread_mutex_unlock(&ht->views_mutex);
+      return 1;
     }
-    key_node = key_node->next; // Move to the next node
+    ht->views = views;
+    ht->views_capacity = capacity;
   }
 
-  // Key not found, create a new key node
-  key_node = malloc(sizeof(KeyNode));
-  key_node->key = strdup(key); // Allocate memory for the key
-  key_node->value = strdup(value); // Allocate memory for the value
-  key_node->next = ht->table[index]; // Link to existing nodes
-  ht->table[index] = key_node; // Place new key node at the start of the list
+  // Pin first, then pick the version. A writer that took its version after
+  // the pin was stored sees the pin and keeps the versions before its own;
+  // one that missed the pin took its version before the second load, so
+  // the view shows its write anyway.
+  uint64_t pin = atomic_load(&ht->version);
+  ht->views[ht->num_views++] = pin;
+  if (pin < atomic_load(&ht->oldest_view))
+    atomic_store(&ht->oldest_view, pin);
+  view->pin = pin;
+  view->version = atomic_load(&ht->version);
+  pthread_mutex_unlock(&ht->views_mutex);
+
+  // Writers take their version holding their stripe locks and publish every
+  // node before releasing them, so once each lock has been free the writes
+  // up to view->version are all in place.
+  for (size_t i = 0; i < LOCK_STRIPES; i++) {
+    pthread_rwlock_rdlock(&ht->stripes[i].lock);
+    pthread_rwlock_unlock(&ht->stripes[i].lock);
+  }
   return 0;
 }
 
-char* read_pair(HashTable *ht, const char *key) {
-  int index = hash(key);
-  KeyNode *key_node = ht->table[index];
-  char* value;
+/// Drops the versions and tombstones no open view needs from every stripe.
+/// @param ht The hash table.
+static void sweep_versions(HashTable *ht) {
+  for (size_t i = 0; i < LOCK_STRIPES; i++) {
+    pthread_rwlock_wrlock(&ht->stripes[i].lock);
+    HashSegment *seg = &ht->stripes[i].segment;
+    uint64_t oldest = oldest_view(ht);
+    uint64_t base = atomic_load_explicit(&ht->delta_base, memory_order_relaxed);
+    if (base < oldest)
+      oldest = base;
+    BucketArray *arrays[2] = {
+    atomic_load_explicit(&seg->old_buckets, memory_order_relaxed),
+    atomic_load_explicit(&seg->buckets, memory_order_relaxed)};
+    for (int a = 0; a < 2; a++) {
+      if (arrays[a] == NULL)
+        continue;
+      for (size_t j = 0; j < arrays[a]->num_buckets; j++) {
+        _Atomic(KeyNode *) *link = &arrays[a]->buckets[j];
+        KeyNode *key_node;
+        while ((key_node = atomic_load_explicit(link,
+        memory_order_relaxed)) != NULL) {
+          prune_versions(key_node, oldest);
+          KeyNodeTail *tail = node_tail(key_node);
+          if (key_node->deleted && tail->version <= oldest &&
+          atomic_load_explicit(&tail->older, memory_order_relaxed) == NULL)
+            unlink_node(seg, link);
+          else
+            link = &key_node->next;
+        }
+      }
+    }
+    pthread_rwlock_unlock(&ht->stripes[i].lock);
+  }
+}
 
-  while (key_node != NULL) {
-    if (strcmp(key_node->key, key) == 0) {
-      value = strdup(key_node->value);
-      return value; // Return copy of the value if found
+void view_end(HashTable *ht, const TableView *view) {
+  pthread_mutex_lock(&ht->views_mutex);
+  uint64_t oldest = UINT64_MAX;
+  int removed = 0;
+  for (size_t i = 0; i < ht->num_views; i++) {
+    if (!removed && ht->views[i] == view->pin) {
+      ht->views[i--] = ht->views[--ht->num_views];
+      removed = 1;
+    } else if (ht->views[i] < oldest) {
+      oldest = ht->views[i];
     }
-    key_node = key_node->next; // Move to the next node
   }
-  return NULL; // Key not found
+  atomic_store(&ht->oldest_view, oldest);
+  int last = ht->num_views == 0;
+  pthread_mutex_unlock(&ht->views_mutex);
+
+  if (last)
+    sweep_versions(ht);
 }
 
-int delete_pair(HashTable *ht, const char *key) {
-  int index = hash(key);
-  KeyNode *key_node = ht->table[index];
-  KeyNode *prev_node = NULL;
+size_t count_keys(HashTable *ht, uint64_t since) {
+  size_t count = 0;
+  for (size_t i = 0; i < LOCK_STRIPES; i++) {
+    HashStripe *hash_stripe = &ht->stripes[i];
+    if (since > 0 && atomic_load_explicit(&hash_stripe->segment.changed,
+    memory_order_relaxed) < since)
+      continue;
+    pthread_rwlock_rdlock(&hash_stripe->lock);
+    count += hash_stripe->segment.num_keys;
+    pthread_rwlock_unlock(&hash_stripe->lock);
+  }
+  return count;
+}
 
-  while (key_node != NULL) {
-    if (strcmp(key_node->key, key) == 0) {
-      // Key found; delete this node
-      if (prev_node == NULL) {
-        ht->table[index] = key_node->next; // Update the table to point to the next node
-      } else {
-        // Node to delete is not the first; bypass it
-        prev_node->next = key_node->next; // Link the previous node to the next node
+void set_delta_base(HashTable *ht, uint64_t version) {
+  atomic_store(&ht->delta_base, version);
+}
+
+/// Version of a key a view sees.
+/// @param key_node Newest version of the key.
+/// @param version Version of the view.
+/// @return The node, possibly a tombstone, NULL if the key did not exist.
+static const KeyNode *version_at(const KeyNode *key_node, uint64_t version) {
+  while (key_node != NULL && node_tail(key_node)->version > version)
+    key_node = atomic_load_explicit(&node_tail(key_node)->older,
+    memory_order_acquire);
+  return key_node;
+}
+
+int stripe_for_each_at(HashTable *ht, size_t stripe, const TableView *view,
+uint64_t since, void (*visit)(const KeyNode *key_node, void *arg), void *arg) {
+  HashStripe *hash_stripe = &ht->stripes[stripe];
+  HashSegment *seg = &hash_stripe->segment;
+  // view_begin synchronized with every writer of the view's versions.
+  if (since > 0 &&
+  atomic_load_explicit(&seg->changed, memory_order_relaxed) < since)
+    return 0;
+  const KeyNode **nodes = NULL;
+  size_t count = 0;
+  size_t capacity = 0;
+  int failed = 0;
+
+  epoch_enter();
+  for (int attempt = 0; ; attempt++) {
+    // A resize keeps moving nodes between arrays, so after a few attempts
+    // the walk holds the read lock instead.
+    int locked = attempt >= VIEW_WALK_ATTEMPTS;
+    if (locked)
+      pthread_rwlock_rdlock(&hash_stripe->lock);
+    unsigned int seq = atomic_load_explicit(&seg->seq, memory_order_acquire);
+    if (seq & 1) {
+      sched_yield();
+      continue;
+    }
+
+    count = 0;
+    BucketArray *arrays[2] = {
+    atomic_load_explicit(&seg->old_buckets, memory_order_acquire),
+    atomic_load_explicit(&seg->buckets, memory_order_acquire)};
+    for (int a = 0; a < 2 && !failed; a++) {
+      if (arrays[a] == NULL)
+        continue;
+      for (size_t j = 0; j < arrays[a]->num_buckets && !failed; j++) {
+        for (KeyNode *key_node = atomic_load_explicit(&arrays[a]->buckets[j],
+        memory_order_acquire); key_node != NULL;
+        key_node = atomic_load_explicit(&key_node->next, memory_order_acquire)) {
+          const KeyNode *visible = version_at(key_node, view->version);
+          if (visible == NULL || node_tail(visible)->version < since)
+            continue;
+          if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            const KeyNode **grown = realloc(nodes, capacity * sizeof(*nodes));
+            if (grown == NULL) {
+              failed = 1;
+              break;
+            }
+            nodes = grown;
+          }
+          nodes[count++] = visible;
+        }
       }
-      // Free the memory allocated for the key and value
-      free(key_node->key);
-      key_node->key = NULL;
-      free(key_node->value);
-      key_node->value = NULL;
-      free(key_node); // Free the key node itself
-      key_node = NULL;
-      return 0; // Exit the function
-    } else {
-      prev_node = key_node; // Move prev_node to current node
-      key_node = key_node->next; // Move to the next node
     }
+
+    if (locked) {
+      pthread_rwlock_unlock(&hash_stripe->lock);
+      break;
+    }
+    atomic_thread_fence(memory_order_acquire);
+    if (failed || atomic_load_explicit(&seg->seq, memory_order_relaxed) == seq)
+      break;
   }
-  return 1;
+
+  if (!failed)
+    for (size_t i = 0; i < count; i++)
+      visit(nodes[i], arg);
+  epoch_exit();
+  free(nodes);
+  return failed;
 }
 
 void free_table(HashTable *ht) {
-  for (int i=0; i < TABLE_SIZE; i++)
-    pthread_rwlock_rdlock(&ht->hash_lock[i]);
-  for (int i = 0; i < TABLE_SIZE; i++) {
-    KeyNode *key_node = ht->table[i];
-    while (key_node != NULL) {
-      KeyNode *temp = key_node;
-      key_node = key_node->next;
-      free(temp->key);
-      temp->key = NULL;
-      free(temp->value);
-      temp->value = NULL;
-      free(temp);
-      temp = NULL;
-    }
+  for (size_t i = 0; i < LOCK_STRIPES; i++)
+    pthread_rwlock_rdlock(&ht->stripes[i].lock);
+  // Retired nodes go back to their arenas first, then whole slabs are freed.
+  epoch_drain();
+  for (size_t i = 0; i < LOCK_STRIPES; i++) {
+    HashSegment *seg = &ht->stripes[i].segment;
+    free(atomic_load(&seg->buckets));
+    free(atomic_load(&seg->old_buckets));
+    arena_destroy(&seg->arena);
   }
-  for (int i=0; i < TABLE_SIZE; i++) {
-    pthread_rwlock_unlock(&ht->hash_lock[i]);
-    pthread_rwlock_destroy(&ht->hash_lock[i]);
+  for (size_t i = 0; i < LOCK_STRIPES; i++) {
+    pthread_rwlock_unlock(&ht->stripes[i].lock);
+    pthread_rwlock_destroy(&ht->stripes[i].lock);
   }
+  pthread_mutex_destroy(&ht->views_mutex);
+  free(ht->views);
+  free(ht->stripes);
   free(ht);
   ht = NULL;
 }
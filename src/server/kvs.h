@@ -1,50 +1,230 @@
 #ifndef KEY_VALUE_STORE_H
 #define KEY_VALUE_STORE_H
-#define TABLE_SIZE 26
+#ifndef LOCK_STRIPES
+#define LOCK_STRIPES 1024     // Number of lock stripes, a power of two.
+#endif
+#define INITIAL_BUCKETS 8     // Buckets per segment when the table is created.
+#define MAX_LOAD_FACTOR 1     // Keys per bucket that trigger a segment resize.
+#define REHASH_STEP 4         // Old buckets migrated by each write or delete.
+#define VIEW_WALK_ATTEMPTS 4  // Lock-free walks of a stripe before locking it.
 
 #include <ctype.h>
 #include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "arena.h"
+#include "constants.h"
+#include "epoch.h"
+#include "slice.h"
+
+// Readers traverse bucket chains without locks, under an epoch guard.
+// Writers hold the stripe write lock, publish nodes with atomic pointer
+// stores and retire replaced or deleted nodes through epoch reclamation.
+// Build with -DKVS_RWLOCK_READS (make RWLOCK_READS=1) to have readers take
+// the stripe read lock instead.
+//
+// Every write or delete carries a table version, shared by all the pairs of
+// one command. While a view (a point-in-time snapshot, for SHOW and BACKUP)
+// is open, a replaced node stays reachable from its successor's older link
+// and a delete leaves a tombstone, so the view can still find the version
+// it needs. Versions no open view needs are retired as keys are written,
+// and by a sweep once the last view closes.
+//
+// Delta backups (see snapshot.h) need every change since the previous
+// backup. Each segment remembers the version of its last change, so walks
+// skip unchanged stripes, and deletes newer than the delta base keep their
+// tombstone until a backup past them has been taken.
+
+/// A pair stored in one arena block, key and value inline after the header.
+/// A chain hop only reads next and hash, and a match the key right after
+/// them: blocks are ARENA_ALIGN aligned, so the hash and the start of the key
+/// share a cache line. The fields lookups never read follow the value, see
+/// KeyNodeTail.
 typedef struct KeyNode {
-  char *key;
-  char *value;
-  struct KeyNode *next;
+  _Atomic(struct KeyNode *) next;
+  uint64_t hash;        // Full key hash, compared before the key itself.
+  uint8_t key_size;     // Key length, without the terminator.
+  uint8_t value_size;   // Value length, without the terminator.
+  uint8_t deleted;      // Tombstone, the key was deleted at this version.
+  char data[];          // Key and value, each '\0' terminated.
 } KeyNode;
 
+_Static_assert(offsetof(KeyNode, data) < ARENA_ALIGN && 64 % ARENA_ALIGN == 0,
+"a key must start in the cache line of its hash");
+
+/// End of a node's block, after its value, aligned. Only writers, views and
+/// reclamation use it.
+typedef struct KeyNodeTail {
+  uint64_t version;     // Version of the write that created the node.
+  _Atomic(struct KeyNode *) older;  // Previous version, kept for open views.
+  EpochEntry retire;
+  KeyNode *node;        // Start of the block, for reclamation.
+} KeyNodeTail;
+
+typedef struct BucketArray {
+  EpochEntry retire;  // Must be first, arrays are freed through it.
+  size_t num_buckets;
+  _Atomic(KeyNode *) buckets[];
+} BucketArray;
+
+_Static_assert((LOCK_STRIPES & (LOCK_STRIPES - 1)) == 0,
+"LOCK_STRIPES must be a power of two");
+
+/// Independently resizable part of the table, guarded by one stripe lock.
+/// While a resize is in progress the old bucket array is drained into the
+/// new one a few buckets at a time, so no single write pays for a full rehash.
+/// Moving nodes between arrays can hide them from a concurrent reader, so
+/// writers keep seq odd while doing it and readers retry misses that
+/// overlapped a move.
+typedef struct HashSegment {
+  _Atomic(BucketArray *) buckets;
+  _Atomic(BucketArray *) old_buckets; // Array being drained, NULL if not resizing.
+  atomic_uint seq;                    // Odd while nodes are being moved.
+  size_t rehash_index;                // Next old bucket to migrate.
+  size_t num_keys;
+  _Atomic uint64_t changed;           // Version of the last write or delete.
+  Arena arena;                        // Storage for the segment's nodes.
+} HashSegment;
+
+/// A lock and the segment it guards, padded to whole cache lines so writers
+/// on neighbouring stripes never share a line.
+typedef struct HashStripe {
+  alignas(CACHE_LINE_SIZE) pthread_rwlock_t lock;
+  HashSegment segment;
+} HashStripe;
+
 typedef struct HashTable {
-  KeyNode *table[TABLE_SIZE];
-  pthread_rwlock_t hash_lock[TABLE_SIZE];
+  HashStripe *stripes; // LOCK_STRIPES entries, cache line aligned.
+  uint64_t seed[2];    // SipHash key, randomized per table.
+  _Atomic uint64_t version;       // Last version handed out.
+  _Atomic uint64_t oldest_view;   // Oldest pinned version, UINT64_MAX if none.
+  _Atomic uint64_t delta_base;    // Deletes after it keep a tombstone.
+  pthread_mutex_t views_mutex;
+  uint64_t *views;                // Pinned version of each open view.
+  size_t num_views;
+  size_t views_capacity;
 } HashTable;
 
+/// A consistent point-in-time view of the table.
+typedef struct TableView {
+  uint64_t version;   // Pairs written at or before it are visible.
+  uint64_t pin;       // Versions the view keeps alive, at most version.
+} TableView;
+
 /// Creates a new KVS hash table.
 /// @return Newly created hash table, NULL on failure
 struct HashTable *create_hash_table();
 
-/// Hash function based on key initial.
-/// @param key Lowercase alphabetical string.
+/// Keyed hash function (SipHash-2-4).
+/// @param ht The hash table holding the hash key.
+/// @param key The key, only its first MAX_STRING_SIZE bytes are significant.
 /// @return hash.
-int hash(const char *key); 
+uint64_t hash(const HashTable *ht, StringSlice key);
 
-/// Writes a key value pair in the hash table.
+/// Index of the stripe that owns a key.
+/// @param key_hash Hash of the key.
+/// @return Index in [0, LOCK_STRIPES).
+size_t stripe_index(uint64_t key_hash);
+
+/// Hands out the version of a write or delete command. Must be called while
+/// holding the write locks of every stripe the command touches.
+/// @param ht The hash table.
+/// @return The version, larger than any handed out before.
+uint64_t next_version(HashTable *ht);
+
+/// Writes a key value pair in the hash table. Keys and values are copied
+/// into the table, truncated to MAX_STRING_SIZE bytes.
 /// @param ht The hash table.
 /// @param key The key.
 /// @param value The value.
+/// @param version Version from next_version, 0 for pairs older than any view.
 /// @return 0 if successful.
-int write_pair(HashTable *ht, const char *key, const char *value);
+int write_pair(HashTable *ht, StringSlice key, StringSlice value,
+uint64_t version);
 
-/// Reads the value of a given key.
+/// Reads the value of a given key without copying it.
+/// The caller must be inside an epoch critical section, or hold the key's
+/// stripe read lock when built with KVS_RWLOCK_READS. The returned value
+/// borrows the node's storage and is only valid until the caller leaves it.
 /// @param ht The hash table.
 /// @param key The key.
 /// return the value if found, NULL otherwise.
-char* read_pair(HashTable *ht, const char *key);
+const char* read_pair(HashTable *ht, StringSlice key);
+
+/// Checks if a key is stored, without allocating anything.
+/// Same protection requirements as read_pair.
+/// @param ht The hash table.
+/// @param key The key.
+/// @return 1 if the key exists, 0 otherwise.
+int contains_pair(HashTable *ht, StringSlice key);
 
 /// Deletes a pair from the table.
 /// @param ht Hash table to read from.
 /// @param key Key of the pair to be deleted.
-/// @return 0 if the node was deleted successfully, 1 otherwise.
-int delete_pair(HashTable *ht, const char *key);
+/// @param version Version from next_version.
+/// @return 0 if the node was deleted successfully, 1 if it did not exist,
+/// -1 if the tombstone an open view or the next delta backup needs could not
+/// be allocated, the pair is then left in place.
+int delete_pair(HashTable *ht, StringSlice key, uint64_t version);
+
+/// Key stored in a node.
+/// @param key_node The node.
+/// @return The key, '\0' terminated.
+const char *node_key(const KeyNode *key_node);
+
+/// Value stored in a node.
+/// @param key_node The node.
+/// @return The value, '\0' terminated.
+const char *node_value(const KeyNode *key_node);
+
+/// Opens a view of the table as it is now. Writers are never blocked by it,
+/// they keep the versions it needs until view_end. The caller must hold no
+/// stripe lock.
+/// @param ht The hash table.
+/// @param view Where to store the view.
+/// @return 0 on success, 1 if the view could not be registered.
+int view_begin(HashTable *ht, TableView *view);
+
+/// Closes a view. Closing the last one sweeps the versions and tombstones
+/// left behind for views out of the table.
+/// @param ht The hash table.
+/// @param view The view.
+void view_end(HashTable *ht, const TableView *view);
+
+/// Counts the keys of the stripes changed since a version, tombstones
+/// included. Takes each stripe's read lock in turn, so the count is only a
+/// snapshot if writers are running.
+/// @param ht The hash table.
+/// @param since Only stripes changed at this version or later, 0 for all.
+/// @return The number of keys.
+size_t count_keys(HashTable *ht, uint64_t since);
+
+/// Sets the version the next delta backup starts from. Deletes after it
+/// leave a tombstone for the delta to find, older tombstones are swept.
+/// @param ht The hash table.
+/// @param version The version, UINT64_MAX when no delta will be taken.
+void set_delta_base(HashTable *ht, uint64_t version);
+
+/// Calls a function for every key of a stripe as it was at a view, without
+/// locking it. The keys are collected first and the walk is retried if
+/// writers moved nodes meanwhile, so each key is visited exactly once.
+/// @param ht The hash table.
+/// @param stripe Index of the stripe.
+/// @param view An open view.
+/// @param since Only keys written or deleted at this version or later, 0
+/// for all of them. Deleted keys are visited as tombstones (deleted set)
+/// while the table still holds them, see set_delta_base.
+/// @param visit Function called with each node and arg, inside an epoch
+/// critical section.
+/// @param arg Opaque argument passed to visit.
+/// @return 0 on success, 1 if the scratch memory could not be allocated.
+int stripe_for_each_at(HashTable *ht, size_t stripe, const TableView *view,
+uint64_t since, void (*visit)(const KeyNode *key_node, void *arg), void *arg);
 
 /// Frees the hashtable.
 /// @param ht Hash table to be deleted.
@@ -0,0 +1,168 @@
+#include <string.h>
+
+#include "lz.h"
+
+size_t lz_bound(size_t size) {
+  return size + size / 255 + 16;
+}
+
+/// Reads 4 bytes, unaligned.
+static uint32_t load32(const uint8_t *p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+/// Match finder hash of 4 bytes.
+static uint32_t hash4(uint32_t sequence) {
+  return (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/// Writes the extra bytes of a length that did not fit its nibble.
+/// @param dst Output position.
+/// @param end End of the output buffer.
+/// @param length Length minus 15.
+/// @return New output position, NULL if out of room.
+static uint8_t *put_length(uint8_t *dst, uint8_t *end, size_t length) {
+  while (length >= 255) {
+    if (dst == end)
+      return NULL;
+    *dst++ = 255;
+    length -= 255;
+  }
+  if (dst == end)
+    return NULL;
+  *dst++ = (uint8_t) length;
+  return dst;
+}
+
+/// Writes one sequence.
+/// @param dst Output position.
+/// @param end End of the output buffer.
+/// @param literals Literal bytes.
+/// @param num_literals Number of literals.
+/// @param offset Match offset, ignored for the last sequence.
+/// @param match_length Match length, 0 for the last sequence.
+/// @return New output position, NULL if out of room.
+static uint8_t *put_sequence(uint8_t *dst, uint8_t *end,
+const uint8_t *literals, size_t num_literals, size_t offset,
+size_t match_length) {
+  if (dst == end)
+    return NULL;
+  uint8_t *token = dst++;
+  size_t match_code = match_length > 0 ? match_length - LZ_MIN_MATCH : 0;
+  *token = (uint8_t) ((num_literals < 15 ? num_literals : 15) << 4 |
+  (match_code < 15 ? match_code : 15));
+
+  if (num_literals >= 15 &&
+  (dst = put_length(dst, end, num_literals - 15)) == NULL)
+    return NULL;
+  if ((size_t) (end - dst) < num_literals)
+    return NULL;
+  memcpy(dst, literals, num_literals);
+  dst += num_literals;
+
+  if (match_length == 0)
+    return dst;
+  if (end - dst < 2)
+    return NULL;
+  *dst++ = (uint8_t) offset;
+  *dst++ = (uint8_t) (offset >> 8);
+  if (match_code >= 15 && (dst = put_length(dst, end, match_code - 15)) == NULL)
+    return NULL;
+  return dst;
+}
+
+size_t lz_compress(const uint8_t *src, size_t size, uint8_t *dst,
+size_t capacity) {
+  uint32_t table[1 << LZ_HASH_BITS];
+  memset(table, 0, sizeof(table));
+  uint8_t *out = dst;
+  uint8_t *end = dst + (capacity < size ? capacity : size);
+  size_t anchor = 0;
+  size_t pos = 0;
+
+  if (size >= LZ_MIN_MATCH + LZ_LAST_LITERALS) {
+    size_t limit = size - LZ_LAST_LITERALS;
+    while (pos + LZ_MIN_MATCH <= limit) {
+      uint32_t sequence = load32(src + pos);
+      uint32_t slot = hash4(sequence);
+      size_t candidate = table[slot];
+      table[slot] = (uint32_t) pos;
+
+      if (candidate >= pos || pos - candidate > LZ_MAX_OFFSET ||
+      load32(src + candidate) != sequence) {
+        pos++;
+        continue;
+      }
+
+      size_t length = LZ_MIN_MATCH;
+      while (pos + length < limit && src[candidate + length] == src[pos + length])
+        length++;
+      out = put_sequence(out, end, src + anchor, pos - anchor, pos - candidate,
+      length);
+      if (out == NULL)
+        return 0;
+      pos += length;
+      anchor = pos;
+    }
+  }
+
+  out = put_sequence(out, end, src + anchor, size - anchor, 0, 0);
+  if (out == NULL || (size_t) (out - dst) >= size)
+    return 0;
+  return (size_t) (out - dst);
+}
+
+/// Reads the extra bytes of a length whose nibble was 15.
+/// @param src Input position, advanced past the length.
+/// @param end End of the input.
+/// @param length Length to extend.
+/// @return 0 on success, 1 if the input ends early.
+static int get_length(const uint8_t **src, const uint8_t *end, size_t *length) {
+  uint8_t byte;
+  do {
+    if (*src == end)
+      return 1;
+    byte = *(*src)++;
+    *length += byte;
+  } while (byte == 255);
+  return 0;
+}
+
+int lz_decompress(const uint8_t *src, size_t size, uint8_t *dst,
+size_t raw_size) {
+  const uint8_t *end = src + size;
+  size_t pos = 0;
+
+  while (src < end) {
+    uint8_t token = *src++;
+    size_t num_literals = token >> 4;
+    if (num_literals == 15 && get_length(&src, end, &num_literals) != 0)
+      return 1;
+    if ((size_t) (end - src) < num_literals || raw_size - pos < num_literals)
+      return 1;
+    memcpy(dst + pos, src, num_literals);
+    src += num_literals;
+    pos += num_literals;
+
+    if (src == end)
+      break; // Last sequence.
+
+    if (end - src < 2)
+      return 1;
+    size_t offset = (size_t) src[0] | (size_t) src[1] << 8;
+    src += 2;
+    size_t length = (size_t) (token & 15);
+    if (length == 15 && get_length(&src, end, &length) != 0)
+      return 1;
+    length += LZ_MIN_MATCH;
+    if (offset == 0 || offset > pos || raw_size - pos < length)
+      return 1;
+
+    // Byte by byte, a match may overlap the bytes it produces.
+    for (size_t i = 0; i < length; i++, pos++)
+      dst[pos] = dst[pos - offset];
+  }
+  return pos == raw_size ? 0 : 1;
+}
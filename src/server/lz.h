@@ -0,0 +1,41 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LZ_MIN_MATCH 4        // Shortest match worth encoding.
+#define LZ_HASH_BITS 12       // log2 of the match finder's table size.
+#define LZ_MAX_OFFSET 65535   // Matches are at most this far back.
+#define LZ_LAST_LITERALS 5    // Input tail always stored as literals.
+
+// Self-contained LZ77 block codec in the style of LZ4: a sequence is a
+// token byte (literal count << 4 | match length - LZ_MIN_MATCH), extra
+// length bytes for counts of 15 or more, the literals, then a 2 byte little
+// endian match offset. The last sequence has literals only.
+
+/// Largest compressed size of an input, for sizing the output buffer.
+/// @param size Input size.
+/// @return Worst case output size.
+size_t lz_bound(size_t size);
+
+/// Compresses a block.
+/// @param src Input bytes.
+/// @param size Input size.
+/// @param dst Output buffer.
+/// @param capacity Output buffer size.
+/// @return Compressed size, 0 if it would not be smaller than the input or
+///         does not fit in capacity.
+size_t lz_compress(const uint8_t *src, size_t size, uint8_t *dst,
+size_t capacity);
+
+/// Decompresses a block, validating it as it goes.
+/// @param src Compressed bytes.
+/// @param size Compressed size.
+/// @param dst Output buffer.
+/// @param raw_size Exact size of the decompressed block.
+/// @return 0 on success, 1 if the input is corrupt.
+int lz_decompress(const uint8_t *src, size_t size, uint8_t *dst,
+size_t raw_size);
+
+#endif // LZ_H
@@ -1,7 +1,6 @@
 #include <dirent.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/wait.h>
 #include <unistd.h>
 
 #include "jobs_manager.h"
@@ -33,8 +32,27 @@ int main(int argc, char** argv) {
     write_str(STDERR_FILENO, "Failed to initialize KVS.\n");
     cleanup_and_exit(1);
   }
+  switch (kvs_restore(argv[1])) {
+    case KVS_RESTORED:
+      break;
+    case KVS_RESTORE_SNAPSHOT_FAILED:
+      write_str(STDERR_FILENO, "Failed to restore a backup.\n");
+      cleanup_and_exit(1);
+      break;
+    case KVS_RESTORE_REPLAY_FAILED:
+      write_str(STDERR_FILENO, "Failed to replay the write-ahead log.\n");
+      cleanup_and_exit(1);
+      break;
+    case KVS_RESTORE_WAL_FAILED:
+      write_str(STDERR_FILENO, "Failed to open the write-ahead log.\n");
+      cleanup_and_exit(1);
+      break;
+  }
   
-  initialize_session_buffer();
+  if (initialize_session_loops()) {
+    write_str(STDERR_FILENO, "Failed to initialize the session loops.\n");
+    cleanup_and_exit(1);
+  }
 
   setup_client_workers();
 
@@ -46,8 +64,9 @@ int main(int argc, char** argv) {
   run_jobs();
   printf("Finished processing jobs.\n");
 
+  // Posted by the SIGINT and SIGTERM handler.
   while (!atomic_load(&server_data->terminate))
-    sleep(1);
+    sem_wait(&server_data->terminate_posted);
   
   cleanup_and_exit(0);
 }
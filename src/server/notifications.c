@@ -1,17 +1,67 @@
+#include "common/protocol.h"
 #include "notifications.h"
 #include "operations.h"
 
 extern ServerData* server_data;
 
-int is_already_subscribed(const char* key, int notification_fifo_fd) {
-  SubscriptionData* current = server_data->all_subscriptions.subscription_data;
-  while (current != NULL) {
-    if (strncmp(current->key, key, MAX_STRING_SIZE) == 0 && current->notification_fifo_fd == notification_fifo_fd) {
-      return 1; // Subscription already exists.
-    }
-    current = current->next;
+/// Bucket of a key in all_subscriptions.by_key.
+/// @param key The key, at most MAX_STRING_SIZE bytes.
+/// @return The bucket.
+static SubscriptionData** key_bucket(StringSlice key) {
+  return &server_data->all_subscriptions.by_key[
+  slice_hash(key) & (SUBSCRIPTION_BUCKETS - 1)];
+}
+
+/// Bucket of a notification FIFO in all_subscriptions.by_client.
+/// @param notification_fifo_fd The file descriptor of the FIFO.
+/// @return The bucket.
+static SubscriptionData** client_bucket(int notification_fifo_fd) {
+  return &server_data->all_subscriptions.by_client[
+  (size_t) notification_fifo_fd & (SUBSCRIPTION_BUCKETS - 1)];
+}
+
+/// Slice of a subscribed key.
+/// @param sub The subscription.
+/// @return The key.
+static StringSlice subscription_key(const SubscriptionData* sub) {
+  return (StringSlice){sub->key, strnlen(sub->key, MAX_STRING_SIZE)};
+}
+
+/// Finds a client's subscription to a key. Called with the lock held.
+/// @param key The key.
+/// @param notification_fifo_fd The client's notification FIFO.
+/// @return The subscription, NULL if there is none.
+static SubscriptionData* find_subscription(StringSlice key,
+int notification_fifo_fd) {
+  for (SubscriptionData* sub = *key_bucket(key); sub != NULL; sub = sub->next) {
+    StringSlice sub_key = subscription_key(sub);
+    if (sub->notification_fifo_fd == notification_fifo_fd &&
+    sub_key.size == key.size && memcmp(sub_key.data, key.data, key.size) == 0)
+      return sub;
   }
-  return 0; // Subscription does not exist.
+  return NULL;
+}
+
+/// Unlinks a subscription from both of its chains and frees it. Called with
+/// the lock held for writing.
+/// @param sub The subscription.
+static void unlink_subscription(SubscriptionData* sub) {
+  if (sub->prev != NULL)
+    sub->prev->next = sub->next;
+  else
+    *key_bucket(subscription_key(sub)) = sub->next;
+  if (sub->next != NULL)
+    sub->next->prev = sub->prev;
+
+  if (sub->client_prev != NULL)
+    sub->client_prev->client_next = sub->client_next;
+  else
+    *client_bucket(sub->notification_fifo_fd) = sub->client_next;
+  if (sub->client_next != NULL)
+    sub->client_next->client_prev = sub->client_prev;
+
+  atomic_fetch_sub(&server_data->all_subscriptions.count, 1);
+  free(sub);
 }
 
 int add_subscription(const char* key, int notification_fifo_fd) {
@@ -20,103 +70,111 @@ int add_subscription(const char* key, int notification_fifo_fd) {
     return 1; // Key does not exist.
   }
 
-  if (is_already_subscribed(key, notification_fifo_fd)) {
+  StringSlice slice = {key, strnlen(key, MAX_STRING_SIZE)};
+  ClientSubscriptions* subs = &server_data->all_subscriptions;
+  pthread_rwlock_wrlock(&subs->lock);
+  if (find_subscription(slice, notification_fifo_fd) != NULL) {
+    pthread_rwlock_unlock(&subs->lock);
     return 3;
   }
 
   SubscriptionData* new_sub = malloc(sizeof(SubscriptionData));
   if (new_sub == NULL) {
+    pthread_rwlock_unlock(&subs->lock);
     write_str(STDERR_FILENO, "Failed to allocate memory for subscrpition data.\n");
     return 1;
   }
 
   strncpy(new_sub->key, key, MAX_STRING_SIZE);
   new_sub->notification_fifo_fd = notification_fifo_fd;
-  new_sub->next = NULL;
-
-  pthread_mutex_lock(&server_data->all_subscriptions.mutex);
-  new_sub->next = server_data->all_subscriptions.subscription_data;
-  server_data->all_subscriptions.subscription_data = new_sub;
-  pthread_mutex_unlock(&server_data->all_subscriptions.mutex);
 
+  SubscriptionData** bucket = key_bucket(slice);
+  new_sub->prev = NULL;
+  new_sub->next = *bucket;
+  if (*bucket != NULL)
+    (*bucket)->prev = new_sub;
+  *bucket = new_sub;
+
+  bucket = client_bucket(notification_fifo_fd);
+  new_sub->client_prev = NULL;
+  new_sub->client_next = *bucket;
+  if (*bucket != NULL)
+    (*bucket)->client_prev = new_sub;
+  *bucket = new_sub;
+
+  atomic_fetch_add(&subs->count, 1);
+  pthread_rwlock_unlock(&subs->lock);
   return 0;
 }
 
-int remove_subscription(const char* key) {
-  pthread_mutex_lock(&server_data->all_subscriptions.mutex);
-  SubscriptionData* prev = NULL;
-  SubscriptionData* sub_data =
-  server_data->all_subscriptions.subscription_data;
-
-  while (sub_data != NULL) {
-    if (strncmp(sub_data->key, key, MAX_STRING_SIZE) == 0) {
-      if (prev == NULL) {
-        server_data->all_subscriptions.subscription_data = sub_data->next;
-      } else {
-        prev->next = sub_data->next;
-      }
-      free(sub_data);
-      pthread_mutex_unlock(&server_data->all_subscriptions.mutex);
-      return 0;
-    }
-    prev = sub_data;
-    sub_data = sub_data->next;
-  }
-
-  pthread_mutex_unlock(&server_data->all_subscriptions.mutex);
-  return 1; // Key not found in subscriptions.
+int remove_subscription(const char* key, int notification_fifo_fd) {
+  StringSlice slice = {key, strnlen(key, MAX_STRING_SIZE)};
+  pthread_rwlock_wrlock(&server_data->all_subscriptions.lock);
+  SubscriptionData* sub = find_subscription(slice, notification_fifo_fd);
+  if (sub != NULL)
+    unlink_subscription(sub);
+  pthread_rwlock_unlock(&server_data->all_subscriptions.lock);
+  return sub == NULL; // 1 if the key was not subscribed.
 }
 
 void remove_client(int notification_fifo_fd) {
-  pthread_mutex_lock(&server_data->all_subscriptions.mutex);
-
-  SubscriptionData* prev = NULL;
-  SubscriptionData* curr = server_data->all_subscriptions.subscription_data;
+  pthread_rwlock_wrlock(&server_data->all_subscriptions.lock);
 
+  SubscriptionData* curr = *client_bucket(notification_fifo_fd);
   while (curr != NULL) {
-    if (curr->notification_fifo_fd == notification_fifo_fd) {
-      if (prev == NULL) {
-        server_data->all_subscriptions.subscription_data = curr->next;
-      } else {
-        prev->next = curr->next;
-      }
-      free(curr);
-      curr = (prev == NULL) ?
-      server_data->all_subscriptions.subscription_data : prev->next;
-    } else {
-      prev = curr;
-      curr = curr->next;
-    }
+    SubscriptionData* next = curr->client_next;
+    if (curr->notification_fifo_fd == notification_fifo_fd)
+      unlink_subscription(curr);
+    curr = next;
   }
 
-  pthread_mutex_unlock(&server_data->all_subscriptions.mutex);
+  pthread_rwlock_unlock(&server_data->all_subscriptions.lock);
 }
 
-void notify_subscribers(const char* key, const char* value) {
-  pthread_mutex_lock(&server_data->all_subscriptions.mutex);
-
-  SubscriptionData* sub = server_data->all_subscriptions.subscription_data;
-  while (sub != NULL) {
-    if (strncmp(sub->key, key, MAX_STRING_SIZE) == 0) {
-      char notification[MAX_STRING_SIZE * 2];
-      snprintf(notification, sizeof(notification), "(%s,%s)", key, value);
-      write(sub->notification_fifo_fd, notification, strlen(notification) + 1);
-    }
-    sub = sub->next;
+void notify_subscribers(StringSlice key, StringSlice value) {
+  // Most writes have no subscriber, they skip the lock.
+  if (atomic_load(&server_data->all_subscriptions.count) == 0)
+    return;
+  if (key.size > MAX_STRING_SIZE)
+    key.size = MAX_STRING_SIZE;
+  if (value.size > MAX_STRING_SIZE)
+    value.size = MAX_STRING_SIZE;
+
+  // Under PIPE_BUF, so the frame is written whole or not at all.
+  uint8_t notification[FRAME_HEADER_SIZE + 2 * (2 + MAX_STRING_SIZE)];
+  FrameEncoder enc;
+  frame_begin(&enc, notification, sizeof(notification), OP_CODE_NOTIFY, 0, 0);
+  frame_put_string(&enc, key.data, key.size);
+  frame_put_string(&enc, value.data, value.size);
+  size_t length = frame_end(&enc);
+  pthread_rwlock_rdlock(&server_data->all_subscriptions.lock);
+
+  for (SubscriptionData* sub = *key_bucket(key); sub != NULL; sub = sub->next) {
+    StringSlice sub_key = subscription_key(sub);
+    // The FIFO is non-blocking: a client that does not read its
+    // notifications loses them rather than stalling every writer.
+    if (sub_key.size == key.size &&
+    memcmp(sub_key.data, key.data, key.size) == 0)
+      write(sub->notification_fifo_fd, notification, length);
   }
-  pthread_mutex_unlock(&server_data->all_subscriptions.mutex);
+  pthread_rwlock_unlock(&server_data->all_subscriptions.lock);
 }
 
 void clear_all_subscriptions() {
-  pthread_mutex_lock(&server_data->all_subscriptions.mutex);
+  ClientSubscriptions* subs = &server_data->all_subscriptions;
+  pthread_rwlock_wrlock(&subs->lock);
 
-  SubscriptionData* curr = server_data->all_subscriptions.subscription_data;
-  while (curr != NULL) {
-    SubscriptionData* temp = curr;
-    curr = curr->next;
-    free(temp);
+  for (size_t i = 0; i < SUBSCRIPTION_BUCKETS; i++) {
+    SubscriptionData* curr = subs->by_key[i];
+    while (curr != NULL) {
+      SubscriptionData* temp = curr;
+      curr = curr->next;
+      free(temp);
+    }
   }
-  server_data->all_subscriptions.subscription_data = NULL;
+  memset(subs->by_key, 0, sizeof(subs->by_key));
+  memset(subs->by_client, 0, sizeof(subs->by_client));
+  atomic_store(&subs->count, 0);
 
-  pthread_mutex_unlock(&server_data->all_subscriptions.mutex);
+  pthread_rwlock_unlock(&subs->lock);
 }
@@ -8,6 +8,7 @@
 
 #include "common/constants.h"
 #include "server/io.h"
+#include "server/slice.h"
 #include "server/subscriptions.h"
 
 /// Adds a subscription for a given key.
@@ -15,9 +16,11 @@
 /// @param notification_fifo_fd The file descriptor for the notification FIFO.
 int add_subscription(const char* key, int notification_fifo_fd);
 
-/// Removes a subscription for a given key.
+/// Removes a client's subscription to a given key.
 /// @param key The key to unsubscribe from.
-int remove_subscription(const char* key);
+/// @param notification_fifo_fd The file descriptor for the client's notification FIFO.
+/// @return 0 on success, 1 if the client was not subscribed to the key.
+int remove_subscription(const char* key, int notification_fifo_fd);
 
 /// Removes a client from all subscriptions.
 /// @param notification_fifo_fd The file descriptor for the notification FIFO.
@@ -26,7 +29,7 @@ void remove_client(int notification_fifo_fd);
 /// Notifies all subscribers of a key with a new value.
 /// @param key The key whose subscribers will be notified.
 /// @param value The new value to notify the subscribers with.
-void notify_subscribers(const char* key, const char* value);
+void notify_subscribers(StringSlice key, StringSlice value);
 
 /// Clears all subscriptions.
 void clear_all_subscriptions();
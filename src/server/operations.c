@@ -2,6 +2,9 @@
 #include "kvs.h"
 #include "jobs_manager.h"
 #include "macros.h"
+#include "restore.h"
+#include "snapshot.h"
+#include "wal.h"
 
 static struct HashTable* hash_table = NULL;
 extern ServerData* server_data;
@@ -10,6 +13,11 @@ struct timespec delay_to_timespec(unsigned int delay_ms) {
   return (struct timespec){delay_ms / 1000, (delay_ms % 1000) * 1000000};
 }
 
+uint64_t elapsed_ns(const struct timespec *start, const struct timespec *end) {
+  return (uint64_t) (end->tv_sec - start->tv_sec) * 1000000000ULL +
+  (uint64_t) end->tv_nsec - (uint64_t) start->tv_nsec;
+}
+
 int kvs_init() {
   CHECK_NOT_NULL(hash_table, "KVS state has already been initialized.");
 
@@ -17,266 +25,938 @@ int kvs_init() {
   return hash_table == NULL; // Checks if the HashTable was created successfully
 }
 
-int kvs_terminate() {
-  CHECK_NULL(hash_table, "KVS state must be initialized.");
+/// Collects the stripes owning a set of keys, sorted and without duplicates.
+/// Every caller takes stripe locks in this ascending order, which keeps
+/// multi-key operations deadlock free.
+/// @param keys The keys.
+/// @param num_pairs The number of keys, at most MAX_WRITE_SIZE.
+/// @param stripes Output array with room for num_pairs indexes.
+/// @return The number of distinct stripes.
+static size_t collect_stripes(const StringSlice *keys, size_t num_pairs,
+size_t *stripes) {
+  size_t num_stripes = 0;
+
+  // Insertion sort, num_pairs is small.
+  for (size_t i = 0; i < num_pairs; ++i) {
+    size_t stripe = stripe_index(hash(hash_table, keys[i]));
+    size_t j = num_stripes;
+    while (j > 0 && stripes[j - 1] > stripe)
+      --j;
+    if (j > 0 && stripes[j - 1] == stripe)
+      continue; // Already collected.
+    memmove(&stripes[j + 1], &stripes[j], (num_stripes - j) * sizeof(size_t));
+    stripes[j] = stripe;
+    num_stripes++;
+  }
+  return num_stripes;
+}
 
-  free_table(hash_table);
-  hash_table = NULL;
-  return 0;
+/// Materializes restored stripes before an operation touches them.
+/// @param stripes Stripe indexes.
+/// @param num_stripes The number of stripes.
+static void restore_stripes(const size_t *stripes, size_t num_stripes) {
+  for (size_t i = 0; i < num_stripes; ++i)
+    restore_stripe(stripes[i]);
 }
 
-/// Locks or unlocks hash table entries based on the provided keys and lock type.
-/// Ensures locks are always locked and unlocked in a specific order to avoid deadlocks.
-/// @param keys An array of strings representing the keys to be locked or unlocked.
-/// @param num_pairs The number of key-value pairs.
-/// @param type The type of lock operation to perform (READ_LOCK, WRITE_LOCK, READ_UNLOCK, WRITE_UNLOCK)
-void lock_unlock_hashes(char keys[][MAX_STRING_SIZE], size_t num_pairs, LOCK_TYPE type) {
-  int HASH_LOCK_BITMAP[TABLE_SIZE] = {0};
-  
+/// Materializes the restored stripes owning a set of keys.
+/// @param keys The keys.
+/// @param num_pairs The number of keys.
+static void restore_keys(const StringSlice *keys, size_t num_pairs) {
+  if (!restore_pending())
+    return;
   for (size_t i = 0; i < num_pairs; ++i)
-    HASH_LOCK_BITMAP[hash(keys[i])] = 1;
-
-  for (int i = 0; i < TABLE_SIZE; ++i)
-    if (HASH_LOCK_BITMAP[i])
-      switch (type) {
-        case READ_LOCK:
-          pthread_rwlock_rdlock(&hash_table->hash_lock[i]);
-          break;
-        case WRITE_LOCK:
-          pthread_rwlock_wrlock(&hash_table->hash_lock[i]);
-          break;
-        case READ_UNLOCK:
-          pthread_rwlock_unlock(&hash_table->hash_lock[i]);
-          break;
-        case WRITE_UNLOCK:
-          pthread_rwlock_unlock(&hash_table->hash_lock[i]);
-          break;
-      }
+    restore_stripe(stripe_index(hash(hash_table, keys[i])));
+}
+
+/// Locks or unlocks a set of stripes based on the lock type.
+/// @param stripes Sorted, deduplicated stripe indexes from collect_stripes.
+/// @param num_stripes The number of stripes.
+/// @param type The type of lock operation to perform (READ_LOCK, WRITE_LOCK, READ_UNLOCK, WRITE_UNLOCK)
+void lock_unlock_hashes(const size_t *stripes, size_t num_stripes,
+LOCK_TYPE type) {
+  for (size_t i = 0; i < num_stripes; ++i) {
+    pthread_rwlock_t *lock = &hash_table->stripes[stripes[i]].lock;
+    switch (type) {
+      case READ_LOCK:
+        pthread_rwlock_rdlock(lock);
+        break;
+      case WRITE_LOCK:
+        pthread_rwlock_wrlock(lock);
+        break;
+      case READ_UNLOCK:
+      case WRITE_UNLOCK:
+        pthread_rwlock_unlock(lock);
+        break;
+    }
+  }
 }
 
-int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], 
-char values[][MAX_STRING_SIZE], int fd) {
-  char buffer[PIPE_BUF];
-  size_t buff_size = sizeof(buffer);
-  size_t offset = 0;
+int kvs_write(size_t num_pairs, const StringSlice *keys,
+const StringSlice *values, OutputWriter *out, uint64_t *lsn) {
+  size_t stripes[MAX_WRITE_SIZE];
+  int result = 0;
   CHECK_NULL(hash_table, "KVS state must be initialized.");
+  *lsn = 0;
+  if (num_pairs > MAX_WRITE_SIZE) return 1;
 
-  lock_unlock_hashes(keys, num_pairs, WRITE_LOCK);
+  size_t num_stripes = collect_stripes(keys, num_pairs, stripes);
+  restore_stripes(stripes, num_stripes);
+  lock_unlock_hashes(stripes, num_stripes, WRITE_LOCK);
 
+  uint64_t version = next_version(hash_table);
   for (size_t i = 0; i < num_pairs; ++i) {
-    if (write_pair(hash_table, keys[i], values[i]) != 0)
-      offset += (size_t) snprintf(buffer + offset, buff_size - offset,
-      "Failed to write keypair (%s,%s)\n", keys[i], values[i]);
+    if (write_pair(hash_table, keys[i], values[i], version) != 0)
+      result |= out == NULL ? 1 : output_printf(out,
+      "Failed to write keypair (%.*s,%.*s)\n", (int) keys[i].size,
+      keys[i].data, (int) values[i].size, values[i].data);
     notify_subscribers(keys[i], values[i]);
   }
+  // Logged under the stripe locks, so the log orders updates of a key the
+  // way they were applied. The caller waits for the commit, once for all
+  // the updates it reports.
+  *lsn = wal_append(WAL_WRITE, keys, values, num_pairs);
   
-  lock_unlock_hashes(keys, num_pairs, WRITE_UNLOCK);
+  lock_unlock_hashes(stripes, num_stripes, WRITE_UNLOCK);
 
-  CHECK_RETURN_MINUS_ONE(write(fd, buffer, offset), "Error during writing.");
-  return 0;
+  return result != 0;
 }
 
-int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd) {
-  char buffer[PIPE_BUF];
-  size_t buff_size = sizeof(buffer);
-  size_t offset = 0;
+int kvs_read_values(size_t num_pairs, const StringSlice *keys,
+KvsValueVisit visit, void *arg) {
   CHECK_NULL(hash_table, "KVS state must be initialized.");
+  if (num_pairs > MAX_WRITE_SIZE) return 1;
+
+#ifdef KVS_RWLOCK_READS
+  size_t stripes[MAX_WRITE_SIZE];
+  size_t num_stripes = collect_stripes(keys, num_pairs, stripes);
+  restore_stripes(stripes, num_stripes);
+  lock_unlock_hashes(stripes, num_stripes, READ_LOCK);
+#else
+  restore_keys(keys, num_pairs);
+  epoch_enter();
+#endif
+
+  // Values are handed out straight from the table, no copies are made.
+  for (size_t i = 0; i < num_pairs; ++i)
+    visit(keys[i], read_pair(hash_table, keys[i]), arg);
 
-  offset += (size_t) snprintf(buffer + offset, buff_size - offset, "[");
+#ifdef KVS_RWLOCK_READS
+  lock_unlock_hashes(stripes, num_stripes, READ_UNLOCK);
+#else
+  epoch_exit();
+#endif
+  return 0;
+}
+
+/// Where print_value writes.
+typedef struct PrintState {
+  OutputWriter *out;
+  int result;
+} PrintState;
+
+/// Prints a pair read by kvs_read as "(key,value)", or "(key,KVSERROR)".
+/// @param key The key.
+/// @param value Its value, NULL if it does not exist.
+/// @param arg The PrintState.
+static void print_value(StringSlice key, const char *value, void *arg) {
+  PrintState *state = arg;
+  if (value == NULL) {
+    state->result |= output_printf(state->out, "(%.*s,KVSERROR)",
+    (int) key.size, key.data);
+  } else {
+    state->result |= output_printf(state->out, "(%.*s,%s)", (int) key.size,
+    key.data, value);
+  }
+}
 
-  lock_unlock_hashes(keys, num_pairs, READ_LOCK);
+int kvs_read(size_t num_pairs, const StringSlice *keys, OutputWriter *out) {
+  PrintState state = {out, output_write(out, "[", 1)};
+  if (kvs_read_values(num_pairs, keys, print_value, &state) != 0)
+    return 1;
+  state.result |= output_write(out, "]\n", 2);
+  return state.result != 0;
+}
 
-  for (size_t i = 0; i < num_pairs; ++i) {
-    char* result = read_pair(hash_table, keys[i]);
-    if (result == NULL) {
-      offset += (size_t) snprintf(buffer + offset, buff_size - offset,
-      "(%s,KVSERROR)", keys[i]);
-    } else {
-      offset += (size_t) snprintf(buffer + offset, buff_size - offset,
-      "(%s,%s)", keys[i], result);
-    }
-    free(result);
-    result = NULL;
+int kvs_remove(size_t num_pairs, const StringSlice *keys,
+unsigned char *deleted, uint64_t *lsn) {
+  size_t stripes[MAX_WRITE_SIZE];
+  CHECK_NULL(hash_table, "KVS state must be initialized.");
+  *lsn = 0;
+  if (num_pairs > MAX_WRITE_SIZE) return 1;
+
+  size_t num_stripes = collect_stripes(keys, num_pairs, stripes);
+  restore_stripes(stripes, num_stripes);
+  lock_unlock_hashes(stripes, num_stripes, WRITE_LOCK);
+
+  uint64_t version = next_version(hash_table);
+  StringSlice removed[MAX_WRITE_SIZE];
+  size_t num_removed = 0;
+  for (size_t i = 0; i < num_pairs; i++) {
+    int result = delete_pair(hash_table, keys[i], version);
+    deleted[i] = result == 0;
+    if (result < 0)
+      continue;  // Still there, neither notified nor logged.
+    removed[num_removed++] = keys[i];
+    notify_subscribers(keys[i], STRING_SLICE("DELETED"));
   }
 
-  lock_unlock_hashes(keys, num_pairs, READ_UNLOCK);
+  if (num_removed > 0)
+    *lsn = wal_append(WAL_DELETE, removed, NULL, num_removed);
 
-  offset += (size_t) snprintf(buffer + offset, buff_size - offset, "]\n");
-  CHECK_RETURN_MINUS_ONE(write(fd, buffer, offset), "Error during writing.");
-  return 0;
+  lock_unlock_hashes(stripes, num_stripes, WRITE_UNLOCK);
+  return num_removed < num_pairs;
 }
 
-int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd) {
-  char buffer[PIPE_BUF];
-  size_t buff_size = sizeof(buffer);
-  size_t offset = 0;
-  CHECK_NULL(hash_table, "KVS state must be initialized.");
+int kvs_delete(size_t num_pairs, const StringSlice *keys, OutputWriter *out,
+uint64_t *lsn) {
+  unsigned char deleted[MAX_WRITE_SIZE];
+  if (num_pairs > MAX_WRITE_SIZE) return 1;
+  int result = kvs_remove(num_pairs, keys, deleted, lsn);
 
   int aux = 0;
-
-  lock_unlock_hashes(keys, num_pairs, WRITE_LOCK);
-  
   for (size_t i = 0; i < num_pairs; i++) {
-    if (delete_pair(hash_table, keys[i]) != 0) {
+    if (!deleted[i]) {
       if (!aux) {
-        offset += (size_t) snprintf(buffer + offset, buff_size - offset, "[");
+        result |= output_write(out, "[", 1);
         aux = 1;
       }
-      offset += (size_t) snprintf(buffer + offset, buff_size - offset,
-      "(%s,KVSMISSING)", keys[i]);
+      result |= output_printf(out, "(%.*s,KVSMISSING)", (int) keys[i].size,
+      keys[i].data);
     }
-    notify_subscribers(keys[i], "DELETED");
   }
-
-  lock_unlock_hashes(keys, num_pairs, WRITE_UNLOCK);
-
   if (aux)
-    offset += (size_t) snprintf(buffer + offset, buff_size - offset, "]\n");
-
-  CHECK_RETURN_MINUS_ONE(write(fd, buffer, offset), "Error during writing.");
-  return 0;
+    result |= output_write(out, "]\n", 2);
+  return result != 0;
 }
 
-void kvs_show(int fd) {
-  char buffer[PIPE_BUF];
-  size_t buff_size = sizeof(buffer);
-  size_t offset = 0;
-
-  for (int i = 0; i < TABLE_SIZE; i++)
-    pthread_rwlock_rdlock(&hash_table->hash_lock[i]);
+/// Replays a WAL record on top of the restored snapshot, without logging it
+/// again or notifying anyone.
+/// @param type The operation.
+/// @param keys The keys.
+/// @param values The values, NULL for deletes.
+/// @param num_pairs Number of pairs.
+static void replay_wal_record(WalRecordType type, const StringSlice *keys,
+const StringSlice *values, size_t num_pairs) {
+  size_t stripes[MAX_WRITE_SIZE];
+  size_t num_stripes = collect_stripes(keys, num_pairs, stripes);
+  restore_stripes(stripes, num_stripes);
+  lock_unlock_hashes(stripes, num_stripes, WRITE_LOCK);
+  uint64_t version = next_version(hash_table);
+  for (size_t i = 0; i < num_pairs; ++i) {
+    if (type == WAL_WRITE)
+      write_pair(hash_table, keys[i], values[i], version);
+    else if (delete_pair(hash_table, keys[i], version) < 0)
+      fprintf(stderr, "Failed to replay the delete of %.*s.\n",
+      (int) keys[i].size, keys[i].data);
+  }
+  lock_unlock_hashes(stripes, num_stripes, WRITE_UNLOCK);
+}
 
-  for (int i = 0; i < TABLE_SIZE; ++i) {
-    KeyNode *key_node = hash_table->table[i];
-    while (key_node != NULL) {
-      offset += (size_t) snprintf(buffer + offset, buff_size - offset,
-      "(%s, %s)\n", key_node->key, key_node->value);
-      key_node = key_node->next;
-    }
+/// Destination of a table dump, shared by SHOW and BACKUP.
+typedef struct PairStream {
+  OutputWriter *out;
+  size_t count;       // Pairs written so far.
+  int error;
+} PairStream;
+
+/// Appends a pair to a PairStream, in the format "(key, value)\n". Deleted
+/// keys are skipped.
+/// @param key_node The pair.
+/// @param arg The PairStream.
+static void stream_pair(const KeyNode *key_node, void *arg) {
+  PairStream *stream = arg;
+  if (key_node->deleted)
+    return;
+  size_t key_size = key_node->key_size;
+  size_t value_size = key_node->value_size;
+  char *line = output_reserve(stream->out, key_size + value_size + 5);
+  if (line == NULL) {
+    stream->error = 1;
+    return;
   }
+  *line++ = '(';
+  memcpy(line, node_key(key_node), key_size);
+  line += key_size;
+  memcpy(line, ", ", 2);
+  line += 2;
+  memcpy(line, node_value(key_node), value_size);
+  line += value_size;
+  memcpy(line, ")\n", 2);
+  output_commit(stream->out, key_size + value_size + 5);
+  stream->count++;
+}
+
+/// Streams every pair of the table as of a view, flushing as the writer
+/// fills up.
+/// @param out The writer.
+/// @param view The view.
+/// @return The number of pairs written, or -1 on error.
+static ssize_t stream_table(OutputWriter *out, const TableView *view) {
+  PairStream stream = {out, 0, 0};
+  for (size_t i = 0; i < LOCK_STRIPES && !stream.error; ++i)
+    if (stripe_for_each_at(hash_table, i, view, 0, stream_pair, &stream) != 0)
+      stream.error = 1;
+  return stream.error ? -1 : (ssize_t) stream.count;
+}
 
-  for (int i = 0; i < TABLE_SIZE; ++i)
-    pthread_rwlock_unlock(&hash_table->hash_lock[i]);
+void kvs_show(OutputWriter *out) {
+  restore_wait();
+  // Writers keep going while the table is streamed, the view pins the
+  // state SHOW started from.
+  TableView view;
+  CHECK_RETURN_ONE(view_begin(hash_table, &view), "Failed to open a view.");
+  ssize_t count = stream_table(out, &view);
+  view_end(hash_table, &view);
 
-  CHECK_RETURN_MINUS_ONE(write(fd, buffer, offset), "Error during writing.");
+  CHECK_RETURN_MINUS_ONE(count, "Error during writing.");
 }
+
 int key_exists(const char *key) {
   if (hash_table == NULL) {
     write_str(STDERR_FILENO, "KVS state must be initialized.\n");
     return 0;
   }
+  StringSlice slice = {key, strnlen(key, MAX_STRING_SIZE)};
+  restore_keys(&slice, 1);
 
-  for (int i=0; i < TABLE_SIZE; i++)
-    pthread_rwlock_rdlock(&hash_table->hash_lock[i]);
+#ifdef KVS_RWLOCK_READS
+  size_t stripe = stripe_index(hash(hash_table, slice));
+  lock_unlock_hashes(&stripe, 1, READ_LOCK);
+#else
+  epoch_enter();
+#endif
 
-  char *result = read_pair(hash_table, key);
+  int exists = contains_pair(hash_table, slice);
 
-  for (int i=0; i < TABLE_SIZE; i++)
-    pthread_rwlock_unlock(&hash_table->hash_lock[i]);
+#ifdef KVS_RWLOCK_READS
+  lock_unlock_hashes(&stripe, 1, READ_UNLOCK);
+#else
+  epoch_exit();
+#endif
 
-  if (result == NULL) {
-    return 1; // Key does not exist
-  } else {
-    free(result);
-    return 0; // Key exists
-  }
+  return exists ? 0 : 1; // 0 if the key exists, 1 if it does not
+}
+
+/// Snapshot being written from one stripe, for snapshot_pair.
+typedef struct SnapshotStream {
+  SnapshotWriter *writer;
+  uint32_t stripe;
+  int delta;          // Deleted keys are written too.
+  int error;
+} SnapshotStream;
+
+/// Appends a pair, or the deletion of a key to a delta, to a snapshot.
+/// @param key_node The pair.
+/// @param arg The SnapshotStream.
+static void snapshot_pair(const KeyNode *key_node, void *arg) {
+  SnapshotStream *stream = arg;
+  StringSlice key = {node_key(key_node), key_node->key_size};
+  StringSlice value = {node_value(key_node), key_node->value_size};
+  if (stream->error || (key_node->deleted && !stream->delta))
+    return;
+  if ((key_node->deleted ?
+  snapshot_writer_delete(stream->writer, stream->stripe, key) :
+  snapshot_writer_add(stream->writer, stream->stripe, key, value)) != 0)
+    stream->error = 1;
+}
+
+/// Another path a backup is published under, for a BACKUP that found the
+/// table as it was for one still queued or being written.
+typedef struct BackupLink {
+  char *path;
+  struct BackupLink *next;
+} BackupLink;
+
+/// A backup queued for the backup service, or being written by it.
+typedef struct BackupTask {
+  char *path;
+  TableView view;           // State of the table when BACKUP ran.
+  SnapshotInfo info;        // Header of the backup, see snapshot.h.
+  uint64_t since;           // First version of a delta, 0 for a full backup.
+  size_t partitions;        // Segments written, 1 for a single file.
+  struct timespec requested;
+  BackupLink *links;        // Coalesced requests.
+  int written;              // Takes no more links.
+  struct BackupTask *next;  // In the list of running backups.
+  struct BackupTask *queued; // Next in the service queue.
+} BackupTask;
+
+/// A range of stripes of a backup written to one file: the whole table, or
+/// one partition written by its own thread.
+typedef struct BackupPartition {
+  const BackupTask *task;
+  char path[PATH_MAX];
+  SnapshotInfo info;        // The task's, with the partition fields set.
+  SnapshotSegment segment;  // Stripe range on input, the rest on output.
+  int failed;
+  int threaded;             // Written by thread, to be joined.
+  pthread_t thread;
+} BackupPartition;
+
+/// Writes a stripe range of the table as of a view in the binary snapshot
+/// format, stripe by stripe. See snapshot.h. A delta only walks the stripes
+/// changed since its base.
+/// @param fd The file.
+/// @param partition The partition, its segment filled in on success.
+/// @return 0 if the file was fully written, 1 otherwise.
+static int kvs_write_snapshot(int fd, BackupPartition *partition) {
+  const BackupTask *task = partition->task;
+  SnapshotWriter writer;
+  if (snapshot_writer_open(&writer, fd, &partition->info) != 0)
+    return 1;
+  SnapshotStream stream = {&writer, partition->segment.first_stripe,
+  task->since > 0, 0};
+  for (; stream.stripe <= partition->segment.last_stripe && !stream.error;
+  stream.stripe++)
+    if (stripe_for_each_at(hash_table, stream.stripe, &task->view,
+    task->since, snapshot_pair, &stream) != 0)
+      stream.error = 1;
+  int failed = snapshot_writer_close(&writer) != 0 || stream.error;
+  partition->segment.size = writer.offset;
+  partition->segment.record_count = writer.record_count;
+  partition->segment.header_crc = writer.header_crc;
+  return failed;
+}
+
+/// Writes a partition to its file.
+/// @param arg The BackupPartition.
+/// @return NULL.
+static void *write_partition(void *arg) {
+  BackupPartition *partition = arg;
+  unlink(partition->path); // It may be a link to an older backup.
+  int fd = open(partition->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  partition->failed = fd < 0 || kvs_write_snapshot(fd, partition) ||
+  fdatasync(fd) != 0;
+  if (fd >= 0)
+    close(fd);
+  return NULL;
+}
+
+/// Number of partitions to split a backup into: one per core, as long as
+/// each gets SNAPSHOT_PARTITION_MIN_KEYS keys.
+/// @param task The backup.
+/// @return The count, at least 1.
+static size_t backup_partitions(const BackupTask *task) {
+  size_t partitions = count_keys(hash_table, task->since) /
+  SNAPSHOT_PARTITION_MIN_KEYS;
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cores > 0 && partitions > (size_t) cores)
+    partitions = (size_t) cores;
+  if (partitions > SNAPSHOT_MAX_PARTITIONS)
+    partitions = SNAPSHOT_MAX_PARTITIONS;
+  return partitions > 0 ? partitions : 1;
 }
 
-/// Thread-safe version of kvs_show using memcpy that writes the contents of the hash table to a file descriptor.
-/// This function iterates through the hash table and writes each key-value pair to the provided file descriptor
-/// in the format "(key, value)\n". It ensures that the buffer does not overflow by checking the available space
-/// before writing each key-value pair.
-/// @param fd The file descriptor to which the hash table contents will be written.
-void kvs_show_backup(int fd) {
-  char buffer[PIPE_BUF];
-  size_t buff_size = sizeof(buffer);
-  size_t offset = 0;
-  for (int i = 0; i < TABLE_SIZE; ++i) {
-    KeyNode *key_node = hash_table->table[i];
-    while (key_node != NULL) {
-      size_t len_key = strlen(key_node -> key);
-      size_t len_value = strlen(key_node -> value);
-      size_t line_len = len_key + len_value + 5; // For (, )\n
-      if (offset + line_len < buff_size) {
-        buffer[offset++] = '(';
-        memcpy(buffer + offset, key_node -> key, len_key);
-        offset += len_key;
-        memcpy(buffer + offset, ", ", 2);
-        offset += 2;
-        memcpy(buffer + offset, key_node -> value, len_value);
-        offset += len_value;
-        memcpy(buffer + offset, ")\n", 2);
-        offset += 2;
-        buffer[offset] = '\0';
-      }  
-      key_node = key_node->next;
+/// Writes a backup, split into segment files and a manifest when it is
+/// large enough.
+/// @param task The backup, its partition count filled in.
+/// @return Bytes written, 0 on failure.
+static uint64_t write_backup(BackupTask *task) {
+  size_t count = backup_partitions(task);
+  task->partitions = count;
+  BackupPartition *partitions = calloc(count, sizeof(BackupPartition));
+  if (partitions == NULL)
+    return 0;
+
+  for (size_t i = 0; i < count; i++) {
+    BackupPartition *partition = &partitions[i];
+    partition->task = task;
+    partition->info = task->info;
+    partition->segment.first_stripe = (uint32_t) (i * LOCK_STRIPES / count);
+    partition->segment.last_stripe =
+    (uint32_t) ((i + 1) * LOCK_STRIPES / count - 1);
+    if (count == 1) {
+      strncpy(partition->path, task->path, PATH_MAX - 1);
+      continue;
     }
+    partition->info.partition = (uint32_t) i;
+    partition->info.partitions = (uint32_t) count;
+    snprintf(partition->path, PATH_MAX, "%s.%zu", task->path, i);
+  }
+
+  // The calling thread writes the last partition itself, or any whose
+  // thread could not be started.
+  for (size_t i = 0; i + 1 < count; i++) {
+    partitions[i].threaded = pthread_create(&partitions[i].thread, NULL,
+    write_partition, &partitions[i]) == 0;
+    if (!partitions[i].threaded)
+      write_partition(&partitions[i]);
   }
-  CHECK_RETURN_MINUS_ONE(write(fd, buffer, offset), "Error during writing.");
+  write_partition(&partitions[count - 1]);
+
+  uint64_t size = 0;
+  int failed = 0;
+  SnapshotSegment *segments = malloc(count * sizeof(SnapshotSegment));
+  for (size_t i = 0; i < count; i++) {
+    if (partitions[i].threaded)
+      pthread_join(partitions[i].thread, NULL);
+    failed |= partitions[i].failed;
+    size += partitions[i].segment.size;
+    if (segments != NULL)
+      segments[i] = partitions[i].segment;
+  }
+  free(partitions);
+
+  // The manifest goes last, so it only ever lists complete segments.
+  if (!failed && count > 1) {
+    unlink(task->path);
+    int fd = open(task->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    failed = fd < 0 || segments == NULL ||
+    snapshot_manifest_write(fd, segments, count) != 0 || fdatasync(fd) != 0;
+    if (fd >= 0)
+      close(fd);
+    size += SNAPSHOT_MANIFEST_HEADER_SIZE +
+    count * SNAPSHOT_MANIFEST_ENTRY_SIZE + SNAPSHOT_MANIFEST_FOOTER_SIZE;
+  }
+  free(segments);
+  // Durable once its directory entries are, see trim_wal.
+  if (!failed)
+    failed = sync_parent_dir(task->path);
+  return failed ? 0 : size;
 }
 
-void kvs_wait(unsigned int delay_ms, int fd) {
-  char buffer[PIPE_BUF];
-  size_t buff_size = sizeof(buffer);
-  size_t offset = 0;
-  offset += (size_t) snprintf(buffer + offset, buff_size - offset,
-  "Waiting...\n");
-  CHECK_RETURN_MINUS_ONE(write(fd, buffer, offset), "Error during writing.");
+void kvs_wait(unsigned int delay_ms, OutputWriter *out) {
+  CHECK_RETURN_MINUS_ONE(output_write(out, "Waiting...\n", 11),
+  "Error during writing.");
   struct timespec delay = delay_to_timespec(delay_ms);
   nanosleep(&delay, NULL);
 }
 
-int kvs_backup(char* backup_out_file_path, JobQueue* queue) {
-  pid_t pid;
+static pthread_mutex_t backups_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t backups_done = PTHREAD_COND_INITIALIZER;
+static BackupTask *running_backups = NULL;
+
+/// Chain the next backup extends, guarded by backups_mutex.
+static struct {
+  int extendable;       // Whether the next backup can be a delta.
+  uint64_t chain_id;
+  uint32_t sequence;    // Of the last backup started.
+  uint32_t deltas_left; // Before the next full backup.
+  uint64_t base;        // View version of the last backup started.
+  uint64_t full_bytes;  // Size of the chain's full backup, once written.
+  uint64_t delta_bytes; // Total size of its deltas written so far.
+} chain = {0, 0, 0, 0, 0, 0, 0};
+
+/// Picks the id of a new chain.
+/// @return The id.
+static uint64_t new_chain_id() {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return ((uint64_t) now.tv_sec * 1000000000ULL + (uint64_t) now.tv_nsec) ^
+  ((uint64_t) getpid() << 48);
+}
+
+/// Keeps the tombstones the running deltas and the next one need, see
+/// set_delta_base. Called with backups_mutex held.
+static void update_delta_base() {
+  uint64_t base = chain.extendable ? chain.base : UINT64_MAX;
+  for (BackupTask *task = running_backups; task != NULL; task = task->next)
+    if (task->since > 0 && task->since - 1 < base)
+      base = task->since - 1;
+  set_delta_base(hash_table, base);
+}
+
+/// Drops the log records a written backup holds, once it can be restored: a
+/// delta needs the earlier backups of its chain, and a backup started before
+/// it could still fail. Called with backups_mutex held, the task out of the
+/// running list.
+/// @param task The backup.
+/// @param size Bytes written, 0 if the backup failed.
+static void trim_wal(const BackupTask *task, uint64_t size) {
+  if (size == 0 || (task->since > 0 &&
+  (task->info.chain_id != chain.chain_id || !chain.extendable)))
+    return;
+  for (const BackupTask *other = running_backups; other != NULL;
+  other = other->next)
+    if (other->view.version < task->view.version)
+      return;
+  wal_trim(task->info.wal_lsn);
+}
 
-  sem_wait(&server_data->backup_semaphore);
+/// Removes a backup from the running list and accounts for its outcome.
+/// @param task The backup.
+/// @param size Bytes written, 0 if the backup failed.
+static void backup_finished(BackupTask *task, uint64_t size) {
+  pthread_mutex_lock(&backups_mutex);
+  for (BackupTask **link = &running_backups; *link != NULL;
+  link = &(*link)->next) {
+    if (*link == task) {
+      *link = task->next;
+      break;
+    }
+  }
+  if (task->info.chain_id == chain.chain_id) {
+    if (size == 0)
+      chain.extendable = 0; // Later deltas would miss its changes.
+    else if (task->info.sequence == 0)
+      chain.full_bytes = size;
+    else
+      chain.delta_bytes += size;
+  }
+  update_delta_base();
+  trim_wal(task, size);
+  if (running_backups == NULL)
+    pthread_cond_broadcast(&backups_done);
+  pthread_mutex_unlock(&backups_mutex);
+}
 
-  pid = fork();
-  if (pid < 0) {
-    // Fork failed, release the semaphore slot
-    sem_post(&server_data->backup_semaphore);
+/// Copies a file, for links across file systems.
+/// @param from The file.
+/// @param to The copy, replaced if it exists.
+/// @return 0 on success, 1 otherwise.
+static int copy_file(const char *from, const char *to) {
+  int in = open(from, O_RDONLY);
+  if (in < 0)
     return 1;
+  int fd = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  OutputWriter out;
+  int failed = fd < 0 || output_init(&out, fd, OUTPUT_FSYNC_DEFAULT) != 0;
+  if (!failed) {
+    char buffer[OUTPUT_CHUNK_SIZE];
+    ssize_t bytes;
+    while ((bytes = read(in, buffer, sizeof(buffer))) > 0 && !failed)
+      failed = output_write(&out, buffer, (size_t) bytes) != 0;
+    failed |= bytes < 0;
+    failed |= output_finish(&out) != 0;
   }
+  if (fd >= 0)
+    close(fd);
+  close(in);
+  return failed;
+}
 
-  if (pid == 0) {
-    // This is the child process
-    int backup_output_fd = open(backup_out_file_path,
-    O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (backup_output_fd < 0) { // Failed to open file
-      _exit(EXIT_FAILURE);
+/// Publishes a written backup under another path, hard linking its files, or
+/// copying them when that fails. The manifest of a split backup goes last.
+/// @param task The backup.
+/// @param path The other path.
+/// @return 0 on success, 1 otherwise.
+static int link_backup(const BackupTask *task, const char *path) {
+  size_t count = task->partitions > 1 ? task->partitions : 0;
+  for (size_t i = 0; i <= count; i++) {
+    char from[PATH_MAX];
+    char to[PATH_MAX];
+    if (i < count) {
+      snprintf(from, sizeof(from), "%s.%zu", task->path, i);
+      snprintf(to, sizeof(to), "%s.%zu", path, i);
+    } else {
+      strncpy(from, task->path, sizeof(from) - 1);
+      from[sizeof(from) - 1] = '\0';
+      strncpy(to, path, sizeof(to) - 1);
+      to[sizeof(to) - 1] = '\0';
     }
-    kvs_show_backup(backup_output_fd);
-    close(backup_output_fd);
-    free(backup_out_file_path);
-    backup_out_file_path = NULL;
-    destroy_jobs_queue(queue);
-    queue = NULL;
-    kvs_terminate();
-    _exit(EXIT_SUCCESS);
+    unlink(to);
+    if (link(from, to) != 0 && copy_file(from, to) != 0)
+      return 1;
   }
   return 0;
 }
 
+/// Outcome of every backup so far, for monitoring. Guarded by backups_mutex.
+static struct {
+  uint64_t written;     // Full backups and deltas written.
+  uint64_t deltas;
+  uint64_t coalesced;   // Requests published as links to another backup.
+  uint64_t failed;
+  uint64_t bytes;
+  uint64_t write_ns;    // Time spent writing them.
+} backup_stats = {0, 0, 0, 0, 0, 0};
+
+/// Threads writing queued backups, max_backups of them, started by the first
+/// BACKUP. Guarded by backups_mutex.
+static struct {
+  BackupTask *head;         // Oldest queued backup.
+  BackupTask *tail;
+  pthread_t *threads;
+  size_t num_threads;
+  int stopping;
+} service = {NULL, NULL, NULL, 0, 0};
+static pthread_cond_t backups_queued = PTHREAD_COND_INITIALIZER;
+
+/// Writes a backup and the requests coalesced into it, then releases its
+/// view.
+/// @param task The backup, freed.
+static void run_backup(BackupTask *task) {
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  uint64_t size = write_backup(task);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if (size == 0)
+    fprintf(stderr, "Failed to write backup %s.\n", task->path);
+  else
+    printf("Finished backup: %s, %s %u of chain %016lx, %lu bytes in %zu "
+    "file%s, written in %.3f ms after %.3f ms queued\n", task->path,
+    task->since > 0 ? "delta" : "full backup", task->info.sequence,
+    (unsigned long) task->info.chain_id, (unsigned long) size,
+    task->partitions > 1 ? task->partitions + 1 : 1,
+    task->partitions > 1 ? "s" : "", (double) elapsed_ns(&start, &end) / 1e6,
+    (double) elapsed_ns(&task->requested, &start) / 1e6);
+
+  pthread_mutex_lock(&backups_mutex);
+  task->written = 1;
+  BackupLink *links = task->links;
+  task->links = NULL;
+  backup_stats.write_ns += elapsed_ns(&start, &end);
+  if (size == 0) {
+    backup_stats.failed++;
+  } else {
+    backup_stats.written++;
+    backup_stats.deltas += task->since > 0;
+    backup_stats.bytes += size;
+  }
+  pthread_mutex_unlock(&backups_mutex);
+  while (links != NULL) {
+    BackupLink *link = links;
+    links = link->next;
+    int failed = size == 0 || link_backup(task, link->path) != 0;
+    if (failed)
+      fprintf(stderr, "Failed to write backup %s.\n", link->path);
+    else
+      printf("Finished backup: %s, linked to %s\n", link->path, task->path);
+    pthread_mutex_lock(&backups_mutex);
+    if (failed)
+      backup_stats.failed++;
+    else
+      backup_stats.coalesced++;
+    pthread_mutex_unlock(&backups_mutex);
+    free(link->path);
+    free(link);
+  }
+
+  // The delta base moves first, so the view's sweep drops the tombstones
+  // this backup no longer needs.
+  backup_finished(task, size);
+  view_end(hash_table, &task->view);
+  free(task->path);
+  free(task);
+}
+
+/// Backup service thread. Writes queued backups in order until the service
+/// stops with an empty queue.
+/// @param arg Unused.
+/// @return NULL.
+static void *backup_service(void *arg) {
+  (void) arg;
+  pthread_mutex_lock(&backups_mutex);
+  for (;;) {
+    while (service.head == NULL && !service.stopping)
+      pthread_cond_wait(&backups_queued, &backups_mutex);
+    BackupTask *task = service.head;
+    if (task == NULL)
+      break;
+    service.head = task->queued;
+    if (service.head == NULL)
+      service.tail = NULL;
+    pthread_mutex_unlock(&backups_mutex);
+    run_backup(task);
+    pthread_mutex_lock(&backups_mutex);
+  }
+  pthread_mutex_unlock(&backups_mutex);
+  return NULL;
+}
 
-void signal_child_terminated() {
-  atomic_store(&server_data->child_terminated_flag, 1);
+/// Starts the service threads if they are not running. Called with
+/// backups_mutex held.
+/// @return 0 if at least one thread runs, 1 otherwise.
+static int start_service() {
+  if (service.num_threads > 0)
+    return 0;
+  size_t count = server_data->max_backups > 0 ? server_data->max_backups : 1;
+  service.threads = malloc(count * sizeof(pthread_t));
+  if (service.threads == NULL)
+    return 1;
+  service.stopping = 0;
+  while (service.num_threads < count && pthread_create(
+  &service.threads[service.num_threads], NULL, backup_service, NULL) == 0)
+    service.num_threads++;
+  if (service.num_threads > 0)
+    return 0;
+  free(service.threads);
+  service.threads = NULL;
+  return 1;
 }
 
-void* checks_for_terminated_children() {
-  // Block SIGCHLD signal for this thread
-  sigset_t set;
-  sigemptyset(&set);
-  sigaddset(&set, SIGCHLD);
-  pthread_sigmask(SIG_BLOCK, &set, NULL);
+/// Writes the queued backups, then stops the service threads.
+static void stop_service() {
+  pthread_mutex_lock(&backups_mutex);
+  service.stopping = 1;
+  pthread_cond_broadcast(&backups_queued);
+  size_t count = service.num_threads;
+  pthread_t *threads = service.threads;
+  service.num_threads = 0;
+  service.threads = NULL;
+  pthread_mutex_unlock(&backups_mutex);
+  for (size_t i = 0; i < count; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+}
 
-  while (1) {
-    while (atomic_load(&server_data->child_terminated_flag) == 0) {
-      struct timespec delay = delay_to_timespec(1);
-      nanosleep(&delay, NULL);
+/// Backup still queued or being written whose view sees the table at a
+/// version, which would write the same pairs. Called with backups_mutex held.
+/// @param version The version.
+/// @return The backup, NULL if there is none.
+static BackupTask *backup_at(uint64_t version) {
+  for (BackupTask *task = running_backups; task != NULL; task = task->next)
+    if (!task->written && task->view.version == version)
+      return task;
+  return NULL;
+}
+
+/// Decides whether a backup is a full backup or a delta of the current
+/// chain. Called with backups_mutex held.
+/// @param task The backup, its view open.
+static void plan_backup(BackupTask *task) {
+  // Deltas are cheap while the chain is short and small next to its full
+  // backup. Past that, a full backup compacts the chain.
+  int delta = chain.extendable && chain.deltas_left > 0 &&
+  chain.delta_bytes <= chain.full_bytes / 2;
+  if (delta) {
+    chain.sequence++;
+    chain.deltas_left--;
+    task->since = chain.base + 1;
+  } else {
+    chain.chain_id = new_chain_id();
+    chain.sequence = 0;
+    chain.deltas_left = SNAPSHOT_MAX_DELTAS;
+    chain.full_bytes = 0;
+    chain.delta_bytes = 0;
+    chain.extendable = 1;
+    task->since = 0;
+  }
+  chain.base = task->view.version;
+
+  task->info.flags = (SNAPSHOT_COMPRESSION ? SNAPSHOT_FLAG_COMPRESSED : 0) |
+  (delta ? SNAPSHOT_FLAG_DELTA : 0);
+  task->info.stripe_count = LOCK_STRIPES;
+  memcpy(task->info.seed, hash_table->seed, sizeof(task->info.seed));
+  task->info.chain_id = chain.chain_id;
+  task->info.sequence = chain.sequence;
+
+  task->next = running_backups;
+  running_backups = task;
+  update_delta_base();
+}
+
+int kvs_backup(const char *backup_out_file_path) {
+  BackupTask *task = calloc(1, sizeof(BackupTask));
+  if (task == NULL)
+    return 1;
+  task->path = strdup(backup_out_file_path);
+  if (task->path == NULL) {
+    free(task);
+    return 1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &task->requested);
+
+  // The view only sees materialized stripes.
+  restore_wait();
+  // Records are logged after being applied, so every record up to this LSN
+  // is in the view opened next. Later ones are replayed on restore.
+  task->info.wal_lsn = wal_last_lsn();
+  TableView view;
+  if (view_begin(hash_table, &view) != 0) {
+    free(task->path);
+    free(task);
+    return 1;
+  }
+
+  pthread_mutex_lock(&backups_mutex);
+  BackupTask *same = backup_at(view.version);
+  if (same != NULL) {
+    // Nothing changed since that backup was requested, publish its files.
+    BackupLink *link = malloc(sizeof(BackupLink));
+    if (link != NULL) {
+      link->path = task->path;
+      link->next = same->links;
+      same->links = link;
+      pthread_mutex_unlock(&backups_mutex);
+      view_end(hash_table, &view);
+      free(task);
+      return 0;
     }
-    atomic_store(&server_data->child_terminated_flag, 0);
+  }
+  if (start_service() != 0) {
+    pthread_mutex_unlock(&backups_mutex);
+    view_end(hash_table, &view);
+    free(task->path);
+    free(task);
+    return 1;
+  }
+  task->view = view;
+  plan_backup(task);
+  if (service.tail != NULL)
+    service.tail->queued = task;
+  else
+    service.head = task;
+  service.tail = task;
+  pthread_cond_signal(&backups_queued);
+  pthread_mutex_unlock(&backups_mutex);
+  return 0;
+}
 
-    while (waitpid(-1, NULL, WNOHANG) > 0)
-      sem_post(&server_data->backup_semaphore);
+void kvs_wait_backups() {
+  pthread_mutex_lock(&backups_mutex);
+  while (running_backups != NULL)
+    pthread_cond_wait(&backups_done, &backups_mutex);
+  pthread_mutex_unlock(&backups_mutex);
+}
+
+/// Lets the next backup extend the restored chain, so it only holds what
+/// changed since the restart, including the replayed log.
+static void continue_chain() {
+  uint64_t chain_id;
+  uint32_t sequence;
+  if (restore_chain_position(&chain_id, &sequence) != 0)
+    return;
+  pthread_mutex_lock(&backups_mutex);
+  chain.extendable = 1;
+  chain.chain_id = chain_id;
+  chain.sequence = sequence;
+  uint32_t max_deltas = SNAPSHOT_MAX_DELTAS;
+  chain.deltas_left = sequence < max_deltas ? max_deltas - sequence : 0;
+  chain.base = 0;                 // Restored pairs have version 0.
+  chain.full_bytes = UINT64_MAX;  // Unknown, only the length limits it.
+  chain.delta_bytes = 0;
+  update_delta_base();
+  pthread_mutex_unlock(&backups_mutex);
+}
+
+KvsRestoreResult kvs_restore(const char *dir) {
+  CHECK_NULL(hash_table, "KVS state must be initialized.");
+  // The log may have dropped the records older snapshots need.
+  uint64_t base_lsn = wal_base_lsn(dir);
+  uint64_t snapshot_lsn;
+  if (restore_latest(hash_table, dir, base_lsn, &snapshot_lsn) != 0 &&
+  base_lsn > 0) {
+    fprintf(stderr, "No backup holds the records the write-ahead log "
+    "dropped, up to LSN %lu.\n", (unsigned long) base_lsn);
+    return KVS_RESTORE_SNAPSHOT_FAILED;
   }
-  return NULL;
+  continue_chain();
+  switch (wal_open(dir, snapshot_lsn, replay_wal_record)) {
+    case 0:
+      return KVS_RESTORED;
+    case 2:
+      return KVS_RESTORE_REPLAY_FAILED;
+    default:
+      return KVS_RESTORE_WAL_FAILED;
+  }
+}
+
+int kvs_terminate() {
+  CHECK_NULL(hash_table, "KVS state must be initialized.");
+
+  kvs_wait_backups();
+  stop_service();
+  if (backup_stats.written + backup_stats.coalesced + backup_stats.failed > 0)
+    printf("Backups: %lu written (%lu deltas), %lu coalesced, %lu failed, %lu "
+    "bytes in %.3f ms of writing.\n", (unsigned long) backup_stats.written,
+    (unsigned long) backup_stats.deltas,
+    (unsigned long) backup_stats.coalesced,
+    (unsigned long) backup_stats.failed, (unsigned long) backup_stats.bytes,
+    (double) backup_stats.write_ns / 1e6);
+  restore_stop();
+  free_table(hash_table);
+  hash_table = NULL;
+  return 0;
 }
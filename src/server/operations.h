@@ -9,7 +9,6 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 #include <stdatomic.h>
@@ -17,10 +16,12 @@
 #include "constants.h"
 #include "io.h"
 #include "jobs_manager.h"
+#include "output.h"
 #include "server/utils.h"
+#include "slice.h"
 
 // Forward Declaration
-void notify_subscribers(const char* key, const char* value);
+void notify_subscribers(StringSlice key, StringSlice value);
 
 typedef enum {
   READ_LOCK,
@@ -29,70 +30,124 @@ typedef enum {
   WRITE_UNLOCK
 } LOCK_TYPE;
 
+/// Step of kvs_restore that failed.
+typedef enum {
+  KVS_RESTORED,
+  KVS_RESTORE_SNAPSHOT_FAILED,  // No backup holds what the log dropped.
+  KVS_RESTORE_REPLAY_FAILED,    // The log is not valid or unreadable.
+  KVS_RESTORE_WAL_FAILED,       // The log could not be opened or repaired.
+} KvsRestoreResult;
+
 /// Calculates a timespec from a delay in milliseconds.
 /// @param delay_ms Delay in milliseconds.
 /// @return Timespec with the given delay.
 struct timespec delay_to_timespec(unsigned int delay_ms);
 
+/// Nanoseconds between two CLOCK_MONOTONIC readings.
+/// @param start The earlier reading.
+/// @param end The later reading.
+/// @return Elapsed time in nanoseconds.
+uint64_t elapsed_ns(const struct timespec *start, const struct timespec *end);
+
 /// Initializes the KVS state.
 /// @return 0 if the KVS state was initialized successfully, 1 otherwise.
 int kvs_init();
 
+/// Restores the newest snapshot of a directory (see restore.h), replays the
+/// write-ahead log on top of it and opens the log (see wal.h).
+/// Called right after kvs_init, before any request is served.
+/// @param dir Directory holding the job files, their backups and the log.
+/// @return KVS_RESTORED on success, otherwise the step that failed.
+KvsRestoreResult kvs_restore(const char *dir);
+
 /// Destroys the KVS state.
 /// @return 0 if the KVS state was terminated successfully, 1 otherwise.
 int kvs_terminate();
 
 /// Writes key-value pairs to the KVS. If a key already exists, it is updated.
 /// @param num_pairs Number of pairs being written.
-/// @param keys Array of keys' strings.
-/// @param values Array of values' strings.
-/// @param fd The file descriptor to write to.
+/// @param keys Array of keys, they may borrow the job file.
+/// @param values Array of values, they may borrow the job file.
+/// @param out The job's output writer, or NULL to only report failures
+/// through the result.
+/// @param lsn Where to store the LSN of the write's log record. The write
+/// must not be reported as done before wal_commit of it.
 /// @return 0 if the pairs were written successfully, 1 otherwise.
-int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE],
-char values[][MAX_STRING_SIZE], int fd);
+int kvs_write(size_t num_pairs, const StringSlice *keys,
+const StringSlice *values, OutputWriter *out, uint64_t *lsn);
+
+/// Called by kvs_read_values for each key, in order.
+/// @param key The key.
+/// @param value Its value, NULL if it does not exist. Only valid during the
+/// call.
+/// @param arg The caller's argument.
+typedef void (*KvsValueVisit)(StringSlice key, const char *value, void *arg);
+
+/// Reads values from the KVS, handing each to a callback rather than
+/// printing it.
+/// @param num_pairs Number of keys to read.
+/// @param keys Array of keys.
+/// @param visit Called for each key.
+/// @param arg Passed to visit.
+/// @return 0 if the keys were read, 1 otherwise.
+int kvs_read_values(size_t num_pairs, const StringSlice *keys,
+KvsValueVisit visit, void *arg);
 
 /// Reads values from the KVS.
 /// @param num_pairs Number of pairs to read.
-/// @param keys Array of keys' strings.
-/// @param fd The file descriptor to write to.
+/// @param keys Array of keys.
+/// @param out The job's output writer.
 /// @return 0 if the key reading was successful, 1 otherwise.
-int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd);
+int kvs_read(size_t num_pairs, const StringSlice *keys, OutputWriter *out);
+
+/// Deletes key-value pairs from the KVS, reporting which existed rather than
+/// printing the missing ones.
+/// @param num_pairs Number of pairs to delete.
+/// @param keys Array of keys.
+/// @param deleted Where to store, for each key, 1 if it existed, 0 if not.
+/// @param lsn Where to store the LSN of the delete's log record, as for
+/// kvs_write, 0 if no key could be deleted.
+/// @return 0 if the pairs were deleted successfully, 1 if some could not be
+/// (see delete_pair): they are left in place, unlogged, and reported as 0.
+int kvs_remove(size_t num_pairs, const StringSlice *keys,
+unsigned char *deleted, uint64_t *lsn);
 
 /// Deletes key-value pairs from the KVS.
 /// @param num_pairs Number of pairs to delete.
-/// @param keys Array of keys' strings.
-/// @param fd The file descriptor to write to.
+/// @param keys Array of keys.
+/// @param out The job's output writer.
+/// @param lsn Where to store the LSN of the delete's log record, as for
+/// kvs_write.
 /// @return 0 if the pairs were deleted successfully, 1 otherwise.
-int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd);
+int kvs_delete(size_t num_pairs, const StringSlice *keys, OutputWriter *out,
+uint64_t *lsn);
 
-/// Writes the state of the KVS to the specified file descriptor.
-/// @param fd The file descriptor to write to.
-void kvs_show(int fd);
+/// Writes the state of the KVS to a job's output.
+/// @param out The job's output writer.
+void kvs_show(OutputWriter *out);
 
 /// Waits for a given amount of time.
 /// @param delay_ms Delay in milliseconds.
-/// @param fd The file descriptor to write to.
-void kvs_wait(unsigned int delay_ms, int fd);
+/// @param out The job's output writer.
+void kvs_wait(unsigned int delay_ms, OutputWriter *out);
 
 
-/// Creates a backup of the KVS state and stores it in the specified backup file.
-/// @param backup_out_file_path Path to the backup output file.
-/// @param queue Pointer to the job queue.
-/// @return 0 if the backup was successful, 1 otherwise.
-int kvs_backup(char* backup_out_file_path, JobQueue* queue);
+/// Creates a backup of the KVS state and stores it in the specified backup
+/// file. The state is pinned by a view (see kvs.h) and queued for the
+/// max_backups backup service threads, so the caller and every writer carry
+/// on meanwhile. If the table has not changed since a backup that is still
+/// queued or being written, that backup's files are linked to this path
+/// instead.
+/// @param backup_out_file_path Path to the backup output file, copied.
+/// @return 0 if the backup was started successfully, 1 otherwise.
+int kvs_backup(const char *backup_out_file_path);
 
-/// Auxiliary function to handle semaphore operations.
-/// Checks for terminated child processes and when it finds one, sets a flag true.
-void signal_child_terminated();
+/// Waits until every backup started so far has been written.
+void kvs_wait_backups();
 
 /// Checks if a key exits
 /// @param key a key for a entry in the HashTable
 /// @return 0 if exists 1 if not
 int key_exists(const char *key);
 
-/// Continuously checks for terminated child processes and handles them.
-/// When a child exits this function will cleanup the process using waitpid and
-/// release the slot in the semaphore, also resets the flag.
-void* checks_for_terminated_children();
-
 #endif  // KVS_OPERATIONS_H
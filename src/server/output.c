@@ -0,0 +1,429 @@
+#ifdef OUTPUT_IO_URING
+#define _DEFAULT_SOURCE // For syscall().
+#endif
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifdef OUTPUT_IO_URING
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#endif
+
+#include "output.h"
+
+/// Start of a chunk.
+/// @param out The writer.
+/// @param index Chunk index.
+/// @return Pointer to the chunk.
+static char *chunk_at(OutputWriter *out, size_t index) {
+  return out->chunks + index * OUTPUT_CHUNK_SIZE;
+}
+
+#ifdef OUTPUT_IO_URING
+/// An io_uring writing the chunks of one writer, driven by raw system calls.
+/// Chunks are written at explicit offsets, so the ones in flight may complete
+/// in any order. The chunk being filled is never in flight.
+typedef struct OutputRing {
+  int fd;
+  void *sq_map;
+  size_t sq_map_size;
+  void *cq_map;
+  size_t cq_map_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  _Atomic unsigned *sq_tail;
+  const unsigned *sq_mask;
+  unsigned *sq_array;
+  _Atomic unsigned *cq_head;
+  _Atomic unsigned *cq_tail;
+  const unsigned *cq_mask;
+  const struct io_uring_cqe *cqes;
+  uint64_t offset;                      // Where the next chunk goes.
+  uint64_t offsets[OUTPUT_CHUNKS];      // Of each chunk in flight.
+  struct iovec iov[OUTPUT_CHUNKS];
+  int busy[OUTPUT_CHUNKS];              // Submitted, not completed yet.
+  size_t in_flight;
+} OutputRing;
+
+/// Unmaps and closes a ring.
+/// @param ring The ring, freed.
+static void ring_destroy(OutputRing *ring) {
+  if (ring->sqes != NULL)
+    munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_map != NULL)
+    munmap(ring->cq_map, ring->cq_map_size);
+  if (ring->sq_map != NULL)
+    munmap(ring->sq_map, ring->sq_map_size);
+  close(ring->fd);
+  free(ring);
+}
+
+/// Maps one of the regions of a ring.
+/// @param ring_fd The ring.
+/// @param size Bytes to map.
+/// @param offset IORING_OFF_* region.
+/// @return The mapping, NULL on failure.
+static void *ring_map(int ring_fd, size_t size, off_t offset) {
+  void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, ring_fd,
+  offset);
+  return map == MAP_FAILED ? NULL : map;
+}
+
+/// Sets up a ring for a file, which must be a regular file not opened for
+/// appending, since every write has its own offset.
+/// @param fd The file, written from its current position.
+/// @return The ring, NULL if the file or the kernel does not allow one.
+static OutputRing *ring_create(int fd) {
+  struct stat st;
+  int flags = fcntl(fd, F_GETFL);
+  off_t position = lseek(fd, 0, SEEK_CUR);
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || flags < 0 ||
+  (flags & O_APPEND) || position < 0)
+    return NULL;
+
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  long ring_fd = syscall(__NR_io_uring_setup, OUTPUT_CHUNKS, &params);
+  if (ring_fd < 0)
+    return NULL;
+  OutputRing *ring = calloc(1, sizeof(OutputRing));
+  if (ring == NULL) {
+    close((int) ring_fd);
+    return NULL;
+  }
+  ring->fd = (int) ring_fd;
+  ring->sq_map_size = params.sq_off.array + params.sq_entries *
+  sizeof(unsigned);
+  ring->cq_map_size = params.cq_off.cqes + params.cq_entries *
+  sizeof(struct io_uring_cqe);
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sq_map = ring_map(ring->fd, ring->sq_map_size, IORING_OFF_SQ_RING);
+  ring->cq_map = ring_map(ring->fd, ring->cq_map_size, IORING_OFF_CQ_RING);
+  ring->sqes = ring_map(ring->fd, ring->sqes_size, IORING_OFF_SQES);
+  if (ring->sq_map == NULL || ring->cq_map == NULL || ring->sqes == NULL) {
+    ring_destroy(ring);
+    return NULL;
+  }
+
+  char *sq = ring->sq_map;
+  char *cq = ring->cq_map;
+  ring->sq_tail = (_Atomic unsigned *) (sq + params.sq_off.tail);
+  ring->sq_mask = (const unsigned *) (sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+  ring->cq_head = (_Atomic unsigned *) (cq + params.cq_off.head);
+  ring->cq_tail = (_Atomic unsigned *) (cq + params.cq_off.tail);
+  ring->cq_mask = (const unsigned *) (cq + params.cq_off.ring_mask);
+  ring->cqes = (const struct io_uring_cqe *) (cq + params.cq_off.cqes);
+  ring->offset = (uint64_t) position;
+  return ring;
+}
+
+/// Submits a chunk to be written at the next offset.
+/// @param out The writer.
+/// @param index The chunk, not empty.
+/// @return 0 on success, -1 on error.
+static int ring_submit(OutputWriter *out, size_t index) {
+  OutputRing *ring = out->ring;
+  unsigned tail = atomic_load_explicit(ring->sq_tail, memory_order_relaxed);
+  unsigned slot = tail & *ring->sq_mask;
+  ring->iov[index] = (struct iovec){chunk_at(out, index), out->used[index]};
+  struct io_uring_sqe *sqe = &ring->sqes[slot];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_WRITEV;
+  sqe->fd = out->fd;
+  sqe->addr = (uint64_t) (uintptr_t) &ring->iov[index];
+  sqe->len = 1;
+  sqe->off = ring->offset;
+  sqe->user_data = index;
+  ring->sq_array[slot] = slot;
+  atomic_store_explicit(ring->sq_tail, tail + 1, memory_order_release);
+
+  while (syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0) < 0) {
+    if (errno != EINTR) {
+      out->error = 1;
+      return -1;
+    }
+  }
+  ring->offsets[index] = ring->offset;
+  ring->offset += out->used[index];
+  ring->busy[index] = 1;
+  ring->in_flight++;
+  return 0;
+}
+
+/// Accounts for a completed chunk, finishing a short write synchronously.
+/// @param out The writer.
+/// @param index The chunk.
+/// @param result Bytes written, or a negated errno.
+static void ring_complete(OutputWriter *out, size_t index, int result) {
+  OutputRing *ring = out->ring;
+  size_t size = out->used[index];
+  size_t done = result > 0 ? (size_t) result : 0;
+  if (result < 0)
+    out->error = 1;
+  while (!out->error && done < size) {
+    ssize_t written = pwrite(out->fd, chunk_at(out, index) + done, size - done,
+    (off_t) (ring->offsets[index] + done));
+    if (written < 0 && errno != EINTR)
+      out->error = 1;
+    else if (written > 0)
+      done += (size_t) written;
+  }
+  out->bytes_written += done;
+  out->used[index] = 0;
+  ring->busy[index] = 0;
+  ring->in_flight--;
+}
+
+/// Waits for at least one chunk in flight to complete.
+/// @param out The writer.
+/// @return 0 on success, -1 if the ring failed.
+static int ring_reap(OutputWriter *out) {
+  OutputRing *ring = out->ring;
+  unsigned head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+  while (head == atomic_load_explicit(ring->cq_tail, memory_order_acquire)) {
+    if (syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS,
+    NULL, 0) < 0 && errno != EINTR) {
+      out->error = 1;
+      return -1;
+    }
+  }
+  while (head != atomic_load_explicit(ring->cq_tail, memory_order_acquire)) {
+    const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    ring_complete(out, (size_t) cqe->user_data, cqe->res);
+    head++;
+  }
+  atomic_store_explicit(ring->cq_head, head, memory_order_release);
+  return 0;
+}
+
+/// Waits for every chunk in flight.
+/// @param out The writer.
+/// @return 0 on success, -1 if the ring failed, leaving some in flight.
+static int ring_drain(OutputWriter *out) {
+  while (out->ring->in_flight > 0)
+    if (ring_reap(out) != 0)
+      return -1;
+  return 0;
+}
+
+/// Submits the chunk being filled and waits for every write, then moves the
+/// file position past them as a writev would have.
+/// @param out The writer.
+/// @return 0 on success, -1 on error.
+static int ring_flush(OutputWriter *out) {
+  if (out->used[out->current] > 0 && ring_submit(out, out->current) == 0)
+    out->current = (out->current + 1) % OUTPUT_CHUNKS;
+  if (ring_drain(out) != 0 || out->error)
+    return -1;
+  out->current = 0;
+  if (lseek(out->fd, (off_t) out->ring->offset, SEEK_SET) < 0) {
+    out->error = 1;
+    return -1;
+  }
+  return 0;
+}
+#endif // OUTPUT_IO_URING
+
+int output_init(OutputWriter *out, int fd, OutputSyncPolicy sync) {
+  out->fd = fd;
+  out->sync = sync;
+  for (size_t i = 0; i < OUTPUT_CHUNKS; i++)
+    out->used[i] = 0;
+  out->current = 0;
+  out->bytes_written = 0;
+  out->error = 0;
+  out->ring = NULL;
+  out->barrier = NULL;
+  out->barrier_arg = NULL;
+  out->chunks = malloc(OUTPUT_CHUNKS * OUTPUT_CHUNK_SIZE);
+#ifdef OUTPUT_IO_URING
+  if (out->chunks != NULL)
+    out->ring = ring_create(fd);
+#endif
+  return out->chunks == NULL;
+}
+
+void output_barrier(OutputWriter *out, OutputBarrier barrier, void *arg) {
+  out->barrier = barrier;
+  out->barrier_arg = arg;
+}
+
+/// Writes every chunk filled so far with one writev.
+/// @param out The writer.
+/// @return 0 on success, -1 on error.
+static int write_chunks(OutputWriter *out) {
+  struct iovec iov[OUTPUT_CHUNKS];
+  int count = 0;
+  for (size_t i = 0; i <= out->current; i++)
+    if (out->used[i] > 0)
+      iov[count++] = (struct iovec){chunk_at(out, i), out->used[i]};
+  if (count == 0)
+    return 0;
+
+  struct iovec *next = iov;
+  while (count > 0) {
+    ssize_t written = writev(out->fd, next, count);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      out->error = 1;
+      return -1;
+    }
+    out->bytes_written += (uint64_t) written;
+
+    // Skip what was written, a short write resumes mid chunk.
+    size_t left = (size_t) written;
+    while (count > 0 && left >= next->iov_len) {
+      left -= next->iov_len;
+      next++;
+      count--;
+    }
+    if (count > 0) {
+      next->iov_base = (char *) next->iov_base + left;
+      next->iov_len -= left;
+    }
+  }
+
+  for (size_t i = 0; i < OUTPUT_CHUNKS; i++)
+    out->used[i] = 0;
+  out->current = 0;
+  return 0;
+}
+
+/// Moves on to the next chunk once the current one is full: with a ring the
+/// full chunk is submitted and the next one waited for if still in flight,
+/// otherwise every chunk is written once they are all full.
+/// @param out The writer.
+/// @return 0 on success, -1 on error.
+static int next_chunk(OutputWriter *out) {
+#ifdef OUTPUT_IO_URING
+  if (out->ring != NULL) {
+    if (out->barrier != NULL)
+      out->barrier(out->barrier_arg);
+    if (ring_submit(out, out->current) != 0)
+      return -1;
+    out->current = (out->current + 1) % OUTPUT_CHUNKS;
+    while (out->ring->busy[out->current])
+      if (ring_reap(out) != 0)
+        return -1;
+    return out->error ? -1 : 0;
+  }
+#endif
+  if (out->current + 1 < OUTPUT_CHUNKS) {
+    out->current++;
+    return 0;
+  }
+  return output_flush(out);
+}
+
+int output_flush(OutputWriter *out) {
+  if (out->error)
+    return -1;
+  if (out->barrier != NULL)
+    out->barrier(out->barrier_arg);
+#ifdef OUTPUT_IO_URING
+  int failed = out->ring != NULL ? ring_flush(out) : write_chunks(out);
+#else
+  int failed = write_chunks(out);
+#endif
+  if (failed)
+    return -1;
+
+  if (out->sync == OUTPUT_FSYNC_ON_FLUSH && fdatasync(out->fd) != 0) {
+    out->error = 1;
+    return -1;
+  }
+  return 0;
+}
+
+char *output_reserve(OutputWriter *out, size_t size) {
+  if (out->error || size > OUTPUT_CHUNK_SIZE)
+    return NULL;
+  if (OUTPUT_CHUNK_SIZE - out->used[out->current] < size &&
+  next_chunk(out) != 0)
+    return NULL;
+  return chunk_at(out, out->current) + out->used[out->current];
+}
+
+void output_commit(OutputWriter *out, size_t size) {
+  out->used[out->current] += size;
+}
+
+int output_write(OutputWriter *out, const void *data, size_t size) {
+  const char *bytes = data;
+  while (size > 0) {
+    if (out->error)
+      return -1;
+    size_t room = OUTPUT_CHUNK_SIZE - out->used[out->current];
+    if (room == 0) {
+      if (output_reserve(out, 1) == NULL)
+        return -1;
+      room = OUTPUT_CHUNK_SIZE - out->used[out->current];
+    }
+    size_t n = size < room ? size : room;
+    memcpy(chunk_at(out, out->current) + out->used[out->current], bytes, n);
+    out->used[out->current] += n;
+    bytes += n;
+    size -= n;
+  }
+  return out->error ? -1 : 0;
+}
+
+int output_printf(OutputWriter *out, const char *format, ...) {
+  if (out->error)
+    return -1;
+
+  char *dest = chunk_at(out, out->current) + out->used[out->current];
+  size_t room = OUTPUT_CHUNK_SIZE - out->used[out->current];
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(dest, room, format, args);
+  va_end(args);
+  if (length < 0 || (size_t) length >= OUTPUT_CHUNK_SIZE)
+    return -1;
+
+  if ((size_t) length >= room) {
+    // Did not fit, format it again where there is room for it and the '\0'.
+    dest = output_reserve(out, (size_t) length + 1);
+    if (dest == NULL)
+      return -1;
+    va_start(args, format);
+    vsnprintf(dest, (size_t) length + 1, format, args);
+    va_end(args);
+  }
+  out->used[out->current] += (size_t) length;
+  return 0;
+}
+
+int output_finish(OutputWriter *out) {
+  int result = output_flush(out);
+  if (result == 0 && out->sync == OUTPUT_FSYNC_ON_CLOSE &&
+  fdatasync(out->fd) != 0)
+    result = -1;
+#ifdef OUTPUT_IO_URING
+  if (out->ring != NULL) {
+    // A failed writer may still have chunks in flight.
+    int drained = ring_drain(out) == 0;
+    ring_destroy(out->ring);
+    out->ring = NULL;
+    if (!drained) {
+      out->chunks = NULL; // The kernel may still read them, leak them.
+      return -1;
+    }
+  }
+#endif
+  free(out->chunks);
+  out->chunks = NULL;
+  return result;
+}
@@ -0,0 +1,100 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define OUTPUT_CHUNK_SIZE 65536 // Bytes per buffer chunk.
+#define OUTPUT_CHUNKS 4         // Chunks per writer, flushed in one writev.
+
+typedef enum {
+  OUTPUT_FSYNC_NEVER,     // Leave write back to the kernel.
+  OUTPUT_FSYNC_ON_CLOSE,  // fdatasync once, when the writer is finished.
+  OUTPUT_FSYNC_ON_FLUSH   // fdatasync after every flush.
+} OutputSyncPolicy;
+
+// With make IO_URING=1 (Linux), full chunks are written through an io_uring
+// while the next ones fill up, instead of by a blocking writev once every
+// chunk is full. Writers fall back to writev when the kernel refuses a ring.
+
+// Policy of job output files, e.g. make FSYNC=close.
+#ifndef OUTPUT_FSYNC_DEFAULT
+#define OUTPUT_FSYNC_DEFAULT OUTPUT_FSYNC_NEVER
+#endif
+
+/// Called before buffered output is handed to the kernel.
+/// @param arg The argument given to output_barrier.
+typedef void (*OutputBarrier)(void *arg);
+
+/// Buffered writer for one output file. Data accumulates in fixed chunks;
+/// a record that does not fit in the current chunk starts the next one, so
+/// nothing is ever moved, and full buffers are flushed with a single writev,
+/// or each chunk as soon as it is full with IO_URING.
+/// Not thread safe, each job owns its writer.
+typedef struct OutputWriter {
+  int fd;
+  OutputSyncPolicy sync;
+  char *chunks;                   // OUTPUT_CHUNKS chunks, contiguous.
+  size_t used[OUTPUT_CHUNKS];     // Bytes filled in each chunk.
+  size_t current;                 // Chunk being filled.
+  uint64_t bytes_written;         // Bytes handed to the kernel so far.
+  int error;                      // Set once a flush fails, sticky.
+  struct OutputRing *ring;        // Writes in flight, NULL without a ring.
+  OutputBarrier barrier;          // NULL for none.
+  void *barrier_arg;
+} OutputWriter;
+
+/// Initializes a writer for a file descriptor.
+/// @param out The writer.
+/// @param fd File descriptor to write to, still owned by the caller.
+/// @param sync When to fdatasync fd.
+/// @return 0 on success, 1 if the buffer could not be allocated.
+int output_init(OutputWriter *out, int fd, OutputSyncPolicy sync);
+
+/// Sets a function called before each write of buffered output, e.g. to
+/// make durable what the output reports.
+/// @param out The writer.
+/// @param barrier The function, NULL for none.
+/// @param arg Passed to it.
+void output_barrier(OutputWriter *out, OutputBarrier barrier, void *arg);
+
+/// Appends bytes, flushing whenever the buffer fills up.
+/// @param out The writer.
+/// @param data Bytes to append.
+/// @param size Number of bytes.
+/// @return 0 on success, -1 on error.
+int output_write(OutputWriter *out, const void *data, size_t size);
+
+/// Returns room for a record of up to size bytes, in the current chunk or,
+/// when it does not fit, in the next one, flushing first if every chunk is
+/// used. The record is only appended by output_commit.
+/// @param out The writer.
+/// @param size Record size, at most OUTPUT_CHUNK_SIZE.
+/// @return Where to store the record, NULL on error.
+char *output_reserve(OutputWriter *out, size_t size);
+
+/// Appends the record stored where output_reserve pointed.
+/// @param out The writer.
+/// @param size Bytes actually stored, at most the reserved size.
+void output_commit(OutputWriter *out, size_t size);
+
+/// Appends a formatted record, which must fit in OUTPUT_CHUNK_SIZE bytes.
+/// @param out The writer.
+/// @param format printf format.
+/// @return 0 on success, -1 on error.
+int output_printf(OutputWriter *out, const char *format, ...)
+__attribute__((format(printf, 2, 3)));
+
+/// Writes everything buffered so far with writev, or waits for it to be
+/// written through the ring.
+/// @param out The writer.
+/// @return 0 on success, -1 on error.
+int output_flush(OutputWriter *out);
+
+/// Flushes, syncs according to the policy and frees the buffer. The file
+/// descriptor is left open.
+/// @param out The writer.
+/// @return 0 if everything was written, -1 otherwise.
+int output_finish(OutputWriter *out);
+
+#endif // OUTPUT_H
@@ -1,9 +1,112 @@
 #include <limits.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "parser.h"
 
+/// Job file contents being parsed by the calling thread.
+typedef struct ParserInput {
+  int fd;             // Attached file descriptor, -1 if none.
+  char *data;         // Mapped file, or the streaming buffer.
+  size_t size;        // Bytes available in data.
+  size_t pos;         // Next byte to parse.
+  int mapped;         // 1 if data is an mmap of the whole file.
+} ParserInput;
+
+static _Thread_local ParserInput input = {-1, NULL, 0, 0, 0};
+
+int parser_attach(int fd) {
+  parser_detach(input.fd);
+
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void *data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+      posix_madvise(data, (size_t) st.st_size, POSIX_MADV_SEQUENTIAL);
+      input = (ParserInput){fd, data, (size_t) st.st_size, 0, 1};
+      return 0;
+    }
+  }
+
+  // Not mappable (empty file, pipe, ...), stream it through a buffer.
+  char *buffer = malloc(PARSER_BUFFER_SIZE);
+  if (buffer == NULL)
+    return 1;
+  input = (ParserInput){fd, buffer, 0, 0, 0};
+  return 0;
+}
+
+void parser_detach(int fd) {
+  if (input.fd == -1 || input.fd != fd)
+    return;
+  if (input.mapped)
+    munmap(input.data, input.size);
+  else
+    free(input.data);
+  input = (ParserInput){-1, NULL, 0, 0, 0};
+}
+
+/// Makes sure the attached input has unread bytes, refilling the streaming
+/// buffer if needed.
+/// @return 1 if bytes are available, 0 at end of file, -1 on error.
+static int input_fill() {
+  if (input.pos < input.size)
+    return 1;
+  if (input.mapped)
+    return 0;
+  ssize_t bytes_read = read(input.fd, input.data, PARSER_BUFFER_SIZE);
+  if (bytes_read <= 0)
+    return bytes_read == 0 ? 0 : -1;
+  input.size = (size_t) bytes_read;
+  input.pos = 0;
+  return 1;
+}
+
+/// Reads up to n bytes, from memory when the fd is attached, with the same
+/// return convention as read(2).
+/// @param fd File descriptor to read from.
+/// @param buf Where to store the bytes.
+/// @param n Maximum number of bytes.
+/// @return Bytes read, 0 at end of file, -1 on error.
+static ssize_t read_bytes(int fd, char *buf, size_t n) {
+  if (fd != input.fd)
+    return read(fd, buf, n);
+
+  size_t total = 0;
+  while (total < n) {
+    int status = input_fill();
+    if (status <= 0)
+      return total > 0 ? (ssize_t) total : status;
+    size_t chunk = input.size - input.pos;
+    if (chunk > n - total)
+      chunk = n - total;
+    memcpy(buf + total, input.data + input.pos, chunk);
+    input.pos += chunk;
+    total += chunk;
+  }
+  return (ssize_t) total;
+}
+
+/// Reads a single character.
+/// @param fd File descriptor to read from.
+/// @param ch Where to store the character.
+/// @return 1 on success, 0 at end of file, -1 on error.
+static ssize_t read_char(int fd, char *ch) {
+  if (fd == input.fd && input.pos < input.size) {
+    *ch = input.data[input.pos++];
+    return 1;
+  }
+  return read_bytes(fd, ch, 1);
+}
+
 /// Reads a string and indicates the position from where it was
 /// extracted, based on the KVS specification.
 /// @param fd File to read from.
@@ -16,7 +119,7 @@ static int read_string(int fd, char *buffer, size_t max) {
   int value = -1;
 
   while (i < max) {
-    bytes_read = read(fd, &ch, 1);
+    bytes_read = read_char(fd, &ch);
 
     if (bytes_read <= 0) {
       return -1;
@@ -57,7 +160,7 @@ static int read_uint(int fd, unsigned int *value, char *next) {
 
   int i = 0;
   while (1) {
-    if (read(fd, buf + i, 1) == 0) {
+    if (read_char(fd, buf + i) == 0) {
       *next = '\0';
       break;
     }
@@ -86,21 +189,181 @@ static int read_uint(int fd, unsigned int *value, char *next) {
 /// Jumps file descriptor to next line.
 /// @param fd File descriptor.
 static void cleanup(int fd) {
+  if (fd == input.fd) {
+    while (input_fill() > 0) {
+      const char *start = input.data + input.pos;
+      const char *newline = memchr(start, '\n', input.size - input.pos);
+      if (newline != NULL) {
+        input.pos += (size_t) (newline - start) + 1;
+        return;
+      }
+      input.pos = input.size;
+    }
+    return;
+  }
+
   char ch;
-  while (read(fd, &ch, 1) == 1 && ch != '\n')
+  while (read_char(fd, &ch) == 1 && ch != '\n')
     ;
 }
 
+/// Makes the next want bytes of the attached input contiguous in memory, or
+/// everything left of it. Streaming buffers are compacted and refilled, which
+/// invalidates slices handed out for earlier commands.
+/// @param want Bytes wanted, at most PARSER_BUFFER_SIZE.
+static void input_reserve(size_t want) {
+  if (input.mapped || input.size - input.pos >= want)
+    return;
+  memmove(input.data, input.data + input.pos, input.size - input.pos);
+  input.size -= input.pos;
+  input.pos = 0;
+  while (input.size < want) {
+    ssize_t bytes_read = read(input.fd, input.data + input.size,
+    PARSER_BUFFER_SIZE - input.size);
+    if (bytes_read <= 0)
+      break;
+    input.size += (size_t) bytes_read;
+  }
+}
+
+/// Finds the first string delimiter (',', ')', ']' or ' '), comparing 32 or
+/// 16 bytes at a time when AVX2 or SSE2 are available.
+/// @param data Bytes to scan.
+/// @param size Number of bytes.
+/// @return Offset of the delimiter, size if there is none.
+static size_t find_delimiter(const char *data, size_t size) {
+  size_t i = 0;
+#if defined(__AVX2__)
+  const __m256i comma = _mm256_set1_epi8(',');
+  const __m256i paren = _mm256_set1_epi8(')');
+  const __m256i bracket = _mm256_set1_epi8(']');
+  const __m256i space = _mm256_set1_epi8(' ');
+  for (; i + 32 <= size; i += 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i *) (data + i));
+    __m256i hits = _mm256_or_si256(
+    _mm256_or_si256(_mm256_cmpeq_epi8(chunk, comma),
+    _mm256_cmpeq_epi8(chunk, paren)),
+    _mm256_or_si256(_mm256_cmpeq_epi8(chunk, bracket),
+    _mm256_cmpeq_epi8(chunk, space)));
+    unsigned int mask = (unsigned int) _mm256_movemask_epi8(hits);
+    if (mask != 0)
+      return i + (size_t) __builtin_ctz(mask);
+  }
+#elif defined(__SSE2__)
+  const __m128i comma = _mm_set1_epi8(',');
+  const __m128i paren = _mm_set1_epi8(')');
+  const __m128i bracket = _mm_set1_epi8(']');
+  const __m128i space = _mm_set1_epi8(' ');
+  for (; i + 16 <= size; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *) (data + i));
+    __m128i hits = _mm_or_si128(
+    _mm_or_si128(_mm_cmpeq_epi8(chunk, comma), _mm_cmpeq_epi8(chunk, paren)),
+    _mm_or_si128(_mm_cmpeq_epi8(chunk, bracket),
+    _mm_cmpeq_epi8(chunk, space)));
+    unsigned int mask = (unsigned int) _mm_movemask_epi8(hits);
+    if (mask != 0)
+      return i + (size_t) __builtin_ctz(mask);
+  }
+#endif
+  for (; i < size; i++)
+    if (data[i] == ',' || data[i] == ')' || data[i] == ']' || data[i] == ' ')
+      return i;
+  return size;
+}
+
+/// In-memory counterpart of read_string: the string is borrowed from the
+/// attached input instead of being copied.
+/// @param slice Where to store the string.
+/// @param max Maximum string size.
+/// @return Same as read_string.
+static int scan_string(StringSlice *slice, size_t max) {
+  const char *start = input.data + input.pos;
+  size_t limit = input.size - input.pos;
+  if (limit > max)
+    limit = max;
+
+  size_t length = find_delimiter(start, limit);
+  if (length == limit) {
+    input.pos += limit;
+    return -1;
+  }
+  input.pos += length + 1;
+  slice->data = start;
+  slice->size = length;
+
+  switch (start[length]) {
+    case ',':
+      return 0;
+    case ')':
+      return 1;
+    case ']':
+      return 2;
+    default:
+      return -1;
+  }
+}
+
+/// In-memory counterpart of parse_pair.
+/// @param fd File descriptor, attached by the calling thread.
+/// @param key Where to store the key.
+/// @param value Where to store the value.
+/// @return 1 if successful, 0 otherwise.
+static int scan_pair(int fd, StringSlice *key, StringSlice *value) {
+  if (scan_string(key, MAX_STRING_SIZE) != 0) {
+    cleanup(fd);
+    return 0;
+  }
+
+  if (scan_string(value, MAX_STRING_SIZE) != 1) {
+    cleanup(fd);
+    return 0;
+  }
+  return 1;
+}
+
+void count_commands(int fd, CommandCounts *counts) {
+  *counts = (CommandCounts){0, 0, 0, 0};
+  parser_attach(fd);
+
+  char buf[8];
+  while (read_char(fd, buf) == 1) {
+    if (buf[0] == '\n')
+      continue;
+    if (buf[0] == '#') {
+      cleanup(fd);
+      continue;
+    }
+    counts->commands++;
+
+    if (buf[0] == 'S') {
+      counts->shows++;
+    } else if (buf[0] == 'B') {
+      counts->backups++;
+    } else if (buf[0] == 'W' && read_bytes(fd, buf + 1, 4) == 4 &&
+    strncmp(buf, "WAIT ", 5) == 0) {
+      unsigned int delay;
+      char next;
+      if (read_uint(fd, &delay, &next) == 0)
+        counts->wait_ms += delay;
+      if (next == '\n')
+        continue;
+    }
+    cleanup(fd);
+  }
+
+  parser_detach(fd);
+}
+
 enum Command get_next(int fd) {
   char buf[16];
-  if (read(fd, buf, 1) != 1) {
+  if (read_char(fd, buf) != 1) {
     return EOC;
   }
 
   switch (buf[0]) {
     case 'W':
-      if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "WAIT ", 5) != 0) {
-        if (read(fd, buf + 5, 1) != 1 || strncmp(buf, "WRITE ", 6) != 0) {
+      if (read_bytes(fd, buf + 1, 4) != 4 || strncmp(buf, "WAIT ", 5) != 0) {
+        if (read_char(fd, buf + 5) != 1 || strncmp(buf, "WRITE ", 6) != 0) {
           cleanup(fd);
           return CMD_INVALID;
         }
@@ -110,7 +373,7 @@ enum Command get_next(int fd) {
       return CMD_WAIT;
 
     case 'R':
-      if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "READ ", 5) != 0) {
+      if (read_bytes(fd, buf + 1, 4) != 4 || strncmp(buf, "READ ", 5) != 0) {
         cleanup(fd);
         return CMD_INVALID;
       }
@@ -118,7 +381,7 @@ enum Command get_next(int fd) {
       return CMD_READ;
 
     case 'D':
-      if (read(fd, buf + 1, 6) != 6 || strncmp(buf, "DELETE ", 7) != 0) {
+      if (read_bytes(fd, buf + 1, 6) != 6 || strncmp(buf, "DELETE ", 7) != 0) {
         cleanup(fd);
         return CMD_INVALID;
       }
@@ -126,12 +389,12 @@ enum Command get_next(int fd) {
       return CMD_DELETE;
 
     case 'S':
-      if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "SHOW", 4) != 0) {
+      if (read_bytes(fd, buf + 1, 3) != 3 || strncmp(buf, "SHOW", 4) != 0) {
         cleanup(fd);
         return CMD_INVALID;
       }
 
-      if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
+      if (read_char(fd, buf + 4) != 0 && buf[4] != '\n') {
         cleanup(fd);
         return CMD_INVALID;
       }
@@ -139,12 +402,12 @@ enum Command get_next(int fd) {
       return CMD_SHOW;
 
     case 'B':
-      if (read(fd, buf + 1, 5) != 5 || strncmp(buf, "BACKUP", 6) != 0) {
+      if (read_bytes(fd, buf + 1, 5) != 5 || strncmp(buf, "BACKUP", 6) != 0) {
         cleanup(fd);
         return CMD_INVALID;
       }
 
-      if (read(fd, buf + 6, 1) != 0 && buf[6] != '\n') {
+      if (read_char(fd, buf + 6) != 0 && buf[6] != '\n') {
         cleanup(fd);
         return CMD_INVALID;
       }
@@ -152,12 +415,12 @@ enum Command get_next(int fd) {
       return CMD_BACKUP;
 
     case 'H':
-      if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "HELP", 4) != 0) {
+      if (read_bytes(fd, buf + 1, 3) != 3 || strncmp(buf, "HELP", 4) != 0) {
         cleanup(fd);
         return CMD_INVALID;
       }
 
-      if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
+      if (read_char(fd, buf + 4) != 0 && buf[4] != '\n') {
         cleanup(fd);
         return CMD_INVALID;
       }
@@ -199,12 +462,12 @@ size_t parse_write(int fd, char keys[][MAX_STRING_SIZE],
 char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size) {
   char ch;
 
-  if (read(fd, &ch, 1) != 1 || ch != '[') {
+  if (read_char(fd, &ch) != 1 || ch != '[') {
     cleanup(fd);
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || ch != '(') {
+  if (read_char(fd, &ch) != 1 || ch != '(') {
     cleanup(fd);
     return 0;
   }
@@ -221,7 +484,7 @@ char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size) {
     strcpy(keys[num_pairs], key);
     strcpy(values[num_pairs++], value);
 
-    if (read(fd, &ch, 1) != 1 || (ch != '(' && ch != ']')) {
+    if (read_char(fd, &ch) != 1 || (ch != '(' && ch != ']')) {
       cleanup(fd);
       return 0;
     }
@@ -236,7 +499,7 @@ char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size) {
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
+  if (read_char(fd, &ch) != 1 || (ch != '\n' && ch != '\0')) {
     cleanup(fd);
     return 0;
   }
@@ -248,7 +511,7 @@ size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE],
 size_t max_keys, size_t max_string_size) {
   char ch;
 
-  if (read(fd, &ch, 1) != 1 || ch != '[') {
+  if (read_char(fd, &ch) != 1 || ch != '[') {
     cleanup(fd);
     return 0;
   }
@@ -274,7 +537,115 @@ size_t max_keys, size_t max_string_size) {
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
+  if (read_char(fd, &ch) != 1 || (ch != '\n' && ch != '\0')) {
+    cleanup(fd);
+    return 0;
+  }
+
+  return num_keys;
+}
+
+// Backing storage for slices of fds that are not attached.
+static _Thread_local char scratch_keys[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+static _Thread_local char scratch_values[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+
+size_t parse_write_slices(int fd, StringSlice *keys, StringSlice *values,
+size_t max_pairs) {
+  if (fd != input.fd) {
+    if (max_pairs > MAX_WRITE_SIZE)
+      max_pairs = MAX_WRITE_SIZE;
+    size_t num_pairs = parse_write(fd, scratch_keys, scratch_values, max_pairs,
+    MAX_STRING_SIZE);
+    for (size_t i = 0; i < num_pairs; i++) {
+      keys[i] = (StringSlice){scratch_keys[i], strlen(scratch_keys[i])};
+      values[i] = (StringSlice){scratch_values[i], strlen(scratch_values[i])};
+    }
+    return num_pairs;
+  }
+
+  input_reserve(PARSER_MAX_COMMAND);
+  char ch;
+
+  if (read_char(fd, &ch) != 1 || ch != '[') {
+    cleanup(fd);
+    return 0;
+  }
+
+  if (read_char(fd, &ch) != 1 || ch != '(') {
+    cleanup(fd);
+    return 0;
+  }
+
+  size_t num_pairs = 0;
+  while (num_pairs < max_pairs) {
+    if (scan_pair(fd, &keys[num_pairs], &values[num_pairs]) == 0) {
+      cleanup(fd);
+      return 0;
+    }
+    num_pairs++;
+
+    if (read_char(fd, &ch) != 1 || (ch != '(' && ch != ']')) {
+      cleanup(fd);
+      return 0;
+    }
+
+    if (ch == ']') {
+      break;
+    }
+  }
+
+  if (num_pairs == max_pairs) {
+    cleanup(fd);
+    return 0;
+  }
+
+  if (read_char(fd, &ch) != 1 || (ch != '\n' && ch != '\0')) {
+    cleanup(fd);
+    return 0;
+  }
+
+  return num_pairs;
+}
+
+size_t parse_read_delete_slices(int fd, StringSlice *keys, size_t max_keys) {
+  if (fd != input.fd) {
+    if (max_keys > MAX_WRITE_SIZE)
+      max_keys = MAX_WRITE_SIZE;
+    size_t num_keys = parse_read_delete(fd, scratch_keys, max_keys,
+    MAX_STRING_SIZE);
+    for (size_t i = 0; i < num_keys; i++)
+      keys[i] = (StringSlice){scratch_keys[i], strlen(scratch_keys[i])};
+    return num_keys;
+  }
+
+  input_reserve(PARSER_MAX_COMMAND);
+  char ch;
+
+  if (read_char(fd, &ch) != 1 || ch != '[') {
+    cleanup(fd);
+    return 0;
+  }
+
+  size_t num_keys = 0;
+  while (num_keys < max_keys) {
+    int output = scan_string(&keys[num_keys], MAX_STRING_SIZE);
+    if (output < 0 || output == 1) {
+      cleanup(fd);
+      return 0;
+    }
+    num_keys++;
+
+    if (output == 2) {
+      break;
+    }
+  }
+
+  if (num_keys == max_keys) {
+    cleanup(fd);
+    return 0;
+  }
+
+  if (read_char(fd, &ch) != 1 || (ch != '\n' && ch != '\0')) {
     cleanup(fd);
     return 0;
   }
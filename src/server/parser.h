@@ -5,6 +5,14 @@
 #include <string.h>
 
 #include "constants.h"
+#include "slice.h"
+
+#define PARSER_BUFFER_SIZE 65536 // Read size when a file cannot be mapped.
+// Longest valid WRITE argument list, "[(key,value)...]\n".
+#define PARSER_MAX_COMMAND (MAX_WRITE_SIZE * (2 * MAX_STRING_SIZE + 3) + 3)
+
+_Static_assert(PARSER_MAX_COMMAND <= PARSER_BUFFER_SIZE,
+"A whole command must fit in the streaming buffer");
 
 enum Command {
   CMD_WRITE,
@@ -19,6 +27,33 @@ enum Command {
   EOC  // End of commands
 };
 
+/// Makes the calling thread parse fd from memory: regular files are mapped
+/// whole, anything else is read in PARSER_BUFFER_SIZE chunks. A thread has at
+/// most one attached fd, attaching another one detaches the previous.
+/// Unattached fds are still parsed, one read() per byte.
+/// @param fd File descriptor of input, positioned at its start.
+/// @return 0 on success, 1 otherwise.
+int parser_attach(int fd);
+
+/// Releases the memory parser_attach set up for fd, if any. Must be called
+/// by the thread that attached it, before fd is closed.
+/// @param fd File descriptor of input.
+void parser_detach(int fd);
+
+/// Commands of a job file, counted without parsing their arguments.
+typedef struct CommandCounts {
+  size_t commands;        // Lines that are neither empty nor comments.
+  size_t shows;
+  size_t backups;
+  unsigned long wait_ms;  // Sum of the WAIT delays.
+} CommandCounts;
+
+/// Quickly scans a job file, one memchr per line, to estimate its cost.
+/// Attaches fd for the duration of the scan.
+/// @param fd File descriptor of input, positioned at its start.
+/// @param counts Where to store the counts.
+void count_commands(int fd, CommandCounts *counts);
+
 /// Parses input from the given file descriptor, according to
 /// KVS specification.
 /// @param fd File descriptor of input.
@@ -46,6 +81,27 @@ char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size);
 size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
 size_t max_string_size);
 
+/// Parses a WRITE command like parse_write, without copying: the slices
+/// point into the attached input and stay valid until the next parse call
+/// on fd. Fds that are not attached are parsed into per-thread storage.
+/// @param fd File descriptor to read from.
+/// @param keys Array to store the keys.
+/// @param values Array to store the values.
+/// @param max_pairs Maximum number of pairs it will write.
+/// @return 0 if the command was not parsed successfully, otherwise the
+///         number of pairs parsed.
+size_t parse_write_slices(int fd, StringSlice *keys, StringSlice *values,
+size_t max_pairs);
+
+/// Parses a READ or a DELETE command like parse_read_delete, without
+/// copying. Slices follow the rules of parse_write_slices.
+/// @param fd File descriptor to read from.
+/// @param keys Array to store the keys.
+/// @param max_keys Maximum number of keys it will write.
+/// @return 0 if the command was not parsed successfully, otherwise the
+///         number of keys parsed.
+size_t parse_read_delete_slices(int fd, StringSlice *keys, size_t max_keys);
+
 /// Parses a WAIT command.
 /// @param fd File descriptor to read from.
 /// @param delay Pointer to the variable to store the wait delay in.
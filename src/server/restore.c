@@ -0,0 +1,639 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "restore.h"
+#include "snapshot.h"
+
+/// A snapshot file found while looking for the newest one.
+typedef struct SnapshotCandidate {
+  char *path;
+  struct timespec mtime;
+  SnapshotSet set;
+  int valid;            // The file is a valid backup, set is open.
+  int used;             // The set was moved into the restored chain.
+} SnapshotCandidate;
+
+typedef struct CandidateList {
+  SnapshotCandidate *items;
+  size_t count;
+  size_t capacity;
+} CandidateList;
+
+// Most loader threads, each one taking a share of the full snapshot's
+// blocks, and least blocks for each.
+#define RESTORE_MAX_LOADERS 8
+#define RESTORE_LOADER_MIN_BLOCKS 16
+
+/// Blocks of the full snapshot loaded by one loader thread, numbered across
+/// its segments.
+typedef struct LoaderRange {
+  size_t first;
+  size_t end;
+  pthread_t thread;
+} LoaderRange;
+
+/// State of the restore in progress, there is at most one per process.
+static struct {
+  HashTable *ht;
+  SnapshotSet *chain;                          // Full snapshot, then deltas.
+  size_t chain_length;
+  uint64_t record_count;                       // Records of the whole chain,
+                                               // overwritten ones included.
+  size_t block_size;                           // Largest of the chain.
+  int continuable;                             // See restore_chain_position.
+  uint64_t chain_id;
+  uint32_t sequence;                           // Of the newest backup.
+  _Atomic unsigned char pending[LOCK_STRIPES]; // 1 until materialized.
+  atomic_size_t remaining;                     // Stripes still pending.
+  atomic_size_t on_demand;                     // Stripes loaded by requests.
+  atomic_int active;
+  atomic_int stop;
+  atomic_int refs;                             // Users of the chain.
+  atomic_size_t loaders_left;                  // Still walking their range.
+  LoaderRange loaders[RESTORE_MAX_LOADERS];
+  atomic_size_t num_loaders;                   // Started, not joined yet.
+  atomic_int awaiting_request;                 // 1 until the first one.
+  struct timespec start;
+} restore;
+
+/// Milliseconds since the restore started.
+/// @return Elapsed milliseconds.
+static double restore_elapsed_ms() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double) (now.tv_sec - restore.start.tv_sec) * 1e3 +
+  (double) (now.tv_nsec - restore.start.tv_nsec) / 1e6;
+}
+
+/// Adds every *.bck file of a directory tree to a list.
+/// @param list The list.
+/// @param dir_path Directory to search.
+static void find_snapshots(CandidateList *list, const char *dir_path) {
+  DIR *dir = opendir(dir_path);
+  if (dir == NULL)
+    return;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+      continue;
+    char path[PATH_MAX];
+    if ((size_t) snprintf(path, sizeof(path), "%s/%s", dir_path,
+    entry->d_name) >= sizeof(path))
+      continue;
+    struct stat st;
+    if (stat(path, &st) != 0)
+      continue;
+    if (S_ISDIR(st.st_mode)) {
+      find_snapshots(list, path);
+      continue;
+    }
+    size_t length = strlen(entry->d_name);
+    if (!S_ISREG(st.st_mode) || length < 4 ||
+    strcmp(entry->d_name + length - 4, ".bck") != 0)
+      continue;
+
+    if (list->count == list->capacity) {
+      size_t capacity = list->capacity ? list->capacity * 2 : 16;
+      SnapshotCandidate *items = realloc(list->items,
+      capacity * sizeof(SnapshotCandidate));
+      if (items == NULL)
+        break;
+      list->items = items;
+      list->capacity = capacity;
+    }
+    char *copy = strdup(path);
+    if (copy == NULL)
+      break;
+    list->items[list->count++] = (SnapshotCandidate){copy, st.st_mtim, {0},
+    0, 0};
+  }
+  closedir(dir);
+}
+
+/// Orders candidates newest first.
+static int compare_candidates(const void *a, const void *b) {
+  const struct timespec *ta = &((const SnapshotCandidate *) a)->mtime;
+  const struct timespec *tb = &((const SnapshotCandidate *) b)->mtime;
+  if (ta->tv_sec != tb->tv_sec)
+    return ta->tv_sec < tb->tv_sec ? 1 : -1;
+  if (ta->tv_nsec != tb->tv_nsec)
+    return ta->tv_nsec < tb->tv_nsec ? 1 : -1;
+  return 0;
+}
+
+/// Records being materialized.
+typedef struct StripeLoad {
+  HashTable *ht;
+  size_t first;     // Only records of stripes in [first, last].
+  size_t last;
+  int pending_only; // And only of stripes still pending.
+} StripeLoad;
+
+/// Applies a snapshot record to the table.
+/// @param key The key.
+/// @param value The value, NULL data for a key deleted by a delta.
+/// @param arg The StripeLoad.
+/// @return 0, to keep walking.
+static int load_pair(StringSlice key, StringSlice value, void *arg) {
+  StripeLoad *load = arg;
+  if (load->first > 0 || load->last < SIZE_MAX) {
+    size_t stripe = stripe_index(hash(load->ht, key));
+    if (stripe < load->first || stripe > load->last || (load->pending_only &&
+    !atomic_load_explicit(&restore.pending[stripe], memory_order_relaxed)))
+      return 0;
+  }
+  if (value.data == NULL)
+    delete_pair(load->ht, key, 0);
+  else
+    write_pair(load->ht, key, value, 0);
+  return 0;
+}
+
+/// Reads a block into the table, reporting corruption.
+/// @param link Position of the snapshot in the chain.
+/// @param segment Segment of the snapshot holding the block.
+/// @param index Block number within the segment.
+/// @param buffer Scratch of block_size bytes.
+/// @param load Which records to apply.
+static void load_block(size_t link, size_t segment, size_t index,
+uint8_t *buffer, StripeLoad *load) {
+  if (snapshot_read_block(&restore.chain[link].segments[segment], index,
+  buffer, load_pair, load) != 0)
+    fprintf(stderr, "Snapshot block %zu of segment %zu of backup %zu of the "
+    "chain is corrupt, some of its pairs were not restored.\n", index, segment,
+    link);
+}
+
+/// Applies the records of a range of stripes from one snapshot of the chain,
+/// decoding only the blocks whose stripe range overlaps it.
+/// @param link Position of the snapshot in the chain.
+/// @param buffer Scratch of block_size bytes.
+/// @param load The range, its stripes write locked by the caller.
+static void load_range(size_t link, uint8_t *buffer, StripeLoad *load) {
+  const SnapshotSet *set = &restore.chain[link];
+  for (size_t segment = snapshot_set_segment(set, load->first);
+  segment < set->num_segments && set->first_stripes[segment] <= load->last;
+  segment++) {
+    const SnapshotReader *reader = &set->segments[segment];
+
+    // Blocks are sorted by stripe, find the first one that can hold it.
+    size_t low = 0;
+    size_t high = reader->num_blocks;
+    while (low < high) {
+      size_t middle = low + (high - low) / 2;
+      SnapshotBlockInfo block;
+      snapshot_block_info(reader, middle, &block);
+      if (block.last_stripe < load->first)
+        low = middle + 1;
+      else
+        high = middle;
+    }
+
+    for (size_t i = low; i < reader->num_blocks; i++) {
+      SnapshotBlockInfo block;
+      snapshot_block_info(reader, i, &block);
+      if (block.first_stripe > load->last)
+        break;
+      load_block(link, segment, i, buffer, load);
+    }
+  }
+}
+
+/// Materializes a stripe from the full snapshot, then from each delta.
+/// @param stripe The stripe, write locked by the caller.
+static void load_stripe(size_t stripe) {
+  uint8_t *buffer = malloc(restore.block_size);
+  if (buffer == NULL) {
+    fprintf(stderr, "Failed to restore stripe %zu.\n", stripe);
+    return;
+  }
+  StripeLoad load = {restore.ht, stripe, stripe, 0};
+  for (size_t link = 0; link < restore.chain_length; link++)
+    load_range(link, buffer, &load);
+  free(buffer);
+}
+
+/// Unmaps the chain.
+static void close_chain() {
+  for (size_t i = 0; i < restore.chain_length; i++)
+    snapshot_set_close(&restore.chain[i]);
+  free(restore.chain);
+  restore.chain = NULL;
+}
+
+/// Drops a reference to the chain, unmapping it after the last one. The
+/// pending stripes hold one, and each loader thread another until it exits,
+/// since it may still be decoding a block whose stripes requests loaded.
+static void release_chain() {
+  if (atomic_fetch_sub(&restore.refs, 1) == 1)
+    close_chain();
+}
+
+/// Reports how long the first request after a restore waited for the server,
+/// from its start, whether stripes were still loading or not.
+static void request_started() {
+  if (atomic_load_explicit(&restore.awaiting_request, memory_order_relaxed) &&
+  atomic_exchange(&restore.awaiting_request, 0))
+    printf("First request started after %.3f ms.\n", restore_elapsed_ms());
+}
+
+/// Ends the restore once every stripe is loaded.
+static void finish_restore() {
+  printf("Restored %lu records in %zu backup%s, fully loaded after %.3f ms "
+  "(%zu of %d stripes loaded on demand).\n",
+  (unsigned long) restore.record_count, restore.chain_length,
+  restore.chain_length > 1 ? "s" : "", restore_elapsed_ms(),
+  atomic_load(&restore.on_demand), LOCK_STRIPES);
+  if (atomic_exchange(&restore.active, 0))
+    release_chain();
+}
+
+/// Counts stripes that were just materialized.
+/// @param count Number of stripes.
+/// @param on_demand Whether a request was waiting for them.
+static void stripes_loaded(size_t count, int on_demand) {
+  if (count == 0)
+    return;
+  if (on_demand)
+    atomic_fetch_add(&restore.on_demand, count);
+  if (atomic_fetch_sub(&restore.remaining, count) == count)
+    finish_restore();
+}
+
+/// Materializes a stripe if it is still pending.
+/// @param stripe The stripe, not locked by the caller.
+/// @param on_demand Whether a request is waiting for it.
+static void materialize(size_t stripe, int on_demand) {
+  if (atomic_load_explicit(&restore.pending[stripe], memory_order_acquire) == 0)
+    return;
+
+  pthread_rwlock_t *lock = &restore.ht->stripes[stripe].lock;
+  pthread_rwlock_wrlock(lock);
+  size_t loaded = 0;
+  if (atomic_load_explicit(&restore.pending[stripe], memory_order_relaxed)) {
+    load_stripe(stripe);
+    atomic_store_explicit(&restore.pending[stripe], 0, memory_order_release);
+    loaded = 1;
+  }
+  pthread_rwlock_unlock(lock);
+  stripes_loaded(loaded, on_demand);
+}
+
+/// Block of the full snapshot, numbered across its segments.
+/// @param number The block number.
+/// @param segment Where to store the segment holding it.
+/// @param index Where to store its number within the segment.
+static void locate_block(size_t number, size_t *segment, size_t *index) {
+  const SnapshotSet *base = &restore.chain[0];
+  *segment = 0;
+  while (*segment + 1 < base->num_segments &&
+  number >= base->segments[*segment].num_blocks) {
+    number -= base->segments[*segment].num_blocks;
+    (*segment)++;
+  }
+  *index = number;
+}
+
+/// Loader thread. Walks its range of blocks of the full snapshot in order,
+/// decoding each one once under the write locks of its stripe range and
+/// inserting the records of stripes no request has materialized yet. A stripe
+/// is complete once the next block starts past it, then the deltas are
+/// applied to it. A stripe whose first records are in the previous range is
+/// left to the final sweep, as is one continued in the next range. A request
+/// may still load a partially inserted stripe itself, rewriting the same
+/// pairs.
+/// @param arg The LoaderRange.
+/// @return NULL.
+static void *loader_thread(void *arg) {
+  const LoaderRange *range = arg;
+  uint8_t *buffer = malloc(restore.block_size);
+  size_t segment = 0;
+  size_t i = 0;
+  locate_block(range->first, &segment, &i);
+  const SnapshotReader *reader = &restore.chain[0].segments[segment];
+
+  // A stripe started by the previous range is not complete here.
+  size_t foreign = SIZE_MAX;
+  if (i > 0 && i < reader->num_blocks) {
+    SnapshotBlockInfo block, previous;
+    snapshot_block_info(reader, i, &block);
+    snapshot_block_info(reader, i - 1, &previous);
+    if (previous.last_stripe >= block.first_stripe)
+      foreign = block.first_stripe;
+  }
+
+  for (size_t number = range->first; buffer != NULL && number < range->end &&
+  !atomic_load(&restore.stop); number++, i++) {
+    while (i == reader->num_blocks) {
+      reader = &restore.chain[0].segments[++segment];
+      i = 0;
+    }
+    SnapshotBlockInfo block;
+    snapshot_block_info(reader, i, &block);
+    if (block.first_stripe > block.last_stripe ||
+    block.last_stripe >= LOCK_STRIPES)
+      continue;
+    size_t first = block.first_stripe;
+    size_t end = (size_t) block.last_stripe + 1; // Stripes complete after it.
+    if (i + 1 < reader->num_blocks) {
+      SnapshotBlockInfo next;
+      snapshot_block_info(reader, i + 1, &next);
+      if (next.first_stripe <= block.last_stripe)
+        end--;
+    }
+    size_t complete = first == foreign ? first + 1 : first;
+
+    for (size_t s = first; s <= block.last_stripe; s++)
+      pthread_rwlock_wrlock(&restore.ht->stripes[s].lock);
+    StripeLoad load = {restore.ht, first, block.last_stripe, 1};
+    load_block(0, segment, i, buffer, &load);
+    if (end > complete) {
+      StripeLoad changes = {restore.ht, complete, end - 1, 1};
+      for (size_t link = 1; link < restore.chain_length; link++)
+        load_range(link, buffer, &changes);
+    }
+    size_t loaded = 0;
+    for (size_t s = complete; s < end; s++) {
+      if (atomic_load_explicit(&restore.pending[s], memory_order_relaxed)) {
+        atomic_store_explicit(&restore.pending[s], 0, memory_order_release);
+        loaded++;
+      }
+    }
+    for (size_t s = first; s <= block.last_stripe; s++)
+      pthread_rwlock_unlock(&restore.ht->stripes[s].lock);
+    stripes_loaded(loaded, 0);
+  }
+  free(buffer);
+
+  // The last loader out sweeps stripes without records, split across ranges
+  // or left over by a failed allocation.
+  if (atomic_fetch_sub(&restore.loaders_left, 1) == 1)
+    for (size_t s = 0; s < LOCK_STRIPES && !atomic_load(&restore.stop); s++)
+      materialize(s, 0);
+  release_chain();
+  return NULL;
+}
+
+/// Splits the full snapshot's blocks across loader threads and starts them.
+static void start_loaders() {
+  const SnapshotSet *base = &restore.chain[0];
+  size_t num_blocks = 0;
+  for (size_t i = 0; i < base->num_segments; i++)
+    num_blocks += base->segments[i].num_blocks;
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t count = num_blocks / RESTORE_LOADER_MIN_BLOCKS;
+  if (cores > 0 && count > (size_t) cores)
+    count = (size_t) cores;
+  if (count > RESTORE_MAX_LOADERS)
+    count = RESTORE_MAX_LOADERS;
+  if (count == 0)
+    count = 1;
+
+  atomic_store(&restore.loaders_left, count);
+  atomic_fetch_add(&restore.refs, (int) count);
+  size_t started = 0;
+  for (size_t i = 0; i < count; i++) {
+    LoaderRange *range = &restore.loaders[started];
+    range->first = num_blocks * i / count;
+    range->end = num_blocks * (i + 1) / count;
+    if (pthread_create(&range->thread, NULL, loader_thread, range) != 0) {
+      // The others still load its blocks' stripes through the final sweep.
+      fprintf(stderr, "Failed to start a restore loader thread.\n");
+      atomic_fetch_sub(&restore.loaders_left, 1);
+      release_chain();
+      continue;
+    }
+    started++;
+  }
+  atomic_store(&restore.num_loaders, started);
+}
+
+/// Applies the whole chain, for snapshots whose stripes do not match the
+/// table's.
+static void load_all() {
+  uint8_t *buffer = malloc(restore.block_size);
+  if (buffer == NULL) {
+    fprintf(stderr, "Failed to restore the snapshot.\n");
+    return;
+  }
+  StripeLoad load = {restore.ht, 0, SIZE_MAX, 0};
+  for (size_t link = 0; link < restore.chain_length; link++)
+    load_range(link, buffer, &load);
+  free(buffer);
+}
+
+/// Whether a snapshot can precede another one in a chain.
+/// @param earlier The candidate predecessor.
+/// @param later The snapshot.
+/// @param sequence Position the predecessor must have.
+/// @return 1 if it can, 0 otherwise.
+static int chain_link(const SnapshotInfo *earlier, const SnapshotInfo *later,
+uint32_t sequence) {
+  return earlier->chain_id == later->chain_id &&
+  earlier->sequence == sequence &&
+  (earlier->flags & SNAPSHOT_FLAG_DELTA) == (sequence > 0 ?
+  SNAPSHOT_FLAG_DELTA : 0) &&
+  earlier->stripe_count == later->stripe_count &&
+  earlier->seed[0] == later->seed[0] && earlier->seed[1] == later->seed[1];
+}
+
+/// Collects the chain ending at a candidate, moving the readers of its
+/// snapshots into restore.chain.
+/// @param list The candidates, newest first.
+/// @param tail The candidate to restore.
+/// @return 0 on success, 1 if some snapshot of the chain is missing.
+static int assemble_chain(CandidateList *list, size_t tail) {
+  const SnapshotInfo *info = &list->items[tail].set.info;
+  int delta = (info->flags & SNAPSHOT_FLAG_DELTA) != 0;
+  if (delta != (info->sequence > 0))
+    return 1;
+  size_t length = (size_t) info->sequence + 1;
+  size_t *links = malloc(length * sizeof(size_t));
+  if (links == NULL)
+    return 1;
+
+  links[length - 1] = tail;
+  for (size_t position = length - 1; position-- > 0; ) {
+    links[position] = list->count;
+    for (size_t i = 0; i < list->count; i++) {
+      if (list->items[i].valid && chain_link(&list->items[i].set.info, info,
+      (uint32_t) position)) {
+        links[position] = i;
+        break;
+      }
+    }
+    if (links[position] == list->count) {
+      free(links);
+      return 1;
+    }
+  }
+
+  restore.chain = malloc(length * sizeof(SnapshotSet));
+  if (restore.chain == NULL) {
+    free(links);
+    return 1;
+  }
+  restore.chain_length = length;
+  restore.record_count = 0;
+  restore.block_size = 0;
+  for (size_t i = 0; i < length; i++) {
+    SnapshotCandidate *candidate = &list->items[links[i]];
+    restore.chain[i] = candidate->set;
+    candidate->used = 1;
+    restore.record_count += candidate->set.record_count;
+    if (candidate->set.block_size > restore.block_size)
+      restore.block_size = candidate->set.block_size;
+  }
+  free(links);
+  return 0;
+}
+
+/// Latest backup of the chain of a candidate. Backups are written in the
+/// background, so a later delta may have an older modification time.
+/// @param list The candidates.
+/// @param index The candidate.
+/// @return The valid candidate of the same chain with the highest sequence.
+static size_t newest_of_chain(const CandidateList *list, size_t index) {
+  size_t newest = index;
+  for (size_t i = 0; i < list->count; i++) {
+    const SnapshotInfo *info = &list->items[i].set.info;
+    const SnapshotInfo *best = &list->items[newest].set.info;
+    if (list->items[i].valid && info->chain_id == best->chain_id &&
+    info->sequence > best->sequence)
+      newest = i;
+  }
+  return newest;
+}
+
+int restore_latest(HashTable *ht, const char *dir, uint64_t min_lsn,
+uint64_t *wal_lsn) {
+  clock_gettime(CLOCK_MONOTONIC, &restore.start);
+  *wal_lsn = 0;
+
+  CandidateList list = {NULL, 0, 0};
+  find_snapshots(&list, dir);
+  if (list.count > 1)
+    qsort(list.items, list.count, sizeof(SnapshotCandidate),
+    compare_candidates);
+
+  for (size_t i = 0; i < list.count; i++) {
+    list.items[i].valid = snapshot_set_open(&list.items[i].set,
+    list.items[i].path) == 0;
+    if (!list.items[i].valid)
+      fprintf(stderr, "Skipping %s, not a valid snapshot or missing some of "
+      "its segments.\n", list.items[i].path);
+  }
+
+  // Newest chain first, from its latest backup that can be assembled.
+  const char *path = NULL;
+  size_t next = 0;
+  while (next < list.count && path == NULL) {
+    if (!list.items[next].valid) {
+      next++;
+      continue;
+    }
+    size_t tail = newest_of_chain(&list, next);
+    if (list.items[tail].set.info.wal_lsn < min_lsn) {
+      fprintf(stderr, "Skipping %s, the write-ahead log no longer holds the "
+      "updates after it.\n", list.items[tail].path);
+      list.items[tail].valid = 0;
+      snapshot_set_close(&list.items[tail].set);
+    } else if (assemble_chain(&list, tail) == 0) {
+      path = list.items[tail].path;
+    } else {
+      fprintf(stderr, "Skipping %s, its backup chain is incomplete.\n",
+      list.items[tail].path);
+      list.items[tail].valid = 0;
+      snapshot_set_close(&list.items[tail].set);
+    }
+  }
+
+  int result = 1;
+  if (path != NULL) {
+    const SnapshotInfo *tail = &restore.chain[restore.chain_length - 1].info;
+    restore.ht = ht;
+    *wal_lsn = tail->wal_lsn;
+    result = 0;
+    atomic_store(&restore.awaiting_request, 1);
+    if (tail->stripe_count != LOCK_STRIPES) {
+      load_all();
+      printf("Restored %s, %lu records in %zu backup%s, in %.3f ms.\n", path,
+      (unsigned long) restore.record_count, restore.chain_length,
+      restore.chain_length > 1 ? "s" : "", restore_elapsed_ms());
+      close_chain();
+    } else {
+      // Same seed and stripe count, so each stripe maps to its own blocks.
+      memcpy(ht->seed, tail->seed, sizeof(ht->seed));
+      restore.continuable = 1;
+      restore.chain_id = tail->chain_id;
+      restore.sequence = tail->sequence;
+      for (size_t i = 0; i < LOCK_STRIPES; i++)
+        atomic_store(&restore.pending[i], 1);
+      atomic_store(&restore.remaining, LOCK_STRIPES);
+      atomic_store(&restore.refs, 1);
+      atomic_store(&restore.active, 1);
+      printf("Restoring %s, %lu records in %zu backup%s, ready for requests "
+      "after %.3f ms.\n", path, (unsigned long) restore.record_count,
+      restore.chain_length, restore.chain_length > 1 ? "s" : "",
+      restore_elapsed_ms());
+      start_loaders();
+    }
+  }
+
+  for (size_t i = 0; i < list.count; i++) {
+    if (list.items[i].valid && !list.items[i].used)
+      snapshot_set_close(&list.items[i].set);
+    free(list.items[i].path);
+  }
+  free(list.items);
+  return result;
+}
+
+int restore_chain_position(uint64_t *chain_id, uint32_t *sequence) {
+  if (!restore.continuable)
+    return 1;
+  *chain_id = restore.chain_id;
+  *sequence = restore.sequence;
+  return 0;
+}
+
+int restore_pending() {
+  return atomic_load_explicit(&restore.active, memory_order_acquire);
+}
+
+void restore_stripe(size_t stripe) {
+  if (restore_pending())
+    materialize(stripe, 1);
+  request_started();
+}
+
+/// Waits for every loader thread to exit.
+static void join_loaders() {
+  size_t count = atomic_exchange(&restore.num_loaders, 0);
+  for (size_t i = 0; i < count; i++)
+    pthread_join(restore.loaders[i].thread, NULL);
+}
+
+void restore_wait() {
+  if (restore_pending())
+    for (size_t i = 0; i < LOCK_STRIPES; i++)
+      materialize(i, 1);
+  join_loaders();
+  request_started();
+}
+
+void restore_stop() {
+  atomic_store(&restore.stop, 1);
+  join_loaders();
+  if (atomic_exchange(&restore.active, 0))
+    release_chain();
+}
@@ -0,0 +1,56 @@
+#ifndef RESTORE_H
+#define RESTORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "kvs.h"
+
+// Warm restart from a snapshot (see snapshot.h), or from a chain of a full
+// snapshot and its deltas, applied in order. The snapshot is mapped and
+// its index read, which takes the same time whatever its size, then the
+// server starts serving requests right away. Each stripe is materialized
+// into the table the first time a request touches it, and background loader
+// threads, one per core for large snapshots, fill in the rest. A backup
+// split into segments is opened through its manifest. Snapshots written by a
+// build with another stripe count are loaded eagerly instead.
+//
+// Every operation must call restore_stripe for each stripe it is about to
+// touch, or restore_wait before touching all of them, while holding no
+// stripe lock.
+
+/// Restores the newest valid snapshot (*.bck file) of a directory whose
+/// chain is complete. Must be called on an empty table, before any request
+/// is served.
+/// @param ht The table, its hash seed is replaced by the snapshot's.
+/// @param dir Directory to search.
+/// @param min_lsn Oldest WAL LSN a snapshot may have, see wal_base_lsn.
+/// @param wal_lsn Where to store the snapshot's WAL LSN, 0 without one.
+/// @return 0 if a snapshot is being restored, 1 if there was none to use.
+int restore_latest(HashTable *ht, const char *dir, uint64_t min_lsn,
+uint64_t *wal_lsn);
+
+/// Position of the restored chain, so that later backups can extend it.
+/// @param chain_id Where to store the chain id.
+/// @param sequence Where to store the sequence of its newest backup.
+/// @return 0 on success, 1 if nothing was restored or the table cannot
+/// extend the chain (its stripes differ).
+int restore_chain_position(uint64_t *chain_id, uint32_t *sequence);
+
+/// Whether some stripes are still waiting to be materialized.
+/// @return 1 while a restore is in progress, 0 otherwise.
+int restore_pending();
+
+/// Materializes a stripe if it has not been yet. The first call after a
+/// restore prints when the first request started.
+/// @param stripe Index of the stripe, not locked by the caller.
+void restore_stripe(size_t stripe);
+
+/// Materializes every stripe and waits for the loader threads to exit.
+void restore_wait();
+
+/// Stops the loader threads and unmaps the snapshot, even if stripes are
+/// still missing. Called when the table is destroyed.
+void restore_stop();
+
+#endif // RESTORE_H
@@ -0,0 +1,29 @@
+#ifndef SLICE_H
+#define SLICE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// Borrowed, not NUL terminated string, e.g. a key inside a mapped job file.
+typedef struct StringSlice {
+  const char *data;
+  size_t size;
+} StringSlice;
+
+/// Slice of a string literal.
+#define STRING_SLICE(literal) ((StringSlice){(literal), sizeof(literal) - 1})
+
+/// FNV-1a hash, for the small indexes of sessions and subscriptions. The
+/// table itself uses a keyed hash, see hash in kvs.h.
+/// @param slice The string.
+/// @return The hash.
+static inline uint64_t slice_hash(StringSlice slice) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < slice.size; i++) {
+    hash ^= (unsigned char) slice.data[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+#endif // SLICE_H
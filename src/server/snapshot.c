@@ -0,0 +1,524 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bytes.h"
+#include "crc32c.h"
+#include "lz.h"
+#include "snapshot.h"
+
+static const char header_magic[8] = "KVSSNAP";
+static const char footer_magic[8] = "KVSSEND";
+static const char manifest_magic[8] = "KVSMANI";
+
+/// Bytes taken by a varint.
+/// @param value The value.
+/// @return Encoded size.
+static size_t varint_size(size_t value) {
+  size_t size = 1;
+  while (value >= 0x80) {
+    value >>= 7;
+    size++;
+  }
+  return size;
+}
+
+/// Encodes a varint (LEB128).
+/// @param p Where to store it.
+/// @param value The value.
+/// @return Position after it.
+static uint8_t *put_varint(uint8_t *p, size_t value) {
+  while (value >= 0x80) {
+    *p++ = (uint8_t) (value | 0x80);
+    value >>= 7;
+  }
+  *p++ = (uint8_t) value;
+  return p;
+}
+
+/// Decodes a varint of at most 32 bits.
+/// @param p Position, advanced past the varint.
+/// @param end End of the input.
+/// @param value Where to store the value.
+/// @return 0 on success, 1 if it is truncated or too long.
+static int get_varint(const uint8_t **p, const uint8_t *end, size_t *value) {
+  *value = 0;
+  for (unsigned int shift = 0; shift < 35; shift += 7) {
+    if (*p == end)
+      return 1;
+    uint8_t byte = *(*p)++;
+    *value |= (size_t) (byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0)
+      return 0;
+  }
+  return 1;
+}
+
+int snapshot_writer_open(SnapshotWriter *writer, int fd,
+const SnapshotInfo *info) {
+  memset(writer, 0, sizeof(*writer));
+  writer->info = *info;
+  writer->info.version = SNAPSHOT_VERSION;
+  writer->info.block_size = SNAPSHOT_BLOCK_SIZE;
+  int compress = (info->flags & SNAPSHOT_FLAG_COMPRESSED) != 0;
+  if (output_init(&writer->out, fd, OUTPUT_FSYNC_DEFAULT) != 0)
+    return 1;
+  writer->block = malloc(SNAPSHOT_BLOCK_SIZE);
+  if (compress)
+    writer->compressed = malloc(lz_bound(SNAPSHOT_BLOCK_SIZE));
+  if (writer->block == NULL || (compress && writer->compressed == NULL)) {
+    free(writer->block);
+    free(writer->compressed);
+    output_finish(&writer->out);
+    return 1;
+  }
+
+  uint8_t header[SNAPSHOT_HEADER_SIZE];
+  memcpy(header, header_magic, 8);
+  put_le32(header + 8, writer->info.version);
+  put_le32(header + 12, writer->info.flags);
+  put_le32(header + 16, writer->info.block_size);
+  put_le32(header + 20, writer->info.stripe_count);
+  put_le64(header + 24, writer->info.seed[0]);
+  put_le64(header + 32, writer->info.seed[1]);
+  put_le64(header + 40, writer->info.wal_lsn);
+  put_le64(header + 48, writer->info.chain_id);
+  put_le32(header + 56, writer->info.sequence);
+  put_le32(header + 60, writer->info.partition);
+  put_le32(header + 64, writer->info.partitions);
+  writer->header_crc = crc32c(header, 68);
+  put_le32(header + 68, writer->header_crc);
+  if (output_write(&writer->out, header, sizeof(header)) != 0)
+    writer->error = 1;
+  writer->offset = SNAPSHOT_HEADER_SIZE;
+  return 0;
+}
+
+/// Compresses, checksums and writes the block being built.
+/// @param writer The writer.
+/// @return 0 on success, 1 otherwise.
+static int flush_block(SnapshotWriter *writer) {
+  if (writer->block_records == 0)
+    return writer->error;
+
+  const uint8_t *payload = writer->block;
+  size_t stored_size = writer->block_used;
+  SnapshotCodec codec = SNAPSHOT_CODEC_NONE;
+  if (writer->compressed != NULL) {
+    size_t compressed_size = lz_compress(writer->block, writer->block_used,
+    writer->compressed, lz_bound(SNAPSHOT_BLOCK_SIZE));
+    if (compressed_size > 0) {
+      payload = writer->compressed;
+      stored_size = compressed_size;
+      codec = SNAPSHOT_CODEC_LZ;
+    }
+  }
+
+  uint8_t header[SNAPSHOT_BLOCK_HEADER_SIZE];
+  put_le32(header, (uint32_t) writer->block_used);
+  put_le32(header + 4, (uint32_t) stored_size);
+  put_le32(header + 8, writer->block_records);
+  put_le32(header + 12, (uint32_t) codec);
+  put_le32(header + 16, crc32c_update(crc32c(header, 16), payload, stored_size));
+
+  if (writer->num_blocks == writer->index_capacity) {
+    size_t capacity = writer->index_capacity ? writer->index_capacity * 2 : 64;
+    SnapshotBlockInfo *index = realloc(writer->index,
+    capacity * sizeof(SnapshotBlockInfo));
+    if (index == NULL) {
+      writer->error = 1;
+      return 1;
+    }
+    writer->index = index;
+    writer->index_capacity = capacity;
+  }
+  writer->index[writer->num_blocks++] = (SnapshotBlockInfo){writer->offset,
+  (uint32_t) stored_size, writer->block_records, writer->block_first_stripe,
+  writer->block_last_stripe};
+
+  if (output_write(&writer->out, header, sizeof(header)) != 0 ||
+  output_write(&writer->out, payload, stored_size) != 0)
+    writer->error = 1;
+  writer->offset += SNAPSHOT_BLOCK_HEADER_SIZE + stored_size;
+  writer->block_used = 0;
+  writer->block_records = 0;
+  return writer->error;
+}
+
+/// Appends a record, a deletion when value.data is NULL.
+/// @param writer The writer.
+/// @param stripe Stripe owning the key.
+/// @param key The key.
+/// @param value The value.
+/// @return 0 on success, 1 otherwise.
+static int append_record(SnapshotWriter *writer, uint32_t stripe,
+StringSlice key, StringSlice value) {
+  // Deltas shift value sizes by one to make room for deletions.
+  size_t value_field = value.size;
+  if (writer->info.flags & SNAPSHOT_FLAG_DELTA)
+    value_field = value.data == NULL ? 0 : value.size + 1;
+  size_t record_size = varint_size(key.size) + varint_size(value_field) +
+  key.size + value.size;
+  if (record_size > SNAPSHOT_BLOCK_SIZE) {
+    writer->error = 1;
+    return 1;
+  }
+  if (writer->block_used + record_size > SNAPSHOT_BLOCK_SIZE &&
+  flush_block(writer) != 0)
+    return 1;
+
+  if (writer->block_records == 0)
+    writer->block_first_stripe = stripe;
+  writer->block_last_stripe = stripe;
+
+  uint8_t *p = writer->block + writer->block_used;
+  p = put_varint(p, key.size);
+  p = put_varint(p, value_field);
+  memcpy(p, key.data, key.size);
+  if (value.size > 0)
+    memcpy(p + key.size, value.data, value.size);
+  writer->block_used += record_size;
+  writer->block_records++;
+  writer->record_count++;
+  return 0;
+}
+
+int snapshot_writer_add(SnapshotWriter *writer, uint32_t stripe,
+StringSlice key, StringSlice value) {
+  return append_record(writer, stripe, key, value);
+}
+
+int snapshot_writer_delete(SnapshotWriter *writer, uint32_t stripe,
+StringSlice key) {
+  if ((writer->info.flags & SNAPSHOT_FLAG_DELTA) == 0) {
+    writer->error = 1;
+    return 1;
+  }
+  return append_record(writer, stripe, key, (StringSlice){NULL, 0});
+}
+
+int snapshot_writer_close(SnapshotWriter *writer) {
+  flush_block(writer);
+
+  uint64_t index_offset = writer->offset;
+  uint32_t index_crc = 0;
+  for (size_t i = 0; i < writer->num_blocks; i++) {
+    const SnapshotBlockInfo *block = &writer->index[i];
+    uint8_t entry[SNAPSHOT_INDEX_ENTRY_SIZE];
+    put_le64(entry, block->offset);
+    put_le32(entry + 8, block->stored_size);
+    put_le32(entry + 12, block->record_count);
+    put_le32(entry + 16, block->first_stripe);
+    put_le32(entry + 20, block->last_stripe);
+    index_crc = crc32c_update(index_crc, entry, sizeof(entry));
+    if (output_write(&writer->out, entry, sizeof(entry)) != 0)
+      writer->error = 1;
+  }
+
+  uint8_t footer[SNAPSHOT_FOOTER_SIZE];
+  put_le64(footer, index_offset);
+  put_le64(footer + 8, writer->record_count);
+  put_le32(footer + 16, (uint32_t) writer->num_blocks);
+  put_le32(footer + 20, index_crc);
+  put_le32(footer + 24, crc32c(footer, 24));
+  put_le32(footer + 28, 0);
+  memcpy(footer + 32, footer_magic, 8);
+  if (output_write(&writer->out, footer, sizeof(footer)) != 0)
+    writer->error = 1;
+  writer->offset = index_offset +
+  writer->num_blocks * SNAPSHOT_INDEX_ENTRY_SIZE + SNAPSHOT_FOOTER_SIZE;
+
+  if (output_finish(&writer->out) != 0)
+    writer->error = 1;
+  free(writer->block);
+  free(writer->compressed);
+  free(writer->index);
+  writer->block = NULL;
+  writer->compressed = NULL;
+  writer->index = NULL;
+  return writer->error;
+}
+
+int snapshot_reader_open(SnapshotReader *reader, int fd) {
+  struct stat st;
+  if (fstat(fd, &st) != 0 ||
+  st.st_size < SNAPSHOT_HEADER_SIZE + SNAPSHOT_FOOTER_SIZE)
+    return 1;
+  size_t size = (size_t) st.st_size;
+  void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED)
+    return 1;
+  reader->data = data;
+  reader->size = size;
+
+  const uint8_t *header = reader->data;
+  const uint8_t *footer = reader->data + size - SNAPSHOT_FOOTER_SIZE;
+  reader->info = (SnapshotInfo){get_le32(header + 8), get_le32(header + 12),
+  get_le32(header + 16), get_le32(header + 20),
+  {get_le64(header + 24), get_le64(header + 32)}, get_le64(header + 40),
+  get_le64(header + 48), get_le32(header + 56), get_le32(header + 60),
+  get_le32(header + 64)};
+  uint64_t index_offset = get_le64(footer);
+  reader->record_count = get_le64(footer + 8);
+  reader->num_blocks = get_le32(footer + 16);
+  reader->index = reader->data + index_offset;
+
+  if (memcmp(header, header_magic, 8) != 0 ||
+  get_le32(header + 68) != crc32c(header, 68) ||
+  reader->info.version != SNAPSHOT_VERSION ||
+  reader->info.block_size == 0 ||
+  reader->info.block_size > SNAPSHOT_MAX_BLOCK_SIZE ||
+  memcmp(footer + 32, footer_magic, 8) != 0 ||
+  get_le32(footer + 24) != crc32c(footer, 24) ||
+  index_offset < SNAPSHOT_HEADER_SIZE ||
+  index_offset + reader->num_blocks * SNAPSHOT_INDEX_ENTRY_SIZE !=
+  size - SNAPSHOT_FOOTER_SIZE ||
+  get_le32(footer + 20) != crc32c(reader->index,
+  reader->num_blocks * SNAPSHOT_INDEX_ENTRY_SIZE)) {
+    snapshot_reader_close(reader);
+    return 1;
+  }
+  return 0;
+}
+
+void snapshot_block_info(const SnapshotReader *reader, size_t index,
+SnapshotBlockInfo *block) {
+  const uint8_t *entry = reader->index + index * SNAPSHOT_INDEX_ENTRY_SIZE;
+  *block = (SnapshotBlockInfo){get_le64(entry), get_le32(entry + 8),
+  get_le32(entry + 12), get_le32(entry + 16), get_le32(entry + 20)};
+}
+
+int snapshot_read_block(const SnapshotReader *reader, size_t index,
+uint8_t *buffer, int (*visit)(StringSlice key, StringSlice value, void *arg),
+void *arg) {
+  SnapshotBlockInfo block;
+  snapshot_block_info(reader, index, &block);
+  size_t index_offset = (size_t) (reader->index - reader->data);
+  if (block.offset < SNAPSHOT_HEADER_SIZE || block.offset > index_offset ||
+  index_offset - block.offset < SNAPSHOT_BLOCK_HEADER_SIZE ||
+  index_offset - block.offset - SNAPSHOT_BLOCK_HEADER_SIZE < block.stored_size)
+    return 1;
+
+  const uint8_t *header = reader->data + block.offset;
+  const uint8_t *payload = header + SNAPSHOT_BLOCK_HEADER_SIZE;
+  uint32_t raw_size = get_le32(header);
+  uint32_t codec = get_le32(header + 12);
+  if (get_le32(header + 4) != block.stored_size ||
+  get_le32(header + 8) != block.record_count ||
+  raw_size > reader->info.block_size ||
+  get_le32(header + 16) != crc32c_update(crc32c(header, 16), payload,
+  block.stored_size))
+    return 1;
+
+  const uint8_t *records = payload;
+  if (codec == SNAPSHOT_CODEC_LZ) {
+    if (lz_decompress(payload, block.stored_size, buffer, raw_size) != 0)
+      return 1;
+    records = buffer;
+  } else if (codec != SNAPSHOT_CODEC_NONE || raw_size != block.stored_size) {
+    return 1;
+  }
+
+  int delta = (reader->info.flags & SNAPSHOT_FLAG_DELTA) != 0;
+  const uint8_t *p = records;
+  const uint8_t *end = records + raw_size;
+  uint32_t count = 0;
+  while (p < end) {
+    size_t key_size, value_size;
+    if (get_varint(&p, end, &key_size) != 0 ||
+    get_varint(&p, end, &value_size) != 0)
+      return 1;
+    int deleted = delta && value_size == 0;
+    if (delta && !deleted)
+      value_size--;
+    if ((size_t) (end - p) < key_size ||
+    (size_t) (end - p) - key_size < value_size)
+      return 1;
+    StringSlice key = {(const char *) p, key_size};
+    StringSlice value = {deleted ? NULL : (const char *) p + key_size,
+    value_size};
+    p += key_size + value_size;
+    count++;
+    if (visit != NULL && visit(key, value, arg) != 0)
+      return 1;
+  }
+  return count == block.record_count ? 0 : 1;
+}
+
+void snapshot_reader_close(SnapshotReader *reader) {
+  if (reader->data != NULL)
+    munmap((void *) reader->data, reader->size);
+  reader->data = NULL;
+  reader->size = 0;
+}
+
+int snapshot_manifest_write(int fd, const SnapshotSegment *segments,
+size_t count) {
+  size_t size = SNAPSHOT_MANIFEST_HEADER_SIZE +
+  count * SNAPSHOT_MANIFEST_ENTRY_SIZE + SNAPSHOT_MANIFEST_FOOTER_SIZE;
+  uint8_t *manifest = calloc(1, size);
+  if (manifest == NULL)
+    return 1;
+  memcpy(manifest, manifest_magic, 8);
+  put_le32(manifest + 8, SNAPSHOT_VERSION);
+  put_le32(manifest + 12, (uint32_t) count);
+  uint8_t *entry = manifest + SNAPSHOT_MANIFEST_HEADER_SIZE;
+  for (size_t i = 0; i < count; i++, entry += SNAPSHOT_MANIFEST_ENTRY_SIZE) {
+    put_le64(entry, segments[i].size);
+    put_le64(entry + 8, segments[i].record_count);
+    put_le32(entry + 16, segments[i].first_stripe);
+    put_le32(entry + 20, segments[i].last_stripe);
+    put_le32(entry + 24, segments[i].header_crc);
+  }
+  put_le32(entry, crc32c(manifest, size - SNAPSHOT_MANIFEST_FOOTER_SIZE));
+
+  OutputWriter out;
+  if (output_init(&out, fd, OUTPUT_FSYNC_DEFAULT) != 0) {
+    free(manifest);
+    return 1;
+  }
+  int failed = output_write(&out, manifest, size) != 0;
+  failed |= output_finish(&out) != 0;
+  free(manifest);
+  return failed;
+}
+
+/// Maps a snapshot file.
+/// @param reader The reader.
+/// @param path The file.
+/// @return 0 on success, 1 if it cannot be read or is not a valid snapshot.
+static int open_snapshot_file(SnapshotReader *reader, const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return 1;
+  int failed = snapshot_reader_open(reader, fd);
+  close(fd);
+  return failed;
+}
+
+/// Opens the segments listed by a manifest.
+/// @param set The set, its arrays allocated for count segments.
+/// @param path Path of the manifest.
+/// @param manifest The manifest, validated.
+/// @param count Number of segments.
+/// @return 0 on success, 1 if a segment is missing or does not match.
+static int open_segments(SnapshotSet *set, const char *path,
+const uint8_t *manifest, size_t count) {
+  const uint8_t *entry = manifest + SNAPSHOT_MANIFEST_HEADER_SIZE;
+  for (size_t i = 0; i < count; i++, entry += SNAPSHOT_MANIFEST_ENTRY_SIZE) {
+    char segment_path[PATH_MAX];
+    if ((size_t) snprintf(segment_path, sizeof(segment_path), "%s.%zu", path,
+    i) >= sizeof(segment_path))
+      return 1;
+    SnapshotReader *reader = &set->segments[i];
+    if (open_snapshot_file(reader, segment_path) != 0)
+      return 1;
+    set->num_segments++;
+
+    const uint8_t *header = reader->data;
+    const SnapshotInfo *info = &reader->info;
+    const SnapshotInfo *first = &set->segments[0].info;
+    if (reader->size != get_le64(entry) ||
+    reader->record_count != get_le64(entry + 8) ||
+    get_le32(header + 68) != get_le32(entry + 24) ||
+    info->partition != i || info->partitions != count ||
+    info->flags != first->flags || info->stripe_count != first->stripe_count ||
+    info->chain_id != first->chain_id || info->sequence != first->sequence ||
+    memcmp(info->seed, first->seed, sizeof(info->seed)) != 0)
+      return 1;
+    set->first_stripes[i] = get_le32(entry + 16);
+    // Segments cover consecutive stripe ranges, from the first stripe.
+    uint32_t expected = i == 0 ? 0 : get_le32(entry - 12) + 1;
+    if (set->first_stripes[i] != expected ||
+    get_le32(entry + 20) < set->first_stripes[i])
+      return 1;
+  }
+  return 0;
+}
+
+int snapshot_set_open(SnapshotSet *set, const char *path) {
+  memset(set, 0, sizeof(*set));
+  SnapshotReader manifest;
+  if (open_snapshot_file(&manifest, path) == 0) {
+    // A single snapshot file.
+    set->segments = malloc(sizeof(SnapshotReader));
+    set->first_stripes = malloc(sizeof(uint32_t));
+    if (set->segments == NULL || set->first_stripes == NULL) {
+      snapshot_reader_close(&manifest);
+      snapshot_set_close(set);
+      return 1;
+    }
+    set->segments[0] = manifest;
+    set->first_stripes[0] = 0;
+    set->num_segments = 1;
+  } else {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+      return 1;
+    uint8_t header[SNAPSHOT_MANIFEST_HEADER_SIZE];
+    struct stat st;
+    int failed = fstat(fd, &st) != 0 ||
+    pread(fd, header, sizeof(header), 0) != (ssize_t) sizeof(header) ||
+    memcmp(header, manifest_magic, 8) != 0 ||
+    get_le32(header + 8) != SNAPSHOT_VERSION;
+    size_t count = failed ? 0 : get_le32(header + 12);
+    size_t size = SNAPSHOT_MANIFEST_HEADER_SIZE +
+    count * SNAPSHOT_MANIFEST_ENTRY_SIZE + SNAPSHOT_MANIFEST_FOOTER_SIZE;
+    uint8_t *data = NULL;
+    if (!failed && (count == 0 || (uint64_t) st.st_size != size ||
+    (data = malloc(size)) == NULL ||
+    pread(fd, data, size, 0) != (ssize_t) size ||
+    get_le32(data + size - SNAPSHOT_MANIFEST_FOOTER_SIZE) !=
+    crc32c(data, size - SNAPSHOT_MANIFEST_FOOTER_SIZE)))
+      failed = 1;
+    close(fd);
+    if (!failed) {
+      set->segments = calloc(count, sizeof(SnapshotReader));
+      set->first_stripes = calloc(count, sizeof(uint32_t));
+      failed = set->segments == NULL || set->first_stripes == NULL ||
+      open_segments(set, path, data, count) != 0;
+    }
+    free(data);
+    if (failed) {
+      snapshot_set_close(set);
+      return 1;
+    }
+  }
+
+  set->info = set->segments[0].info;
+  set->info.partition = 0;
+  for (size_t i = 0; i < set->num_segments; i++) {
+    set->record_count += set->segments[i].record_count;
+    if (set->segments[i].info.block_size > set->block_size)
+      set->block_size = set->segments[i].info.block_size;
+  }
+  return 0;
+}
+
+size_t snapshot_set_segment(const SnapshotSet *set, size_t stripe) {
+  size_t low = 0;
+  size_t high = set->num_segments;
+  while (high - low > 1) {
+    size_t middle = low + (high - low) / 2;
+    if (set->first_stripes[middle] <= stripe)
+      low = middle;
+    else
+      high = middle;
+  }
+  return low;
+}
+
+void snapshot_set_close(SnapshotSet *set) {
+  for (size_t i = 0; i < set->num_segments; i++)
+    snapshot_reader_close(&set->segments[i]);
+  free(set->segments);
+  free(set->first_stripes);
+  set->segments = NULL;
+  set->first_stripes = NULL;
+  set->num_segments = 0;
+}
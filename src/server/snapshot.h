@@ -0,0 +1,234 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "output.h"
+#include "slice.h"
+
+// Binary snapshot (backup) file, all integers little endian:
+//
+//   header  magic "KVSSNAP\0", version, flags, block size, stripe count,
+//           hash seed[2], WAL LSN, chain id, sequence, partition,
+//           partition count, CRC32C of the preceding header bytes
+//   blocks  raw size, stored size, record count, codec, CRC32C of the
+//           block header and payload, then the payload: records
+//           <varint key size><varint value size><key><value>, LZ
+//           compressed when the codec says so
+//   index   per block: file offset, stored size, record count, first and
+//           last stripe of its records
+//   footer  index offset, record count, block count, index CRC32C,
+//           footer CRC32C, magic "KVSSEND\0"
+//
+// Records are written stripe by stripe, so a block only holds records of a
+// small range of stripes and the index tells which blocks hold a stripe.
+//
+// Backups form chains: a full snapshot (sequence 0) followed by deltas
+// (SNAPSHOT_FLAG_DELTA, sequence 1, 2, ...) sharing its chain id, each
+// holding the keys written or deleted since the previous one. In a delta
+// the value size is stored plus one, 0 marking a deleted key. Restoring a
+// delta means applying the whole chain in sequence order.
+//
+// A large backup is split by stripe range into partitions, each written by
+// its own thread to a segment file <backup>.<partition>, a snapshot with
+// the partition fields set. The backup file itself is then a manifest,
+// written once every segment is complete:
+//
+//   header  magic "KVSMANI\0", version, partition count
+//   entries per segment: file size, record count, first and last stripe,
+//           header CRC32C of the segment, reserved
+//   footer  CRC32C of the preceding bytes, reserved
+
+#define SNAPSHOT_VERSION 3
+#define SNAPSHOT_BLOCK_SIZE 65536         // Raw bytes per block, at most.
+#define SNAPSHOT_MAX_BLOCK_SIZE (1 << 24) // Largest block size a reader accepts.
+#define SNAPSHOT_HEADER_SIZE 72
+#define SNAPSHOT_BLOCK_HEADER_SIZE 20
+#define SNAPSHOT_INDEX_ENTRY_SIZE 24
+#define SNAPSHOT_FOOTER_SIZE 40
+#define SNAPSHOT_MANIFEST_HEADER_SIZE 16
+#define SNAPSHOT_MANIFEST_ENTRY_SIZE 32
+#define SNAPSHOT_MANIFEST_FOOTER_SIZE 8
+#define SNAPSHOT_FLAG_COMPRESSED 1        // Blocks may be LZ compressed.
+#define SNAPSHOT_FLAG_DELTA 2             // Changes since the previous backup.
+
+// Whether backups compress their blocks, e.g. make COMPRESSION=0.
+#ifndef SNAPSHOT_COMPRESSION
+#define SNAPSHOT_COMPRESSION 1
+#endif
+
+// Deltas written after a full backup before the next full one, e.g.
+// make DELTAS=0 for full backups only.
+#ifndef SNAPSHOT_MAX_DELTAS
+#define SNAPSHOT_MAX_DELTAS 8
+#endif
+
+// Partitions of a backup, at most, e.g. make PARTITIONS=1 for single files.
+// Backups use one per core, as long as each gets enough keys.
+#ifndef SNAPSHOT_MAX_PARTITIONS
+#define SNAPSHOT_MAX_PARTITIONS 8
+#endif
+#define SNAPSHOT_PARTITION_MIN_KEYS 65536
+
+typedef enum {
+  SNAPSHOT_CODEC_NONE,
+  SNAPSHOT_CODEC_LZ
+} SnapshotCodec;
+
+/// Table the snapshot was taken from, stored in the header.
+typedef struct SnapshotInfo {
+  uint32_t version;
+  uint32_t flags;
+  uint32_t block_size;
+  uint32_t stripe_count;
+  uint64_t seed[2];
+  uint64_t wal_lsn;     // WAL records up to this LSN are in the snapshot.
+  uint64_t chain_id;    // Shared by a full snapshot and its deltas.
+  uint32_t sequence;    // Position in the chain, 0 for the full snapshot.
+  uint32_t partition;   // Of a segment file, 0 otherwise.
+  uint32_t partitions;  // Segments of the backup, 0 if it is not split.
+} SnapshotInfo;
+
+/// Where a block is and what it holds, from the index.
+typedef struct SnapshotBlockInfo {
+  uint64_t offset;
+  uint32_t stored_size;
+  uint32_t record_count;
+  uint32_t first_stripe;
+  uint32_t last_stripe;
+} SnapshotBlockInfo;
+
+typedef struct SnapshotWriter {
+  OutputWriter out;
+  SnapshotInfo info;
+  uint8_t *block;               // Raw records of the block being built.
+  size_t block_used;
+  uint32_t block_records;
+  uint32_t block_first_stripe;
+  uint32_t block_last_stripe;
+  uint8_t *compressed;          // Scratch for the compressed block.
+  SnapshotBlockInfo *index;
+  size_t num_blocks;
+  size_t index_capacity;
+  uint64_t offset;              // File offset of the next block.
+  uint64_t record_count;
+  uint32_t header_crc;
+  int error;
+} SnapshotWriter;
+
+/// A segment file of a split backup, as listed by its manifest.
+typedef struct SnapshotSegment {
+  uint64_t size;
+  uint64_t record_count;
+  uint32_t first_stripe;
+  uint32_t last_stripe;
+  uint32_t header_crc;
+} SnapshotSegment;
+
+/// Starts a snapshot, writing its header.
+/// @param writer The writer.
+/// @param fd File to write to, still owned by the caller.
+/// @param info Flags, stripe count, seed, WAL LSN and chain position of the
+/// snapshot. Its version and block size are filled in by the writer.
+/// @return 0 on success, 1 otherwise.
+int snapshot_writer_open(SnapshotWriter *writer, int fd,
+const SnapshotInfo *info);
+
+/// Appends a record. Records must come in ascending stripe order.
+/// @param writer The writer.
+/// @param stripe Stripe owning the key.
+/// @param key The key.
+/// @param value The value.
+/// @return 0 on success, 1 otherwise.
+int snapshot_writer_add(SnapshotWriter *writer, uint32_t stripe,
+StringSlice key, StringSlice value);
+
+/// Appends the deletion of a key to a delta.
+/// @param writer The writer, of a snapshot with SNAPSHOT_FLAG_DELTA.
+/// @param stripe Stripe owning the key.
+/// @param key The key.
+/// @return 0 on success, 1 otherwise.
+int snapshot_writer_delete(SnapshotWriter *writer, uint32_t stripe,
+StringSlice key);
+
+/// Writes the last block, the index and the footer, then frees the writer.
+/// Its offset is left at the size of the file.
+/// @param writer The writer.
+/// @return 0 if the whole snapshot was written, 1 otherwise.
+int snapshot_writer_close(SnapshotWriter *writer);
+
+/// Writes the manifest of a split backup.
+/// @param fd File to write to, still owned by the caller.
+/// @param segments The segments, in partition order.
+/// @param count Number of segments.
+/// @return 0 on success, 1 otherwise.
+int snapshot_manifest_write(int fd, const SnapshotSegment *segments,
+size_t count);
+
+typedef struct SnapshotReader {
+  const uint8_t *data;      // The whole file, mapped.
+  size_t size;
+  SnapshotInfo info;
+  uint64_t record_count;
+  size_t num_blocks;
+  const uint8_t *index;     // Raw index entries.
+} SnapshotReader;
+
+/// Maps a snapshot and validates its header, footer and index.
+/// @param reader The reader.
+/// @param fd The snapshot file, may be closed once this returns.
+/// @return 0 on success, 1 if the file is not a valid snapshot.
+int snapshot_reader_open(SnapshotReader *reader, int fd);
+
+/// Index entry of a block.
+/// @param reader The reader.
+/// @param index Block number.
+/// @param block Where to store the entry.
+void snapshot_block_info(const SnapshotReader *reader, size_t index,
+SnapshotBlockInfo *block);
+
+/// Validates a block, decompresses it and calls a function per record.
+/// Deleted keys of a delta are passed with a NULL value.data.
+/// @param reader The reader.
+/// @param index Block number.
+/// @param buffer Scratch of info.block_size bytes.
+/// @param visit Called per record, stops the walk by returning non zero.
+/// @param arg Opaque argument passed to visit.
+/// @return 0 on success, 1 if the block is corrupt or visit stopped it.
+int snapshot_read_block(const SnapshotReader *reader, size_t index,
+uint8_t *buffer, int (*visit)(StringSlice key, StringSlice value, void *arg),
+void *arg);
+
+/// Unmaps the snapshot.
+/// @param reader The reader.
+void snapshot_reader_close(SnapshotReader *reader);
+
+/// A whole backup: one snapshot file, or the segments of a manifest.
+typedef struct SnapshotSet {
+  SnapshotReader *segments;   // By ascending stripe range.
+  uint32_t *first_stripes;    // First stripe of each segment.
+  size_t num_segments;
+  SnapshotInfo info;          // Of the first segment, partition cleared.
+  uint64_t record_count;
+  uint32_t block_size;        // Largest of the segments.
+} SnapshotSet;
+
+/// Opens a backup, and the segments it lists if it is a manifest. Every
+/// segment must belong to the same backup and be valid.
+/// @param set The set.
+/// @param path The backup file.
+/// @return 0 on success, 1 if the backup is not valid or incomplete.
+int snapshot_set_open(SnapshotSet *set, const char *path);
+
+/// Segment holding a stripe.
+/// @param set The set.
+/// @param stripe The stripe.
+/// @return Index of the segment.
+size_t snapshot_set_segment(const SnapshotSet *set, size_t stripe);
+
+/// Unmaps every segment.
+/// @param set The set.
+void snapshot_set_close(SnapshotSet *set);
+
+#endif // SNAPSHOT_H
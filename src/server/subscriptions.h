@@ -2,21 +2,33 @@
 #define SUBSCRIPTIONS_H
 
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "common/constants.h"
 
+// Each subscription is chained twice: in the bucket of its key, walked to
+// notify a key's subscribers, and in the bucket of its notification FIFO,
+// walked to drop a client's subscriptions. Both are fixed arrays of doubly
+// linked chains. Notifications only take the lock for reading.
+#define SUBSCRIPTION_BUCKETS 4096
+
 typedef struct SubscriptionData {
   char key[MAX_STRING_SIZE];
   int notification_fifo_fd;
-  struct SubscriptionData* next;
+  struct SubscriptionData* next;          // Same key bucket.
+  struct SubscriptionData* prev;
+  struct SubscriptionData* client_next;   // Same notification FIFO bucket.
+  struct SubscriptionData* client_prev;
 } SubscriptionData;
 
 typedef struct ClientSubscriptions {
-  pthread_mutex_t mutex;
-  SubscriptionData* subscription_data;
+  pthread_rwlock_t lock;
+  atomic_size_t count;                    // Read without the lock.
+  SubscriptionData* by_key[SUBSCRIPTION_BUCKETS];
+  SubscriptionData* by_client[SUBSCRIPTION_BUCKETS];
 } ClientSubscriptions;
 
-#endif // SUBSCRIPTIONS_H
\ No newline at end of file
+#endif // SUBSCRIPTIONS_H
@@ -1,4 +1,5 @@
 #include "server/utils.h"
+#include "server/wal.h"
 
 extern ServerData* server_data;
 
@@ -22,21 +23,27 @@ char* max_threads, char* max_backups) {
 		cleanup_and_exit(1);
 	}
 
-  pthread_mutex_init(&server_data->all_subscriptions.mutex, NULL);
-  sem_init(&server_data->backup_semaphore, 0, (unsigned int)server_data->max_backups); // 0 means semaphore is shared between threads of the same process
-  server_data->all_subscriptions.subscription_data = NULL;
+  pthread_rwlock_init(&server_data->all_subscriptions.lock, NULL);
+  atomic_store(&server_data->all_subscriptions.count, 0);
+  memset(server_data->all_subscriptions.by_key, 0,
+  sizeof(server_data->all_subscriptions.by_key));
+  memset(server_data->all_subscriptions.by_client, 0,
+  sizeof(server_data->all_subscriptions.by_client));
   server_data->jobs_directory = job_path;
   server_data->sigusr1_received = 0;
-  server_data->child_terminated_flag = 0;
   server_data->terminate = 0;
+  sem_init(&server_data->terminate_posted, 0, 0);
 }
 
 void handle_sigusr1() {
   server_data->sigusr1_received = 1;
+  wake_connection_manager(); // Async-signal-safe.
 }
 
 void handle_sigint_sigterm() {
   server_data->terminate = 1;
+  sem_post(&server_data->terminate_posted); // Async-signal-safe.
+  wake_connection_manager();
 }
 
 void setup_signal_handling() {
@@ -55,12 +62,12 @@ void setup_signal_handling() {
   sigaction(SIGINT, &sa, NULL);
   sigaction(SIGTERM, &sa, NULL);
 
-  // Sigaction struct to handle SIGCHLD signals
-  struct sigaction sa_child;
-  sa_child.sa_handler = signal_child_terminated;
-  sigemptyset(&sa_child.sa_mask); // Initialize the signal set to empty
-  sa_child.sa_flags = SA_RESTART; // Restart interrupted system calls
-  CHECK_RETURN_ONE(sigaction(SIGCHLD, &sa_child, NULL), "sigaction");
+  // SIGPIPE: writes to the FIFOs of a client that went away fail instead.
+  struct sigaction sa_pipe;
+  sa_pipe.sa_handler = SIG_IGN;
+  sigemptyset(&sa_pipe.sa_mask);
+  sa_pipe.sa_flags = 0;
+  sigaction(SIGPIPE, &sa_pipe, NULL);
 }
 
 int setup_registration_fifo(char* registration_fifo_path) {
@@ -73,20 +80,10 @@ int setup_registration_fifo(char* registration_fifo_path) {
 }
 
 int setup_client_workers() {
-  // Allocate memory for the worker threads array.
-  server_data->worker_threads = malloc(MAX_SESSION_COUNT * sizeof(pthread_t));
-  if (server_data->worker_threads == NULL) {
-    write_str(STDERR_FILENO, "Failed to allocate memory for worker threads.\n");
+  if (start_session_loops() != 0) {
+    write_str(STDERR_FILENO, "Failed to create the session loop threads.\n");
     cleanup_and_exit(1);
   }
-  // Create a pool of worker threads.
-  for (int i = 0; i < MAX_SESSION_COUNT; ++i) {
-    if (pthread_create(&server_data->worker_threads[i], NULL,
-    client_request_handler, NULL) != 0) {
-      write_str(STDERR_FILENO, "Failed to create worker thread.\n");
-      cleanup_and_exit(1);
-    }
-  }
   return 0;
 }
 
@@ -98,55 +95,38 @@ void cleanup_and_exit(int exit_code) {
       pthread_join(server_data->connection_manager, NULL);
     }
 
-    // Join worker threads if they were created.
-    if (server_data->worker_threads != NULL) {
-      for (int i = 0; i < MAX_SESSION_COUNT; ++i) {
-        if (server_data->worker_threads[i] != 0) {
-          pthread_cancel(server_data->worker_threads[i]);
-          pthread_join(server_data->worker_threads[i], NULL);
-        }
-      }
-      // Free the worker threads array.
-      free(server_data->worker_threads);
-      cleanup_session_buffer();
-    }
+    // Disconnect the clients and join the session loops if they started.
+    stop_session_loops();
 
-    // Destroy mutexes
-    pthread_mutex_destroy(&server_data->all_subscriptions.mutex);
+    // Destroy locks
+    pthread_rwlock_destroy(&server_data->all_subscriptions.lock);
   }
+  wal_close();
   kvs_terminate();
   free(server_data);
   _exit(exit_code);
 }
 
 void run_jobs() {
-  JobQueue *queue = create_job_queue(server_data->jobs_directory);
+  JobQueue *queue = create_job_queue(server_data->jobs_directory,
+  server_data->max_threads);
   CHECK_NULL(queue, "Failed to create job queue.");
-  int max_threads = (int) server_data->max_threads;
-  int max_files = queue->num_files;
-  pthread_t threads[max_threads];
-
-  pthread_t semaphore_thread;
-  pthread_create(&semaphore_thread, NULL, checks_for_terminated_children, NULL);
+  size_t num_workers = queue->num_workers;
+  pthread_t threads[num_workers + 1]; // +1, a VLA cannot be empty.
 
-  for (int i = 0; i < max_threads && i < max_files; ++i)
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (size_t i = 0; i < num_workers; ++i)
     pthread_create(&threads[i], NULL, process_file, (void *)queue);
 
-  for (int i = 0; i < max_threads && i < max_files; ++i)
+  for (size_t i = 0; i < num_workers; ++i)
     pthread_join(threads[i], NULL);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("Ran %d jobs on %zu threads in %.3f ms (%.3f ms of job time).\n",
+  queue->num_files, num_workers, (double) elapsed_ns(&start, &end) / 1e6,
+  (double) atomic_load(&queue->busy_ns) / 1e6);
 
-  while (sem_trywait(&server_data->backup_semaphore) != 0) {
-    struct timespec delay = delay_to_timespec(1);
-    nanosleep(&delay, NULL);
-  }
-  // Very small wait to avoid missing signals or exit before child cleanup.
-  struct timespec delay = delay_to_timespec(1);
-  nanosleep(&delay, NULL);
-
-  pthread_cancel(semaphore_thread);
-  pthread_join(semaphore_thread, NULL);
-
-  sem_destroy(&server_data->backup_semaphore);
+  kvs_wait_backups();
   destroy_jobs_queue(queue);
   queue = NULL;
   return;
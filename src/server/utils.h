@@ -17,14 +17,12 @@
 typedef struct ServerData {
   char* jobs_directory;                             // Directory containing the jobs files
   size_t max_threads;                               // Maximum allowed simultaneous threads.
-  size_t max_backups;                               // Maximum allowed simultaneous backups.
-  sem_t backup_semaphore;                           // Semaphore to control access to backup operations.
-  atomic_int child_terminated_flag;                 // Flag indicating a child process has terminated.
+  size_t max_backups;                               // Backup service threads, see kvs_backup.
   pthread_t connection_manager;                     // Thread to listen for client connections to the server.
-  pthread_t* worker_threads;                        // Array of client worker threads.
-  sig_atomic_t sigusr1_received;                    // Flag indicating SIGUSR1 signal was recieved.
+  _Atomic volatile sig_atomic_t sigusr1_received;   // Flag indicating SIGUSR1 signal was recieved.
   _Atomic volatile sig_atomic_t terminate;          // Flag indicating SIGINT or SIGTERM signal was recieved.
-  ClientSubscriptions all_subscriptions;            // Linked list holding subscription data for all clients.
+  sem_t terminate_posted;                           // Posted with terminate, main waits on it.
+  ClientSubscriptions all_subscriptions;            // Subscriptions of all clients, by key and by client.
 } ServerData;
 
 /// Initializes the server data with the given parameters.
@@ -39,7 +37,7 @@ void handle_sigusr1();
 /// Signal handler for SIGINT and SIGTERM signals.
 void handle_sigint_sigterm();
 
-/// Setup signal handlers for SIGUSR1, SIGINT and SIGTERM.
+/// Setup signal handlers for SIGUSR1, SIGINT and SIGTERM, and ignore SIGPIPE.
 void setup_signal_handling();
 
 /// Setup server FIFO listener thread.
@@ -47,7 +45,7 @@ void setup_signal_handling();
 /// @return int Returns 0 on success, or a negative error code on failure.
 int setup_registration_fifo(char* registration_fifo_path);
 
-/// Setup client worker threads.
+/// Setup the threads of the client session event loops.
 /// @return int Returns 0 on success, or a negative error code on failure.
 int setup_client_workers();
 
@@ -0,0 +1,502 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bytes.h"
+#include "constants.h"
+#include "crc32c.h"
+#include "server/io.h"
+#include "wal.h"
+
+static const char wal_magic[8] = "KVSWAL";
+
+/// State of the log, one per process.
+static struct {
+  int fd;
+  int open;
+  char path[PATH_MAX];
+  pthread_mutex_t mutex;
+  pthread_cond_t work;        // Signaled when records are appended.
+  pthread_cond_t durable;     // Broadcast after each commit.
+  uint8_t *buffer;            // Records appended since the last commit.
+  size_t used;
+  size_t capacity;
+  uint64_t last_lsn;          // Last LSN handed out.
+  uint64_t durable_lsn;       // Last LSN known to be on disk.
+  uint64_t base_lsn;          // Records up to it were dropped from the log.
+  uint64_t trim_lsn;          // Records up to it may be dropped.
+  WalCommitted committed;     // Told about each commit.
+  uint64_t commits;
+  uint64_t records;
+  int stop;
+  int error;
+  pthread_t committer;
+} wal = {.fd = -1, .mutex = PTHREAD_MUTEX_INITIALIZER,
+.work = PTHREAD_COND_INITIALIZER, .durable = PTHREAD_COND_INITIALIZER};
+
+/// Writes a whole buffer, retrying short writes.
+/// @param fd File to write to.
+/// @param data The bytes.
+/// @param size Number of bytes.
+/// @return 0 on success, 1 otherwise.
+static int write_all(int fd, const uint8_t *data, size_t size) {
+  while (size > 0) {
+    ssize_t written = write(fd, data, size);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return 1;
+    }
+    data += written;
+    size -= (size_t) written;
+  }
+  return 0;
+}
+
+/// Writes the header of a log.
+/// @param fd The log, empty.
+/// @param base_lsn LSN of the last record dropped from it.
+/// @return 0 on success, 1 otherwise.
+static int write_header(int fd, uint64_t base_lsn) {
+  uint8_t header[WAL_HEADER_SIZE];
+  memcpy(header, wal_magic, 8);
+  put_le32(header + 8, WAL_VERSION);
+  put_le64(header + 12, base_lsn);
+  put_le32(header + 20, crc32c(header, 20));
+  return write_all(fd, header, sizeof(header));
+}
+
+/// Checks the header of a log, of either version.
+/// @param data The start of the log.
+/// @param size Its size.
+/// @param base_lsn Where to store its base LSN.
+/// @return Size of the header, 0 if it is not valid.
+static size_t read_header(const uint8_t *data, size_t size,
+uint64_t *base_lsn) {
+  if (size < 16 || memcmp(data, wal_magic, 8) != 0)
+    return 0;
+  uint32_t version = get_le32(data + 8);
+  if (version == 1 && get_le32(data + 12) == crc32c(data, 12)) {
+    *base_lsn = 0;
+    return 16;
+  }
+  if (version == WAL_VERSION && size >= WAL_HEADER_SIZE &&
+  get_le32(data + 20) == crc32c(data, 20)) {
+    *base_lsn = get_le64(data + 12);
+    return WAL_HEADER_SIZE;
+  }
+  return 0;
+}
+
+/// Decodes a record payload and replays it if it is newer than the snapshot.
+/// @param payload The payload, its checksum already verified.
+/// @param size Payload size.
+/// @param snapshot_lsn LSN of the restored snapshot.
+/// @param apply Replay function.
+/// @param lsn Where to store the record's LSN.
+/// @return 0 on success, 1 if the payload is malformed.
+static int replay_record(const uint8_t *payload, size_t size,
+uint64_t snapshot_lsn, WalApply apply, uint64_t *lsn) {
+  StringSlice keys[MAX_WRITE_SIZE];
+  StringSlice values[MAX_WRITE_SIZE];
+  if (size < 11)
+    return 1;
+  *lsn = get_le64(payload);
+  uint8_t type = payload[8];
+  size_t num_pairs = get_le16(payload + 9);
+  if ((type != WAL_WRITE && type != WAL_DELETE) || num_pairs > MAX_WRITE_SIZE)
+    return 1;
+
+  const uint8_t *p = payload + 11;
+  const uint8_t *end = payload + size;
+  for (size_t i = 0; i < num_pairs; i++) {
+    for (int field = 0; field < (type == WAL_WRITE ? 2 : 1); field++) {
+      if (p == end || (size_t) (end - p) - 1 < *p)
+        return 1;
+      StringSlice slice = {(const char *) p + 1, *p};
+      p += 1 + slice.size;
+      if (field == 0)
+        keys[i] = slice;
+      else
+        values[i] = slice;
+    }
+  }
+  if (p != end)
+    return 1;
+
+  if (*lsn > snapshot_lsn)
+    apply((WalRecordType) type, keys, type == WAL_WRITE ? values : NULL,
+    num_pairs);
+  return 0;
+}
+
+/// Replays a log and finds where its last complete record ends.
+/// @param fd The log, not empty.
+/// @param size File size.
+/// @param snapshot_lsn LSN of the restored snapshot.
+/// @param apply Replay function.
+/// @param valid_size Where to store the size of the intact part, 0 if the
+/// header was cut off.
+/// @return Number of records replayed, -1 if the header is not valid.
+static ssize_t replay(int fd, size_t size, uint64_t snapshot_lsn,
+WalApply apply, size_t *valid_size) {
+  const uint8_t *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED)
+    return -1;
+  posix_madvise((void *) data, size, POSIX_MADV_SEQUENTIAL);
+  size_t offset = read_header(data, size, &wal.base_lsn);
+  if (offset == 0) {
+    munmap((void *) data, size);
+    *valid_size = 0;
+    return size < WAL_HEADER_SIZE ? 0 : -1;
+  }
+  if (wal.base_lsn > wal.last_lsn)
+    wal.last_lsn = wal.base_lsn;
+
+  ssize_t replayed = 0;
+  while (size - offset >= WAL_RECORD_HEADER_SIZE) {
+    const uint8_t *record = data + offset;
+    size_t payload_size = get_le32(record);
+    if (size - offset - WAL_RECORD_HEADER_SIZE < payload_size)
+      break;
+    const uint8_t *payload = record + WAL_RECORD_HEADER_SIZE;
+    uint64_t lsn;
+    if (get_le32(record + 4) != crc32c(payload, payload_size) ||
+    replay_record(payload, payload_size, snapshot_lsn, apply, &lsn) != 0)
+      break;
+    if (lsn > wal.last_lsn)
+      wal.last_lsn = lsn;
+    if (lsn > snapshot_lsn)
+      replayed++;
+    offset += WAL_RECORD_HEADER_SIZE + payload_size;
+  }
+
+  munmap((void *) data, size);
+  *valid_size = offset;
+  return replayed;
+}
+
+/// Rewrites the log without the records up to an LSN, which are all
+/// written. Only the committer writes to the log.
+/// @param lsn LSN of the last record to drop.
+/// @return 0 on success, 1 otherwise.
+static int trim_log(uint64_t lsn) {
+  struct stat st;
+  if (fstat(wal.fd, &st) != 0)
+    return 1;
+  size_t size = (size_t) st.st_size;
+  const uint8_t *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, wal.fd, 0);
+  if (data == MAP_FAILED)
+    return 1;
+
+  // Records are in LSN order, keep those after lsn.
+  uint64_t base_lsn;
+  size_t offset = read_header(data, size, &base_lsn);
+  while (offset != 0 && size - offset >= WAL_RECORD_HEADER_SIZE + 8 &&
+  get_le64(data + offset + WAL_RECORD_HEADER_SIZE) <= lsn)
+    offset += WAL_RECORD_HEADER_SIZE + get_le32(data + offset);
+
+  char path[PATH_MAX];
+  int fd = -1;
+  int failed = offset == 0 || offset > size ||
+  (size_t) snprintf(path, sizeof(path), "%s.new", wal.path) >= sizeof(path) ||
+  (fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644)) < 0 ||
+  write_header(fd, lsn) != 0 ||
+  write_all(fd, data + offset, size - offset) != 0 || fdatasync(fd) != 0 ||
+  rename(path, wal.path) != 0;
+  munmap((void *) data, size);
+  if (failed) {
+    if (fd >= 0) {
+      close(fd);
+      unlink(path);
+    }
+    return 1;
+  }
+  close(wal.fd);
+  wal.fd = fd;
+  return sync_parent_dir(wal.path);
+}
+
+/// Committer thread, writes and syncs the appended records in batches.
+static void *committer_thread(void *arg) {
+  (void) arg;
+  uint8_t *batch = NULL;
+  size_t batch_capacity = 0;
+
+  pthread_mutex_lock(&wal.mutex);
+  while (1) {
+    if (WAL_COMMIT_INTERVAL_MS == 0) {
+      while (!wal.stop && wal.used == 0 && wal.trim_lsn <= wal.base_lsn)
+        pthread_cond_wait(&wal.work, &wal.mutex);
+    } else if (!wal.stop) {
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += (WAL_COMMIT_INTERVAL_MS % 1000) * 1000000L;
+      deadline.tv_sec += WAL_COMMIT_INTERVAL_MS / 1000 +
+      deadline.tv_nsec / 1000000000L;
+      deadline.tv_nsec %= 1000000000L;
+      while (!wal.stop &&
+      pthread_cond_timedwait(&wal.work, &wal.mutex, &deadline) != ETIMEDOUT)
+        ;
+    }
+    if (wal.trim_lsn > wal.base_lsn) {
+      // Records up to lsn still in the buffer land after the trim, where
+      // replays skip them as older than the snapshot.
+      uint64_t lsn = wal.trim_lsn;
+      pthread_mutex_unlock(&wal.mutex);
+      int failed = trim_log(lsn);
+      pthread_mutex_lock(&wal.mutex);
+      if (failed)
+        fprintf(stderr, "Failed to trim the WAL - %s\n", strerror(errno));
+      // On failure the log keeps growing until the next snapshot.
+      wal.base_lsn = lsn;
+    }
+    if (wal.used == 0) {
+      if (wal.stop)
+        break;
+      continue;
+    }
+
+    // Take the appended records, operations keep appending to the other
+    // buffer while this batch is written.
+    uint8_t *records = wal.buffer;
+    size_t records_capacity = wal.capacity;
+    size_t size = wal.used;
+    uint64_t lsn = wal.last_lsn;
+    wal.buffer = batch;
+    wal.capacity = batch_capacity;
+    wal.used = 0;
+    batch = records;
+    batch_capacity = records_capacity;
+    pthread_mutex_unlock(&wal.mutex);
+
+    int failed = write_all(wal.fd, records, size) != 0 ||
+    fdatasync(wal.fd) != 0;
+
+    pthread_mutex_lock(&wal.mutex);
+    if (failed && !wal.error) {
+      wal.error = 1;
+      fprintf(stderr, "Failed to write the WAL - %s\n", strerror(errno));
+    }
+    wal.durable_lsn = lsn;
+    wal.commits++;
+    pthread_cond_broadcast(&wal.durable);
+    if (wal.committed != NULL)
+      wal.committed(lsn);
+  }
+  pthread_mutex_unlock(&wal.mutex);
+  free(batch);
+  return NULL;
+}
+
+uint64_t wal_base_lsn(const char *dir) {
+  char path[PATH_MAX];
+  if ((size_t) snprintf(path, sizeof(path), "%s/%s", dir, WAL_FILE_NAME) >=
+  sizeof(path))
+    return 0;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return 0;
+  uint8_t header[WAL_HEADER_SIZE];
+  ssize_t size = read(fd, header, sizeof(header));
+  close(fd);
+  uint64_t base_lsn = 0;
+  if (size > 0)
+    read_header(header, (size_t) size, &base_lsn);
+  return base_lsn;
+}
+
+int wal_open(const char *dir, uint64_t snapshot_lsn, WalApply apply) {
+  char *path = wal.path;
+  if ((size_t) snprintf(path, sizeof(wal.path), "%s/%s", dir,
+  WAL_FILE_NAME) >= sizeof(wal.path))
+    return 1;
+  int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+  if (fd < 0)
+    return 1;
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return 1;
+  }
+  size_t size = (size_t) st.st_size;
+  size_t valid_size = 0;
+  ssize_t replayed = 0;
+  if (size > 0)
+    replayed = replay(fd, size, snapshot_lsn, apply, &valid_size);
+  if (replayed < 0) {
+    fprintf(stderr, "%s is not a valid WAL.\n", path);
+    close(fd);
+    return 2;
+  }
+
+  if (valid_size == 0) {
+    // New log, or one that crashed before its header was durable.
+    wal.base_lsn = 0;
+    if (ftruncate(fd, 0) != 0 || write_header(fd, 0) != 0 ||
+    fdatasync(fd) != 0 || sync_parent_dir(path) != 0) {
+      close(fd);
+      return 1;
+    }
+  } else if (valid_size < size) {
+    fprintf(stderr, "Discarding %zu bytes of a torn WAL record.\n",
+    size - valid_size);
+    if (ftruncate(fd, (off_t) valid_size) != 0 || fdatasync(fd) != 0) {
+      close(fd);
+      return 1;
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if (replayed > 0)
+    printf("Replayed %zd WAL records in %.3f ms.\n", replayed,
+    (double) (end.tv_sec - start.tv_sec) * 1e3 +
+    (double) (end.tv_nsec - start.tv_nsec) / 1e6);
+
+  // A snapshot may be newer than the log, never reuse its LSNs.
+  if (snapshot_lsn > wal.last_lsn)
+    wal.last_lsn = snapshot_lsn;
+  wal.durable_lsn = wal.last_lsn;
+  wal.fd = fd;
+  if (pthread_create(&wal.committer, NULL, committer_thread, NULL) != 0) {
+    close(fd);
+    wal.fd = -1;
+    return 1;
+  }
+  wal.open = 1;
+  return 0;
+}
+
+uint64_t wal_append(WalRecordType type, const StringSlice *keys,
+const StringSlice *values, size_t num_pairs) {
+  if (!wal.open)
+    return 0;
+
+  size_t payload_size = 11;
+  for (size_t i = 0; i < num_pairs; i++)
+    payload_size += 1 + keys[i].size + (type == WAL_WRITE ? 1 + values[i].size : 0);
+  size_t record_size = WAL_RECORD_HEADER_SIZE + payload_size;
+
+  pthread_mutex_lock(&wal.mutex);
+  if (wal.error) {
+    pthread_mutex_unlock(&wal.mutex);
+    return 0;
+  }
+  if (wal.capacity - wal.used < record_size) {
+    size_t capacity = wal.capacity ? wal.capacity : 65536;
+    while (capacity - wal.used < record_size)
+      capacity *= 2;
+    uint8_t *buffer = realloc(wal.buffer, capacity);
+    if (buffer == NULL) {
+      wal.error = 1;
+      pthread_mutex_unlock(&wal.mutex);
+      return 0;
+    }
+    wal.buffer = buffer;
+    wal.capacity = capacity;
+  }
+
+  uint64_t lsn = ++wal.last_lsn;
+  uint8_t *record = wal.buffer + wal.used;
+  uint8_t *payload = record + WAL_RECORD_HEADER_SIZE;
+  uint8_t *p = payload;
+  put_le64(p, lsn);
+  p[8] = (uint8_t) type;
+  put_le16(p + 9, (uint16_t) num_pairs);
+  p += 11;
+  for (size_t i = 0; i < num_pairs; i++) {
+    // Sizes fit a byte, keys and values are at most MAX_STRING_SIZE.
+    size_t key_size = keys[i].size < MAX_STRING_SIZE ? keys[i].size :
+    MAX_STRING_SIZE;
+    *p++ = (uint8_t) key_size;
+    memcpy(p, keys[i].data, key_size);
+    p += key_size;
+    if (type == WAL_WRITE) {
+      size_t value_size = values[i].size < MAX_STRING_SIZE ? values[i].size :
+      MAX_STRING_SIZE;
+      *p++ = (uint8_t) value_size;
+      memcpy(p, values[i].data, value_size);
+      p += value_size;
+    }
+  }
+  payload_size = (size_t) (p - payload);
+  put_le32(record, (uint32_t) payload_size);
+  put_le32(record + 4, crc32c(payload, payload_size));
+  wal.used += WAL_RECORD_HEADER_SIZE + payload_size;
+  wal.records++;
+  if (WAL_COMMIT_INTERVAL_MS == 0 && wal.used == WAL_RECORD_HEADER_SIZE +
+  payload_size)
+    pthread_cond_signal(&wal.work); // The committer sleeps until the first.
+  pthread_mutex_unlock(&wal.mutex);
+  return lsn;
+}
+
+int wal_commit(uint64_t lsn) {
+  if (!wal.open)
+    return 0;
+  pthread_mutex_lock(&wal.mutex);
+  while (wal.durable_lsn < lsn && !wal.error)
+    pthread_cond_wait(&wal.durable, &wal.mutex);
+  int error = wal.error;
+  pthread_mutex_unlock(&wal.mutex);
+  return error;
+}
+
+void wal_trim(uint64_t lsn) {
+  if (!wal.open)
+    return;
+  pthread_mutex_lock(&wal.mutex);
+  if (lsn > wal.trim_lsn) {
+    wal.trim_lsn = lsn;
+    pthread_cond_signal(&wal.work);
+  }
+  pthread_mutex_unlock(&wal.mutex);
+}
+
+void wal_on_commit(WalCommitted committed) {
+  pthread_mutex_lock(&wal.mutex);
+  wal.committed = committed;
+  pthread_mutex_unlock(&wal.mutex);
+}
+
+uint64_t wal_last_lsn() {
+  pthread_mutex_lock(&wal.mutex);
+  uint64_t lsn = wal.last_lsn;
+  pthread_mutex_unlock(&wal.mutex);
+  return lsn;
+}
+
+uint64_t wal_durable_lsn() {
+  pthread_mutex_lock(&wal.mutex);
+  uint64_t lsn = wal.durable_lsn;
+  pthread_mutex_unlock(&wal.mutex);
+  return lsn;
+}
+
+void wal_close() {
+  if (!wal.open)
+    return;
+  pthread_mutex_lock(&wal.mutex);
+  wal.stop = 1;
+  pthread_cond_signal(&wal.work);
+  pthread_mutex_unlock(&wal.mutex);
+  pthread_join(wal.committer, NULL);
+
+  printf("WAL: %lu records in %lu commits.\n", (unsigned long) wal.records,
+  (unsigned long) wal.commits);
+  close(wal.fd);
+  free(wal.buffer);
+  wal.buffer = NULL;
+  wal.fd = -1;
+  wal.open = 0;
+}
@@ -0,0 +1,112 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "slice.h"
+
+// Write-ahead log of every WRITE and DELETE, <jobs_dir>/kvs.wal, so that a
+// crash only loses what was not committed yet. All integers little endian:
+//
+//   header  magic "KVSWAL\0\0", version, base LSN, CRC32C of the preceding
+//           bytes
+//   record  payload size, CRC32C of the payload, then the payload: LSN,
+//           type, pair count, then per pair <u8 key size><key>, followed by
+//           <u8 value size><value> for writes
+//
+// Operations append their record while holding their stripe locks, so the
+// log orders the updates of a key the way they were applied. A committer
+// thread writes everything appended since its last commit and fdatasyncs it
+// once, so concurrent operations share one sync (group commit). Appending
+// never waits for the disk: whoever reports an update waits for its record
+// with wal_commit first, once for all the updates it reports, or is told
+// when it is durable through wal_on_commit. On startup records after the
+// restored snapshot's LSN are replayed, and a torn record at the end of the
+// log is cut off.
+//
+// Once a snapshot holding every record up to some LSN is durable, the log
+// is rewritten without them: the committer copies the later records to a
+// new file, which replaces the log. Its base LSN tells restores that an
+// older snapshot can no longer be brought up to date. Version 1 logs, with
+// a 16 byte header and no base, are still read.
+
+#define WAL_FILE_NAME "kvs.wal"
+#define WAL_VERSION 2
+#define WAL_HEADER_SIZE 24
+#define WAL_RECORD_HEADER_SIZE 8
+
+// Milliseconds between commits, e.g. make WAL_INTERVAL=5. With 0, a commit
+// starts as soon as there is something to write, otherwise records gather
+// for the interval, fewer syncs for a longer wait in wal_commit.
+#ifndef WAL_COMMIT_INTERVAL_MS
+#define WAL_COMMIT_INTERVAL_MS 0
+#endif
+
+typedef enum {
+  WAL_WRITE = 1,
+  WAL_DELETE = 2
+} WalRecordType;
+
+/// Applies a replayed record to the table.
+/// @param type The operation.
+/// @param keys The keys.
+/// @param values The values, NULL for deletes.
+/// @param num_pairs Number of pairs, at most MAX_WRITE_SIZE.
+typedef void (*WalApply)(WalRecordType type, const StringSlice *keys,
+const StringSlice *values, size_t num_pairs);
+
+/// Reads the base LSN of the log of a directory, before it is opened.
+/// @param dir Directory of the log.
+/// @return Records up to this LSN were dropped, a snapshot at least as new
+/// is needed to replay the log. 0 without a log.
+uint64_t wal_base_lsn(const char *dir);
+
+/// Opens the log of a directory, creating it if needed, replays the records
+/// after a snapshot and starts the committer thread.
+/// @param dir Directory of the log.
+/// @param snapshot_lsn LSN of the restored snapshot, 0 if there was none.
+/// @param apply Called for each record to replay.
+/// @return 0 on success, 1 if the log could not be opened, created or
+/// repaired, 2 if it could not be read or is not a valid log.
+int wal_open(const char *dir, uint64_t snapshot_lsn, WalApply apply);
+
+/// Appends a record, to be written by the next commit.
+/// @param type The operation.
+/// @param keys The keys.
+/// @param values The values, ignored for deletes.
+/// @param num_pairs Number of pairs.
+/// @return The record's LSN, 0 if the log is not open or failed.
+uint64_t wal_append(WalRecordType type, const StringSlice *keys,
+const StringSlice *values, size_t num_pairs);
+
+/// Waits until a record, and every record before it, is durable.
+/// @param lsn LSN returned by wal_append, 0 to wait for nothing.
+/// @return 0 on success, 1 if the log could not be written.
+int wal_commit(uint64_t lsn);
+
+/// Called by the committer thread after each commit, with the log locked.
+/// @param durable_lsn Every record up to this LSN is durable.
+typedef void (*WalCommitted)(uint64_t durable_lsn);
+
+/// Sets the function called after each commit, for callers that must not
+/// block in wal_commit. It must not call into the log.
+/// @param committed The function, NULL for none.
+void wal_on_commit(WalCommitted committed);
+
+/// Has the committer drop the records up to an LSN, in the background.
+/// @param lsn LSN of a durable snapshot, see SnapshotInfo.wal_lsn.
+void wal_trim(uint64_t lsn);
+
+/// LSN of the last appended record.
+/// @return The LSN, 0 if nothing was ever logged.
+uint64_t wal_last_lsn();
+
+/// LSN of the last durable record, those up to it never wait in wal_commit.
+/// @return The LSN.
+uint64_t wal_durable_lsn();
+
+/// Commits what is left, stops the committer thread and closes the log.
+void wal_close();
+
+#endif // WAL_H
@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "server/snapshot.h"
+
+/// What the dump does with each record.
+typedef struct DumpState {
+  int print;            // Print records, not just validate them.
+  uint64_t data_bytes;  // Key and value bytes seen.
+} DumpState;
+
+/// Counts a record and prints it as "(key, value)", or "#DELETE key" for a
+/// key deleted by a delta.
+/// @param key The key.
+/// @param value The value, NULL data for a deleted key.
+/// @param arg The DumpState.
+/// @return 0, to keep walking.
+static int dump_pair(StringSlice key, StringSlice value, void *arg) {
+  DumpState *state = arg;
+  state->data_bytes += key.size + value.size;
+  if (state->print && value.data == NULL)
+    printf("#DELETE %.*s\n", (int) key.size, key.data);
+  else if (state->print)
+    printf("(%.*s, %.*s)\n", (int) key.size, key.data, (int) value.size,
+    value.data);
+  return 0;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-c] <snapshot>\n", name);
+  fprintf(stderr, "  A split backup is read through its manifest.\n");
+  fprintf(stderr, "  Prints every pair of a backup, then \"#END <count>\".\n");
+  fprintf(stderr, "  Keys deleted by a delta backup print as \"#DELETE <key>\".\n");
+  fprintf(stderr, "  -c  only validate it and print a summary\n");
+}
+
+int main(int argc, char *argv[]) {
+  int check_only = argc == 3 && strcmp(argv[1], "-c") == 0;
+  if (argc != 2 + check_only) {
+    usage(argv[0]);
+    return 1;
+  }
+  const char *path = argv[argc - 1];
+
+  SnapshotSet set;
+  if (snapshot_set_open(&set, path) != 0) {
+    fprintf(stderr, "%s: not a valid snapshot, truncated or missing some of "
+    "its segments\n", path);
+    return 1;
+  }
+
+  uint8_t *buffer = malloc(set.block_size);
+  if (buffer == NULL) {
+    perror("malloc");
+    snapshot_set_close(&set);
+    return 1;
+  }
+
+  DumpState state = {!check_only, 0};
+  uint64_t records = 0;
+  size_t num_blocks = 0;
+  size_t size = 0;
+  int failed = 0;
+  for (size_t s = 0; s < set.num_segments && !failed; s++) {
+    const SnapshotReader *reader = &set.segments[s];
+    for (size_t i = 0; i < reader->num_blocks; i++) {
+      SnapshotBlockInfo block;
+      snapshot_block_info(reader, i, &block);
+      if (snapshot_read_block(reader, i, buffer, dump_pair, &state) != 0) {
+        fprintf(stderr, "%s: block %zu of segment %zu at offset %lu is "
+        "corrupt\n", path, i, s, (unsigned long) block.offset);
+        failed = 1;
+        break;
+      }
+      records += block.record_count;
+    }
+    num_blocks += reader->num_blocks;
+    size += reader->size;
+  }
+  if (!failed && records != set.record_count) {
+    fprintf(stderr, "%s: %lu records in blocks, footers say %lu\n", path,
+    (unsigned long) records, (unsigned long) set.record_count);
+    failed = 1;
+  }
+
+  if (!failed) {
+    if (!check_only)
+      printf("#END %lu\n", (unsigned long) records);
+    fprintf(stderr, "%s: %lu %s, %zu blocks in %zu segment%s, %zu stripes, "
+    "%lu bytes of data in %zu bytes%s, %s %u of chain %016lx\n", path,
+    (unsigned long) records,
+    set.info.flags & SNAPSHOT_FLAG_DELTA ? "changes" : "pairs", num_blocks,
+    set.num_segments, set.num_segments == 1 ? "" : "s",
+    (size_t) set.info.stripe_count, (unsigned long) state.data_bytes, size,
+    set.info.flags & SNAPSHOT_FLAG_COMPRESSED ? ", compressed" : "",
+    set.info.flags & SNAPSHOT_FLAG_DELTA ? "delta" : "full backup",
+    set.info.sequence, (unsigned long) set.info.chain_id);
+  }
+
+  free(buffer);
+  snapshot_set_close(&set);
+  return failed;
+}